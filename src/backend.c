@@ -0,0 +1,78 @@
+#include "backend.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <strings.h>
+
+static bool has_signature(const struct imv_backend_signature *sig,
+    const void *head, size_t len)
+{
+  return sig->offset + sig->len <= len
+    && !memcmp((const char *)head + sig->offset, sig->bytes, sig->len);
+}
+
+static bool has_extension(const char *const *extensions, const char *path)
+{
+  const char *dot = path ? strrchr(path, '.') : NULL;
+  if (!dot || strchr(dot, '/')) {
+    return false;
+  }
+
+  for (const char *const *ext = extensions; *ext; ++ext) {
+    if (!strcasecmp(dot + 1, *ext)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+enum backend_match imv_backend_match(const struct imv_backend *backend,
+    const char *path, const void *head, size_t len)
+{
+  if (backend->signatures) {
+    for (const struct imv_backend_signature *sig = backend->signatures;
+        sig->bytes; ++sig) {
+      if (has_signature(sig, head, len)) {
+        return BACKEND_MATCHES;
+      }
+    }
+    return BACKEND_NO_MATCH;
+  }
+
+  if (backend->extensions && has_extension(backend->extensions, path)) {
+    return BACKEND_MATCHES;
+  }
+  return BACKEND_MAY_MATCH;
+}
+
+/* The backends whose init has been called, of which there are only ever a
+ * handful */
+static const struct imv_backend *g_initialised[32];
+static size_t g_initialised_count;
+static pthread_mutex_t g_init_lock = PTHREAD_MUTEX_INITIALIZER;
+
+bool imv_backend_init(const struct imv_backend *backend)
+{
+  if (!backend->init) {
+    return false;
+  }
+
+  pthread_mutex_lock(&g_init_lock);
+  for (size_t i = 0; i < g_initialised_count; ++i) {
+    if (g_initialised[i] == backend) {
+      pthread_mutex_unlock(&g_init_lock);
+      return false;
+    }
+  }
+
+  /* Held throughout, so nothing else uses the backend until it's ready */
+  backend->init();
+  if (g_initialised_count < sizeof g_initialised / sizeof *g_initialised) {
+    g_initialised[g_initialised_count++] = backend;
+  }
+  pthread_mutex_unlock(&g_init_lock);
+  return true;
+}
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
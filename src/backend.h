@@ -1,6 +1,7 @@
 #ifndef IMV_BACKEND_H
 #define IMV_BACKEND_H
 
+#include <stdbool.h>
 #include <stddef.h>
 
 struct imv_source;
@@ -19,6 +20,31 @@ enum backend_result {
   BACKEND_UNSUPPORTED = 2,
 };
 
+/* How many bytes from the start of a file are read to match signatures */
+#define BACKEND_SNIFF_LEN 32
+
+/* A run of bytes found at a fixed offset into every file of some format, its
+ * "magic number". Lists of these end with one whose bytes are NULL. */
+struct imv_backend_signature {
+  size_t offset;
+  const char *bytes;
+  size_t len;
+};
+
+/* How likely a backend is to be able to open a file */
+enum backend_match {
+
+  /* The file has none of the backend's signatures, so it needn't be tried */
+  BACKEND_NO_MATCH = 0,
+
+  /* The backend has no signatures to go by, so it's worth trying */
+  BACKEND_MAY_MATCH = 1,
+
+  /* The file has one of the backend's signatures, or the backend has none
+   * but claims the file's extension, so it should be tried first */
+  BACKEND_MATCHES = 2,
+};
+
 /* A backend is responsible for taking a path, or a raw data pointer, and
  * converting that into an imv_source. Each backend may be powered by a
  * different image library and support different image formats.
@@ -46,6 +72,35 @@ struct imv_backend {
    * and src will point to an imv_source instance for the given data.
    */
   enum backend_result (*open_memory)(void *data, size_t len, struct imv_source **src);
+
+  /* Optional. The signatures of every format the backend can open. If given,
+   * files with none of them are never handed to the backend. Backends that
+   * can't be this sure, such as those of text based formats, leave it NULL.
+   */
+  const struct imv_backend_signature *signatures;
+
+  /* Optional. A NULL terminated list of the extensions, without the dot,
+   * that files the backend can open usually have. Only consulted for
+   * backends without signatures, to pick which of them to try first.
+   */
+  const char *const *extensions;
+
+  /* Optional. Sets up the backend's library, for those with costly global
+   * state. Rather than at startup, it's called just before the first file
+   * is handed to the backend, so backends never used cost nothing.
+   */
+  void (*init)(void);
 };
 
+/* Judges whether backend is worth trying on the file at path, whose first
+ * len bytes are head. path may be NULL if the data didn't come from a file.
+ */
+enum backend_match imv_backend_match(const struct imv_backend *backend,
+    const char *path, const void *head, size_t len);
+
+/* Calls backend's init, the first time only, returning true if that was now.
+ * Safe to call from any thread, returning only once init has finished.
+ */
+bool imv_backend_init(const struct imv_backend *backend);
+
 #endif
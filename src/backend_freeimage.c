@@ -1,7 +1,10 @@
 #include "backend.h"
 #include "bitmap.h"
+#include "bitmap_pool.h"
 #include "image.h"
 #include "log.h"
+#include "mapped_file.h"
+#include "pixel.h"
 #include "source.h"
 #include "source_private.h"
 
@@ -12,6 +15,9 @@
 struct private {
   char *path;
   FIMEMORY *memory;
+  /* what memory reads from when opened by path, NULL when opened from
+   * memory belonging to someone else */
+  struct imv_mapped_file *file;
   FREE_IMAGE_FORMAT format;
   FIMULTIBITMAP *multibitmap;
   FIBITMAP *last_frame;
@@ -19,6 +25,13 @@ struct private {
   int next_frame;
   int width;
   int height;
+  /* The pages of a multi-page TIFF or ICO, only opened once a page after
+   * the first is asked after. Page 0 is loaded on its own all the same. */
+  FIMULTIBITMAP *pages;
+  int page_count;
+  int page;
+  /* buffers for the frames handed out, recycled as they're displayed */
+  struct imv_bitmap_pool *pool;
 };
 
 static void free_private(void *raw_private)
@@ -42,24 +55,120 @@ static void free_private(void *raw_private)
     private->multibitmap = NULL;
   }
 
+  if (private->pages) {
+    FreeImage_CloseMultiBitmap(private->pages, 0);
+    private->pages = NULL;
+  }
+
   if (private->last_frame) {
     FreeImage_Unload(private->last_frame);
     private->last_frame = NULL;
   }
 
+  imv_mapped_file_close(private->file);
+  imv_bitmap_pool_free(private->pool);
   free(private);
 }
 
-static struct imv_image *to_image(FIBITMAP *in_bmp)
+/* Converts the common layouts of pixels with the kernels in pixel.h, returning
+ * false for any others. FreeImage keeps its rows bottom-up. 16-bit and
+ * floating point pixels keep their depth, the floats as halves. */
+static bool convert_rows(struct imv_bitmap *bmp, FIBITMAP *in_bmp)
+{
+  const FREE_IMAGE_TYPE type = FreeImage_GetImageType(in_bmp);
+  const unsigned bpp = FreeImage_GetBPP(in_bmp);
+  const size_t width = bmp->width;
+
+  if (type == FIT_BITMAP && bpp == 24) {
+    for (int y = 0; y < bmp->height; ++y) {
+      imv_pixel_rgb_to_rgba(bmp->data + (size_t)y * bmp->stride,
+          FreeImage_GetScanLine(in_bmp, bmp->height - 1 - y), width);
+    }
+    return true;
+  }
+
+  if (type == FIT_RGB16) {
+    for (int y = 0; y < bmp->height; ++y) {
+      imv_pixel_rgb16_to_rgba16((uint16_t *)(bmp->data + (size_t)y * bmp->stride),
+          (const uint16_t *)FreeImage_GetScanLine(in_bmp, bmp->height - 1 - y),
+          width);
+    }
+    return true;
+  }
+
+  if (type == FIT_RGBA16) {
+    for (int y = 0; y < bmp->height; ++y) {
+      memcpy(bmp->data + (size_t)y * bmp->stride,
+          FreeImage_GetScanLine(in_bmp, bmp->height - 1 - y), width * 8);
+    }
+    return true;
+  }
+
+  if (type == FIT_RGBF) {
+    float *row = malloc(width * 4 * sizeof *row);
+    for (int y = 0; y < bmp->height; ++y) {
+      const float *src = (const float *)FreeImage_GetScanLine(in_bmp,
+          bmp->height - 1 - y);
+      for (size_t x = 0; x < width; ++x) {
+        row[x * 4] = src[x * 3];
+        row[x * 4 + 1] = src[x * 3 + 1];
+        row[x * 4 + 2] = src[x * 3 + 2];
+        row[x * 4 + 3] = 1.0f;
+      }
+      imv_pixel_float_to_half((uint16_t *)(bmp->data + (size_t)y * bmp->stride),
+          row, width * 4);
+    }
+    free(row);
+    return true;
+  }
+
+  if (type == FIT_RGBAF) {
+    for (int y = 0; y < bmp->height; ++y) {
+      imv_pixel_float_to_half((uint16_t *)(bmp->data + (size_t)y * bmp->stride),
+          (const float *)FreeImage_GetScanLine(in_bmp, bmp->height - 1 - y),
+          width * 4);
+    }
+    return true;
+  }
+
+  return false;
+}
+
+static struct imv_image *to_image(struct private *private, FIBITMAP *in_bmp)
 {
-  struct imv_bitmap *bmp = malloc(sizeof *bmp);
-  bmp->width = FreeImage_GetWidth(in_bmp);
-  bmp->height = FreeImage_GetHeight(in_bmp);
-  bmp->format = IMV_ARGB;
-  bmp->data = malloc(4 * bmp->width * bmp->height);
-  FreeImage_ConvertToRawBits(bmp->data, in_bmp, 4 * bmp->width, 32,
-      FI_RGBA_RED_MASK, FI_RGBA_GREEN_MASK, FI_RGBA_BLUE_MASK, TRUE);
+  if (!private->pool) {
+    private->pool = imv_bitmap_pool_create();
+  }
+
+  /* 8-bit colour is in FreeImage's own byte order, blue first on little
+   * endian machines, while 16-bit and floating point colour is always red
+   * first */
+  const FREE_IMAGE_TYPE type = FreeImage_GetImageType(in_bmp);
+  const bool floating = type == FIT_RGBF || type == FIT_RGBAF;
+  enum imv_pixelformat format;
+  if (type == FIT_RGB16 || type == FIT_RGBA16) {
+    format = IMV_ABGR16;
+  } else if (floating) {
+    format = IMV_ABGR_HALF;
+  } else {
+    format = FREEIMAGE_COLORORDER == FREEIMAGE_COLORORDER_RGB ? IMV_ABGR : IMV_ARGB;
+  }
+
+  struct imv_bitmap *bmp = imv_bitmap_pool_get(private->pool,
+      FreeImage_GetWidth(in_bmp), FreeImage_GetHeight(in_bmp), format);
+  if (!bmp) {
+    return NULL;
+  }
+  if (!convert_rows(bmp, in_bmp)) {
+    bmp->format = IMV_ARGB;
+    FreeImage_ConvertToRawBits(bmp->data, in_bmp, bmp->stride, 32,
+        FI_RGBA_RED_MASK, FI_RGBA_GREEN_MASK, FI_RGBA_BLUE_MASK, TRUE);
+  }
   struct imv_image *image = imv_image_create_from_bitmap(bmp);
+  /* Floating point formats like OpenEXR hold scene light */
+  if (floating) {
+    imv_image_set_transfer(image, IMV_TRANSFER_LINEAR);
+  }
   return image;
 }
 
@@ -68,14 +177,8 @@ static FIBITMAP *normalise_bitmap(FIBITMAP *input)
   FIBITMAP *output = NULL;
 
   switch (FreeImage_GetImageType(input)) {
-    case FIT_RGB16:
-    case FIT_RGBA16:
-    case FIT_RGBF:
-    case FIT_RGBAF:
-      output = FreeImage_ConvertTo32Bits(input);
-      FreeImage_Unload(input);
-      break;
-
+    /* FIT_RGB16, FIT_RGBA16, FIT_RGBF and FIT_RGBAF are converted by
+     * to_image itself */
     case FIT_UINT16:
     case FIT_INT16:
     case FIT_UINT32:
@@ -98,6 +201,55 @@ static FIBITMAP *normalise_bitmap(FIBITMAP *input)
   return output;
 }
 
+static bool has_page(void *raw_private, int page)
+{
+  struct private *private = raw_private;
+  if (page == 0) {
+    return true;
+  }
+
+  if (!private->page_count) {
+    /* Only tried the once, and while FreeImage reads every page's header
+     * when it opens them, that's left until there's a second page to see */
+    private->page_count = 1;
+    if (private->format != FIF_TIFF && private->format != FIF_ICO) {
+      return false;
+    }
+    if (private->path) {
+      private->pages = FreeImage_OpenMultiBitmap(private->format, private->path,
+          /* don't create file */ 0,
+          /* read only */ 1,
+          /* keep in memory */ 1,
+          /* flags */ 0);
+    } else if (private->memory) {
+      private->pages = FreeImage_LoadMultiBitmapFromMemory(private->format,
+          private->memory, /* flags */ 0);
+    }
+    if (private->pages) {
+      private->page_count = FreeImage_GetPageCount(private->pages);
+    }
+  }
+  return page < private->page_count;
+}
+
+static void set_page(void *raw_private, int page)
+{
+  struct private *private = raw_private;
+  private->page = page;
+}
+
+/* Loads a copy of a page after the first, which outlives the page itself */
+static FIBITMAP *load_page(struct private *private)
+{
+  FIBITMAP *page = FreeImage_LockPage(private->pages, private->page);
+  if (!page) {
+    return NULL;
+  }
+  FIBITMAP *copy = FreeImage_Clone(page);
+  FreeImage_UnlockPage(private->pages, page, 0);
+  return copy;
+}
+
 static void first_frame(void *raw_private, struct imv_image **image, int *frametime)
 {
   *image = NULL;
@@ -150,7 +302,9 @@ static void first_frame(void *raw_private, struct imv_image **image, int *framet
     private->num_frames = 1;
     int flags = (private->format == FIF_JPEG) ? JPEG_EXIFROTATE : 0;
     FIBITMAP *fibitmap = NULL;
-    if (private->path) {
+    if (private->page > 0) {
+      fibitmap = load_page(private);
+    } else if (private->path) {
       fibitmap = FreeImage_Load(private->format, private->path, flags);
     } else if (private->memory) {
       fibitmap = FreeImage_LoadFromMemory(private->format, private->memory, flags);
@@ -165,10 +319,14 @@ static void first_frame(void *raw_private, struct imv_image **image, int *framet
 
   private->width = FreeImage_GetWidth(bmp);
   private->height = FreeImage_GetHeight(bmp);
+  if (private->last_frame) {
+    /* the first frame of another page */
+    FreeImage_Unload(private->last_frame);
+  }
   private->last_frame = bmp;
   private->next_frame = 1 % private->num_frames;
 
-  *image = to_image(bmp);
+  *image = to_image(private, bmp);
 }
 
 static void next_frame(void *raw_private, struct imv_image **image, int *frametime)
@@ -179,7 +337,7 @@ static void next_frame(void *raw_private, struct imv_image **image, int *frameti
   struct private *private = raw_private;
 
   if (private->num_frames == 1) {
-    *image = to_image(private->last_frame);
+    *image = to_image(private, private->last_frame);
     return;
   }
 
@@ -264,51 +422,71 @@ static void next_frame(void *raw_private, struct imv_image **image, int *frameti
 
   private->next_frame = (private->next_frame + 1) % private->num_frames;
 
-  *image = to_image(private->last_frame);
+  *image = to_image(private, private->last_frame);
 }
 
 static const struct imv_source_vtable vtable = {
   .load_first_frame = first_frame,
   .load_next_frame = next_frame,
+  .has_page = has_page,
+  .set_page = set_page,
   .free = free_private
 };
 
-static enum backend_result open_path(const char *path, struct imv_source **src)
+/* Makes a source decoding the len bytes at data, which stay valid until it's
+ * freed. If file is given, the source takes ownership of it. */
+static enum backend_result open_data(void *data, size_t len,
+    struct imv_mapped_file *file, struct imv_source **src)
 {
-  imv_log(IMV_DEBUG, "freeimage: open_path(%s)\n", path);
-  FREE_IMAGE_FORMAT fmt = FreeImage_GetFileType(path, 0);
+  FIMEMORY *fmem = FreeImage_OpenMemory(data, len);
+
+  FREE_IMAGE_FORMAT fmt = FreeImage_GetFileTypeFromMemory(fmem, 0);
 
   if (fmt == FIF_UNKNOWN) {
     imv_log(IMV_DEBUG, "freeimage: unknown file format\n");
+    FreeImage_CloseMemory(fmem);
     return BACKEND_UNSUPPORTED;
   }
 
   struct private *private = calloc(1, sizeof(struct private));
   private->format = fmt;
-  private->path = strdup(path);
+  private->memory = fmem;
+  private->file = file;
+  private->path = NULL;
 
   *src = imv_source_create(&vtable, private);
   return BACKEND_SUCCESS;
 }
 
-static enum backend_result open_memory(void *data, size_t len, struct imv_source **src)
+static enum backend_result open_path(const char *path, struct imv_source **src)
 {
-  FIMEMORY *fmem = FreeImage_OpenMemory(data, len);
+  imv_log(IMV_DEBUG, "freeimage: open_path(%s)\n", path);
 
-  FREE_IMAGE_FORMAT fmt = FreeImage_GetFileTypeFromMemory(fmem, 0);
+  struct imv_mapped_file *file = imv_mapped_file_open(path);
+  if (!file) {
+    return BACKEND_BAD_PATH;
+  }
 
-  if (fmt == FIF_UNKNOWN) {
-    FreeImage_CloseMemory(fmem);
-    return BACKEND_UNSUPPORTED;
+  enum backend_result ret = open_data(imv_mapped_file_data(file),
+      imv_mapped_file_size(file), file, src);
+  if (ret != BACKEND_SUCCESS) {
+    imv_mapped_file_close(file);
+  } else {
+    imv_mapped_file_will_read(file, 0, imv_mapped_file_size(file));
   }
+  return ret;
+}
 
-  struct private *private = calloc(1, sizeof(struct private));
-  private->format = fmt;
-  private->memory = fmem;
-  private->path = NULL;
+static enum backend_result open_memory(void *data, size_t len, struct imv_source **src)
+{
+  return open_data(data, len, NULL, src);
+}
 
-  *src = imv_source_create(&vtable, private);
-  return BACKEND_SUCCESS;
+/* Registers all of FreeImage's plugins. Built as a shared library it has
+ * already done so when loaded, and this only takes another reference. */
+static void init(void)
+{
+  FreeImage_Initialise(FALSE);
 }
 
 const struct imv_backend imv_backend_freeimage = {
@@ -318,4 +496,5 @@ const struct imv_backend imv_backend_freeimage = {
   .license = "FreeImage Public License v1.0",
   .open_path = &open_path,
   .open_memory = &open_memory,
+  .init = &init,
 };
@@ -1,3 +1,5 @@
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <libheif/heif.h>
@@ -5,10 +7,24 @@
 #include "backend.h"
 #include "bitmap.h"
 #include "image.h"
+#include "mapped_file.h"
 #include "source_private.h"
 
 struct private {
-  struct heif_image *img;
+  struct heif_context *ctx;
+  /* the image of the page being loaded */
+  struct heif_image_handle *handle;
+  /* The top level images of a collection, the primary one first and the
+   * rest in the order they're stored. Only listed once a page after the
+   * first is asked after. */
+  heif_item_id *pages;
+  int page_count;
+  int page;
+  /* what ctx reads from when opened by path, outliving it */
+  struct imv_mapped_file *file;
+  /* the size hint from set_target_size, or 0x0 for full resolution */
+  int target_width;
+  int target_height;
 };
 
 static void free_private(void *raw_private)
@@ -17,77 +33,285 @@ static void free_private(void *raw_private)
     return;
   }
   struct private *private = raw_private;
-  heif_image_release(private->img);
+  heif_image_handle_release(private->handle);
+  heif_context_free(private->ctx);
+  imv_mapped_file_close(private->file);
+  free(private->pages);
   free(private);
 }
 
-static void load_image(void *raw_private, struct imv_image **image, int *frametime)
+static void release_image(void *img)
 {
-  *image = NULL;
-  *frametime = 0;
+  heif_image_release(img);
+}
 
+static void set_target_size(void *raw_private, int width, int height)
+{
   struct private *private = raw_private;
+  private->target_width = width;
+  private->target_height = height;
+}
 
-  int stride;
-  const uint8_t *data = heif_image_get_plane_readonly(private->img, heif_channel_interleaved, &stride);
+static bool list_pages(struct private *private)
+{
+  heif_item_id primary;
+  const int count = heif_context_get_number_of_top_level_images(private->ctx);
+  if (count <= 0 || heif_context_get_primary_image_ID(private->ctx,
+        &primary).code != heif_error_Ok) {
+    return false;
+  }
 
-  int width = heif_image_get_width(private->img, heif_channel_interleaved);
-  int height = heif_image_get_height(private->img, heif_channel_interleaved);
-  unsigned char *bitmap = malloc(width * height * 4);
-  memcpy(bitmap, data, width * height * 4);
+  heif_item_id *ids = malloc(count * sizeof *ids);
+  private->pages = malloc(count * sizeof *private->pages);
+  if (!ids || !private->pages) {
+    free(ids);
+    free(private->pages);
+    private->pages = NULL;
+    return false;
+  }
+  heif_context_get_list_of_top_level_image_IDs(private->ctx, ids, count);
 
-  struct imv_bitmap *bmp = malloc(sizeof *bmp);
-  bmp->width = width,
-  bmp->height = height,
-  bmp->format = IMV_ABGR;
-  bmp->data = bitmap;
-  *image = imv_image_create_from_bitmap(bmp);
+  private->pages[private->page_count++] = primary;
+  for (int i = 0; i < count; ++i) {
+    if (ids[i] != primary) {
+      private->pages[private->page_count++] = ids[i];
+    }
+  }
+  free(ids);
+  return true;
 }
 
-static const struct imv_source_vtable vtable = {
-  .load_first_frame = load_image,
-  .free = free_private,
-};
+static bool has_page(void *raw_private, int page)
+{
+  struct private *private = raw_private;
+  if (page == 0) {
+    return true;
+  }
+  if (!private->page_count && !list_pages(private)) {
+    /* only tried the once, and from then on there's just the primary image */
+    private->page_count = 1;
+  }
+  return page < private->page_count;
+}
 
-struct heif_error get_primary_image(struct heif_context *ctx, struct heif_image **img)
+static void set_page(void *raw_private, int page)
 {
+  struct private *private = raw_private;
+  if (page == private->page || !private->pages) {
+    return;
+  }
+
   struct heif_image_handle *handle;
-  struct heif_error err = heif_context_get_primary_image_handle(ctx, &handle);
-  if (err.code != heif_error_Ok) {
-    return err;
+  struct heif_error err = heif_context_get_image_handle(private->ctx,
+      private->pages[page], &handle);
+  if (err.code == heif_error_Ok) {
+    heif_image_handle_release(private->handle);
+    private->handle = handle;
+    private->page = page;
   }
+}
 
-  err = heif_decode_image(handle, img, heif_colorspace_RGB, heif_chroma_interleaved_RGBA, NULL);
-  heif_image_handle_release(handle);
-  return err;
+/* Finds the smallest embedded thumbnail that still fills width x height.
+ * Returns NULL if there isn't one. */
+static struct heif_image_handle *find_thumbnail(struct private *private,
+    int width, int height)
+{
+  const int count = heif_image_handle_get_number_of_thumbnails(private->handle);
+  if (count <= 0) {
+    return NULL;
+  }
+
+  heif_item_id *ids = calloc(count, sizeof *ids);
+  heif_image_handle_get_list_of_thumbnail_IDs(private->handle, ids, count);
+
+  struct heif_image_handle *best = NULL;
+  for (int i = 0; i < count; ++i) {
+    struct heif_image_handle *thumb;
+    struct heif_error err = heif_image_handle_get_thumbnail(private->handle, ids[i], &thumb);
+    if (err.code != heif_error_Ok) {
+      continue;
+    }
+
+    const int w = heif_image_handle_get_width(thumb);
+    const int h = heif_image_handle_get_height(thumb);
+    const bool fills = w >= width || h >= height;
+    if (fills && (!best || w < heif_image_handle_get_width(best))) {
+      if (best) {
+        heif_image_handle_release(best);
+      }
+      best = thumb;
+    } else {
+      heif_image_handle_release(thumb);
+    }
+  }
+
+  free(ids);
+  return best;
 }
 
-static enum backend_result open_path(const char *path, struct imv_source **src)
+/* Attaches the primary image's ICC profile, which its thumbnails share, to
+ * image. Images described only by nclx colour parameters have no ICC profile,
+ * though set_transfer takes HDR transfer functions from them. */
+static void set_icc_profile(struct private *private, struct imv_image *image)
 {
-  struct heif_context *ctx = heif_context_alloc();
-  struct heif_error err = heif_context_read_from_file(ctx, path, NULL); // TODO: error
-  if (err.code != heif_error_Ok) {
-    heif_context_free(ctx);
-    if (err.code == heif_error_Input_does_not_exist) {
-      return BACKEND_BAD_PATH;
+  if (heif_image_handle_get_color_profile_type(private->handle)
+      == heif_color_profile_type_nclx) {
+    return;
+  }
+  const size_t len = heif_image_handle_get_raw_color_profile_size(private->handle);
+  void *profile = len ? malloc(len) : NULL;
+  if (!profile) {
+    return;
+  }
+  struct heif_error err = heif_image_handle_get_raw_color_profile(
+      private->handle, profile);
+  if (err.code == heif_error_Ok) {
+    imv_image_set_icc_profile(image, profile, len);
+  }
+  free(profile);
+}
+
+/* Marks image as HDR if handle's nclx colour parameters say it is */
+static void set_transfer(struct heif_image_handle *handle, struct imv_image *image)
+{
+  struct heif_color_profile_nclx *nclx = NULL;
+  struct heif_error err = heif_image_handle_get_nclx_color_profile(handle, &nclx);
+  if (err.code != heif_error_Ok || !nclx) {
+    return;
+  }
+  switch (nclx->transfer_characteristics) {
+    case heif_transfer_characteristic_ITU_R_BT_2100_0_PQ:
+      imv_image_set_transfer(image, IMV_TRANSFER_PQ);
+      break;
+    case heif_transfer_characteristic_ITU_R_BT_2100_0_HLG:
+      imv_image_set_transfer(image, IMV_TRANSFER_HLG);
+      break;
+    case heif_transfer_characteristic_linear:
+      imv_image_set_transfer(image, IMV_TRANSFER_LINEAR);
+      break;
+    default:
+      break;
+  }
+  heif_nclx_color_profile_free(nclx);
+}
+
+/* Scales the bits-bit values libheif gives deep images up to the full 16
+ * bits, repeating the top bits in the bottom ones so white stays white */
+static void widen_samples(uint8_t *data, int stride, int width, int height,
+    int bits)
+{
+  if (bits <= 8 || bits >= 16) {
+    return;
+  }
+  for (int y = 0; y < height; ++y) {
+    uint16_t *row = (uint16_t *)(data + (size_t)y * stride);
+    for (int x = 0; x < width * 4; ++x) {
+      row[x] = row[x] << (16 - bits) | row[x] >> (2 * bits - 16);
     }
-    return BACKEND_UNSUPPORTED;
   }
+}
+
+/* Decodes the given image, which is either the primary image or one of its
+ * thumbnails, into an image the size of the primary image. Images deeper than
+ * 8 bits are kept that deep. */
+static struct imv_image *decode(struct private *private,
+    struct heif_image_handle *handle)
+{
+  const uint16_t one = 1;
+  const bool little_endian = *(const unsigned char *)&one;
+  const bool deep = heif_image_handle_get_luma_bits_per_pixel(handle) > 8;
+  const enum heif_chroma chroma = !deep ? heif_chroma_interleaved_RGBA
+    : little_endian ? heif_chroma_interleaved_RRGGBBAA_LE
+    : heif_chroma_interleaved_RRGGBBAA_BE;
 
   struct heif_image *img;
-  err = get_primary_image(ctx, &img);
-  heif_context_free(ctx);
+  struct heif_error err = heif_decode_image(handle,
+      &img, heif_colorspace_RGB, chroma, NULL);
   if (err.code != heif_error_Ok) {
-    return BACKEND_UNSUPPORTED;
+    return NULL;
   }
 
-  struct private *private = malloc(sizeof *private);
-  private->img = img;
-  *src = imv_source_create(&vtable, private);
-  return BACKEND_SUCCESS;
+  int stride;
+  uint8_t *data = heif_image_get_plane(img, heif_channel_interleaved, &stride);
+
+  int width = heif_image_get_width(img, heif_channel_interleaved);
+  int height = heif_image_get_height(img, heif_channel_interleaved);
+  if (deep) {
+    widen_samples(data, stride, width, height,
+        heif_image_get_bits_per_pixel_range(img, heif_channel_interleaved));
+  }
+
+  /* Use the plane in place, padding and all, and release the image along
+   * with the bitmap */
+  struct imv_bitmap *bmp = imv_bitmap_create_borrowed(width, height, stride,
+      deep ? IMV_ABGR16 : IMV_ABGR, data, release_image, img);
+
+  struct imv_image *image = handle != private->handle
+    ? imv_image_create_from_scaled_bitmap(bmp,
+        heif_image_handle_get_width(private->handle),
+        heif_image_handle_get_height(private->handle))
+    : imv_image_create_from_bitmap(bmp);
+  set_icc_profile(private, image);
+  set_transfer(handle, image);
+  return image;
 }
 
-static enum backend_result open_memory(void *data, size_t len, struct imv_source **src)
+static void load_preview(void *raw_private, struct imv_image **image)
+{
+  *image = NULL;
+
+  struct private *private = raw_private;
+
+  /* If load_image is going to use a thumbnail, it'll be quick enough */
+  if (private->target_width && private->target_height) {
+    struct heif_image_handle *thumbnail = find_thumbnail(private,
+        private->target_width, private->target_height);
+    if (thumbnail) {
+      heif_image_handle_release(thumbnail);
+      return;
+    }
+  }
+
+  struct heif_image_handle *thumbnail = find_thumbnail(private, 0, 0);
+  if (thumbnail) {
+    *image = decode(private, thumbnail);
+    heif_image_handle_release(thumbnail);
+  }
+}
+
+static void load_image(void *raw_private, struct imv_image **image, int *frametime)
+{
+  *image = NULL;
+  *frametime = 0;
+
+  struct private *private = raw_private;
+
+  struct heif_image_handle *thumbnail = NULL;
+  if (private->target_width && private->target_height) {
+    thumbnail = find_thumbnail(private,
+        private->target_width, private->target_height);
+  }
+
+  *image = decode(private, thumbnail ? thumbnail : private->handle);
+  if (thumbnail) {
+    heif_image_handle_release(thumbnail);
+  }
+}
+
+static const struct imv_source_vtable vtable = {
+  .load_first_frame = load_image,
+  .load_preview = load_preview,
+  .set_target_size = set_target_size,
+  .has_page = has_page,
+  .set_page = set_page,
+  .free = free_private,
+};
+
+/* Reads enough of the len bytes at data to find the primary image, leaving
+ * the decoding itself to load_image. The data must stay valid until the
+ * source is freed. If file is given, the source takes ownership of it. */
+static enum backend_result open_data(void *data, size_t len,
+    struct imv_mapped_file *file, struct imv_source **src)
 {
   struct heif_context *ctx = heif_context_alloc();
   struct heif_error err = heif_context_read_from_memory_without_copy(ctx, data, len, NULL);
@@ -96,19 +320,56 @@ static enum backend_result open_memory(void *data, size_t len, struct imv_source
     return BACKEND_UNSUPPORTED;
   }
 
-  struct heif_image *img;
-  err = get_primary_image(ctx, &img);
-  heif_context_free(ctx);
+  struct heif_image_handle *handle;
+  err = heif_context_get_primary_image_handle(ctx, &handle);
   if (err.code != heif_error_Ok) {
+    heif_context_free(ctx);
     return BACKEND_UNSUPPORTED;
   }
 
-  struct private *private = malloc(sizeof *private);
-  private->img = img;
+  struct private *private = calloc(1, sizeof *private);
+  private->ctx = ctx;
+  private->handle = handle;
+  private->file = file;
   *src = imv_source_create(&vtable, private);
   return BACKEND_SUCCESS;
 }
 
+static enum backend_result open_path(const char *path, struct imv_source **src)
+{
+  struct imv_mapped_file *file = imv_mapped_file_open(path);
+  if (!file) {
+    return BACKEND_BAD_PATH;
+  }
+
+  enum backend_result ret = open_data(imv_mapped_file_data(file),
+      imv_mapped_file_size(file), file, src);
+  if (ret != BACKEND_SUCCESS) {
+    imv_mapped_file_close(file);
+  }
+  return ret;
+}
+
+static enum backend_result open_memory(void *data, size_t len, struct imv_source **src)
+{
+  return open_data(data, len, NULL, src);
+}
+
+#if LIBHEIF_HAVE_VERSION(1, 13, 0)
+/* Loads libheif's decoder plugins, which it would otherwise do itself on
+ * first use, so the time is accounted to the backend */
+static void init(void)
+{
+  heif_init(NULL);
+}
+#endif
+
+/* Any ISO base media file, the brand being left for libheif to judge */
+static const struct imv_backend_signature signatures[] = {
+  {4, "ftyp", 4},
+  {0, NULL, 0},
+};
+
 const struct imv_backend imv_backend_libheif = {
   .name = "libheif",
   .description = "ISO/IEC 23008-12:2017 HEIF file format decoder and encoder.",
@@ -116,4 +377,8 @@ const struct imv_backend imv_backend_libheif = {
   .license = "GNU Lesser General Public License",
   .open_path = &open_path,
   .open_memory = &open_memory,
+  .signatures = signatures,
+#if LIBHEIF_HAVE_VERSION(1, 13, 0)
+  .init = &init,
+#endif
 };
@@ -1,26 +1,34 @@
 #include "backend.h"
 #include "bitmap.h"
 #include "image.h"
+#include "mapped_file.h"
 #include "source.h"
 #include "source_private.h"
 
 #include <assert.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
-#include <sys/mman.h>
 #include <string.h>
-#include <unistd.h>
-#include <fcntl.h>
 
 #include <turbojpeg.h>
 
 struct private {
-  int fd;
+  /* NULL when data belongs to whoever called open_memory */
+  struct imv_mapped_file *file;
   void *data;
   size_t len;
   tjhandle jpeg;
   int width;
   int height;
+  /* the embedded ICC profile, if there is one */
+  unsigned char *icc_profile;
+  size_t icc_profile_len;
+  /* the size hint from set_target_size, or 0x0 for full resolution */
+  int target_width;
+  int target_height;
 };
 
 static void free_private(void *raw_private)
@@ -30,14 +38,235 @@ static void free_private(void *raw_private)
   }
   struct private *private = raw_private;
   tjDestroy(private->jpeg);
-  if (private->fd >= 0) {
-    munmap(private->data, private->len);
-    close(private->fd);
-  }
+  imv_mapped_file_close(private->file);
+  free(private->icc_profile);
 
   free(private);
 }
 
+static void set_target_size(void *raw_private, int width, int height)
+{
+  struct private *private = raw_private;
+  private->target_width = width;
+  private->target_height = height;
+}
+
+/* Picks the smallest size libjpeg-turbo can decode to directly that still
+ * fills the target size */
+static void pick_size(struct private *private, int *width, int *height)
+{
+  *width = private->width;
+  *height = private->height;
+
+  if (!private->target_width || !private->target_height) {
+    return;
+  }
+
+  int num_factors;
+  tjscalingfactor *factors = tjGetScalingFactors(&num_factors);
+  for (int i = 0; factors && i < num_factors; ++i) {
+    const int w = TJSCALED(private->width, factors[i]);
+    const int h = TJSCALED(private->height, factors[i]);
+    if (w < private->target_width && h < private->target_height) {
+      /* too small, it would need upscaling to fit */
+      continue;
+    }
+    if (w * h < *width * *height) {
+      *width = w;
+      *height = h;
+    }
+  }
+}
+
+static unsigned read_u16(const unsigned char *p, bool big_endian)
+{
+  return big_endian ? (p[0] << 8) | p[1] : (p[1] << 8) | p[0];
+}
+
+static uint32_t read_u32(const unsigned char *p, bool big_endian)
+{
+  return big_endian
+    ? ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | (p[2] << 8) | p[3]
+    : ((uint32_t)p[3] << 24) | ((uint32_t)p[2] << 16) | (p[1] << 8) | p[0];
+}
+
+/* Finds the JPEG thumbnail in the EXIF data of an APP1 segment by looking up
+ * its offset and length in the second IFD, which describes the thumbnail */
+static bool find_exif_thumbnail(const unsigned char *exif, size_t len,
+    const unsigned char **thumb, size_t *thumb_len)
+{
+  if (len < 14 || memcmp(exif, "Exif\0\0", 6)) {
+    return false;
+  }
+  const unsigned char *tiff = exif + 6;
+  len -= 6;
+
+  bool big_endian;
+  if (!memcmp(tiff, "MM", 2)) {
+    big_endian = true;
+  } else if (!memcmp(tiff, "II", 2)) {
+    big_endian = false;
+  } else {
+    return false;
+  }
+
+  /* skip over the first IFD to reach the second */
+  uint32_t ifd = read_u32(tiff + 4, big_endian);
+  if (ifd > len - 2) {
+    return false;
+  }
+  const unsigned entries = read_u16(tiff + ifd, big_endian);
+  if (ifd + 2 + entries * 12 + 4 > len) {
+    return false;
+  }
+  ifd = read_u32(tiff + ifd + 2 + entries * 12, big_endian);
+  if (!ifd || ifd > len - 2) {
+    return false;
+  }
+
+  uint32_t offset = 0, length = 0;
+  const unsigned count = read_u16(tiff + ifd, big_endian);
+  for (unsigned i = 0; i < count; ++i) {
+    const size_t entry = ifd + 2 + i * 12;
+    if (entry + 12 > len) {
+      return false;
+    }
+    const unsigned tag = read_u16(tiff + entry, big_endian);
+    if (tag == 0x0201) {
+      offset = read_u32(tiff + entry + 8, big_endian);
+    } else if (tag == 0x0202) {
+      length = read_u32(tiff + entry + 8, big_endian);
+    }
+  }
+
+  if (!offset || !length || offset > len || length > len - offset) {
+    return false;
+  }
+  *thumb = tiff + offset;
+  *thumb_len = length;
+  return true;
+}
+
+/* Walks the segments ahead of the image data looking for an EXIF thumbnail */
+static bool find_thumbnail(struct private *private,
+    const unsigned char **thumb, size_t *thumb_len)
+{
+  const unsigned char *data = private->data;
+  size_t pos = 2;
+
+  while (pos + 4 <= private->len && data[pos] == 0xff) {
+    const unsigned marker = data[pos + 1];
+    const size_t seg_len = read_u16(data + pos + 2, true);
+    if (marker == 0xda || seg_len < 2 || pos + 2 + seg_len > private->len) {
+      /* start of scan, or a broken segment */
+      break;
+    }
+    if (marker == 0xe1 && find_exif_thumbnail(data + pos + 4, seg_len - 2,
+          thumb, thumb_len)) {
+      return true;
+    }
+    pos += 2 + seg_len;
+  }
+  return false;
+}
+
+/* Reassembles the ICC profile that's split into numbered chunks across the
+ * APP2 segments ahead of the image data, if there is one. Returns it in a
+ * buffer to be freed by the caller, or NULL if there's none or it's broken. */
+static unsigned char *find_icc_profile(struct private *private, size_t *len)
+{
+  static const char tag[] = "ICC_PROFILE";
+  const unsigned char *chunks[256] = {0};
+  size_t chunk_lens[256] = {0};
+  unsigned count = 0;
+
+  const unsigned char *data = private->data;
+  size_t pos = 2;
+  while (pos + 4 <= private->len && data[pos] == 0xff) {
+    const unsigned marker = data[pos + 1];
+    const size_t seg_len = read_u16(data + pos + 2, true);
+    if (marker == 0xda || seg_len < 2 || pos + 2 + seg_len > private->len) {
+      break;
+    }
+    /* The tag and its NUL, then the chunk's number counting from 1 and how
+     * many chunks there are */
+    if (marker == 0xe2 && seg_len >= 2 + sizeof tag + 2
+        && !memcmp(data + pos + 4, tag, sizeof tag)) {
+      const unsigned seq = data[pos + 4 + sizeof tag];
+      const unsigned total = data[pos + 5 + sizeof tag];
+      if (!count) {
+        count = total;
+      }
+      if (seq >= 1 && seq <= count && total == count) {
+        chunks[seq - 1] = data + pos + 6 + sizeof tag;
+        chunk_lens[seq - 1] = seg_len - 4 - sizeof tag;
+      }
+    }
+    pos += 2 + seg_len;
+  }
+
+  size_t total_len = 0;
+  for (unsigned i = 0; i < count; ++i) {
+    if (!chunks[i]) {
+      return NULL;
+    }
+    total_len += chunk_lens[i];
+  }
+  unsigned char *profile = total_len ? malloc(total_len) : NULL;
+  if (!profile) {
+    return NULL;
+  }
+
+  *len = 0;
+  for (unsigned i = 0; i < count; ++i) {
+    memcpy(profile + *len, chunks[i], chunk_lens[i]);
+    *len += chunk_lens[i];
+  }
+  return profile;
+}
+
+static void load_preview(void *raw_private, struct imv_image **image)
+{
+  *image = NULL;
+
+  struct private *private = raw_private;
+
+  const unsigned char *thumb;
+  size_t thumb_len;
+  if (!find_thumbnail(private, &thumb, &thumb_len)) {
+    return;
+  }
+
+  int thumb_width, thumb_height, subsamp, colorspace;
+  if (tjDecompressHeader3(private->jpeg, thumb, thumb_len,
+        &thumb_width, &thumb_height, &subsamp, &colorspace)) {
+    return;
+  }
+
+  /* Only worth it if it's much quicker than the real thing, and won't look
+   * stretched, as thumbnails are sometimes letterboxed to a fixed size */
+  int width, height;
+  pick_size(private, &width, &height);
+  if (thumb_width * 4 > width || thumb_width <= 0 || thumb_height <= 0
+      || fabs((double)thumb_width / thumb_height
+        - (double)private->width / private->height) > 0.02) {
+    return;
+  }
+
+  struct imv_bitmap *bmp = imv_bitmap_create(thumb_width, thumb_height, IMV_ABGR);
+  if (!bmp) {
+    return;
+  }
+
+  if (tjDecompress2(private->jpeg, thumb, thumb_len, bmp->data,
+        thumb_width, bmp->stride, thumb_height, TJPF_RGBA, TJFLAG_FASTDCT)) {
+    imv_bitmap_free(bmp);
+    return;
+  }
+
+  *image = imv_image_create_from_scaled_bitmap(bmp, private->width, private->height);
+}
+
 static void load_image(void *raw_private, struct imv_image **image, int *frametime)
 {
   *image = NULL;
@@ -45,55 +274,51 @@ static void load_image(void *raw_private, struct imv_image **image, int *frameti
 
   struct private *private = raw_private;
 
-  void *bitmap = malloc(private->height * private->width * 4);
+  int width, height;
+  pick_size(private, &width, &height);
+
+  struct imv_bitmap *bmp = imv_bitmap_create(width, height, IMV_ABGR);
+  if (!bmp) {
+    return;
+  }
+
   int rcode = tjDecompress2(private->jpeg, private->data, private->len,
-      bitmap, private->width, 0, private->height, TJPF_RGBA, TJFLAG_FASTDCT);
+      bmp->data, width, bmp->stride, height, TJPF_RGBA, TJFLAG_FASTDCT);
 
   if (rcode) {
-    free(bitmap);
+    imv_bitmap_free(bmp);
     return;
   }
 
-  struct imv_bitmap *bmp = malloc(sizeof *bmp);
-  bmp->width = private->width;
-  bmp->height = private->height;
-  bmp->format = IMV_ABGR;
-  bmp->data = bitmap;
-  *image = imv_image_create_from_bitmap(bmp);
+  if (width != private->width || height != private->height) {
+    *image = imv_image_create_from_scaled_bitmap(bmp, private->width, private->height);
+  } else {
+    *image = imv_image_create_from_bitmap(bmp);
+  }
+  imv_image_set_icc_profile(*image, private->icc_profile, private->icc_profile_len);
 }
 
 static const struct imv_source_vtable vtable = {
   .load_first_frame = load_image,
+  .load_preview = load_preview,
+  .set_target_size = set_target_size,
   .free = free_private
 };
 
 static enum backend_result open_path(const char *path, struct imv_source **src)
 {
-  struct private private;
+  struct private private = {0};
 
-  private.fd = open(path, O_RDONLY);
-  if (private.fd < 0) {
-    return BACKEND_BAD_PATH;
-  }
-
-  off_t len = lseek(private.fd, 0, SEEK_END);
-  if (len < 0) {
-    close(private.fd);
-    return BACKEND_BAD_PATH;
-  }
-
-  private.len = len;
-
-  private.data = mmap(NULL, private.len, PROT_READ, MAP_PRIVATE, private.fd, 0);
-  if (private.data == MAP_FAILED || !private.data) {
-    close(private.fd);
+  private.file = imv_mapped_file_open(path);
+  if (!private.file) {
     return BACKEND_BAD_PATH;
   }
+  private.data = imv_mapped_file_data(private.file);
+  private.len = imv_mapped_file_size(private.file);
 
   private.jpeg = tjInitDecompress();
   if (!private.jpeg) {
-    munmap(private.data, private.len);
-    close(private.fd);
+    imv_mapped_file_close(private.file);
     return BACKEND_UNSUPPORTED;
   }
 
@@ -101,11 +326,13 @@ static enum backend_result open_path(const char *path, struct imv_source **src)
       &private.width, &private.height);
   if (rcode) {
     tjDestroy(private.jpeg);
-    munmap(private.data, private.len);
-    close(private.fd);
+    imv_mapped_file_close(private.file);
     return BACKEND_UNSUPPORTED;
   }
 
+  private.icc_profile = find_icc_profile(&private, &private.icc_profile_len);
+  imv_mapped_file_will_read(private.file, 0, private.len);
+
   struct private *new_private = malloc(sizeof private);
   memcpy(new_private, &private, sizeof private);
 
@@ -115,9 +342,8 @@ static enum backend_result open_path(const char *path, struct imv_source **src)
 
 static enum backend_result open_memory(void *data, size_t len, struct imv_source **src)
 {
-  struct private private;
+  struct private private = {0};
 
-  private.fd = -1;
   private.data = data;
   private.len = len;
 
@@ -133,6 +359,8 @@ static enum backend_result open_memory(void *data, size_t len, struct imv_source
     return BACKEND_UNSUPPORTED;
   }
 
+  private.icc_profile = find_icc_profile(&private, &private.icc_profile_len);
+
   struct private *new_private = malloc(sizeof private);
   memcpy(new_private, &private, sizeof private);
 
@@ -140,6 +368,11 @@ static enum backend_result open_memory(void *data, size_t len, struct imv_source
   return BACKEND_SUCCESS;
 }
 
+static const struct imv_backend_signature signatures[] = {
+  {0, "\xff\xd8\xff", 3},
+  {0, NULL, 0},
+};
+
 const struct imv_backend imv_backend_libjpeg = {
   .name = "libjpeg-turbo",
   .description = "Fast JPEG codec based on libjpeg. "
@@ -149,4 +382,5 @@ const struct imv_backend imv_backend_libjpeg = {
   .license = "The Modified BSD License",
   .open_path = &open_path,
   .open_memory = &open_memory,
+  .signatures = signatures,
 };
@@ -1,41 +1,50 @@
 #include "backend.h"
 #include "bitmap.h"
+#include "bitmap_pool.h"
 #include "image.h"
 #include "log.h"
+#include "mapped_file.h"
 #include "source.h"
 #include "source_private.h"
 
-#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/mman.h>
-#include <unistd.h>
 #include <limits.h>
+#include <stdint.h>
 
 #include <jxl/decode.h>
+#include <jxl/version.h>
 
 #define BACKEND_NB_CHANNELS       4
 #define BACKEND_DEFAULT_FRAMETIME 100
-#define BACKEND_NB_ALLOC_FRAMES   64
-
-struct jxl_frame {
-  void *data;
-  int frametime;
-};
 
 struct private {
   void *data;
-  off_t data_len;
-  int owns_data;
+  size_t data_len;
+  /* NULL when data belongs to whoever called open_memory */
+  struct imv_mapped_file *file;
 
   int width;
   int height;
   int is_animation;
+  uint32_t tps_numerator;
+  uint32_t tps_denominator;
 
-  struct jxl_frame *frames;
-  int nb_allocd_frames;
-  int cur_frame;
-  int nb_frames;
+  /* Kept alive between frames of an animation, so each frame is decoded
+   * only when it's asked for, and rewound to loop back to the start */
+  JxlDecoder *decoder;
+  /* duration of the frame being decoded, in milliseconds */
+  int frametime;
+  /* the ICC profile of the colour space frames are decoded in */
+  unsigned char *icc_profile;
+  size_t icc_profile_len;
+  /* what frames are decoded to, deeper than 8 bits for images that are, and
+   * how their values map to light */
+  enum imv_pixelformat format;
+  enum imv_transfer transfer;
+
+  /* buffers for the frames handed out, recycled as they're displayed */
+  struct imv_bitmap_pool *pool;
 };
 
 static void free_private(void *raw_pvt)
@@ -45,135 +54,261 @@ static void free_private(void *raw_pvt)
 
   struct private *pvt = raw_pvt;
 
-  if (pvt->owns_data) {
-    if (pvt->data)
-      munmap(pvt->data, pvt->data_len);
-  }
+  imv_mapped_file_close(pvt->file);
 
-  if (pvt->frames) {
-    for (int i = 0; i != pvt->nb_allocd_frames; ++i)
-      if (pvt->frames[i].data)
-        free(pvt->frames[i].data);
+  if (pvt->decoder)
+    JxlDecoderDestroy(pvt->decoder);
 
-    free(pvt->frames);
+  imv_bitmap_pool_free(pvt->pool);
+  free(pvt->icc_profile);
+  free(pvt);
+}
+
+/* Points the decoder back at the start of the file, creating it if need be.
+ * Rewinding rather than recreating lets libjxl keep what it has learnt of
+ * the frame layout. */
+static int rewind_decoder(struct private *pvt)
+{
+  if (pvt->decoder) {
+    JxlDecoderRewind(pvt->decoder);
+  } else {
+    pvt->decoder = JxlDecoderCreate(NULL);
+    if (!pvt->decoder) {
+      imv_log(IMV_ERROR, "libjxl: failed to create decoder\n");
+      return 0;
+    }
+    if (JxlDecoderSubscribeEvents(pvt->decoder,
+          JXL_DEC_BASIC_INFO | JXL_DEC_COLOR_ENCODING | JXL_DEC_FRAME
+          | JXL_DEC_FULL_IMAGE) != JXL_DEC_SUCCESS) {
+      imv_log(IMV_ERROR, "libjxl: decoder failed to subscribe to events\n");
+      return 0;
+    }
   }
 
-  free(pvt);
+  if (JxlDecoderSetInput(pvt->decoder, pvt->data, pvt->data_len) != JXL_DEC_SUCCESS) {
+    imv_log(IMV_ERROR, "libjxl: decoder failed to set input\n");
+    return 0;
+  }
+  JxlDecoderCloseInput(pvt->decoder);
+  return 1;
 }
 
-static void push_frame(struct private *pvt, struct imv_image **img, int *frametime)
+static int frame_duration(struct private *pvt, uint32_t ticks)
 {
-  struct imv_bitmap *bmp = malloc(sizeof *bmp);
-  size_t sz = pvt->width * pvt->height * BACKEND_NB_CHANNELS;
+  if (!pvt->tps_numerator || !pvt->tps_denominator) {
+    imv_log(IMV_DEBUG, "libjxl: no frametime info for animation, using default\n");
+    return BACKEND_DEFAULT_FRAMETIME;
+  }
+  return (int)((uint64_t)ticks * 1000 * pvt->tps_denominator / pvt->tps_numerator);
+}
 
-  bmp->width = pvt->width;
-  bmp->height = pvt->height;
-  bmp->format = IMV_ABGR;
-  bmp->data = malloc(sz);
-  memcpy(bmp->data, pvt->frames[pvt->cur_frame].data, sz);
+/* libjxl 0.9 stopped asking for the pixel format when getting profiles */
+#if JPEGXL_NUMERIC_VERSION >= JPEGXL_COMPUTE_NUMERIC_VERSION(0, 9, 0)
+#define PROFILE_TARGET(fmt) JXL_COLOR_PROFILE_TARGET_DATA
+#else
+#define PROFILE_TARGET(fmt) (fmt), JXL_COLOR_PROFILE_TARGET_DATA
+#endif
+
+/* Takes the ICC profile of the colour space the pixels are decoded in,
+ * which libjxl makes up from the image's colour encoding if the image
+ * didn't come with one */
+static void read_icc_profile(struct private *pvt, const JxlPixelFormat *fmt)
+{
+  (void)fmt;
+  free(pvt->icc_profile);
+  pvt->icc_profile = NULL;
+  pvt->icc_profile_len = 0;
+
+  size_t len;
+  if (JxlDecoderGetICCProfileSize(pvt->decoder, PROFILE_TARGET(fmt), &len)
+      != JXL_DEC_SUCCESS || !len)
+    return;
 
-  *img = imv_image_create_from_bitmap(bmp);
-  *frametime = pvt->frames[pvt->cur_frame].frametime;
+  unsigned char *profile = malloc(len);
+  if (!profile)
+    return;
+  if (JxlDecoderGetColorAsICCProfile(pvt->decoder, PROFILE_TARGET(fmt),
+        profile, len) != JXL_DEC_SUCCESS) {
+    imv_log(IMV_DEBUG, "libjxl: failed to get ICC profile\n");
+    free(profile);
+    return;
+  }
+  pvt->icc_profile = profile;
+  pvt->icc_profile_len = len;
 }
 
-static void first_frame(void *raw_pvt, struct imv_image **img, int *frametime)
+/* Finds out whether the pixels are decoded in an HDR colour space, which
+ * only images with an encoded colour space rather than an ICC profile can be
+ * known to be */
+static void read_transfer(struct private *pvt, const JxlPixelFormat *fmt)
 {
-  *img = NULL;
-  *frametime = 0;
+  (void)fmt;
+  pvt->transfer = IMV_TRANSFER_SRGB;
 
-  imv_log(IMV_DEBUG, "libjxl: first_frame called\n");
+  JxlColorEncoding encoding;
+  if (JxlDecoderGetColorAsEncodedProfile(pvt->decoder, PROFILE_TARGET(fmt),
+        &encoding) != JXL_DEC_SUCCESS)
+    return;
 
-  struct private *pvt = raw_pvt;
-  JxlDecoder *jxld = JxlDecoderCreate(NULL);
-  if (JxlDecoderSubscribeEvents(jxld, JXL_DEC_BASIC_INFO | JXL_DEC_FULL_IMAGE) != JXL_DEC_SUCCESS) {
-    imv_log(IMV_ERROR, "libjxl: decoder failed to subscribe to events\n");
-    goto end;
+  switch (encoding.transfer_function) {
+    case JXL_TRANSFER_FUNCTION_PQ:
+      pvt->transfer = IMV_TRANSFER_PQ;
+      break;
+    case JXL_TRANSFER_FUNCTION_HLG:
+      pvt->transfer = IMV_TRANSFER_HLG;
+      break;
+    case JXL_TRANSFER_FUNCTION_LINEAR:
+      pvt->transfer = IMV_TRANSFER_LINEAR;
+      break;
+    default:
+      break;
   }
+}
 
-  JxlBasicInfo info;
-  JxlDecoderStatus sts = JxlDecoderSetInput(jxld, pvt->data, pvt->data_len);
-  if (sts != JXL_DEC_SUCCESS) {
-    imv_log(IMV_ERROR, "libjxl: decoder failed to set input\n");
-    goto end;
+/* Picks the type frames are decoded to, for the format in pvt */
+static JxlDataType data_type(const struct private *pvt)
+{
+  switch (pvt->format) {
+    case IMV_ABGR16:
+      return JXL_TYPE_UINT16;
+    case IMV_ABGR_HALF:
+      return JXL_TYPE_FLOAT16;
+    default:
+      return JXL_TYPE_UINT8;
   }
-  JxlDecoderCloseInput(jxld);
+}
 
-  pvt->nb_frames = 0;
-  pvt->cur_frame = 0;
+/* Runs the decoder up to the end of the next frame. When it runs off the end
+ * of an animation it starts over from the beginning. */
+static void decode_frame(struct private *pvt, struct imv_image **img, int *frametime)
+{
+  JxlPixelFormat fmt = { BACKEND_NB_CHANNELS, data_type(pvt), JXL_NATIVE_ENDIAN, 0 };
+  struct imv_bitmap *bmp = NULL;
+  int rewound = 0;
 
-  JxlPixelFormat fmt = { BACKEND_NB_CHANNELS, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0 };
-  pvt->nb_allocd_frames = BACKEND_NB_ALLOC_FRAMES;
-  pvt->frames = calloc(pvt->nb_allocd_frames, sizeof *pvt->frames);
-  do {
-    sts = JxlDecoderProcessInput(jxld);
+  while (1) {
+    JxlDecoderStatus sts = JxlDecoderProcessInput(pvt->decoder);
 
     switch (sts) {
       case JXL_DEC_SUCCESS:
+        if (!pvt->is_animation || rewound) {
+          imv_log(IMV_ERROR, "libjxl: no frame left to decode\n");
+          goto fail;
+        }
+        if (!rewind_decoder(pvt))
+          goto fail;
+        rewound = 1;
         break;
       case JXL_DEC_ERROR:
         imv_log(IMV_ERROR, "libjxl: decoder error\n");
-        goto end;
+        goto fail;
       case JXL_DEC_NEED_MORE_INPUT:
         imv_log(IMV_ERROR, "libjxl: decoder needs more input\n");
-        goto end;
+        goto fail;
       case JXL_DEC_BASIC_INFO:
-        if (JxlDecoderGetBasicInfo(jxld, &info) != JXL_DEC_SUCCESS) {
-          imv_log(IMV_ERROR, "libjxl: decoder failed to get basic info\n");
-          goto end;
+        {
+          JxlBasicInfo info;
+          if (JxlDecoderGetBasicInfo(pvt->decoder, &info) != JXL_DEC_SUCCESS) {
+            imv_log(IMV_ERROR, "libjxl: decoder failed to get basic info\n");
+            goto fail;
+          }
+          pvt->width = info.xsize;
+          pvt->height = info.ysize;
+          pvt->is_animation = info.have_animation == JXL_TRUE ? 1 : 0;
+          pvt->tps_numerator = info.animation.tps_numerator;
+          pvt->tps_denominator = info.animation.tps_denominator;
+          /* Anything deeper than 8 bits keeps its depth, with floating point
+           * staying floating point so HDR values above 1.0 survive */
+          if (info.exponent_bits_per_sample > 0) {
+            pvt->format = IMV_ABGR_HALF;
+          } else if (info.bits_per_sample > 8) {
+            pvt->format = IMV_ABGR16;
+          } else {
+            pvt->format = IMV_ABGR;
+          }
+          fmt.data_type = data_type(pvt);
+          break;
         }
-        pvt->width = info.xsize;
-        pvt->height = info.ysize;
-        pvt->is_animation = info.have_animation == JXL_TRUE ? 1 : 0;
+      case JXL_DEC_COLOR_ENCODING:
+        read_icc_profile(pvt, &fmt);
+        read_transfer(pvt, &fmt);
         break;
+      case JXL_DEC_FRAME:
+        {
+          JxlFrameHeader header;
+          if (JxlDecoderGetFrameHeader(pvt->decoder, &header) != JXL_DEC_SUCCESS) {
+            imv_log(IMV_ERROR, "libjxl: decoder failed to get frame header\n");
+            goto fail;
+          }
+          pvt->frametime = pvt->is_animation ? frame_duration(pvt, header.duration) : 0;
+          break;
+        }
       case JXL_DEC_NEED_IMAGE_OUT_BUFFER:
         {
           size_t buf_sz;
-          if (JxlDecoderImageOutBufferSize(jxld, &fmt, &buf_sz) != JXL_DEC_SUCCESS) {
+          if (JxlDecoderImageOutBufferSize(pvt->decoder, &fmt, &buf_sz) != JXL_DEC_SUCCESS) {
             imv_log(IMV_ERROR, "libjxl: decoder failed to get output buffer size\n");
-            goto end;
-          }
-
-          if (pvt->nb_frames == pvt->nb_allocd_frames) {
-            pvt->frames = realloc(pvt->frames,
-                sizeof(struct jxl_frame) * (pvt->nb_allocd_frames + BACKEND_NB_ALLOC_FRAMES));
-            pvt->nb_allocd_frames += BACKEND_NB_ALLOC_FRAMES;
-            memset(&pvt->frames[pvt->nb_frames], 0,
-                (pvt->nb_allocd_frames * sizeof(struct jxl_frame)) - (pvt->nb_frames * sizeof(struct jxl_frame)));
+            goto fail;
           }
 
-          struct jxl_frame *cur_frame = &pvt->frames[pvt->nb_frames];
-          cur_frame->data = malloc(buf_sz);
+          if (!pvt->pool)
+            pvt->pool = imv_bitmap_pool_create();
 
-          if (pvt->is_animation) {
-            if (info.animation.tps_numerator && info.animation.tps_denominator)
-              cur_frame->frametime = info.animation.tps_numerator / info.animation.tps_denominator;
-            else {
-                imv_log(IMV_DEBUG, "libjxl: no frametime info for animation, using default\n");
-                cur_frame->frametime = BACKEND_DEFAULT_FRAMETIME;
-            }
-          } else
-            cur_frame->frametime = 0;
+          /* Decode straight into the bitmap that will be handed out */
+          bmp = imv_bitmap_pool_get(pvt->pool, pvt->width, pvt->height, pvt->format);
+          if (!bmp) {
+            imv_log(IMV_ERROR, "libjxl: failed to allocate output buffer\n");
+            goto fail;
+          }
+          if ((size_t)bmp->stride * bmp->height != buf_sz) {
+            imv_log(IMV_ERROR, "libjxl: unexpected output buffer size\n");
+            goto fail;
+          }
 
-          if (JxlDecoderSetImageOutBuffer(jxld, &fmt, cur_frame->data, buf_sz) != JXL_DEC_SUCCESS) {
+          if (JxlDecoderSetImageOutBuffer(pvt->decoder, &fmt, bmp->data, buf_sz) != JXL_DEC_SUCCESS) {
             imv_log(IMV_ERROR, "libjxl: JxlDecoderSetImageOutBuffer failed\n");
-            goto end;
+            goto fail;
           }
           break;
         }
       case JXL_DEC_FULL_IMAGE:
-        ++pvt->nb_frames;
-        continue;
+        *img = imv_image_create_from_bitmap(bmp);
+        imv_image_set_icc_profile(*img, pvt->icc_profile, pvt->icc_profile_len);
+        imv_image_set_transfer(*img, pvt->transfer);
+        *frametime = pvt->frametime;
+        return;
       default:
         imv_log(IMV_ERROR, "libjxl: unknown decoder status\n");
-        goto end;
+        goto fail;
     }
-  } while (sts != JXL_DEC_SUCCESS);
+  }
 
-  push_frame(pvt, img, frametime);
+fail:
+  if (bmp)
+    imv_bitmap_free(bmp);
+  JxlDecoderDestroy(pvt->decoder);
+  pvt->decoder = NULL;
+}
 
-end:
-  if (jxld)
-    JxlDecoderDestroy(jxld);
+static void first_frame(void *raw_pvt, struct imv_image **img, int *frametime)
+{
+  *img = NULL;
+  *frametime = 0;
+
+  imv_log(IMV_DEBUG, "libjxl: first_frame called\n");
+
+  struct private *pvt = raw_pvt;
+  if (!rewind_decoder(pvt))
+    return;
+
+  decode_frame(pvt, img, frametime);
+
+  /* A still image has nothing more to decode, so give up the decoder's
+   * state now rather than holding it for as long as the image is open */
+  if (pvt->decoder && !pvt->is_animation) {
+    JxlDecoderDestroy(pvt->decoder);
+    pvt->decoder = NULL;
+  }
 }
 
 static void next_frame(void *raw_pvt, struct imv_image **img, int *frametime)
@@ -184,13 +319,10 @@ static void next_frame(void *raw_pvt, struct imv_image **img, int *frametime)
   imv_log(IMV_DEBUG, "libjxl: next_frame called\n");
 
   struct private *pvt = raw_pvt;
+  if (!pvt->decoder && !rewind_decoder(pvt))
+    return;
 
-  if (pvt->cur_frame == pvt->nb_frames - 1)
-    pvt->cur_frame = 0;
-  else
-    ++pvt->cur_frame;
-
-  push_frame(pvt, img, frametime);
+  decode_frame(pvt, img, frametime);
 }
 
 static const struct imv_source_vtable vtable = {
@@ -199,12 +331,11 @@ static const struct imv_source_vtable vtable = {
   .free = free_private,
 };
 
-static enum backend_result open_memory(void *data, size_t sz, struct imv_source **src)
+/* Makes a source decoding sz bytes at data, which stay valid until it's
+ * freed. If file is given, the source takes ownership of it. */
+static enum backend_result open_data(void *data, size_t sz,
+    struct imv_mapped_file *file, struct imv_source **src)
 {
-  imv_log(IMV_DEBUG, "libjxl: open_memory called\n");
-
-  struct private *pvt = calloc(1, sizeof *pvt);
-
   switch (JxlSignatureCheck(data, sz)) {
     case JXL_SIG_NOT_ENOUGH_BYTES:
       imv_log(IMV_DEBUG, "libjxl: not enough bytes to read\n");
@@ -212,64 +343,53 @@ static enum backend_result open_memory(void *data, size_t sz, struct imv_source
       imv_log(IMV_DEBUG, "libjxl: valid jxl signature not found\n");
       return BACKEND_UNSUPPORTED;
     default:
-      pvt->owns_data = 0;
-      pvt->data = data;
-      pvt->data_len = sz;
       break;
     }
 
+  struct private *pvt = calloc(1, sizeof *pvt);
+  pvt->data = data;
+  pvt->data_len = sz;
+  pvt->file = file;
+  pvt->format = IMV_ABGR;
+
   *src = imv_source_create(&vtable, pvt);
 
   return BACKEND_SUCCESS;
 }
 
+static enum backend_result open_memory(void *data, size_t sz, struct imv_source **src)
+{
+  imv_log(IMV_DEBUG, "libjxl: open_memory called\n");
+
+  return open_data(data, sz, NULL, src);
+}
+
 static enum backend_result open_path(const char *path, struct imv_source **src)
 {
   imv_log(IMV_DEBUG, "libjxl: open_path(%s)\n", path);
 
-  enum backend_result ret = BACKEND_SUCCESS;
-  struct private *pvt = calloc(1, sizeof *pvt);
-
-  int fd = open(path, O_RDONLY);
-  if (fd < 0) {
-    ret = BACKEND_BAD_PATH;
-    goto end;
+  struct imv_mapped_file *file = imv_mapped_file_open(path);
+  if (!file) {
+    return BACKEND_BAD_PATH;
   }
 
-  pvt->data_len = lseek(fd, 0, SEEK_END);
-  if (pvt->data_len < 0) {
-    ret = BACKEND_BAD_PATH;
-    goto end;
+  enum backend_result ret = open_data(imv_mapped_file_data(file),
+      imv_mapped_file_size(file), file, src);
+  if (ret != BACKEND_SUCCESS) {
+    imv_mapped_file_close(file);
+  } else {
+    imv_mapped_file_will_read(file, 0, imv_mapped_file_size(file));
   }
-  pvt->data = mmap(NULL, pvt->data_len, PROT_READ, MAP_PRIVATE, fd, 0);
-  if (!pvt->data || pvt->data == MAP_FAILED) {
-    imv_log(IMV_ERROR, "libjxl: failed to map file into memory\n");
-    ret = BACKEND_BAD_PATH;
-    goto end;
-  }
-
-  switch (JxlSignatureCheck(pvt->data, pvt->data_len)) {
-    case JXL_SIG_NOT_ENOUGH_BYTES:
-      imv_log(IMV_DEBUG, "libjxl: not enough bytes to read\n");
-    case JXL_SIG_INVALID:
-      imv_log(IMV_DEBUG, "libjxl: valid jxl signature not found\n");
-      munmap(pvt->data, pvt->data_len);
-      ret = BACKEND_UNSUPPORTED;
-      goto end;
-    default:
-      pvt->owns_data = 1;
-      break;
-    }
-
-  *src = imv_source_create(&vtable, pvt);
-
-end:
-  if (fd >= 0)
-    close(fd);
-
   return ret;
 }
 
+/* A bare codestream, or one in the ISO base media container */
+static const struct imv_backend_signature signatures[] = {
+  {0, "\xff\x0a", 2},
+  {0, "\0\0\0\x0cJXL \r\n\x87\n", 12},
+  {0, NULL, 0},
+};
+
 const struct imv_backend imv_backend_libjxl = {
   .name = "libjxl",
   .description = "The official JPEGXL reference implementation",
@@ -277,6 +397,7 @@ const struct imv_backend imv_backend_libjxl = {
   .license = "The Modified BSD License",
   .open_path = &open_path,
   .open_memory = &open_memory,
+  .signatures = signatures,
 };
 
 /* vim:set ts=2 sts=2 sw=2 et: */
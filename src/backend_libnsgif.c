@@ -1,22 +1,30 @@
 #include "backend.h"
 #include "bitmap.h"
+#include "bitmap_pool.h"
+#include "frame_cache.h"
 #include "image.h"
 #include "log.h"
+#include "mapped_file.h"
 #include "source.h"
 #include "source_private.h"
 
-#include <fcntl.h>
 #include <nsgif.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/mman.h>
-#include <unistd.h>
+
+/* The most bytes of an animation's frames to keep for playing it back
+ * again, enough for a few seconds of a large GIF */
+#define FRAME_CACHE_BUDGET (128 * 1024 * 1024)
 
 struct private {
   int current_frame;
   nsgif_t *gif;
-  void *data;
-  size_t len;
+  /* NULL when the data belongs to whoever called open_memory */
+  struct imv_mapped_file *file;
+  /* buffers for the frames handed out, recycled as they're displayed */
+  struct imv_bitmap_pool *pool;
+  /* the frames of an animation, once it's been through them once */
+  struct imv_frame_cache *frames;
 };
 
 static nsgif_bitmap_t* bitmap_create(int width, int height)
@@ -70,7 +78,9 @@ static void free_private(void *raw_private)
 
   struct private *private = raw_private;
   nsgif_destroy(private->gif);
-  munmap(private->data, private->len);
+  imv_mapped_file_close(private->file);
+  imv_bitmap_pool_free(private->pool);
+  imv_frame_cache_free(private->frames);
   free(private);
 }
 
@@ -80,16 +90,38 @@ static void push_current_image(struct private *private,
   const nsgif_info_t *gif_info = nsgif_get_info(private->gif);
   const nsgif_frame_info_t *frame_info = nsgif_get_frame_info(private->gif, private->current_frame);
 
-  struct imv_bitmap *bmp = malloc(sizeof *bmp);
-  bmp->width = gif_info->width;
-  bmp->height = gif_info->height;
-  bmp->format = IMV_ABGR;
+  if (!private->pool) {
+    private->pool = imv_bitmap_pool_create();
+  }
+  struct imv_bitmap *bmp = imv_bitmap_pool_get(private->pool,
+      gif_info->width, gif_info->height, IMV_ABGR);
+  if (!bmp) {
+    return;
+  }
   size_t len = 4 * bmp->width * bmp->height;
-  bmp->data = malloc(len);
   memcpy(bmp->data, gif_frame_data, len);
 
   *image = imv_image_create_from_bitmap(bmp);
   *frametime = frame_info->delay * 10.0;
+
+  if (private->frames) {
+    imv_frame_cache_put(private->frames, private->current_frame, bmp, *frametime);
+  }
+}
+
+/* Hands out the current frame as kept from an earlier loop, if it was */
+static bool push_cached_image(struct private *private,
+    struct imv_image **image, int *frametime)
+{
+  struct imv_bitmap *bmp = private->frames
+    ? imv_frame_cache_get(private->frames, private->current_frame, frametime)
+    : NULL;
+  if (!bmp) {
+    return false;
+  }
+
+  *image = imv_image_create_from_bitmap(bmp);
+  return true;
 }
 
 static void first_frame(void *raw_private, struct imv_image **image, int *frametime)
@@ -100,6 +132,10 @@ static void first_frame(void *raw_private, struct imv_image **image, int *framet
   struct private *private = raw_private;
   private->current_frame = 0;
 
+  if (push_cached_image(private, image, frametime)) {
+    return;
+  }
+
   void *gif_frame_data;
   nsgif_error code = nsgif_frame_decode(private->gif, private->current_frame, &gif_frame_data);
   if (code != NSGIF_OK) {
@@ -122,6 +158,10 @@ static void next_frame(void *raw_private, struct imv_image **image, int *frameti
   const nsgif_info_t *gif_info = nsgif_get_info(private->gif);
   private->current_frame %= gif_info->frame_count;
 
+  if (push_cached_image(private, image, frametime)) {
+    return;
+  }
+
   void *gif_frame_data;
   nsgif_error code = nsgif_frame_decode(private->gif, private->current_frame, &gif_frame_data);
   if (code != NSGIF_OK) {
@@ -138,10 +178,12 @@ static const struct imv_source_vtable vtable = {
   .free = free_private
 };
 
-static enum backend_result open_memory(void *data, size_t len, struct imv_source **src)
+/* Makes a source decoding the len bytes at data, which stay valid until it's
+ * freed. If file is given, the source takes ownership of it. */
+static enum backend_result open_data(void *data, size_t len,
+    struct imv_mapped_file *file, struct imv_source **src)
 {
   struct private *private = calloc(1, sizeof *private);
-
   nsgif_error code;
 
   code = nsgif_create(&bitmap_callbacks, NSGIF_BITMAP_FMT_R8G8B8A8, &private->gif);
@@ -162,66 +204,51 @@ static enum backend_result open_memory(void *data, size_t len, struct imv_source
 
   nsgif_data_complete(private->gif);
 
+  const nsgif_info_t *gif_info = nsgif_get_info(private->gif);
+
+  imv_log(IMV_DEBUG, "libnsgif: num_frames=%d\n", gif_info->frame_count);
+  imv_log(IMV_DEBUG, "libnsgif: width=%d\n", gif_info->width);
+  imv_log(IMV_DEBUG, "libnsgif: height=%d\n", gif_info->height);
+
+  private->file = file;
+  if (gif_info->frame_count > 1) {
+    private->frames = imv_frame_cache_create(gif_info->frame_count,
+        FRAME_CACHE_BUDGET);
+  }
   *src = imv_source_create(&vtable, private);
   return BACKEND_SUCCESS;
 }
 
+static enum backend_result open_memory(void *data, size_t len, struct imv_source **src)
+{
+  return open_data(data, len, NULL, src);
+}
+
 static enum backend_result open_path(const char *path, struct imv_source **src)
 {
   imv_log(IMV_DEBUG, "libnsgif: open_path(%s)\n", path);
 
-  int fd = open(path, O_RDONLY);
-  if (fd < 0) {
+  struct imv_mapped_file *file = imv_mapped_file_open(path);
+  if (!file) {
     return BACKEND_BAD_PATH;
   }
 
-  off_t len = lseek(fd, 0, SEEK_END);
-  if (len < 0) {
-    close(fd);
-    return BACKEND_BAD_PATH;
+  enum backend_result ret = open_data(imv_mapped_file_data(file),
+      imv_mapped_file_size(file), file, src);
+  if (ret != BACKEND_SUCCESS) {
+    imv_mapped_file_close(file);
+  } else {
+    imv_mapped_file_will_read(file, 0, imv_mapped_file_size(file));
   }
-
-  void *data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
-  close(fd);
-  if (data == MAP_FAILED || !data) {
-    return BACKEND_BAD_PATH;
-  }
-
-  struct private *private = calloc(1, sizeof *private);
-  private->data = data;
-  private->len = len;
-  nsgif_error code;
-
-  code = nsgif_create(&bitmap_callbacks, NSGIF_BITMAP_FMT_R8G8B8A8, &private->gif);
-  if (code != NSGIF_OK) {
-    nsgif_destroy(private->gif);
-    munmap(private->data, private->len);
-    free(private);
-    imv_log(IMV_DEBUG, "libnsgif: unsupported file\n");
-    return BACKEND_UNSUPPORTED;
-  }
-
-  code = nsgif_data_scan(private->gif, len, data);
-  if (code != NSGIF_OK) {
-    nsgif_destroy(private->gif);
-    munmap(private->data, private->len);
-    free(private);
-    imv_log(IMV_DEBUG, "libsngif: unsupported file\n");
-    return BACKEND_UNSUPPORTED;
-  }
-
-  nsgif_data_complete(private->gif);
-
-  const nsgif_info_t *gif_info = nsgif_get_info(private->gif);
-
-  imv_log(IMV_DEBUG, "libnsgif: num_frames=%d\n", gif_info->frame_count);
-  imv_log(IMV_DEBUG, "libnsgif: width=%d\n", gif_info->width);
-  imv_log(IMV_DEBUG, "libnsgif: height=%d\n", gif_info->height);
-
-  *src = imv_source_create(&vtable, private);
-  return BACKEND_SUCCESS;
+  return ret;
 }
 
+static const struct imv_backend_signature signatures[] = {
+  {0, "GIF87a", 6},
+  {0, "GIF89a", 6},
+  {0, NULL, 0},
+};
+
 const struct imv_backend imv_backend_libnsgif = {
   .name = "libnsgif",
   .description = "Tiny GIF decoding library from the NetSurf project",
@@ -229,4 +256,5 @@ const struct imv_backend imv_backend_libnsgif = {
   .license = "MIT",
   .open_path = &open_path,
   .open_memory = &open_memory,
+  .signatures = signatures,
 };
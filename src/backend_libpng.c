@@ -2,31 +2,38 @@
 #include "bitmap.h"
 #include "image.h"
 #include "log.h"
+#include "mapped_file.h"
 #include "source.h"
 #include "source_private.h"
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <png.h>
 
 struct private {
-  FILE *file;
+  /* NULL when data belongs to whoever called open_memory */
+  struct imv_mapped_file *file;
   char *data;
   size_t len, pos;
 
   png_structp png;
   png_infop info;
+  int passes;
+  /* IMV_ABGR16 for 16-bit images, which are kept at that depth */
+  enum imv_pixelformat format;
+
+  /* The source we belong to, to send previews of interlaced images to */
+  struct imv_source *source;
 };
 
 static void read_end(struct private *private)
 {
   if (private->png) // The lifetime of private->info matches private->png
     png_destroy_read_struct(&private->png, &private->info, NULL);
-  if (private->file) {
-    fclose(private->file);
-    private->file = NULL;
-  }
+  imv_mapped_file_close(private->file);
+  private->file = NULL;
 }
 
 static void free_private(void *raw_private)
@@ -39,6 +46,24 @@ static void free_private(void *raw_private)
   free(private);
 }
 
+/* Sends a copy of what has been decoded so far to be shown meanwhile */
+static void push_partial(struct private *private, png_bytep raw,
+    int width, int height, size_t stride)
+{
+  struct imv_bitmap view = {
+    .width = width,
+    .height = height,
+    .stride = stride,
+    .format = private->format,
+    .data = raw
+  };
+
+  struct imv_bitmap *copy = imv_bitmap_clone(&view);
+  if (copy) {
+    imv_source_push_partial(private->source, imv_image_create_from_bitmap(copy));
+  }
+}
+
 static void load_image(void *raw_private, struct imv_image **image, int *frametime)
 {
   *image = NULL;
@@ -52,22 +77,44 @@ static void load_image(void *raw_private, struct imv_image **image, int *frameti
   int height = png_get_image_height(private->png, private->info);
   size_t stride = png_get_rowbytes(private->png, private->info);
 
-  png_bytep raw = malloc(stride * height);
+  png_bytep raw = calloc(height, stride);
 
   png_bytepp row_pointers = malloc(sizeof(png_bytep) * height);
   for (int i = 0; i < height; i++)
     row_pointers[i] = raw + i*stride;
-  png_read_image(private->png, row_pointers);
-  free(row_pointers);
 
-  read_end(private);
+  if (private->passes > 1) {
+    /* Each Adam7 pass fills in the gaps left by the one before, so read the
+     * passes into the display rows, which replicates the pixels decoded so
+     * far over those still missing, and show the early passes as they land.
+     * The last two passes come too close to the finished image to be worth
+     * copying.
+     */
+    for (int pass = 0; pass < private->passes; pass++) {
+      png_read_rows(private->png, NULL, row_pointers, height);
+      if (pass < private->passes - 2 && imv_source_wants_partial(private->source))
+        push_partial(private, raw, width, height, stride);
+    }
+  } else {
+    png_read_image(private->png, row_pointers);
+  }
+  free(row_pointers);
 
-  struct imv_bitmap *bmp = malloc(sizeof(struct imv_bitmap));
-  bmp->width = width;
-  bmp->height = height;
-  bmp->format = IMV_ABGR;
-  bmp->data = raw;
+  struct imv_bitmap *bmp = imv_bitmap_create_borrowed(width, height,
+      stride, private->format, raw, free, raw);
   *image = imv_image_create_from_bitmap(bmp);
+
+  /* The profile belongs to libpng, so has to be taken before it's let go */
+  png_charp name;
+  int compression;
+  png_bytep profile;
+  png_uint_32 profile_len;
+  if (png_get_iCCP(private->png, private->info, &name, &compression,
+        &profile, &profile_len)) {
+    imv_image_set_icc_profile(*image, profile, profile_len);
+  }
+
+  read_end(private);
 }
 
 static const struct imv_source_vtable vtable = {
@@ -101,20 +148,33 @@ static struct private *init_private()
   return private;
 }
 
-static int setup_png(png_structp png, png_infop info)
+static int setup_png(struct private *private)
 {
+  png_structp png = private->png;
+  png_infop info = private->info;
 
   if (setjmp(png_jmpbuf(png)))
     return 0;
 
   png_read_info(png, info);
 
-  /* Tell libpng to give us a consistent output format */
+  /* Tell libpng to give us a consistent output format, which for 16-bit
+   * images is native endian 16-bit channels, where PNG's are big endian */
   png_set_gray_to_rgb(png);
-  png_set_filler(png, 0xff, PNG_FILLER_AFTER);
-  png_set_strip_16(png);
+  if (png_get_bit_depth(png, info) == 16) {
+    const uint16_t one = 1;
+    private->format = IMV_ABGR16;
+    png_set_filler(png, 0xffff, PNG_FILLER_AFTER);
+    if (*(const unsigned char *)&one) {
+      png_set_swap(png);
+    }
+  } else {
+    private->format = IMV_ABGR;
+    png_set_filler(png, 0xff, PNG_FILLER_AFTER);
+  }
   png_set_expand(png);
   png_set_packing(png);
+  private->passes = png_set_interlace_handling(png);
   png_read_update_info(png, info);
 
   imv_log(IMV_DEBUG, "libpng: info width=%d height=%d bit_depth=%d color_type=%d\n",
@@ -126,45 +186,6 @@ static int setup_png(png_structp png, png_infop info)
   return 1;
 }
 
-static enum backend_result open_path(const char *path, struct imv_source **src)
-{
-  FILE *f = fopen(path, "rb");
-  if (!f) {
-    return BACKEND_BAD_PATH;
-  }
-
-  {
-    unsigned char sig[SIG_SIZE];
-    if (fread(sig, 1, SIG_SIZE, f) != SIG_SIZE) {
-      if (feof(f)) {
-        return BACKEND_UNSUPPORTED;
-      } else {
-        imv_log(IMV_ERROR, "Error reading %s\n", path);
-        return BACKEND_BAD_PATH;
-      }
-    }
-    if (png_sig_cmp(sig, 0, SIG_SIZE)) {
-      fclose(f);
-      return BACKEND_UNSUPPORTED;
-    }
-  }
-
-  struct private *private = init_private();
-  if (!private)
-    return BACKEND_UNSUPPORTED;
-  private->file = f;
-
-  png_init_io(private->png, private->file);
-
-  if (!setup_png(private->png, private->info)) {
-    free_private(private);
-    return BACKEND_UNSUPPORTED;
-  }
-
-  *src = imv_source_create(&vtable, private);
-  return BACKEND_SUCCESS;
-}
-
 static void read_memory(png_structp png, png_bytep out, png_size_t size)
 {
   struct private *private = png_get_io_ptr(png);
@@ -177,28 +198,60 @@ static void read_memory(png_structp png, png_bytep out, png_size_t size)
   private->pos += size;
 }
 
-static enum backend_result open_memory(void *data, size_t len, struct imv_source **src)
+/* Makes a source decoding the len bytes at data, which stay valid until it's
+ * freed. If file is given, the source takes ownership of it. */
+static enum backend_result open_data(void *data, size_t len,
+    struct imv_mapped_file *file, struct imv_source **src)
 {
-  if (png_sig_cmp(data, 0, SIG_SIZE))
+  if (len < SIG_SIZE || png_sig_cmp(data, 0, SIG_SIZE))
     return BACKEND_UNSUPPORTED;
 
   struct private *private = init_private();
   if (!private)
     return BACKEND_UNSUPPORTED;
 
-  private->data = data + SIG_SIZE;
+  private->data = (char *)data + SIG_SIZE;
   private->len = len - SIG_SIZE;
   png_set_read_fn(private->png, private, read_memory);
 
-  if (!setup_png(private->png, private->info)) {
+  if (!setup_png(private)) {
     free_private(private);
     return BACKEND_UNSUPPORTED;
   }
 
+  private->file = file;
   *src = imv_source_create(&vtable, private);
+  private->source = *src;
   return BACKEND_SUCCESS;
 }
 
+static enum backend_result open_path(const char *path, struct imv_source **src)
+{
+  struct imv_mapped_file *file = imv_mapped_file_open(path);
+  if (!file) {
+    return BACKEND_BAD_PATH;
+  }
+
+  enum backend_result ret = open_data(imv_mapped_file_data(file),
+      imv_mapped_file_size(file), file, src);
+  if (ret != BACKEND_SUCCESS) {
+    imv_mapped_file_close(file);
+  } else {
+    imv_mapped_file_will_read(file, 0, imv_mapped_file_size(file));
+  }
+  return ret;
+}
+
+static enum backend_result open_memory(void *data, size_t len, struct imv_source **src)
+{
+  return open_data(data, len, NULL, src);
+}
+
+static const struct imv_backend_signature signatures[] = {
+  {0, "\x89PNG\r\n\x1a\n", 8},
+  {0, NULL, 0},
+};
+
 const struct imv_backend imv_backend_libpng = {
   .name = "libpng",
   .description = "The official PNG reference implementation",
@@ -206,4 +259,5 @@ const struct imv_backend imv_backend_libpng = {
   .license = "The libpng license",
   .open_path = open_path,
   .open_memory = open_memory,
+  .signatures = signatures,
 };
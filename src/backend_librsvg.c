@@ -1,9 +1,11 @@
 #include "backend.h"
 #include "image.h"
+#include "mapped_file.h"
 #include "source.h"
 #include "source_private.h"
 
 #include <librsvg/rsvg.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -15,12 +17,17 @@
 struct private {
   void *data;
   size_t len;
-  char path[PATH_MAX+8];
+  /* NULL when data belongs to whoever called open_memory */
+  struct imv_mapped_file *file;
+  /* where the file came from, for resolving any relative references in it */
+  char path[PATH_MAX];
 };
 
 static void free_private(void *raw_private)
 {
-  free(raw_private);
+  struct private *private = raw_private;
+  imv_mapped_file_close(private->file);
+  free(private);
 }
 
 static void load_image(void *raw_private, struct imv_image **image, int *frametime)
@@ -33,10 +40,16 @@ static void load_image(void *raw_private, struct imv_image **image, int *frameti
   RsvgHandle *handle = NULL;
   GError *error = NULL;
 
-  if (private->data) {
-    handle = rsvg_handle_new_from_data(private->data, private->len, &error);
+  if (private->file) {
+    GInputStream *stream = g_memory_input_stream_new_from_data(private->data,
+        private->len, NULL);
+    GFile *base = g_file_new_for_path(private->path);
+    handle = rsvg_handle_new_from_stream_sync(stream, base,
+        RSVG_HANDLE_FLAGS_NONE, NULL, &error);
+    g_object_unref(base);
+    g_object_unref(stream);
   } else {
-    handle = rsvg_handle_new_from_file(private->path, &error);
+    handle = rsvg_handle_new_from_data(private->data, private->len, &error);
   }
 
   if (handle) {
@@ -49,32 +62,11 @@ static const struct imv_source_vtable vtable = {
   .free = free_private
 };
 
-static enum backend_result open_path(const char *path, struct imv_source **src)
-{
-  /* Look for an <SVG> tag near the start of the file */
-  char header[4096];
-  FILE *f = fopen(path, "rb");
-  if (!f) {
-    return BACKEND_BAD_PATH;
-  }
-  (void)fread(header, 1, sizeof header, f);
-  fclose(f);
-
-  header[(sizeof header) - 1] = 0;
-  if (!strstr(header, "<SVG") && !strstr(header, "<svg")) {
-    return BACKEND_UNSUPPORTED;
-  }
-
-  struct private *private = malloc(sizeof *private);
-  private->data = NULL;
-  private->len = 0;
-  snprintf(private->path, sizeof private->path, "file://%s", path);
-
-  *src = imv_source_create(&vtable, private);
-  return BACKEND_SUCCESS;
-}
-
-static enum backend_result open_memory(void *data, size_t len, struct imv_source **src)
+/* Makes a source of the len bytes at data, which stay valid until it's
+ * freed. If file is given, the source takes ownership of it, and path is
+ * where it was mapped from. */
+static enum backend_result open_data(void *data, size_t len,
+    struct imv_mapped_file *file, const char *path, struct imv_source **src)
 {
   /* Look for an <SVG> tag near the start of the file */
   char header[4096];
@@ -82,20 +74,52 @@ static enum backend_result open_memory(void *data, size_t len, struct imv_source
   if (header_len > len) {
     header_len = len;
   }
+  if (header_len == 0) {
+    return BACKEND_UNSUPPORTED;
+  }
   memcpy(header, data, header_len);
   header[header_len - 1] = 0;
   if (!strstr(header, "<SVG") && !strstr(header, "<svg")) {
     return BACKEND_UNSUPPORTED;
   }
 
-  struct private *private = malloc(sizeof *private);
+  struct private *private = calloc(1, sizeof *private);
   private->data = data;
   private->len = len;
+  private->file = file;
+  if (file) {
+    snprintf(private->path, sizeof private->path, "%s", path);
+  }
 
   *src = imv_source_create(&vtable, private);
   return BACKEND_SUCCESS;
 }
 
+static enum backend_result open_path(const char *path, struct imv_source **src)
+{
+  struct imv_mapped_file *file = imv_mapped_file_open(path);
+  if (!file) {
+    return BACKEND_BAD_PATH;
+  }
+
+  enum backend_result ret = open_data(imv_mapped_file_data(file),
+      imv_mapped_file_size(file), file, path, src);
+  if (ret != BACKEND_SUCCESS) {
+    imv_mapped_file_close(file);
+  } else {
+    imv_mapped_file_will_read(file, 0, imv_mapped_file_size(file));
+  }
+  return ret;
+}
+
+static enum backend_result open_memory(void *data, size_t len, struct imv_source **src)
+{
+  return open_data(data, len, NULL, NULL, src);
+}
+
+/* SVG is XML, with nothing fixed to go by at the start */
+static const char *const extensions[] = {"svg", NULL};
+
 const struct imv_backend imv_backend_librsvg = {
   .name = "libRSVG",
   .description = "SVG library developed by GNOME",
@@ -103,4 +127,5 @@ const struct imv_backend imv_backend_librsvg = {
   .license = "GNU Lesser General Public License v2.1+",
   .open_path = &open_path,
   .open_memory = &open_memory,
+  .extensions = extensions,
 };
@@ -1,34 +1,78 @@
 #include "backend.h"
 #include "bitmap.h"
 #include "image.h"
+#include "mapped_file.h"
+#include "pixel.h"
 #include "source.h"
 #include "source_private.h"
+#include "worker_pool.h"
 
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <tiffio.h>
+#include <unistd.h>
 
-struct private {
-  TIFF *tiff;
+/* The most workers one image is decoded with at a time */
+#define DECODE_THREADS 8
+
+/* Images with fewer pixels than this aren't worth splitting between threads */
+#define PARALLEL_MIN_PIXELS (2048 * 2048)
+
+/* Where a TIFF handle is reading from. Each handle over the same data has
+ * its own, so that separate threads can each read with their own. */
+struct reader {
   void *data;
   size_t pos, len;
+};
+
+struct private {
+  TIFF *tiff;
+  struct reader reader;
+  /* NULL when data belongs to whoever called open_memory */
+  struct imv_mapped_file *file;
+  /* The offsets of the directories holding the full resolution image of
+   * each page found so far. Pages are found as they're asked after, as a
+   * file may hold thousands of them, and jumped to by offset, as going by
+   * directory number reads every directory before it. */
+  toff_t *pages;
+  int page_count, page_capacity;
+  /* whether every page has been found */
+  bool all_pages;
+  /* the page being loaded, whose full resolution image is below */
+  int page;
+  toff_t directory;
   int width;
   int height;
+  /* the size hint from set_target_size, or 0x0 for full resolution */
+  int target_width;
+  int target_height;
+  /* the ICC profile of the page's full resolution image, if it has one,
+   * which the reduced ones share */
+  void *icc_profile;
+  uint32_t icc_profile_len;
 };
 
 static tsize_t mem_read(thandle_t data, tdata_t buffer, tsize_t len)
 {
-  struct private *private = (struct private*)data;
-  memcpy(buffer, (char*)private->data + private->pos, len);
-  private->pos += len;
+  struct reader *reader = (struct reader*)data;
+  if (reader->pos >= reader->len) {
+    return 0;
+  }
+  if ((size_t)len > reader->len - reader->pos) {
+    len = reader->len - reader->pos;
+  }
+  memcpy(buffer, (char*)reader->data + reader->pos, len);
+  reader->pos += len;
   return len;
 }
 
 static tsize_t mem_write(thandle_t data, tdata_t buffer, tsize_t len)
 {
-  struct private *private = (struct private*)data;
-  memcpy((char*)private->data + private->pos, buffer, len);
-  private->pos += len;
+  struct reader *reader = (struct reader*)data;
+  memcpy((char*)reader->data + reader->pos, buffer, len);
+  reader->pos += len;
   return len;
 }
 
@@ -40,23 +84,47 @@ static int mem_close(thandle_t data)
 
 static toff_t mem_seek(thandle_t data, toff_t pos, int whence)
 {
-  struct private *private = (struct private*)data;
+  struct reader *reader = (struct reader*)data;
   if (whence == SEEK_SET) {
-    private->pos = pos;
+    reader->pos = pos;
   } else if (whence == SEEK_CUR) {
-    private->pos += pos;
+    reader->pos += pos;
   } else if (whence == SEEK_END) {
-    private->pos = private->len + pos;
+    reader->pos = reader->len + pos;
   } else {
     return -1;
   }
-  return private->pos;
+  return reader->pos;
 }
 
 static toff_t mem_size(thandle_t data)
 {
-  struct private *private = (struct private*)data;
-  return private->len;
+  struct reader *reader = (struct reader*)data;
+  return reader->len;
+}
+
+/* Lets libtiff read strips and tiles straight out of the data, rather than
+ * copying them into buffers of its own first */
+static int mem_map(thandle_t data, tdata_t *base, toff_t *size)
+{
+  struct reader *reader = (struct reader*)data;
+  *base = reader->data;
+  *size = reader->len;
+  return 1;
+}
+
+static void mem_unmap(thandle_t data, tdata_t base, toff_t size)
+{
+  (void)data;
+  (void)base;
+  (void)size;
+}
+
+static TIFF *open_reader(struct reader *reader)
+{
+  return TIFFClientOpen("-", "r", (thandle_t)reader,
+      &mem_read, &mem_write, &mem_seek, &mem_close, &mem_size,
+      &mem_map, &mem_unmap);
 }
 
 static void free_private(void *raw_private)
@@ -68,89 +136,588 @@ static void free_private(void *raw_private)
   struct private *private = raw_private;
   TIFFClose(private->tiff);
   private->tiff = NULL;
+  imv_mapped_file_close(private->file);
+  free(private->icc_profile);
+  free(private->pages);
 
   free(private);
 }
 
+static void set_target_size(void *raw_private, int width, int height)
+{
+  struct private *private = raw_private;
+  private->target_width = width;
+  private->target_height = height;
+}
+
+/* Reads the size and profile of the full resolution image in the current
+ * directory, which becomes the one loaded */
+static void read_page_info(struct private *private)
+{
+  private->directory = TIFFCurrentDirOffset(private->tiff);
+  private->width = private->height = 0;
+  TIFFGetField(private->tiff, TIFFTAG_IMAGEWIDTH, &private->width);
+  TIFFGetField(private->tiff, TIFFTAG_IMAGELENGTH, &private->height);
+
+  /* Only valid until the directory changes, so take a copy */
+  free(private->icc_profile);
+  private->icc_profile = NULL;
+  private->icc_profile_len = 0;
+  void *profile;
+  uint32_t profile_len;
+  if (TIFFGetField(private->tiff, TIFFTAG_ICCPROFILE, &profile_len, &profile)
+      && profile_len && (private->icc_profile = malloc(profile_len))) {
+    memcpy(private->icc_profile, profile, profile_len);
+    private->icc_profile_len = profile_len;
+  }
+}
+
+static void add_page(struct private *private, toff_t offset)
+{
+  if (private->page_count == private->page_capacity) {
+    const int capacity = private->page_capacity ? private->page_capacity * 2 : 8;
+    toff_t *pages = realloc(private->pages, capacity * sizeof *pages);
+    if (!pages) {
+      private->all_pages = true;
+      return;
+    }
+    private->pages = pages;
+    private->page_capacity = capacity;
+  }
+  private->pages[private->page_count++] = offset;
+}
+
+/* Reads on from the last page found until page is, or there are no more.
+ * The reduced images of pyramidal pages are passed over along the way. */
+static bool has_page(void *raw_private, int page)
+{
+  struct private *private = raw_private;
+  TIFF *tiff = private->tiff;
+  while (page >= private->page_count && !private->all_pages) {
+    if (!TIFFSetSubDirectory(tiff, private->pages[private->page_count - 1])) {
+      private->all_pages = true;
+      break;
+    }
+    while (true) {
+      if (!TIFFReadDirectory(tiff)) {
+        private->all_pages = true;
+        break;
+      }
+      uint32_t type = 0;
+      TIFFGetFieldDefaulted(tiff, TIFFTAG_SUBFILETYPE, &type);
+      if (!(type & FILETYPE_REDUCEDIMAGE)) {
+        add_page(private, TIFFCurrentDirOffset(tiff));
+        break;
+      }
+    }
+  }
+  return page < private->page_count;
+}
+
+static void set_page(void *raw_private, int page)
+{
+  struct private *private = raw_private;
+  if (page != private->page
+      && TIFFSetSubDirectory(private->tiff, private->pages[page])) {
+    private->page = page;
+    read_page_info(private);
+  }
+}
+
+/* One resolution of the page, either the full one or one of the reduced
+ * ones pyramidal TIFFs keep in the directories after it */
+struct level {
+  toff_t directory;
+  int width;
+  int height;
+};
+
+/* Picks the smallest level that still fills the target size */
+static struct level choose_level(struct private *private)
+{
+  struct level best = {private->directory, private->width, private->height};
+  if (!private->target_width || !private->target_height) {
+    return best;
+  }
+
+  TIFF *tiff = private->tiff;
+  if (!TIFFSetSubDirectory(tiff, private->directory)) {
+    return best;
+  }
+  while (TIFFReadDirectory(tiff)) {
+    uint32_t type = 0;
+    int width = 0, height = 0;
+    TIFFGetFieldDefaulted(tiff, TIFFTAG_SUBFILETYPE, &type);
+    TIFFGetField(tiff, TIFFTAG_IMAGEWIDTH, &width);
+    TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &height);
+    if (!(type & FILETYPE_REDUCEDIMAGE)) {
+      /* the next page, so the pyramid is over */
+      break;
+    }
+    if (width <= 0 || height <= 0) {
+      continue;
+    }
+
+    const bool fills = width >= private->target_width
+      || height >= private->target_height;
+    if (fills && width * (double)height < best.width * (double)best.height) {
+      best.directory = TIFFCurrentDirOffset(tiff);
+      best.width = width;
+      best.height = height;
+    }
+  }
+  return best;
+}
+
+/* The layouts of pixels the kernels in pixel.h convert directly, without
+ * going through TIFFReadRGBAImage's general purpose conversion */
+enum layout {
+  LAYOUT_OTHER,
+  LAYOUT_RGB8,
+  LAYOUT_RGBA8,
+  LAYOUT_RGB16,
+  LAYOUT_RGBA16,
+};
+
+static enum layout get_layout(TIFF *tiff)
+{
+  uint16_t bits, samples, planar, format, orientation, photometric;
+  uint16_t extra_count, *extra_types;
+  TIFFGetFieldDefaulted(tiff, TIFFTAG_BITSPERSAMPLE, &bits);
+  TIFFGetFieldDefaulted(tiff, TIFFTAG_SAMPLESPERPIXEL, &samples);
+  TIFFGetFieldDefaulted(tiff, TIFFTAG_PLANARCONFIG, &planar);
+  TIFFGetFieldDefaulted(tiff, TIFFTAG_SAMPLEFORMAT, &format);
+  TIFFGetFieldDefaulted(tiff, TIFFTAG_ORIENTATION, &orientation);
+  TIFFGetFieldDefaulted(tiff, TIFFTAG_EXTRASAMPLES, &extra_count, &extra_types);
+
+  /* Associated alpha is premultiplied, which imv doesn't want */
+  const bool rgb = samples == 3 && extra_count == 0;
+  const bool rgba = samples == 4 && extra_count == 1
+    && extra_types[0] == EXTRASAMPLE_UNASSALPHA;
+
+  if (!TIFFGetField(tiff, TIFFTAG_PHOTOMETRIC, &photometric)
+      || photometric != PHOTOMETRIC_RGB
+      || (bits != 8 && bits != 16)
+      || (!rgb && !rgba)
+      || planar != PLANARCONFIG_CONTIG
+      || format != SAMPLEFORMAT_UINT
+      || orientation != ORIENTATION_TOPLEFT) {
+    return LAYOUT_OTHER;
+  }
+
+  if (bits == 8) {
+    return rgb ? LAYOUT_RGB8 : LAYOUT_RGBA8;
+  }
+  return rgb ? LAYOUT_RGB16 : LAYOUT_RGBA16;
+}
+
+/* The format 16-bit layouts are kept at their depth in, and the others are
+ * read in */
+static enum imv_pixelformat layout_format(enum layout layout)
+{
+  return layout == LAYOUT_RGB16 || layout == LAYOUT_RGBA16 ? IMV_ABGR16 : IMV_ABGR;
+}
+
+/* Converts width pixels of a row laid out as layout to layout_format */
+static void convert_row(enum layout layout, unsigned char *dst,
+    const unsigned char *src, size_t width)
+{
+  switch (layout) {
+    case LAYOUT_RGB8:
+      imv_pixel_rgb_to_rgba(dst, src, width);
+      break;
+    case LAYOUT_RGBA8:
+      memcpy(dst, src, width * 4);
+      break;
+    case LAYOUT_RGB16:
+      imv_pixel_rgb16_to_rgba16((uint16_t *)dst, (const uint16_t *)src, width);
+      break;
+    case LAYOUT_RGBA16:
+      memcpy(dst, src, width * 8);
+      break;
+    case LAYOUT_OTHER:
+      break;
+  }
+}
+
+/* Reads a strip image with a layout the kernels handle a row at a time */
+static bool read_scanlines(TIFF *tiff, enum layout layout, struct imv_bitmap *bmp)
+{
+  unsigned char *line = malloc(TIFFScanlineSize(tiff));
+  bool ok = true;
+
+  for (int y = 0; ok && y < bmp->height; ++y) {
+    if (TIFFReadScanline(tiff, line, y, 0) != 1) {
+      ok = false;
+    } else {
+      convert_row(layout, bmp->data + (size_t)y * bmp->stride, line,
+          bmp->width);
+    }
+  }
+
+  free(line);
+  return ok;
+}
+
+/* An image being decoded by several workers at once, each taking the next
+ * tile or strip still to do until there are none left. Shared by the thread
+ * decoding the image and the helper jobs it queues, the last of which to let
+ * go of it frees it. */
+struct parallel {
+  struct private *private;
+  toff_t directory;
+  enum layout layout;
+  struct imv_bitmap *bmp;
+
+  bool tiled;
+  /* strips are as wide as the image, and as tall as a tile */
+  uint32_t unit_width, unit_height;
+  uint32_t across, count;
+
+  pthread_mutex_t lock;
+  /* signalled when a helper stops decoding */
+  pthread_cond_t idle;
+  uint32_t next;
+  bool failed;
+  /* helpers decoding units, which the image mustn't be finished before */
+  int active;
+  /* the decoding thread's reference, plus one per helper queued */
+  int refcount;
+};
+
+static void unref_parallel(struct parallel *job)
+{
+  pthread_mutex_lock(&job->lock);
+  const bool last = --job->refcount == 0;
+  pthread_mutex_unlock(&job->lock);
+  if (last) {
+    pthread_cond_destroy(&job->idle);
+    pthread_mutex_destroy(&job->lock);
+    free(job);
+  }
+}
+
+/* Decodes the tile or strip at index into the bitmap, using buf, which is big
+ * enough for whichever way it's read */
+static bool decode_unit(struct parallel *job, TIFF *tiff, uint32_t index,
+    unsigned char *buf)
+{
+  struct imv_bitmap *bmp = job->bmp;
+  const uint32_t x = (index % job->across) * job->unit_width;
+  const uint32_t y = (index / job->across) * job->unit_height;
+  const uint32_t cols = bmp->width - x < job->unit_width ? bmp->width - x : job->unit_width;
+  const uint32_t rows = bmp->height - y < job->unit_height ? bmp->height - y : job->unit_height;
+  unsigned char *out = bmp->data + (size_t)y * bmp->stride
+    + (size_t)x * imv_bitmap_pixel_size(bmp->format);
+
+  if (job->layout != LAYOUT_OTHER) {
+    tmsize_t got = job->tiled
+      ? TIFFReadEncodedTile(tiff, TIFFComputeTile(tiff, x, y, 0, 0), buf, (tmsize_t)-1)
+      : TIFFReadEncodedStrip(tiff, TIFFComputeStrip(tiff, y, 0), buf, (tmsize_t)-1);
+    if (got < 0) {
+      return false;
+    }
+    const size_t row_size = job->tiled ? TIFFTileRowSize(tiff) : TIFFScanlineSize(tiff);
+    for (uint32_t k = 0; k < rows; ++k) {
+      convert_row(job->layout, out + (size_t)k * bmp->stride,
+          buf + (size_t)k * row_size, cols);
+    }
+    return true;
+  }
+
+  /* These come out bottom-up. Tiles are always whole, with the image's rows
+   * at the bottom of any that overhang it, while strips are only as tall as
+   * the rows they hold. */
+  int ok = job->tiled
+    ? TIFFReadRGBATile(tiff, x, y, (uint32_t *)buf)
+    : TIFFReadRGBAStrip(tiff, y, (uint32_t *)buf);
+  if (ok != 1) {
+    return false;
+  }
+  const uint32_t raster_rows = job->tiled ? job->unit_height : rows;
+  for (uint32_t k = 0; k < rows; ++k) {
+    memcpy(out + (size_t)k * bmp->stride,
+        buf + (size_t)(raster_rows - 1 - k) * job->unit_width * 4, (size_t)cols * 4);
+  }
+  return true;
+}
+
+/* Takes units until none are left, with a TIFF handle of its own. Returns
+ * false if it couldn't be set up. */
+static bool decode_units(struct parallel *job)
+{
+  struct reader reader = job->private->reader;
+  reader.pos = 0;
+  TIFF *tiff = open_reader(&reader);
+  if (!tiff || !TIFFSetSubDirectory(tiff, job->directory)) {
+    if (tiff) {
+      TIFFClose(tiff);
+    }
+    return false;
+  }
+
+  size_t buf_size = (size_t)job->unit_width * job->unit_height * 4;
+  const size_t encoded = job->tiled ? TIFFTileSize(tiff) : TIFFStripSize(tiff);
+  buf_size = encoded > buf_size ? encoded : buf_size;
+  unsigned char *buf = malloc(buf_size);
+  if (!buf) {
+    TIFFClose(tiff);
+    return false;
+  }
+
+  while (true) {
+    pthread_mutex_lock(&job->lock);
+    const uint32_t index = job->next++;
+    const bool done = job->failed || index >= job->count;
+    pthread_mutex_unlock(&job->lock);
+    if (done) {
+      break;
+    }
+
+    if (!decode_unit(job, tiff, index, buf)) {
+      pthread_mutex_lock(&job->lock);
+      job->failed = true;
+      pthread_mutex_unlock(&job->lock);
+    }
+  }
+
+  free(buf);
+  TIFFClose(tiff);
+  return true;
+}
+
+/* Run on a worker to help with the decode, if it's not already over by the
+ * time the job starts */
+static void help_decode(void *data)
+{
+  struct parallel *job = data;
+
+  pthread_mutex_lock(&job->lock);
+  const bool over = job->failed || job->next >= job->count;
+  if (!over) {
+    job->active++;
+  }
+  pthread_mutex_unlock(&job->lock);
+
+  if (!over) {
+    /* What the decoding thread does without help is what's left for it, so
+     * a helper that can't be set up isn't a failure */
+    decode_units(job);
+    pthread_mutex_lock(&job->lock);
+    job->active--;
+    pthread_cond_signal(&job->idle);
+    pthread_mutex_unlock(&job->lock);
+  }
+
+  unref_parallel(job);
+}
+
+static void cancel_help(void *data)
+{
+  unref_parallel(data);
+}
+
+/* Decodes a big tiled or multi-strip image with the help of the source
+ * worker pool. Returns false if it can't be split up this way, or fails. */
+static bool read_parallel(struct private *private, const struct level *level,
+    enum layout layout, struct imv_bitmap *bmp)
+{
+  struct imv_worker_pool *pool = imv_source_worker_pool();
+  TIFF *tiff = private->tiff;
+  uint16_t orientation;
+  TIFFGetFieldDefaulted(tiff, TIFFTAG_ORIENTATION, &orientation);
+  if (!pool || orientation != ORIENTATION_TOPLEFT
+      || (double)level->width * level->height < PARALLEL_MIN_PIXELS) {
+    return false;
+  }
+
+  uint32_t unit_width, unit_height;
+  const bool tiled = TIFFIsTiled(tiff);
+  if (tiled) {
+    TIFFGetField(tiff, TIFFTAG_TILEWIDTH, &unit_width);
+    TIFFGetField(tiff, TIFFTAG_TILELENGTH, &unit_height);
+  } else {
+    unit_width = level->width;
+    TIFFGetFieldDefaulted(tiff, TIFFTAG_ROWSPERSTRIP, &unit_height);
+    if (unit_height > (uint32_t)level->height) {
+      unit_height = level->height;
+    }
+  }
+  if (!unit_width || !unit_height) {
+    return false;
+  }
+  const uint32_t across = (level->width + unit_width - 1) / unit_width;
+  const uint32_t count = across * ((level->height + unit_height - 1) / unit_height);
+
+  /* The workers are shared with every other decode, so this one asks for
+   * no more of them than it has units for */
+  int helpers = imv_worker_pool_size(pool);
+  helpers = helpers < DECODE_THREADS ? helpers : DECODE_THREADS;
+  helpers = helpers < (int)count ? helpers : (int)count;
+  helpers -= 1;
+  if (helpers < 1) {
+    return false;
+  }
+
+  struct parallel *job = calloc(1, sizeof *job);
+  job->private = private;
+  job->directory = level->directory;
+  job->layout = layout;
+  job->bmp = bmp;
+  job->tiled = tiled;
+  job->unit_width = unit_width;
+  job->unit_height = unit_height;
+  job->across = across;
+  job->count = count;
+  job->refcount = 1 + helpers;
+  pthread_mutex_init(&job->lock, NULL);
+  pthread_cond_init(&job->idle, NULL);
+
+  /* Helpers that only get to start once this thread has taken every unit
+   * find nothing left to do, so they're never waited on */
+  for (int i = 0; i < helpers; ++i) {
+    imv_worker_pool_submit(pool, NULL, IMV_JOB_NORMAL, help_decode,
+        cancel_help, job);
+  }
+
+  /* This thread does its share too */
+  const bool started = decode_units(job);
+
+  pthread_mutex_lock(&job->lock);
+  if (!started) {
+    job->failed = true;
+  }
+  while (job->active > 0) {
+    pthread_cond_wait(&job->idle, &job->lock);
+  }
+  const bool ok = !job->failed;
+  pthread_mutex_unlock(&job->lock);
+
+  unref_parallel(job);
+  return ok;
+}
+
 static void load_image(void *raw_private, struct imv_image **image, int *frametime)
 {
   *image = NULL;
   *frametime = 0;
 
   struct private *private = raw_private;
+  const struct level level = choose_level(private);
+  if (!TIFFSetSubDirectory(private->tiff, level.directory)) {
+    return;
+  }
 
   /* libtiff suggests using their own allocation routines to support systems
    * with segmented memory. I have no desire to support that, so I'm just
    * going to use vanilla malloc/free. Systems where that isn't acceptable
    * don't have upstream support from imv.
    */
-  void *bitmap = malloc(private->height * private->width * 4);
-  int rcode = TIFFReadRGBAImageOriented(private->tiff, private->width, private->height,
-      bitmap, ORIENTATION_TOPLEFT, 0);
+  const enum layout layout = get_layout(private->tiff);
+  struct imv_bitmap *bmp = imv_bitmap_create(level.width, level.height,
+      layout_format(layout));
+  if (!bmp) {
+    return;
+  }
 
-  /* 1 = success, unlike the rest of *nix */
-  if (rcode != 1) {
+  bool ok = read_parallel(private, &level, layout, bmp);
+  if (!ok && layout != LAYOUT_OTHER && !TIFFIsTiled(private->tiff)) {
+    ok = read_scanlines(private->tiff, layout, bmp);
+    if (!ok) {
+      /* start again from the top for another go */
+      TIFFSetSubDirectory(private->tiff, level.directory);
+    }
+  }
+  if (!ok && bmp->format != IMV_ABGR) {
+    /* The general purpose conversion only comes in 8 bits */
+    imv_bitmap_free(bmp);
+    bmp = imv_bitmap_create(level.width, level.height, IMV_ABGR);
+    if (!bmp) {
+      return;
+    }
+  }
+  if (!ok) {
+    /* 1 = success, unlike the rest of *nix */
+    ok = TIFFReadRGBAImageOriented(private->tiff, level.width, level.height,
+        (uint32_t *)bmp->data, ORIENTATION_TOPLEFT, 0) == 1;
+  }
+
+  if (!ok) {
+    imv_bitmap_free(bmp);
     return;
   }
 
-  struct imv_bitmap *bmp = malloc(sizeof *bmp);
-  bmp->width = private->width;
-  bmp->height = private->height;
-  bmp->format = IMV_ABGR;
-  bmp->data = bitmap;
-  *image = imv_image_create_from_bitmap(bmp);
+  if (level.directory != private->directory) {
+    *image = imv_image_create_from_scaled_bitmap(bmp, private->width,
+        private->height);
+  } else {
+    *image = imv_image_create_from_bitmap(bmp);
+  }
+  imv_image_set_icc_profile(*image, private->icc_profile, private->icc_profile_len);
 }
 
 static const struct imv_source_vtable vtable = {
   .load_first_frame = load_image,
+  .set_target_size = set_target_size,
+  .has_page = has_page,
+  .set_page = set_page,
   .free = free_private
 };
 
-static enum backend_result open_path(const char *path, struct imv_source **src)
+/* Makes a source decoding the len bytes at data, which stay valid until it's
+ * freed. If file is given, the source takes ownership of it. */
+static enum backend_result open_data(void *data, size_t len,
+    struct imv_mapped_file *file, struct imv_source **src)
 {
-  struct private private;
-
   TIFFSetErrorHandler(NULL);
-
-  private.tiff = TIFFOpen(path, "r");
-  if (!private.tiff) {
+  struct private *private = calloc(1, sizeof *private);
+  private->reader.data = data;
+  private->reader.len = len;
+  private->tiff = open_reader(&private->reader);
+  if (!private->tiff) {
     /* Header is read, so no BAD_PATH check here */
+    free(private);
     return BACKEND_UNSUPPORTED;
   }
 
-  TIFFGetField(private.tiff, TIFFTAG_IMAGEWIDTH, &private.width);
-  TIFFGetField(private.tiff, TIFFTAG_IMAGELENGTH, &private.height);
-
-  struct private *new_private = malloc(sizeof private);
-  memcpy(new_private, &private, sizeof private);
+  /* Only the first page is looked at until others are asked for */
+  read_page_info(private);
+  add_page(private, private->directory);
 
-  *src = imv_source_create(&vtable, new_private);
+  private->file = file;
+  *src = imv_source_create(&vtable, private);
   return BACKEND_SUCCESS;
 }
 
-static enum backend_result open_memory(void *data, size_t len, struct imv_source **src)
+static enum backend_result open_path(const char *path, struct imv_source **src)
 {
-  TIFFSetErrorHandler(NULL);
-  struct private *private = malloc(sizeof *private);
-  private->data = data;
-  private->len = len;
-  private->pos = 0;
-  private->tiff = TIFFClientOpen("-", "rm", (thandle_t)private,
-      &mem_read, &mem_write, &mem_seek, &mem_close, &mem_size,
-      NULL, NULL);
-  if (!private->tiff) {
-    /* Header is read, so no BAD_PATH check here */
-    free(private);
-    return BACKEND_UNSUPPORTED;
+  struct imv_mapped_file *file = imv_mapped_file_open(path);
+  if (!file) {
+    return BACKEND_BAD_PATH;
   }
 
-  TIFFGetField(private->tiff, TIFFTAG_IMAGEWIDTH, &private->width);
-  TIFFGetField(private->tiff, TIFFTAG_IMAGELENGTH, &private->height);
+  enum backend_result ret = open_data(imv_mapped_file_data(file),
+      imv_mapped_file_size(file), file, src);
+  if (ret != BACKEND_SUCCESS) {
+    imv_mapped_file_close(file);
+  }
+  return ret;
+}
 
-  *src = imv_source_create(&vtable, private);
-  return BACKEND_SUCCESS;
+static enum backend_result open_memory(void *data, size_t len, struct imv_source **src)
+{
+  return open_data(data, len, NULL, src);
 }
 
+/* Classic and BigTIFF, in either byte order */
+static const struct imv_backend_signature signatures[] = {
+  {0, "II*\0", 4},
+  {0, "MM\0*", 4},
+  {0, "II+\0", 4},
+  {0, "MM\0+", 4},
+  {0, NULL, 0},
+};
+
 const struct imv_backend imv_backend_libtiff = {
   .name = "libtiff",
   .description = "The de-facto tiff library",
@@ -158,4 +725,5 @@ const struct imv_backend imv_backend_libtiff = {
   .license = "MIT",
   .open_path = &open_path,
   .open_memory = &open_memory,
+  .signatures = signatures,
 };
@@ -1,22 +1,129 @@
 #include "bitmap.h"
 
+#include "memory_budget.h"
+#include "pixel.h"
+
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long g_next_id = 1;
+
+static unsigned long next_id(void)
+{
+  pthread_mutex_lock(&g_lock);
+  const unsigned long id = g_next_id++;
+  pthread_mutex_unlock(&g_lock);
+  return id;
+}
+
+static void no_release(void *data)
+{
+  (void)data;
+}
+
+struct imv_bitmap *imv_bitmap_create(int width, int height,
+    enum imv_pixelformat format)
+{
+  struct imv_bitmap *bmp = calloc(1, sizeof *bmp);
+  bmp->width = width;
+  bmp->height = height;
+  bmp->stride = imv_bitmap_pixel_size(format) * width;
+  bmp->format = format;
+  bmp->id = next_id();
+  bmp->data = malloc((size_t)bmp->stride * height);
+  if (!bmp->data) {
+    free(bmp);
+    return NULL;
+  }
+  imv_memory_acquire((size_t)bmp->stride * height);
+  return bmp;
+}
+
+struct imv_bitmap *imv_bitmap_create_borrowed(int width, int height,
+    int stride, enum imv_pixelformat format, unsigned char *data,
+    void (*release)(void *release_data), void *release_data)
+{
+  struct imv_bitmap *bmp = calloc(1, sizeof *bmp);
+  bmp->width = width;
+  bmp->height = height;
+  bmp->stride = stride;
+  bmp->format = format;
+  bmp->data = data;
+  bmp->release = release ? release : no_release;
+  bmp->release_data = release_data;
+  bmp->id = next_id();
+  imv_memory_acquire((size_t)stride * height);
+  return bmp;
+}
+
+int imv_bitmap_pixel_size(enum imv_pixelformat format)
+{
+  return format == IMV_ABGR16 || format == IMV_ABGR_HALF ? 8 : 4;
+}
+
+void imv_bitmap_narrow_pixels(enum imv_pixelformat format, unsigned char *dst,
+    const unsigned char *src, size_t count)
+{
+  switch (format) {
+    case IMV_ARGB:
+      imv_pixel_swap_red_blue(dst, src, count);
+      break;
+    case IMV_ABGR:
+      memcpy(dst, src, count * 4);
+      break;
+    case IMV_ABGR16:
+      imv_pixel_narrow_16(dst, (const uint16_t *)src, count * 4);
+      break;
+    case IMV_ABGR_HALF:
+      imv_pixel_narrow_half(dst, (const uint16_t *)src, count * 4);
+      break;
+  }
+}
+
+struct imv_bitmap *imv_bitmap_narrow(const struct imv_bitmap *bmp)
+{
+  if (imv_bitmap_pixel_size(bmp->format) == 4) {
+    return imv_bitmap_clone((struct imv_bitmap *)bmp);
+  }
+  struct imv_bitmap *copy = imv_bitmap_create(bmp->width, bmp->height,
+      IMV_ABGR);
+  if (!copy) {
+    return NULL;
+  }
+  for (int y = 0; y < bmp->height; ++y) {
+    imv_bitmap_narrow_pixels(bmp->format, copy->data + (size_t)y * copy->stride,
+        bmp->data + (size_t)y * bmp->stride, bmp->width);
+  }
+  return copy;
+}
+
 struct imv_bitmap *imv_bitmap_clone(struct imv_bitmap *bmp)
 {
-  struct imv_bitmap *copy = malloc(sizeof *copy);
-  const size_t num_bytes = 4 * bmp->width * bmp->height;
-  copy->width = bmp->width;
-  copy->height = bmp->height;
-  copy->format = bmp->format;
-  copy->data = malloc(num_bytes);
-  memcpy(copy->data, bmp->data, num_bytes);
+  struct imv_bitmap *copy = imv_bitmap_create(bmp->width, bmp->height,
+      bmp->format);
+  if (!copy) {
+    return NULL;
+  }
+  if (bmp->stride == copy->stride) {
+    memcpy(copy->data, bmp->data, (size_t)copy->stride * bmp->height);
+  } else {
+    for (int y = 0; y < bmp->height; ++y) {
+      memcpy(copy->data + (size_t)y * copy->stride,
+          bmp->data + (size_t)y * bmp->stride, copy->stride);
+    }
+  }
   return copy;
 }
 
 void imv_bitmap_free(struct imv_bitmap *bmp)
 {
-  free(bmp->data);
+  imv_memory_release((size_t)bmp->stride * bmp->height);
+  if (bmp->release) {
+    bmp->release(bmp->release_data);
+  } else {
+    free(bmp->data);
+  }
   free(bmp);
 }
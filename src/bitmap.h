@@ -1,19 +1,61 @@
 #ifndef IMV_BITMAP_H
 #define IMV_BITMAP_H
 
+#include <stddef.h>
+
 enum imv_pixelformat {
   IMV_ARGB,
   IMV_ABGR,
+  /* The same order as IMV_ABGR, but with native endian 16-bit channels */
+  IMV_ABGR16,
+  /* The same order again, with half float channels, which for HDR images may
+   * go above 1.0, so they're only ever drawn through a transfer function */
+  IMV_ABGR_HALF,
 };
 
 struct imv_bitmap {
   int width;
   int height;
+  /* Bytes from the start of one row of data to the next, at least width times
+   * the size of a pixel */
+  int stride;
   enum imv_pixelformat format;
   unsigned char *data;
+
+  /* If set, data is owned by something else, and release is called with
+   * release_data in place of freeing data when the bitmap is freed. */
+  void (*release)(void *release_data);
+  void *release_data;
+
+  /* Different for every bitmap created, unlike its address, which may be
+   * reused once it's freed, so that caches can tell bitmaps apart */
+  unsigned long id;
 };
 
-/* Copy an imv_bitmap */
+/* Create a bitmap with tightly packed, uninitialised pixel data */
+struct imv_bitmap *imv_bitmap_create(int width, int height,
+    enum imv_pixelformat format);
+
+/* Create a bitmap around pixel data owned by something else, such as a
+ * decoder's output buffer. release is called with release_data once the
+ * bitmap is freed, and may be NULL if data outlives the bitmap. */
+struct imv_bitmap *imv_bitmap_create_borrowed(int width, int height,
+    int stride, enum imv_pixelformat format, unsigned char *data,
+    void (*release)(void *release_data), void *release_data);
+
+/* Get the number of bytes one pixel of a format takes */
+int imv_bitmap_pixel_size(enum imv_pixelformat format);
+
+/* Narrows count pixels of format at src to IMV_ABGR at dst, or copies them if
+ * they're 8-bit already, swapping ARGB's red and blue */
+void imv_bitmap_narrow_pixels(enum imv_pixelformat format, unsigned char *dst,
+    const unsigned char *src, size_t count);
+
+/* Copy an imv_bitmap as IMV_ABGR, for things that only deal in 8 bits, or
+ * as it is if it's 8-bit already */
+struct imv_bitmap *imv_bitmap_narrow(const struct imv_bitmap *bmp);
+
+/* Copy an imv_bitmap, tightly packing its rows */
 struct imv_bitmap *imv_bitmap_clone(struct imv_bitmap *bmp);
 
 /* Clean up a bitmap */
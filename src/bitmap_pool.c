@@ -0,0 +1,144 @@
+#include "bitmap_pool.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+/* How many idle buffers to keep, enough to cover the frames in flight
+ * between being decoded and being displayed */
+#define MAX_IDLE_BUFFERS 8
+
+struct buffer {
+  struct imv_bitmap_pool *pool;
+  size_t size;
+  struct buffer *next;
+  unsigned char data[];
+};
+
+struct imv_bitmap_pool {
+  pthread_mutex_t lock;
+  /* buffers waiting to be reused, all of the same size */
+  struct buffer *idle;
+  size_t num_idle;
+  /* the owner's reference, plus one per buffer in use */
+  size_t refcount;
+  /* set once the owner has released the pool */
+  bool closed;
+};
+
+static void unref_locked(struct imv_bitmap_pool *pool)
+{
+  if (--pool->refcount > 0) {
+    pthread_mutex_unlock(&pool->lock);
+    return;
+  }
+
+  pthread_mutex_unlock(&pool->lock);
+  while (pool->idle) {
+    struct buffer *next = pool->idle->next;
+    free(pool->idle);
+    pool->idle = next;
+  }
+  pthread_mutex_destroy(&pool->lock);
+  free(pool);
+}
+
+static void release_buffer(void *data)
+{
+  struct buffer *buffer = data;
+  struct imv_bitmap_pool *pool = buffer->pool;
+
+  pthread_mutex_lock(&pool->lock);
+
+  /* Only keep it if the pool's owner is still using the pool */
+  if (!pool->closed && pool->num_idle < MAX_IDLE_BUFFERS
+      && (!pool->idle || pool->idle->size == buffer->size)) {
+    buffer->next = pool->idle;
+    pool->idle = buffer;
+    pool->num_idle++;
+    buffer = NULL;
+  }
+  free(buffer);
+
+  unref_locked(pool);
+}
+
+struct imv_bitmap_pool *imv_bitmap_pool_create(void)
+{
+  struct imv_bitmap_pool *pool = calloc(1, sizeof *pool);
+  pthread_mutex_init(&pool->lock, NULL);
+  pool->refcount = 1;
+  return pool;
+}
+
+void imv_bitmap_pool_free(struct imv_bitmap_pool *pool)
+{
+  if (!pool) {
+    return;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  /* Nothing will be taken from the pool again, so drop any idle buffers */
+  pool->closed = true;
+  struct buffer *idle = pool->idle;
+  pool->idle = NULL;
+  pool->num_idle = 0;
+  unref_locked(pool);
+
+  while (idle) {
+    struct buffer *next = idle->next;
+    free(idle);
+    idle = next;
+  }
+}
+
+struct imv_bitmap *imv_bitmap_pool_get(struct imv_bitmap_pool *pool,
+                                       int width, int height,
+                                       enum imv_pixelformat format)
+{
+  const int pixel_size = imv_bitmap_pixel_size(format);
+  const size_t size = (size_t)width * height * pixel_size;
+
+  pthread_mutex_lock(&pool->lock);
+  struct buffer *buffer = NULL;
+  if (pool->idle && pool->idle->size == size) {
+    buffer = pool->idle;
+    pool->idle = buffer->next;
+    pool->num_idle--;
+  } else {
+    /* The frame size changed, so the idle buffers are no use */
+    while (pool->idle) {
+      struct buffer *next = pool->idle->next;
+      free(pool->idle);
+      pool->idle = next;
+    }
+    pool->num_idle = 0;
+  }
+  pool->refcount++;
+  pthread_mutex_unlock(&pool->lock);
+
+  if (!buffer) {
+    buffer = malloc(sizeof *buffer + size);
+    if (!buffer) {
+      pthread_mutex_lock(&pool->lock);
+      unref_locked(pool);
+      return NULL;
+    }
+    buffer->pool = pool;
+    buffer->size = size;
+  }
+
+  return imv_bitmap_create_borrowed(width, height, width * pixel_size, format,
+      buffer->data, release_buffer, buffer);
+}
+
+size_t imv_bitmap_pool_idle(struct imv_bitmap_pool *pool)
+{
+  pthread_mutex_lock(&pool->lock);
+  const size_t idle = pool->num_idle;
+  pthread_mutex_unlock(&pool->lock);
+  return idle;
+}
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
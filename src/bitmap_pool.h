@@ -0,0 +1,32 @@
+#ifndef IMV_BITMAP_POOL_H
+#define IMV_BITMAP_POOL_H
+
+#include "bitmap.h"
+
+/* A pool of pixel buffers for the frames of one animation. A bitmap taken
+ * from the pool returns its buffer to it when freed, so that playing an
+ * animation back reuses the same few buffers rather than allocating one for
+ * every frame. Safe to use from multiple threads. */
+struct imv_bitmap_pool;
+
+/* Create a pool */
+struct imv_bitmap_pool *imv_bitmap_pool_create(void);
+
+/* Release the pool. Bitmaps taken from it remain valid, and the pool is only
+ * cleaned up once they've all been freed. */
+void imv_bitmap_pool_free(struct imv_bitmap_pool *pool);
+
+/* Returns a bitmap of the given size and format, with uninitialised pixels,
+ * reusing a buffer returned to the pool if there is one the right size.
+ * Returns NULL if a new buffer was needed and couldn't be allocated. */
+struct imv_bitmap *imv_bitmap_pool_get(struct imv_bitmap_pool *pool,
+                                       int width, int height,
+                                       enum imv_pixelformat format);
+
+/* Returns how many buffers returned to the pool are waiting to be reused */
+size_t imv_bitmap_pool_idle(struct imv_bitmap_pool *pool);
+
+#endif
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -1,9 +1,13 @@
 #include "canvas.h"
 
 #include "image.h"
+#include "list.h"
 #include "log.h"
+#include "memory_budget.h"
+#include "pixel.h"
+
+#include "opengl.h"
 
-#include <GL/gl.h>
 #include <assert.h>
 #include <cairo.h>
 #include <pango/pangocairo.h>
@@ -11,16 +15,205 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <math.h>
 
 #ifdef IMV_BACKEND_LIBRSVG
+#include "svg_raster.h"
+
 #include <librsvg/rsvg.h>
 #endif
 
-// 16x16 chequerboard texture data
-#define REPEAT8(...) __VA_ARGS__, __VA_ARGS__, __VA_ARGS__, __VA_ARGS__, __VA_ARGS__, __VA_ARGS__, __VA_ARGS__, __VA_ARGS__
-unsigned char checkers_data[] = { REPEAT8(REPEAT8(0xCC, 0xCC, 0xCC, 0xFF), REPEAT8(0x80, 0x80, 0x80, 0xFF)),
-                                  REPEAT8(REPEAT8(0x80, 0x80, 0x80, 0xFF), REPEAT8(0xCC, 0xCC, 0xCC, 0xFF)) };
+/* Images are uploaded in tiles, so they can exceed GL_MAX_TEXTURE_SIZE, and
+ * so that only the parts of them in view need uploading */
+#define MAX_TILE_SIZE 2048
+
+/* How many bytes of tiles to start uploading per frame, so that a huge
+ * image streams in over several frames rather than stalling one */
+#define UPLOAD_BUDGET (16 * 1024 * 1024)
+
+/* How many bytes of textures to keep of recently drawn images, unless told
+ * otherwise */
+#define TEXTURE_BUDGET (512 * 1024 * 1024)
+
+/* How long a frame may wait in total for uploads it started to complete */
+#define UPLOAD_WAIT_NS 2000000
+
+/* How far the zoom may drift from the scale an SVG was rasterised at before
+ * it's rasterised again, stretching the old raster in the meantime */
+#define SVG_RESCALE_THRESHOLD 1.25
+
+/* How many viewports' worth of pixels an SVG raster may hold, beyond which
+ * only the area around the view is rasterised */
+#define SVG_MAX_VIEWPORTS 4
+
+/* 8-bit pixels are always uploaded as RGBA from native-endian 32-bit words,
+ * with the shader swapping red and blue for ARGB data. OpenGL ES has no
+ * packed pixel types, so there we assume a little-endian host. Deeper pixels
+ * are uploaded as native-endian 16-bit channels in RGBA order, or narrowed to
+ * 8 bits first where their format can't be a texture. */
+#ifdef IMV_GLES
+#define PIXEL_TYPE GL_UNSIGNED_BYTE
+#define SHADER_HEADER "#version 100\nprecision highp float;\n"
+#else
+#define PIXEL_TYPE GL_UNSIGNED_INT_8_8_8_8_REV
+#define SHADER_HEADER "#version 120\n"
+#endif
+
+/* Everything is drawn as a unit square, moved into place by transform, and
+ * textured with the region of the texture between texcoords.xy and .zw.
+ * With checkers set, the texture is composited over a chequerboard of 8
+ * pixel squares, with the square's corners at checker_rect.xy and .zw in
+ * units of two squares, so there's no separate pass to draw one. With
+ * color_lut set, colours are first looked up in a 3D table of lut_size
+ * points a side, packed into a 2D texture as lut_size slices side by side,
+ * interpolating between the points in a slice with the texture's filtering
+ * and between slices by hand. With transfer set to one of imv_transfer's HDR
+ * values, colours are first turned into light, with 1.0 as SDR white, then
+ * taken from BT.2020 to sRGB primaries unless they're linear, tone mapped to
+ * fit in 0.0 to 1.0, compressing only what's above the knee, and finally
+ * encoded to sRGB. */
+static const char *vertex_shader_source =
+  "attribute vec2 position;\n"
+  "uniform mat3 transform;\n"
+  "uniform vec4 texcoords;\n"
+  "uniform vec4 checker_rect;\n"
+  "varying vec2 texcoord;\n"
+  "varying vec2 checker_coord;\n"
+  "void main() {\n"
+  "  texcoord = mix(texcoords.xy, texcoords.zw, position);\n"
+  "  checker_coord = mix(checker_rect.xy, checker_rect.zw, position);\n"
+  "  gl_Position = vec4((transform * vec3(position, 1.0)).xy, 0.0, 1.0);\n"
+  "}\n";
+
+static const char *fragment_shader_source =
+  "uniform sampler2D tex;\n"
+  "uniform bool swizzle;\n"
+  "uniform bool checkers;\n"
+  "uniform sampler2D lut;\n"
+  "uniform bool color_lut;\n"
+  "uniform float lut_size;\n"
+  "uniform int transfer;\n"
+  "uniform float opacity;\n"
+  "varying vec2 texcoord;\n"
+  "varying vec2 checker_coord;\n"
+  "vec3 look_up(vec3 color) {\n"
+  "  vec3 point = clamp(color, 0.0, 1.0) * (lut_size - 1.0);\n"
+  "  float slice = min(floor(point.b), lut_size - 2.0);\n"
+  "  vec2 uv = (point.rg + 0.5) / vec2(lut_size * lut_size, lut_size);\n"
+  "  vec3 lo = texture2D(lut, uv + vec2(slice / lut_size, 0.0)).rgb;\n"
+  "  vec3 hi = texture2D(lut, uv + vec2((slice + 1.0) / lut_size, 0.0)).rgb;\n"
+  "  return mix(lo, hi, point.b - slice);\n"
+  "}\n"
+  "vec3 pq_to_light(vec3 e) {\n"
+  "  vec3 p = pow(max(e, 0.0), vec3(1.0 / 78.84375));\n"
+  "  vec3 y = max(p - 0.8359375, 0.0) / (18.8515625 - 18.6875 * p);\n"
+  "  return pow(y, vec3(1.0 / 0.1593017578125)) * (10000.0 / 203.0);\n"
+  "}\n"
+  "vec3 hlg_to_light(vec3 e) {\n"
+  "  e = max(e, 0.0);\n"
+  "  vec3 scene = mix(e * e / 3.0,\n"
+  "      (exp((e - 0.55991073) / 0.17883277) + 0.28466892) / 12.0,\n"
+  "      step(0.5, e));\n"
+  "  float luma = dot(scene, vec3(0.2627, 0.6780, 0.0593));\n"
+  "  return scene * pow(max(luma, 1e-6), 0.2) * (1000.0 / 203.0);\n"
+  "}\n"
+  "vec3 light_to_display(vec3 light) {\n"
+  "  const float knee = 0.75;\n"
+  "  light = max(light, 0.0);\n"
+  "  float peak = max(light.r, max(light.g, light.b));\n"
+  "  if (peak > knee) {\n"
+  "    float over = (peak - knee) / (1.0 - knee);\n"
+  "    light *= (knee + (1.0 - knee) * over / (over + 1.0)) / peak;\n"
+  "  }\n"
+  "  vec3 c = min(light, 1.0);\n"
+  "  return mix(c * 12.92, 1.055 * pow(c, vec3(1.0 / 2.4)) - 0.055,\n"
+  "      step(0.0031308, c));\n"
+  "}\n"
+  "vec3 to_display(vec3 color) {\n"
+  "  const mat3 bt2020_to_srgb = mat3(1.6605, -0.1246, -0.0182,\n"
+  "                                   -0.5876, 1.1329, -0.1006,\n"
+  "                                   -0.0728, -0.0083, 1.1187);\n"
+  "  if (transfer == 1) {\n"
+  "    return light_to_display(color);\n"
+  "  }\n"
+  "  vec3 light = transfer == 2 ? pq_to_light(color) : hlg_to_light(color);\n"
+  "  return light_to_display(bt2020_to_srgb * light);\n"
+  "}\n"
+  "void main() {\n"
+  "  vec4 color = texture2D(tex, texcoord);\n"
+  "  if (swizzle) {\n"
+  "    color = color.bgra;\n"
+  "  }\n"
+  "  if (transfer != 0) {\n"
+  "    color.rgb = to_display(color.rgb);\n"
+  "  }\n"
+  "  if (color_lut) {\n"
+  "    color.rgb = look_up(color.rgb);\n"
+  "  }\n"
+  "  if (checkers) {\n"
+  "    vec2 square = floor(checker_coord * 2.0);\n"
+  "    float odd = mod(square.x + square.y, 2.0);\n"
+  "    vec3 background = mix(vec3(0.8), vec3(0.5), odd);\n"
+  "    color = vec4(mix(background, color.rgb, color.a), 1.0);\n"
+  "  }\n"
+  "  gl_FragColor = vec4(color.rgb, color.a * opacity);\n"
+  "}\n";
+
+/* How many window pixels a pair of chequerboard squares covers */
+#define CHECKER_SIZE 16.0
+
+static const GLfloat quad_vertices[] = {
+  0.0, 0.0,
+  1.0, 0.0,
+  1.0, 1.0,
+  0.0, 1.0,
+};
+
+/* A range of rows of a surface, empty when top >= bottom */
+struct band {
+  int top;
+  int bottom;
+};
+
+/* A 2D affine transform, mapping (x, y) to
+ * (m[0]x + m[1]y + m[2], m[3]x + m[4]y + m[5]) */
+struct transform {
+  double m[6];
+};
+
+struct tile {
+  /* zero until the upload has started */
+  GLuint texture;
+  /* the buffer being uploaded from, and a fence marking the end of the
+   * transfer, for asynchronous uploads still in flight */
+  GLuint pbo;
+  GLsync fence;
+  /* set once the texture holds the tile's pixels */
+  bool ready;
+  /* set once the texture's mip chain has been generated */
+  bool mipmapped;
+  /* the area of the bitmap the tile covers */
+  int x, y, width, height;
+  /* how many pixels of neighbouring tiles the texture includes */
+  int border_left, border_top, border_right, border_bottom;
+};
+
+/* The tiles of one bitmap, kept in the texture cache */
+struct texture_entry {
+  /* the id of the bitmap the tiles are of */
+  unsigned long bitmap_id;
+  struct tile *tiles;
+  int cols;
+  int rows;
+  /* bytes per pixel of the tiles' textures */
+  int texel_size;
+  /* bytes of texture the tiles have taken so far */
+  size_t size;
+  /* the cache's clock when the entry was last drawn */
+  unsigned long used;
+};
 
 struct imv_canvas {
   cairo_surface_t *surface;
@@ -29,14 +222,144 @@ struct imv_canvas {
   GLuint texture;
   int width;
   int height;
+  double scale;
+  /* set when the texture needs reallocating for a new surface size */
+  bool texture_stale;
+  /* the rows of the surface that have anything drawn on them */
+  struct band drawn;
+  /* the rows of the surface that have changed since the last upload */
+  struct band dirty;
+  /* largest tile dimension, allowing for a border pixel either side */
+  int tile_size;
+  int max_texture_size;
+  /* whether tiles can be uploaded asynchronously through pixel buffers */
+  bool async_upload;
+  /* whether mip chains can be generated for tiles */
+  bool mipmaps;
+  /* whether textures can be uploaded from half floats */
+  bool half_float;
+  /* set when a draw left visible tiles that weren't ready */
+  bool uploads_pending;
+  /* how opaque images are drawn, for fading one into another */
+  double opacity;
+  struct {
+    GLuint program;
+    GLuint vbo;
+    /* zero if vertex array objects aren't available */
+    GLuint vao;
+    GLint transform;
+    GLint texcoords;
+    GLint swizzle;
+    GLint checkers;
+    GLint checker_rect;
+    GLint color_lut;
+    GLint lut_size;
+    GLint transfer;
+    GLint opacity;
+  } gl;
+  /* the colour lookup table images are drawn through, if size is nonzero */
   struct {
-    struct imv_bitmap *bitmap;
     GLuint texture;
+    int size;
+  } lut;
+  /* The tiles of recently drawn bitmaps, so that going back to one, or
+   * drawing one uploaded ahead of time, needs no upload. The least recently
+   * drawn are let go once their textures exceed the budget. */
+  struct {
+    struct list *entries;
+    size_t size;
+    size_t budget;
+    /* counts draws of bitmaps */
+    unsigned long clock;
   } cache;
-  GLuint checkers_texture;
+  /* a transparent pixel, for drawing just the chequerboard */
+  GLuint blank_texture;
+#ifdef IMV_BACKEND_LIBRSVG
+  /* SVGs are rasterised in the background at the scale they're shown at,
+   * and the raster drawn from a texture until the zoom strays too far from
+   * it or the view leaves the area it covers */
+  struct {
+    struct imv_svg_rasteriser *rasteriser;
+    /* the raster in the texture */
+    struct imv_svg_raster *raster;
+    GLuint texture;
+    /* what was last asked of the rasteriser, while it's still busy */
+    struct imv_svg_raster pending;
+  } svg;
+#endif
+  void (*ready)(void *data);
+  void *ready_data;
+  /* Set when drawing into memory with cairo in place of OpenGL, in which
+   * case none of the OpenGL state above is used */
+  bool software;
+  struct {
+    /* the memory being drawn into this frame */
+    cairo_surface_t *target;
+    cairo_t *cairo;
+    /* the id of the bitmap drawn last, as a surface cairo can draw from, and
+     * the premultiplied copy of its pixels that needed, if it did. Without a
+     * copy, the surface draws from the pixels at data, so it's only reused
+     * for a bitmap with the same id that still has them there. */
+    unsigned long bitmap_id;
+    const unsigned char *data;
+    cairo_surface_t *image;
+    unsigned char *pixels;
+    size_t pixels_size;
+    /* a pair of chequerboard squares, to repeat behind images */
+    cairo_pattern_t *checkers;
+    /* thumbnails, by handle less one, NULL where a handle is free */
+    cairo_surface_t **thumbnails;
+    size_t thumbnail_count;
+  } soft;
 };
 
-struct imv_canvas *imv_canvas_create(int width, int height)
+static void free_entry(struct imv_canvas *canvas, struct texture_entry *entry);
+
+static GLuint compile_shader(GLenum type, const char *source)
+{
+  const char *sources[] = {SHADER_HEADER, source};
+  GLuint shader = glCreateShader(type);
+  assert(shader);
+  glShaderSource(shader, 2, sources, NULL);
+  glCompileShader(shader);
+
+  GLint status;
+  glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+  if (!status) {
+    char info[1024];
+    glGetShaderInfoLog(shader, sizeof info, NULL, info);
+    imv_log(IMV_ERROR, "Failed to compile shader: %s\n", info);
+    abort();
+  }
+  return shader;
+}
+
+static GLuint link_program(void)
+{
+  GLuint vertex = compile_shader(GL_VERTEX_SHADER, vertex_shader_source);
+  GLuint fragment = compile_shader(GL_FRAGMENT_SHADER, fragment_shader_source);
+
+  GLuint program = glCreateProgram();
+  assert(program);
+  glAttachShader(program, vertex);
+  glAttachShader(program, fragment);
+  glBindAttribLocation(program, 0, "position");
+  glLinkProgram(program);
+  glDeleteShader(vertex);
+  glDeleteShader(fragment);
+
+  GLint status;
+  glGetProgramiv(program, GL_LINK_STATUS, &status);
+  if (!status) {
+    char info[1024];
+    glGetProgramInfoLog(program, sizeof info, NULL, info);
+    imv_log(IMV_ERROR, "Failed to link shader program: %s\n", info);
+    abort();
+  }
+  return program;
+}
+
+struct imv_canvas *imv_canvas_create(int width, int height, bool software)
 {
   struct imv_canvas *canvas = calloc(1, sizeof *canvas);
   canvas->surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
@@ -48,29 +371,126 @@ struct imv_canvas *imv_canvas_create(int width, int height)
   canvas->font = pango_font_description_new();
   assert(canvas->font);
 
+  canvas->width = width;
+  canvas->height = height;
+  canvas->scale = 1.0;
+  canvas->opacity = 1.0;
+  canvas->texture_stale = true;
+  canvas->cache.entries = list_create();
+  canvas->cache.budget = TEXTURE_BUDGET;
+
+  if (software) {
+    canvas->software = true;
+    canvas->max_texture_size = 32767;
+    return canvas;
+  }
+
   glGenTextures(1, &canvas->texture);
   assert(canvas->texture);
 
-  glGenTextures(1, &canvas->checkers_texture);
-  assert(canvas->checkers_texture);
+  glBindTexture(GL_TEXTURE_2D, canvas->texture);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 
-  glBindTexture(GL_TEXTURE_2D, canvas->checkers_texture);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-  glPixelStorei(GL_UNPACK_ROW_LENGTH, 16);
+  glGenTextures(1, &canvas->blank_texture);
+  assert(canvas->blank_texture);
+
+  const unsigned char blank[4] = {0, 0, 0, 0};
+  glBindTexture(GL_TEXTURE_2D, canvas->blank_texture);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, 1);
   glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
   glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 16, 16, 0, GL_RGBA,
-               GL_UNSIGNED_INT_8_8_8_8_REV, checkers_data);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 1, 1, 0, GL_RGBA,
+               PIXEL_TYPE, blank);
 
-  canvas->width = width;
-  canvas->height = height;
+  GLint max_texture_size;
+  glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_texture_size);
+  canvas->max_texture_size = max_texture_size;
+  canvas->tile_size = (max_texture_size < MAX_TILE_SIZE
+                       ? max_texture_size : MAX_TILE_SIZE) - 2;
+
+#ifdef IMV_GLES
+  canvas->async_upload = true;
+  canvas->mipmaps = true;
+  canvas->half_float = true;
+  const bool vertex_arrays = true;
+#else
+  /* Mapping buffer ranges and fences need OpenGL 3.2, generating mipmaps,
+   * half floats and vertex array objects need OpenGL 3.0 */
+  int major = 0, minor = 0;
+  const char *version = (const char *)glGetString(GL_VERSION);
+  if (version && sscanf(version, "%d.%d", &major, &minor) == 2) {
+    canvas->async_upload = major > 3 || (major == 3 && minor >= 2);
+    canvas->mipmaps = major >= 3;
+    canvas->half_float = major >= 3;
+  }
+  const bool vertex_arrays = major >= 3;
+#endif
+
+  canvas->gl.program = link_program();
+  canvas->gl.transform = glGetUniformLocation(canvas->gl.program, "transform");
+  canvas->gl.texcoords = glGetUniformLocation(canvas->gl.program, "texcoords");
+  canvas->gl.swizzle = glGetUniformLocation(canvas->gl.program, "swizzle");
+  canvas->gl.checkers = glGetUniformLocation(canvas->gl.program, "checkers");
+  canvas->gl.checker_rect = glGetUniformLocation(canvas->gl.program, "checker_rect");
+  canvas->gl.color_lut = glGetUniformLocation(canvas->gl.program, "color_lut");
+  canvas->gl.lut_size = glGetUniformLocation(canvas->gl.program, "lut_size");
+  canvas->gl.transfer = glGetUniformLocation(canvas->gl.program, "transfer");
+  canvas->gl.opacity = glGetUniformLocation(canvas->gl.program, "opacity");
+  glUseProgram(canvas->gl.program);
+  glUniform1i(glGetUniformLocation(canvas->gl.program, "tex"), 0);
+  glUniform1i(glGetUniformLocation(canvas->gl.program, "lut"), 1);
+  glUseProgram(0);
+
+  glGenBuffers(1, &canvas->gl.vbo);
+  glBindBuffer(GL_ARRAY_BUFFER, canvas->gl.vbo);
+  glBufferData(GL_ARRAY_BUFFER, sizeof quad_vertices, quad_vertices, GL_STATIC_DRAW);
+  if (vertex_arrays) {
+    glGenVertexArrays(1, &canvas->gl.vao);
+    glBindVertexArray(canvas->gl.vao);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, NULL);
+    glBindVertexArray(0);
+  }
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
 
   return canvas;
 }
 
+static void free_soft_image(struct imv_canvas *canvas)
+{
+  if (canvas->soft.image) {
+    cairo_surface_destroy(canvas->soft.image);
+    canvas->soft.image = NULL;
+  }
+  if (canvas->soft.pixels) {
+    free(canvas->soft.pixels);
+    imv_memory_release(canvas->soft.pixels_size);
+    canvas->soft.pixels = NULL;
+  }
+  canvas->soft.bitmap_id = 0;
+  canvas->soft.data = NULL;
+}
+
+static void free_software(struct imv_canvas *canvas)
+{
+  imv_canvas_set_target(canvas, NULL, 0, 0, 0);
+  free_soft_image(canvas);
+  if (canvas->soft.checkers) {
+    cairo_pattern_destroy(canvas->soft.checkers);
+  }
+  for (size_t i = 0; i < canvas->soft.thumbnail_count; ++i) {
+    if (canvas->soft.thumbnails[i]) {
+      cairo_surface_destroy(canvas->soft.thumbnails[i]);
+    }
+  }
+  free(canvas->soft.thumbnails);
+}
+
 void imv_canvas_free(struct imv_canvas *canvas)
 {
   if (!canvas) {
@@ -82,11 +502,35 @@ void imv_canvas_free(struct imv_canvas *canvas)
   canvas->cairo = NULL;
   cairo_surface_destroy(canvas->surface);
   canvas->surface = NULL;
+#ifdef IMV_BACKEND_LIBRSVG
+  imv_svg_rasteriser_free(canvas->svg.rasteriser);
+  imv_svg_raster_free(canvas->svg.raster);
+#endif
+  if (canvas->software) {
+    free_software(canvas);
+    list_free(canvas->cache.entries);
+    free(canvas);
+    return;
+  }
   glDeleteTextures(1, &canvas->texture);
-  if (canvas->cache.texture) {
-    glDeleteTextures(1, &canvas->cache.texture);
+#ifdef IMV_BACKEND_LIBRSVG
+  if (canvas->svg.texture) {
+    glDeleteTextures(1, &canvas->svg.texture);
+  }
+#endif
+  for (size_t i = 0; i < canvas->cache.entries->len; ++i) {
+    free_entry(canvas, canvas->cache.entries->items[i]);
+  }
+  list_free(canvas->cache.entries);
+  glDeleteTextures(1, &canvas->blank_texture);
+  if (canvas->lut.texture) {
+    glDeleteTextures(1, &canvas->lut.texture);
+  }
+  if (canvas->gl.vao) {
+    glDeleteVertexArrays(1, &canvas->gl.vao);
   }
-  glDeleteTextures(1, &canvas->checkers_texture);
+  glDeleteBuffers(1, &canvas->gl.vbo);
+  glDeleteProgram(canvas->gl.program);
   free(canvas);
 }
 
@@ -97,6 +541,7 @@ void imv_canvas_resize(struct imv_canvas *canvas, int width, int height, double
 
   canvas->width = width;
   canvas->height = height;
+  canvas->scale = scale;
 
   canvas->surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
                                                canvas->width, canvas->height);
@@ -104,15 +549,62 @@ void imv_canvas_resize(struct imv_canvas *canvas, int width, int height, double
   cairo_surface_set_device_scale(canvas->surface, scale, scale);
   canvas->cairo = cairo_create(canvas->surface);
   assert(canvas->cairo);
+
+  /* the new surface starts out blank */
+  canvas->texture_stale = true;
+  canvas->drawn.top = canvas->drawn.bottom = 0;
+  canvas->dirty.top = canvas->dirty.bottom = 0;
+}
+
+static void extend_band(struct band *band, int top, int bottom)
+{
+  if (band->top >= band->bottom) {
+    band->top = top;
+    band->bottom = bottom;
+    return;
+  }
+  band->top = top < band->top ? top : band->top;
+  band->bottom = bottom > band->bottom ? bottom : band->bottom;
+}
+
+/* Records that the given area of the canvas, in user space, has been drawn
+ * on, and so needs uploading */
+static void damage(struct imv_canvas *canvas, double x0, double y0, double x1, double y1)
+{
+  cairo_user_to_device(canvas->cairo, &x0, &y0);
+  cairo_user_to_device(canvas->cairo, &x1, &y1);
+
+  /* allow a pixel either side for antialiasing */
+  int top = floor(y0 < y1 ? y0 : y1) - 1;
+  int bottom = ceil(y0 < y1 ? y1 : y0) + 1;
+  top = top < 0 ? 0 : top;
+  bottom = bottom > canvas->height ? canvas->height : bottom;
+  if (top >= bottom) {
+    return;
+  }
+
+  extend_band(&canvas->drawn, top, bottom);
+  extend_band(&canvas->dirty, top, bottom);
 }
 
 void imv_canvas_clear(struct imv_canvas *canvas)
 {
+  if (canvas->drawn.top >= canvas->drawn.bottom) {
+    return;
+  }
+
+  /* Only the rows drawn on need clearing, and then uploading again */
   cairo_save(canvas->cairo);
   cairo_set_source_rgba(canvas->cairo, 0, 0, 0, 0);
   cairo_set_operator(canvas->cairo, CAIRO_OPERATOR_SOURCE);
-  cairo_paint(canvas->cairo);
+  cairo_rectangle(canvas->cairo, 0, canvas->drawn.top / canvas->scale,
+                  canvas->width / canvas->scale,
+                  (canvas->drawn.bottom - canvas->drawn.top) / canvas->scale);
+  cairo_fill(canvas->cairo);
   cairo_restore(canvas->cairo);
+
+  extend_band(&canvas->dirty, canvas->drawn.top, canvas->drawn.bottom);
+  canvas->drawn.top = canvas->drawn.bottom = 0;
 }
 
 void imv_canvas_color(struct imv_canvas *canvas, float r, float g, float b, float a)
@@ -124,55 +616,133 @@ void imv_canvas_fill_rectangle(struct imv_canvas *canvas, int x, int y, int widt
 {
   cairo_rectangle(canvas->cairo, x, y, width, height);
   cairo_fill(canvas->cairo);
+  damage(canvas, x, y, x + width, y + height);
 }
 
 void imv_canvas_fill(struct imv_canvas *canvas)
 {
   cairo_rectangle(canvas->cairo, 0, 0, canvas->width, canvas->height);
   cairo_fill(canvas->cairo);
+  damage(canvas, 0, 0, canvas->width, canvas->height);
 }
 
-void imv_canvas_fill_checkers(struct imv_canvas *canvas, struct imv_image *image,
-                              int bx, int by, double scale,
-                              double rotation, bool mirrored)
+/* Returns the transform applying b, then a */
+static struct transform transform_multiply(struct transform a, struct transform b)
 {
-  GLint viewport[4];
-  glGetIntegerv(GL_VIEWPORT, viewport);
+  struct transform result = {{
+    a.m[0] * b.m[0] + a.m[1] * b.m[3],
+    a.m[0] * b.m[1] + a.m[1] * b.m[4],
+    a.m[0] * b.m[2] + a.m[1] * b.m[5] + a.m[2],
+    a.m[3] * b.m[0] + a.m[4] * b.m[3],
+    a.m[3] * b.m[1] + a.m[4] * b.m[4],
+    a.m[3] * b.m[2] + a.m[4] * b.m[5] + a.m[5],
+  }};
+  return result;
+}
 
-  glPushMatrix();
-  glOrtho(0.0, viewport[2], viewport[3], 0.0, 0.0, 10.0);
+/* Maps the unit square onto a rectangle */
+static struct transform transform_rect(double x, double y, double width, double height)
+{
+  struct transform result = {{width, 0, x, 0, height, y}};
+  return result;
+}
 
-  glBindTexture(GL_TEXTURE_2D, canvas->checkers_texture);
-  glEnable(GL_TEXTURE_2D);
+/* Maps window pixels, with y pointing down, onto clip space */
+static struct transform transform_ortho(int width, int height)
+{
+  struct transform result = {{2.0 / width, 0, -1, 0, -2.0 / height, 1}};
+  return result;
+}
 
-  const int left = bx;
-  const int top = by;
-  const int right = left + imv_image_width(image) * scale;
-  const int bottom = top + imv_image_height(image) * scale;
-  const int center_x = left + imv_image_width(image) * scale / 2;
-  const int center_y = top + imv_image_height(image) * scale / 2;
-  const float s = (right - left) / 16.0;
-  const float t = s * imv_image_height(image) / imv_image_width(image);
-
-  glTranslated(center_x, center_y, 0);
-  if (mirrored) {
-    glScaled(-1, 1, 1);
-  }
-  glRotated(rotation, 0, 0, 1);
-  glTranslated(-center_x, -center_y, 0);
+/* Rotates by rotation degrees clockwise about a centre point, after
+ * mirroring horizontally about it if mirrored is set */
+static struct transform transform_rotate(double center_x, double center_y,
+                                         double rotation, bool mirrored)
+{
+  const double radians = rotation * M_PI / 180.0;
+  const double c = cos(radians);
+  const double s = sin(radians);
+  const double flip = mirrored ? -1 : 1;
 
-  glBegin(GL_TRIANGLE_FAN);
-  glTexCoord2f(0, 0); glVertex2i(left, top);
-  glTexCoord2f(s, 0); glVertex2i(right, top);
-  glTexCoord2f(s, t); glVertex2i(right, bottom);
-  glTexCoord2f(0, t); glVertex2i(left, bottom);
-  glEnd();
+  struct transform result = {{flip * c, -flip * s, 0, s, c, 0}};
+  result.m[2] = center_x - result.m[0] * center_x - result.m[1] * center_y;
+  result.m[5] = center_y - result.m[3] * center_x - result.m[4] * center_y;
+  return result;
+}
 
+static void begin_draw(struct imv_canvas *canvas)
+{
+  glUseProgram(canvas->gl.program);
+  glUniform1i(canvas->gl.checkers, false);
+  glUniform1i(canvas->gl.color_lut, false);
+  glUniform1i(canvas->gl.transfer, IMV_TRANSFER_SRGB);
+  glUniform1f(canvas->gl.opacity, 1.0f);
+  glActiveTexture(GL_TEXTURE0);
+  if (canvas->gl.vao) {
+    glBindVertexArray(canvas->gl.vao);
+  } else {
+    glBindBuffer(GL_ARRAY_BUFFER, canvas->gl.vbo);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, NULL);
+  }
+  glEnable(GL_BLEND);
+  glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+}
+
+static void end_draw(struct imv_canvas *canvas)
+{
+  glDisable(GL_BLEND);
+  if (canvas->gl.vao) {
+    glBindVertexArray(0);
+  } else {
+    glDisableVertexAttribArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+  }
   glBindTexture(GL_TEXTURE_2D, 0);
-  glDisable(GL_TEXTURE_2D);
-  glPopMatrix();
+  glUseProgram(0);
 }
 
+/* Draws the unit square under transform, textured with the currently bound
+ * texture between (s0, t0) and (s1, t1) */
+static void draw_quad(struct imv_canvas *canvas, struct transform transform,
+                      double s0, double t0, double s1, double t1, bool swizzle)
+{
+  /* column-major, as OpenGL expects */
+  const GLfloat matrix[9] = {
+    transform.m[0], transform.m[3], 0,
+    transform.m[1], transform.m[4], 0,
+    transform.m[2], transform.m[5], 1,
+  };
+  glUniformMatrix3fv(canvas->gl.transform, 1, GL_FALSE, matrix);
+  glUniform4f(canvas->gl.texcoords, s0, t0, s1, t1);
+  glUniform1i(canvas->gl.swizzle, swizzle);
+  glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+}
+
+#ifdef IMV_BACKEND_LIBRSVG
+/* Draws the chequerboard alone, for images not drawn through a texture */
+static void draw_checkers(struct imv_canvas *canvas, int left, int top,
+                          int width, int height, double rotation, bool mirrored)
+{
+  GLint viewport[4];
+  glGetIntegerv(GL_VIEWPORT, viewport);
+
+  const struct transform transform = transform_multiply(
+      transform_ortho(viewport[2], viewport[3]),
+      transform_multiply(transform_rotate(left + width / 2, top + height / 2,
+                                          rotation, mirrored),
+                         transform_rect(left, top, width, height)));
+
+  begin_draw(canvas);
+  glBindTexture(GL_TEXTURE_2D, canvas->blank_texture);
+  glUniform1i(canvas->gl.checkers, true);
+  glUniform4f(canvas->gl.checker_rect, 0, 0,
+              width / CHECKER_SIZE, height / CHECKER_SIZE);
+  draw_quad(canvas, transform, 0, 0, 1, 1, false);
+  end_draw(canvas);
+}
+#endif
+
 void imv_canvas_font(struct imv_canvas *canvas, const char *name, int size)
 {
   pango_font_description_set_family(canvas->font, name);
@@ -194,6 +764,11 @@ void imv_canvas_show_layout(struct imv_canvas *canvas, int x, int y,
 {
   cairo_move_to(canvas->cairo, x, y);
   pango_cairo_show_layout(canvas->cairo, layout);
+
+  PangoRectangle ink;
+  pango_layout_get_pixel_extents(layout, &ink, NULL);
+  damage(canvas, x + ink.x, y + ink.y,
+         x + ink.x + ink.width, y + ink.y + ink.height);
 }
 
 int imv_canvas_printf(struct imv_canvas *canvas, int x, int y, const char *fmt, ...)
@@ -216,166 +791,1223 @@ int imv_canvas_printf(struct imv_canvas *canvas, int x, int y, const char *fmt,
   return extents.width;
 }
 
-void imv_canvas_draw(struct imv_canvas *canvas)
+/* Uploads the given rows of a cairo surface to texture, reallocating the
+ * texture for the surface's size if allocate is set */
+static void upload_surface(GLuint texture, cairo_surface_t *surface,
+                           struct band rows, bool allocate)
 {
-  GLint viewport[4];
-  glGetIntegerv(GL_VIEWPORT, viewport);
-  glPushMatrix();
-  glOrtho(0.0, 1.0, 1.0, 0.0, 0.0, 10.0);
+  cairo_surface_flush(surface);
+  const unsigned char *data = cairo_image_surface_get_data(surface);
+  const int width = cairo_image_surface_get_width(surface);
+  const int height = cairo_image_surface_get_height(surface);
+  const int stride = cairo_image_surface_get_stride(surface);
 
-  void *data = cairo_image_surface_get_data(canvas->surface);
-
-  glEnable(GL_TEXTURE_RECTANGLE);
-  glBindTexture(GL_TEXTURE_RECTANGLE, canvas->texture);
-
-  glPixelStorei(GL_UNPACK_ROW_LENGTH, canvas->width);
+  glBindTexture(GL_TEXTURE_2D, texture);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, stride / 4);
   glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
   glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
-  glTexImage2D(GL_TEXTURE_RECTANGLE, 0, GL_RGBA8, canvas->width, canvas->height,
-               0, GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, data);
+  if (allocate) {
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height,
+                 0, GL_RGBA, PIXEL_TYPE, data);
+  } else if (rows.top < rows.bottom) {
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, rows.top, width, rows.bottom - rows.top,
+                    GL_RGBA, PIXEL_TYPE, data + (size_t)rows.top * stride);
+  }
+}
 
-  glEnable(GL_BLEND);
-  glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-  glBegin(GL_TRIANGLE_FAN);
-  glTexCoord2i(0,             0);              glVertex2i(0.0, 0.0);
-  glTexCoord2i(canvas->width, 0);              glVertex2i(1.0, 0.0);
-  glTexCoord2i(canvas->width, canvas->height); glVertex2i(1.0, 1.0);
-  glTexCoord2i(0,             canvas->height); glVertex2i(0.0, 1.0);
-  glEnd();
-  glDisable(GL_BLEND);
+/* Draws the given rows of a surface-sized texture over the whole window */
+static void draw_surface(struct imv_canvas *canvas, GLuint texture,
+                         int height, struct band rows)
+{
+  const double top = (double)rows.top / height;
+  const double bottom = (double)rows.bottom / height;
+
+  /* cairo's ARGB32 is native-endian ARGB, so needs swizzling like ours */
+  begin_draw(canvas);
+  glBindTexture(GL_TEXTURE_2D, texture);
+  draw_quad(canvas, transform_rect(-1, 1 - 2 * top, 2, -2 * (bottom - top)),
+            0, top, 1, bottom, true);
+  end_draw(canvas);
+}
+
+void imv_canvas_set_target(struct imv_canvas *canvas, void *pixels,
+                           int width, int height, int stride)
+{
+  if (canvas->soft.cairo) {
+    cairo_destroy(canvas->soft.cairo);
+    cairo_surface_destroy(canvas->soft.target);
+    canvas->soft.cairo = NULL;
+    canvas->soft.target = NULL;
+  }
+  if (!pixels) {
+    return;
+  }
 
-  glBindTexture(GL_TEXTURE_RECTANGLE, 0);
-  glDisable(GL_TEXTURE_RECTANGLE);
-  glPopMatrix();
+  /* cairo's RGB24 is the same as the 32-bit pixels with the top byte
+   * ignored that the window gives us */
+  canvas->soft.target = cairo_image_surface_create_for_data(pixels,
+      CAIRO_FORMAT_RGB24, width, height, stride);
+  canvas->soft.cairo = cairo_create(canvas->soft.target);
+}
+
+/* Gets the area being drawn to, as glGetIntegerv(GL_VIEWPORT) would */
+static void get_viewport(struct imv_canvas *canvas, GLint viewport[4])
+{
+  if (!canvas->software) {
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    return;
+  }
+  viewport[0] = viewport[1] = 0;
+  viewport[2] = canvas->soft.target
+    ? cairo_image_surface_get_width(canvas->soft.target) : canvas->width;
+  viewport[3] = canvas->soft.target
+    ? cairo_image_surface_get_height(canvas->soft.target) : canvas->height;
+}
+
+void imv_canvas_draw(struct imv_canvas *canvas)
+{
+  if (canvas->software) {
+    cairo_t *cairo = canvas->soft.cairo;
+    if (!cairo || canvas->drawn.top >= canvas->drawn.bottom) {
+      return;
+    }
+    /* The overlay's device scale makes it smaller as a source, so scale it
+     * back up to map pixel for pixel */
+    cairo_save(cairo);
+    cairo_scale(cairo, canvas->scale, canvas->scale);
+    cairo_set_source_surface(cairo, canvas->surface, 0, 0);
+    cairo_rectangle(cairo, 0, canvas->drawn.top / canvas->scale,
+                    canvas->width / canvas->scale,
+                    (canvas->drawn.bottom - canvas->drawn.top) / canvas->scale);
+    cairo_fill(cairo);
+    cairo_restore(cairo);
+    canvas->dirty.top = canvas->dirty.bottom = 0;
+    return;
+  }
+
+  /* Only upload the rows that changed since last time, and only draw the
+   * rows with anything on them */
+  upload_surface(canvas->texture, canvas->surface, canvas->dirty,
+                 canvas->texture_stale);
+  canvas->texture_stale = false;
+  canvas->dirty.top = canvas->dirty.bottom = 0;
+
+  if (canvas->drawn.top < canvas->drawn.bottom) {
+    draw_surface(canvas, canvas->texture, canvas->height, canvas->drawn);
+  }
 }
 
 struct imv_bitmap *imv_image_get_bitmap(const struct imv_image *image);
 
-static int convert_pixelformat(enum imv_pixelformat fmt)
+/* Returns whether the red and blue channels of fmt need swapping, as the
+ * shader samples pixels in RGBA order */
+static bool needs_swizzle(enum imv_pixelformat fmt)
 {
-  /* opengl uses RGBA order, not ARGB, so we get it to
-   * flip the bytes around so ARGB -> BGRA
-   */
   if (fmt == IMV_ARGB) {
-    return GL_BGRA;
-  } else if (fmt == IMV_ABGR) {
-    return GL_RGBA;
+    return true;
+  } else if (fmt == IMV_ABGR || fmt == IMV_ABGR16 || fmt == IMV_ABGR_HALF) {
+    return false;
   } else {
     imv_log(IMV_WARNING, "Unknown pixel format. Defaulting to ARGB\n");
-    return GL_BGRA;
+    return true;
+  }
+}
+
+/* How the pixels of a bitmap become a texture */
+struct texel_format {
+  GLint internal_format;
+  GLenum type;
+  /* bytes per pixel of the texture */
+  int size;
+  /* set when pixels have to be narrowed to 8 bits to be uploaded */
+  bool narrow;
+};
+
+static struct texel_format texel_format(const struct imv_canvas *canvas,
+                                        enum imv_pixelformat fmt)
+{
+  const struct texel_format rgba8 = {GL_RGBA8, PIXEL_TYPE, 4, false};
+  if (fmt == IMV_ABGR16) {
+#ifdef IMV_GLES
+    /* OpenGL ES has no 16-bit integer textures to upload to */
+    return (struct texel_format){GL_RGBA8, PIXEL_TYPE, 4, true};
+#else
+    return (struct texel_format){GL_RGBA16, GL_UNSIGNED_SHORT, 8, false};
+#endif
+  } else if (fmt == IMV_ABGR_HALF) {
+    if (canvas->half_float) {
+      return (struct texel_format){GL_RGBA16F, GL_HALF_FLOAT, 8, false};
+    }
+    return (struct texel_format){GL_RGBA8, PIXEL_TYPE, 4, true};
+  }
+  return rgba8;
+}
+
+static double cur_time_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Frees an entry of the texture cache, along with its textures */
+static void free_entry(struct imv_canvas *canvas, struct texture_entry *entry)
+{
+  for (int i = 0; i < entry->cols * entry->rows; ++i) {
+    struct tile *tile = &entry->tiles[i];
+    if (tile->fence) {
+      glDeleteSync(tile->fence);
+    }
+    if (tile->pbo) {
+      glDeleteBuffers(1, &tile->pbo);
+    }
+    if (tile->texture) {
+      glDeleteTextures(1, &tile->texture);
+    }
+  }
+  canvas->cache.size -= entry->size;
+  free(entry->tiles);
+  free(entry);
+}
+
+/* Splits bitmap into tiles for the cache, deferring their upload until
+ * they're first needed */
+static struct texture_entry *make_entry(struct imv_canvas *canvas,
+                                        struct imv_bitmap *bitmap)
+{
+  struct texture_entry *entry = calloc(1, sizeof *entry);
+  const int size = canvas->tile_size;
+  entry->bitmap_id = bitmap->id;
+  entry->texel_size = texel_format(canvas, bitmap->format).size;
+  entry->cols = (bitmap->width + size - 1) / size;
+  entry->rows = (bitmap->height + size - 1) / size;
+  entry->tiles = calloc(entry->cols * entry->rows, sizeof *entry->tiles);
+
+  for (int row = 0; row < entry->rows; ++row) {
+    for (int col = 0; col < entry->cols; ++col) {
+      struct tile *tile = &entry->tiles[row * entry->cols + col];
+      tile->x = col * size;
+      tile->y = row * size;
+      tile->width = bitmap->width - tile->x < size ? bitmap->width - tile->x : size;
+      tile->height = bitmap->height - tile->y < size ? bitmap->height - tile->y : size;
+
+      /* Include a pixel of each neighbouring tile, so that linear filtering
+       * is seamless across the joins */
+      tile->border_left = tile->x > 0 ? 1 : 0;
+      tile->border_top = tile->y > 0 ? 1 : 0;
+      tile->border_right = tile->x + tile->width < bitmap->width ? 1 : 0;
+      tile->border_bottom = tile->y + tile->height < bitmap->height ? 1 : 0;
+    }
+  }
+
+  list_append(canvas->cache.entries, entry);
+  return entry;
+}
+
+/* Finds the cache's tiles for bitmap, making them if create is set and
+ * there are none yet */
+static struct texture_entry *find_entry(struct imv_canvas *canvas,
+                                        struct imv_bitmap *bitmap, bool create)
+{
+  for (size_t i = 0; i < canvas->cache.entries->len; ++i) {
+    struct texture_entry *entry = canvas->cache.entries->items[i];
+    if (entry->bitmap_id == bitmap->id) {
+      return entry;
+    }
+  }
+  return create ? make_entry(canvas, bitmap) : NULL;
+}
+
+/* Lets go of the least recently drawn entries until the cache is within its
+ * budget, or there's nothing left to let go of but keep */
+static void evict_entries(struct imv_canvas *canvas, struct texture_entry *keep)
+{
+  while (canvas->cache.size > canvas->cache.budget) {
+    size_t oldest = canvas->cache.entries->len;
+    for (size_t i = 0; i < canvas->cache.entries->len; ++i) {
+      struct texture_entry *entry = canvas->cache.entries->items[i];
+      if (entry != keep && (oldest == canvas->cache.entries->len
+            || entry->used < ((struct texture_entry *)
+              canvas->cache.entries->items[oldest])->used)) {
+        oldest = i;
+      }
+    }
+    if (oldest == canvas->cache.entries->len) {
+      return;
+    }
+    struct texture_entry *entry = canvas->cache.entries->items[oldest];
+    list_remove(canvas->cache.entries, oldest);
+    free_entry(canvas, entry);
+  }
+}
+
+/* The bytes of texture a tile of entry's pixels take, not counting any mip
+ * chain */
+static size_t tile_size(const struct texture_entry *entry,
+                        const struct tile *tile)
+{
+  return (size_t)(tile->border_left + tile->width + tile->border_right)
+    * (tile->border_top + tile->height + tile->border_bottom) * entry->texel_size;
+}
+
+static void create_tile_texture(struct tile *tile)
+{
+  glGenTextures(1, &tile->texture);
+  glBindTexture(GL_TEXTURE_2D, tile->texture);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+}
+
+/* Copies the pixels of a tile, borders and all, into rows row_bytes apart
+ * at dst, in the texture's format */
+static void copy_tile(const struct tile *tile, const struct imv_bitmap *bitmap,
+                      struct texel_format fmt, unsigned char *dst,
+                      size_t row_bytes)
+{
+  const int tex_width = tile->border_left + tile->width + tile->border_right;
+  const int tex_height = tile->border_top + tile->height + tile->border_bottom;
+  const unsigned char *src = bitmap->data
+    + (size_t)(tile->y - tile->border_top) * bitmap->stride
+    + (size_t)(tile->x - tile->border_left) * imv_bitmap_pixel_size(bitmap->format);
+  for (int y = 0; y < tex_height; ++y) {
+    if (fmt.narrow) {
+      imv_bitmap_narrow_pixels(bitmap->format, dst + y * row_bytes,
+          src + (size_t)y * bitmap->stride, tex_width);
+    } else {
+      memcpy(dst + y * row_bytes, src + (size_t)y * bitmap->stride, row_bytes);
+    }
+  }
+}
+
+static void upload_tile(struct imv_canvas *canvas, struct tile *tile,
+                        struct imv_bitmap *bitmap)
+{
+  const int tex_width = tile->border_left + tile->width + tile->border_right;
+  const int tex_height = tile->border_top + tile->height + tile->border_bottom;
+  const struct texel_format fmt = texel_format(canvas, bitmap->format);
+
+  create_tile_texture(tile);
+  if (fmt.narrow) {
+    /* The narrowed pixels have to come from somewhere */
+    const size_t row_bytes = (size_t)tex_width * fmt.size;
+    unsigned char *pixels = malloc(row_bytes * tex_height);
+    if (pixels) {
+      copy_tile(tile, bitmap, fmt, pixels, row_bytes);
+    } else {
+      imv_log(IMV_WARNING, "Out of memory narrowing a tile to upload\n");
+    }
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, tex_width);
+    glTexImage2D(GL_TEXTURE_2D, 0, fmt.internal_format, tex_width, tex_height,
+        0, GL_RGBA, fmt.type, pixels);
+    free(pixels);
+    tile->ready = true;
+    return;
+  }
+
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, bitmap->stride / fmt.size);
+  glPixelStorei(GL_UNPACK_SKIP_PIXELS, tile->x - tile->border_left);
+  glPixelStorei(GL_UNPACK_SKIP_ROWS, tile->y - tile->border_top);
+  glTexImage2D(GL_TEXTURE_2D, 0, fmt.internal_format, tex_width, tex_height,
+      0, GL_RGBA, fmt.type, bitmap->data);
+  glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
+  glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
+  tile->ready = true;
+}
+
+/* Copies the tile into a pixel buffer and starts a transfer from it into
+ * the tile's texture, which completes in the background. Falls back to a
+ * synchronous upload if the buffer can't be mapped. */
+static void start_tile_upload(struct imv_canvas *canvas, struct tile *tile,
+                              struct imv_bitmap *bitmap)
+{
+  const int tex_width = tile->border_left + tile->width + tile->border_right;
+  const int tex_height = tile->border_top + tile->height + tile->border_bottom;
+  const struct texel_format fmt = texel_format(canvas, bitmap->format);
+  const size_t row_bytes = (size_t)tex_width * fmt.size;
+  const size_t size = row_bytes * tex_height;
+
+  glGenBuffers(1, &tile->pbo);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, tile->pbo);
+  glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+  unsigned char *dst = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size,
+      GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+  if (!dst) {
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    glDeleteBuffers(1, &tile->pbo);
+    tile->pbo = 0;
+    upload_tile(canvas, tile, bitmap);
+    return;
   }
+
+  copy_tile(tile, bitmap, fmt, dst, row_bytes);
+  glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+  create_tile_texture(tile);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, tex_width);
+  glTexImage2D(GL_TEXTURE_2D, 0, fmt.internal_format, tex_width, tex_height,
+      0, GL_RGBA, fmt.type, NULL);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+  tile->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
 }
 
+/* Checks whether a tile's transfer has finished, waiting up to timeout
+ * nanoseconds for it to do so */
+static bool poll_tile_upload(struct tile *tile, GLuint64 timeout)
+{
+  if (tile->ready) {
+    return true;
+  }
+  if (!tile->fence) {
+    return false;
+  }
+
+  GLenum status = glClientWaitSync(tile->fence, GL_SYNC_FLUSH_COMMANDS_BIT, timeout);
+  if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED) {
+    glDeleteSync(tile->fence);
+    tile->fence = NULL;
+    glDeleteBuffers(1, &tile->pbo);
+    tile->pbo = 0;
+    tile->ready = true;
+  }
+  return tile->ready;
+}
+
+/* Starts uploading any tiles of entry between the given columns and rows
+ * that don't have textures yet, until budget bytes have gone. Returns what's
+ * left of the budget. */
+static size_t upload_tiles(struct imv_canvas *canvas, struct texture_entry *entry,
+                           struct imv_bitmap *bitmap,
+                           int first_col, int first_row,
+                           int last_col, int last_row, size_t budget)
+{
+  for (int row = first_row; row <= last_row; ++row) {
+    for (int col = first_col; col <= last_col && budget > 0; ++col) {
+      struct tile *tile = &entry->tiles[row * entry->cols + col];
+      if (tile->texture) {
+        continue;
+      }
+      const size_t bytes = (size_t)tile->width * tile->height * entry->texel_size;
+      budget = bytes < budget ? budget - bytes : 0;
+      if (canvas->async_upload) {
+        start_tile_upload(canvas, tile, bitmap);
+      } else {
+        upload_tile(canvas, tile, bitmap);
+      }
+      entry->size += tile_size(entry, tile);
+      canvas->cache.size += tile_size(entry, tile);
+    }
+  }
+  return budget;
+}
+
+/* Finds the area of the bitmap that's visible in the viewport, by mapping
+ * the corners of the viewport back onto it */
+static void visible_area(const GLint viewport[4], int left, int top,
+                         double scale_x, double scale_y,
+                         int center_x, int center_y,
+                         double rotation, bool mirrored,
+                         int bitmap_width, int bitmap_height,
+                         int *x0, int *y0, int *x1, int *y1)
+{
+  const double corners[4][2] = {
+    {0, 0},
+    {viewport[2], 0},
+    {viewport[2], viewport[3]},
+    {0, viewport[3]},
+  };
+
+  const double radians = rotation * M_PI / 180.0;
+  const double c = cos(radians);
+  const double s = sin(radians);
+
+  double min_x = INFINITY, min_y = INFINITY;
+  double max_x = -INFINITY, max_y = -INFINITY;
+  for (int i = 0; i < 4; ++i) {
+    double dx = corners[i][0] - center_x;
+    double dy = corners[i][1] - center_y;
+    if (mirrored) {
+      dx = -dx;
+    }
+    /* undo the rotation */
+    const double px = center_x + c * dx + s * dy;
+    const double py = center_y - s * dx + c * dy;
+    const double bx = (px - left) / scale_x;
+    const double by = (py - top) / scale_y;
+    min_x = bx < min_x ? bx : min_x;
+    min_y = by < min_y ? by : min_y;
+    max_x = bx > max_x ? bx : max_x;
+    max_y = by > max_y ? by : max_y;
+  }
+
+  *x0 = min_x < 0 ? 0 : (int)min_x;
+  *y0 = min_y < 0 ? 0 : (int)min_y;
+  *x1 = max_x > bitmap_width ? bitmap_width : (int)ceil(max_x);
+  *y1 = max_y > bitmap_height ? bitmap_height : (int)ceil(max_y);
+}
+
+/* Draws bitmap stretched over an image of width x height, which is larger
+ * than the bitmap if it was decoded at reduced resolution. Only the tiles in
+ * view are drawn, uploading them the first time they're seen. */
 static void draw_bitmap(struct imv_canvas *canvas,
                         struct imv_bitmap *bitmap,
+                        int width, int height,
                         int bx, int by, double scale,
-                        double rotation, bool mirrored,
+                        double rotation, bool mirrored, bool checkers,
                         enum upscaling_method upscaling_method,
-                        bool cache_invalidated)
+                        enum imv_transfer transfer)
 {
   GLint viewport[4];
   glGetIntegerv(GL_VIEWPORT, viewport);
 
-  glPushMatrix();
-  glOrtho(0.0, viewport[2], viewport[3], 0.0, 0.0, 10.0);
-
-  if (!canvas->cache.texture) {
-    glGenTextures(1, &canvas->cache.texture);
-  }
-
-  const int format = convert_pixelformat(bitmap->format);
-
-  glBindTexture(GL_TEXTURE_RECTANGLE, canvas->cache.texture);
-
   GLint upscaling = 0;
+  GLint downscaling = 0;
   if (upscaling_method == UPSCALING_LINEAR) {
     upscaling = GL_LINEAR;
+    downscaling = GL_LINEAR;
   } else if (upscaling_method == UPSCALING_NEAREST_NEIGHBOUR) {
     upscaling = GL_NEAREST;
+    downscaling = GL_NEAREST;
+  } else if (upscaling_method == UPSCALING_MIPMAP) {
+    /* Without mipmap generation this is as good as we can do */
+    upscaling = GL_LINEAR;
+    downscaling = canvas->mipmaps ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR;
   } else {
     imv_log(IMV_ERROR, "Unknown upscaling method: %d\n", upscaling_method);
     abort();
   }
 
-  if (canvas->cache.bitmap != bitmap || cache_invalidated) {
-    glTexParameteri(GL_TEXTURE_RECTANGLE, GL_TEXTURE_MIN_FILTER, upscaling);
-    glTexParameteri(GL_TEXTURE_RECTANGLE, GL_TEXTURE_MAG_FILTER, upscaling);
-    glPixelStorei(GL_UNPACK_ROW_LENGTH, bitmap->width);
-    glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
-    glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
-    glTexImage2D(GL_TEXTURE_RECTANGLE, 0, GL_RGBA8, bitmap->width, bitmap->height,
-        0, format, GL_UNSIGNED_INT_8_8_8_8_REV, bitmap->data);
+  struct texture_entry *entry = find_entry(canvas, bitmap, true);
+  entry->used = ++canvas->cache.clock;
+
+  const int left = bx;
+  const int top = by;
+  const int center_x = left + width * scale / 2;
+  const int center_y = top + height * scale / 2;
+
+  /* screen pixels per bitmap pixel */
+  const double scale_x = width * scale / bitmap->width;
+  const double scale_y = height * scale / bitmap->height;
+
+  const struct transform view = transform_multiply(
+      transform_ortho(viewport[2], viewport[3]),
+      transform_rotate(center_x, center_y, rotation, mirrored));
+  const bool swizzle = needs_swizzle(bitmap->format);
+
+  int x0, y0, x1, y1;
+  visible_area(viewport, left, top, scale_x, scale_y, center_x, center_y,
+      rotation, mirrored, bitmap->width, bitmap->height, &x0, &y0, &x1, &y1);
+
+  const int size = canvas->tile_size;
+  const int first_col = x0 / size;
+  const int first_row = y0 / size;
+  const int last_col = x0 < x1 ? (x1 - 1) / size : first_col - 1;
+  const int last_row = y0 < y1 ? (y1 - 1) / size : first_row - 1;
+
+  /* Start uploading any visible tiles we don't have yet, up to our budget
+   * for this frame */
+  upload_tiles(canvas, entry, bitmap, first_col, first_row,
+      last_col, last_row, UPLOAD_BUDGET);
+
+  /* Then draw whichever are ready. Small transfers will usually complete
+   * within a moment, so allow them that, but don't hold up the frame. */
+  begin_draw(canvas);
+  glUniform1i(canvas->gl.checkers, checkers);
+  glUniform1i(canvas->gl.transfer, transfer);
+  glUniform1f(canvas->gl.opacity, canvas->opacity);
+  if (canvas->lut.size) {
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, canvas->lut.texture);
+    glActiveTexture(GL_TEXTURE0);
+    glUniform1i(canvas->gl.color_lut, true);
+    glUniform1f(canvas->gl.lut_size, canvas->lut.size);
   }
-  canvas->cache.bitmap = bitmap;
+  canvas->uploads_pending = false;
+  GLuint64 wait = UPLOAD_WAIT_NS;
+  for (int row = first_row; row <= last_row; ++row) {
+    for (int col = first_col; col <= last_col; ++col) {
+      struct tile *tile = &entry->tiles[row * entry->cols + col];
 
-  glEnable(GL_TEXTURE_RECTANGLE);
+      if (!tile->ready) {
+        const double start = cur_time_ns();
+        const bool ready = poll_tile_upload(tile, wait);
+        const double waited = cur_time_ns() - start;
+        wait = waited < wait ? wait - waited : 0;
+        if (!ready) {
+          canvas->uploads_pending = true;
+          continue;
+        }
+      }
 
-  glTexParameteri(GL_TEXTURE_RECTANGLE, GL_TEXTURE_MAG_FILTER, upscaling);
+      glBindTexture(GL_TEXTURE_2D, tile->texture);
 
-  const int left = bx;
-  const int top = by;
-  const int right = left + bitmap->width * scale;
-  const int bottom = top + bitmap->height * scale;
-  const int center_x = left + bitmap->width * scale / 2;
-  const int center_y = top + bitmap->height * scale / 2;
+      /* The mip chain is only built the first time it's needed, so the
+       * other methods don't pay for it */
+      if (downscaling == GL_LINEAR_MIPMAP_LINEAR && !tile->mipmapped) {
+        glGenerateMipmap(GL_TEXTURE_2D);
+        tile->mipmapped = true;
+        /* which takes another third again */
+        entry->size += tile_size(entry, tile) / 3;
+        canvas->cache.size += tile_size(entry, tile) / 3;
+      }
+
+      /* Filtering is texture state, so changing method needs no upload */
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, downscaling);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, upscaling);
+
+      const double tex_width = tile->border_left + tile->width + tile->border_right;
+      const double tex_height = tile->border_top + tile->height + tile->border_bottom;
+      const double s0 = tile->border_left / tex_width;
+      const double t0 = tile->border_top / tex_height;
+      const double s1 = (tile->border_left + tile->width) / tex_width;
+      const double t1 = (tile->border_top + tile->height) / tex_height;
+
+      const double tile_left = left + tile->x * scale_x;
+      const double tile_top = top + tile->y * scale_y;
+      const double tile_right = left + (tile->x + tile->width) * scale_x;
+      const double tile_bottom = top + (tile->y + tile->height) * scale_y;
+
+      glUniform4f(canvas->gl.checker_rect,
+                  (tile_left - left) / CHECKER_SIZE, (tile_top - top) / CHECKER_SIZE,
+                  (tile_right - left) / CHECKER_SIZE, (tile_bottom - top) / CHECKER_SIZE);
+
+      const struct transform transform = transform_multiply(view,
+          transform_rect(tile_left, tile_top,
+                         tile_right - tile_left, tile_bottom - tile_top));
+      draw_quad(canvas, transform, s0, t0, s1, t1, swizzle);
+    }
+  }
+  end_draw(canvas);
+
+  /* Make room for whatever this took, from the images drawn longest ago */
+  evict_entries(canvas, entry);
+}
+
+#ifdef IMV_BACKEND_LIBRSVG
+RsvgHandle *imv_image_get_svg(const struct imv_image *image);
+
+/* Moves a finished raster, if there is one, into the SVG texture */
+static void take_svg_raster(struct imv_canvas *canvas)
+{
+  struct imv_svg_raster *raster = imv_svg_rasteriser_take(canvas->svg.rasteriser);
+  if (!raster) {
+    return;
+  }
+  imv_svg_raster_free(canvas->svg.raster);
+  canvas->svg.raster = raster;
+  if (canvas->software) {
+    /* cairo draws straight from the raster */
+    return;
+  }
+
+  if (!canvas->svg.texture) {
+    glGenTextures(1, &canvas->svg.texture);
+    assert(canvas->svg.texture);
+    glBindTexture(GL_TEXTURE_2D, canvas->svg.texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  }
+  upload_surface(canvas->svg.texture, raster->surface, (struct band){0, 0}, true);
+}
+
+/* Returns whether raster is of handle, near enough scale, and covers the
+ * given area */
+static bool svg_raster_covers(const struct imv_svg_raster *raster,
+                              RsvgHandle *handle, double scale,
+                              int x0, int y0, int x1, int y1)
+{
+  if (raster->handle != handle) {
+    return false;
+  }
+  const double ratio = raster->scale / scale;
+  if (ratio > SVG_RESCALE_THRESHOLD || ratio < 1 / SVG_RESCALE_THRESHOLD) {
+    return false;
+  }
+  if (x0 >= x1 || y0 >= y1) {
+    /* nothing's in view for it to miss */
+    return true;
+  }
+  return raster->x <= x0 && raster->y <= y0
+      && raster->x + raster->width >= x1 && raster->y + raster->height >= y1;
+}
+
+/* Returns the raster to draw an SVG of width x height from, asking for a new
+ * one when the current one no longer does. Rasterising happens off the main
+ * thread, except for the first raster of an image, which is waited for as
+ * there's nothing to show in the meantime. Returns NULL if there's none. */
+static const struct imv_svg_raster *get_svg_raster(struct imv_canvas *canvas,
+    RsvgHandle *svg, int width, int height, int left, int top, double scale,
+    double rotation, bool mirrored, const GLint viewport[4])
+{
+  if (!canvas->svg.rasteriser) {
+    canvas->svg.rasteriser = imv_svg_rasteriser_create(canvas->ready,
+                                                       canvas->ready_data);
+    if (!canvas->svg.rasteriser) {
+      imv_log(IMV_ERROR, "Failed to start the SVG rasteriser\n");
+      return NULL;
+    }
+  }
+
+  take_svg_raster(canvas);
+
+  const int center_x = left + width * scale / 2;
+  const int center_y = top + height * scale / 2;
+
+  int x0, y0, x1, y1;
+  visible_area(viewport, left, top, scale, scale, center_x, center_y,
+      rotation, mirrored, width, height, &x0, &y0, &x1, &y1);
+
+  /* Compare against whatever's on its way if a raster has been asked for,
+   * so that it's not asked for again every frame until it arrives */
+  const bool busy = imv_svg_rasteriser_busy(canvas->svg.rasteriser);
+  const struct imv_svg_raster *target = busy ? &canvas->svg.pending
+                                             : canvas->svg.raster;
+  if (!target || !svg_raster_covers(target, svg, scale, x0, y0, x1, y1)) {
+    /* All of it if that's not too big, so that panning needs nothing more,
+     * otherwise the view and half a viewport around it */
+    const double limit = (double)SVG_MAX_VIEWPORTS * viewport[2] * viewport[3];
+    double rx = 0, ry = 0, rw = width, rh = height;
+    if (rw * scale > canvas->max_texture_size
+        || rh * scale > canvas->max_texture_size
+        || rw * rh * scale * scale > limit) {
+      const double margin_x = viewport[2] / 2 / scale;
+      const double margin_y = viewport[3] / 2 / scale;
+      rx = fmin(fmax(0, x0 - margin_x), width);
+      ry = fmin(fmax(0, y0 - margin_y), height);
+      rw = fmax(0, fmin(fmin(width, x1 + margin_x) - rx,
+                        canvas->max_texture_size / scale));
+      rh = fmax(0, fmin(fmin(height, y1 + margin_y) - ry,
+                        canvas->max_texture_size / scale));
+    }
+    imv_svg_rasteriser_request(canvas->svg.rasteriser, svg, scale,
+                               rx, ry, rw, rh);
+    canvas->svg.pending = (struct imv_svg_raster) {
+      .handle = svg,
+      .scale = scale,
+      .x = rx,
+      .y = ry,
+      .width = rw,
+      .height = rh,
+    };
+  }
+
+  if (!canvas->svg.raster || canvas->svg.raster->handle != svg) {
+    imv_svg_rasteriser_wait(canvas->svg.rasteriser);
+    take_svg_raster(canvas);
+    if (!canvas->svg.raster || canvas->svg.raster->handle != svg) {
+      return NULL;
+    }
+  }
+  return canvas->svg.raster;
+}
+
+/* Draws an SVG of width x height from the raster in its texture */
+static void draw_svg(struct imv_canvas *canvas, RsvgHandle *svg,
+                     int width, int height, int left, int top, double scale,
+                     double rotation, bool mirrored, bool checkers)
+{
+  if (width <= 0 || height <= 0 || scale <= 0) {
+    return;
+  }
 
-  glTranslated(center_x, center_y, 0);
+  GLint viewport[4];
+  glGetIntegerv(GL_VIEWPORT, viewport);
+
+  const struct imv_svg_raster *raster = get_svg_raster(canvas, svg,
+      width, height, left, top, scale, rotation, mirrored, viewport);
+  if (!raster) {
+    return;
+  }
+
+  if (checkers) {
+    draw_checkers(canvas, left, top, width * scale, height * scale,
+                  rotation, mirrored);
+  }
+
+  const int center_x = left + width * scale / 2;
+  const int center_y = top + height * scale / 2;
+  const struct transform transform = transform_multiply(
+      transform_ortho(viewport[2], viewport[3]),
+      transform_multiply(transform_rotate(center_x, center_y, rotation, mirrored),
+                         transform_rect(left + raster->x * scale,
+                                        top + raster->y * scale,
+                                        raster->width * scale,
+                                        raster->height * scale)));
+
+  /* A raster at the scale it's shown at maps pixel for pixel, while one
+   * being stretched until its replacement arrives is best smoothed */
+  const GLint filter = raster->scale == scale ? GL_NEAREST : GL_LINEAR;
+
+  /* cairo's ARGB32 is native-endian ARGB, so needs swizzling like ours */
+  begin_draw(canvas);
+  glUniform1f(canvas->gl.opacity, canvas->opacity);
+  glBindTexture(GL_TEXTURE_2D, canvas->svg.texture);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+  draw_quad(canvas, transform, 0, 0, 1, 1, true);
+  end_draw(canvas);
+}
+#endif
+
+/* Moves cairo into the frame of an image of width x height drawn at (left,
+ * top) and scale, rotated and mirrored about its centre like draw_bitmap,
+ * so that the image's top left is at the origin and a unit is a pixel of
+ * the window */
+static void soft_transform(cairo_t *cairo, int left, int top,
+                           int width, int height, double scale,
+                           double rotation, bool mirrored)
+{
+  const int center_x = left + width * scale / 2;
+  const int center_y = top + height * scale / 2;
+  cairo_translate(cairo, center_x, center_y);
   if (mirrored) {
-    glScaled(-1, 1, 1);
+    cairo_scale(cairo, -1, 1);
   }
-  glRotated(rotation, 0, 0, 1);
-  glTranslated(-center_x, -center_y, 0);
+  cairo_rotate(cairo, rotation * M_PI / 180.0);
+  cairo_translate(cairo, left - center_x, top - center_y);
+}
 
-  glEnable(GL_BLEND);
-  glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+/* Fills a width x height rectangle at the origin with the chequerboard */
+static void soft_checkers(struct imv_canvas *canvas, double width, double height)
+{
+  if (!canvas->soft.checkers) {
+    cairo_surface_t *squares = cairo_image_surface_create(CAIRO_FORMAT_RGB24, 2, 2);
+    cairo_t *cairo = cairo_create(squares);
+    cairo_set_source_rgb(cairo, 0.8, 0.8, 0.8);
+    cairo_paint(cairo);
+    cairo_set_source_rgb(cairo, 0.5, 0.5, 0.5);
+    cairo_rectangle(cairo, 1, 0, 1, 1);
+    cairo_rectangle(cairo, 0, 1, 1, 1);
+    cairo_fill(cairo);
+    cairo_destroy(cairo);
 
-  glBegin(GL_TRIANGLE_FAN);
-  glTexCoord2i(0,             0);              glVertex2i(left, top);
-  glTexCoord2i(bitmap->width, 0);              glVertex2i(right, top);
-  glTexCoord2i(bitmap->width, bitmap->height); glVertex2i(right, bottom);
-  glTexCoord2i(0,             bitmap->height); glVertex2i(left, bottom);
-  glEnd();
+    canvas->soft.checkers = cairo_pattern_create_for_surface(squares);
+    cairo_surface_destroy(squares);
+    cairo_pattern_set_extend(canvas->soft.checkers, CAIRO_EXTEND_REPEAT);
+    cairo_pattern_set_filter(canvas->soft.checkers, CAIRO_FILTER_NEAREST);
+    cairo_matrix_t matrix;
+    cairo_matrix_init_scale(&matrix, 2 / CHECKER_SIZE, 2 / CHECKER_SIZE);
+    cairo_pattern_set_matrix(canvas->soft.checkers, &matrix);
+  }
 
-  glDisable(GL_BLEND);
+  cairo_set_source(canvas->soft.cairo, canvas->soft.checkers);
+  cairo_rectangle(canvas->soft.cairo, 0, 0, width, height);
+  cairo_fill(canvas->soft.cairo);
+}
 
-  glBindTexture(GL_TEXTURE_RECTANGLE, 0);
-  glDisable(GL_TEXTURE_RECTANGLE);
-  glPopMatrix();
+static cairo_filter_t soft_filter(enum upscaling_method upscaling_method)
+{
+  if (upscaling_method == UPSCALING_NEAREST_NEIGHBOUR) {
+    return CAIRO_FILTER_NEAREST;
+  } else if (upscaling_method == UPSCALING_MIPMAP) {
+    /* box filtered when shrinking, much as a mip chain would be */
+    return CAIRO_FILTER_GOOD;
+  }
+  return CAIRO_FILTER_BILINEAR;
+}
+
+/* Returns a surface for cairo to draw bitmap from, making one if it's not
+ * the bitmap drawn last. Opaque native-endian ARGB is drawn from in place,
+ * anything else is copied into the premultiplied ARGB cairo wants, like the
+ * textures assuming a little-endian host. */
+static cairo_surface_t *soft_image(struct imv_canvas *canvas,
+                                   struct imv_bitmap *bitmap)
+{
+  if (canvas->soft.bitmap_id == bitmap->id
+      && (canvas->soft.pixels || canvas->soft.data == bitmap->data)) {
+    return canvas->soft.image;
+  }
+  free_soft_image(canvas);
+  canvas->soft.bitmap_id = bitmap->id;
+
+  /* Deeper pixels are treated as though they had alpha, rather than checking
+   * their alpha before narrowing them */
+  bool opaque = imv_bitmap_pixel_size(bitmap->format) == 4;
+  for (int y = 0; y < bitmap->height && opaque; ++y) {
+    const unsigned char *row = bitmap->data + (size_t)y * bitmap->stride;
+    for (int x = 0; x < bitmap->width; ++x) {
+      if (row[x * 4 + 3] != 0xff) {
+        opaque = false;
+        break;
+      }
+    }
+  }
+
+  unsigned char *pixels = bitmap->data;
+  int stride = bitmap->stride;
+  if (bitmap->format != IMV_ARGB || !opaque) {
+    stride = bitmap->width * 4;
+    const size_t size = (size_t)stride * bitmap->height;
+    pixels = malloc(size);
+    if (!pixels) {
+      return NULL;
+    }
+    imv_memory_acquire(size);
+    canvas->soft.pixels = pixels;
+    canvas->soft.pixels_size = size;
+
+    for (int y = 0; y < bitmap->height; ++y) {
+      const unsigned char *src = bitmap->data + (size_t)y * bitmap->stride;
+      unsigned char *dst = pixels + (size_t)y * stride;
+      if (bitmap->format == IMV_ABGR) {
+        imv_pixel_swap_red_blue(dst, src, bitmap->width);
+      } else if (bitmap->format == IMV_ARGB) {
+        memcpy(dst, src, (size_t)bitmap->width * 4);
+      } else {
+        imv_bitmap_narrow_pixels(bitmap->format, dst, src, bitmap->width);
+        imv_pixel_swap_red_blue(dst, dst, bitmap->width);
+      }
+      if (!opaque) {
+        imv_pixel_premultiply(dst, dst, bitmap->width);
+      }
+    }
+  }
+
+  canvas->soft.data = pixels;
+  cairo_surface_t *image = cairo_image_surface_create_for_data(pixels,
+      opaque ? CAIRO_FORMAT_RGB24 : CAIRO_FORMAT_ARGB32,
+      bitmap->width, bitmap->height, stride);
+  if (cairo_surface_status(image) != CAIRO_STATUS_SUCCESS) {
+    imv_log(IMV_WARNING, "Image too large to draw in software: %dx%d\n",
+            bitmap->width, bitmap->height);
+    cairo_surface_destroy(image);
+    image = NULL;
+  }
+  canvas->soft.image = image;
+  return image;
+}
+
+/* Draws bitmap stretched over an image of width x height, like draw_bitmap.
+ * cairo only samples the area that ends up in view. */
+static void soft_draw_bitmap(struct imv_canvas *canvas,
+                             struct imv_bitmap *bitmap,
+                             int width, int height,
+                             int left, int top, double scale,
+                             double rotation, bool mirrored, bool checkers,
+                             enum upscaling_method upscaling_method)
+{
+  cairo_t *cairo = canvas->soft.cairo;
+  if (!cairo) {
+    return;
+  }
+  cairo_surface_t *image = soft_image(canvas, bitmap);
+
+  cairo_save(cairo);
+  soft_transform(cairo, left, top, width, height, scale, rotation, mirrored);
+  /* Nothing shows through an opaque image */
+  if (checkers && (!image
+        || cairo_image_surface_get_format(image) != CAIRO_FORMAT_RGB24)) {
+    soft_checkers(canvas, width * scale, height * scale);
+  }
+  if (image) {
+    cairo_scale(cairo, width * scale / bitmap->width,
+                height * scale / bitmap->height);
+    cairo_set_source_surface(cairo, image, 0, 0);
+    cairo_pattern_t *pattern = cairo_get_source(cairo);
+    cairo_pattern_set_extend(pattern, CAIRO_EXTEND_PAD);
+    cairo_pattern_set_filter(pattern, soft_filter(upscaling_method));
+    cairo_rectangle(cairo, 0, 0, bitmap->width, bitmap->height);
+    cairo_fill(cairo);
+  }
+  cairo_restore(cairo);
 }
 
 #ifdef IMV_BACKEND_LIBRSVG
-RsvgHandle *imv_image_get_svg(const struct imv_image *image);
+static void soft_draw_svg(struct imv_canvas *canvas, RsvgHandle *svg,
+                          int width, int height, int left, int top, double scale,
+                          double rotation, bool mirrored, bool checkers)
+{
+  cairo_t *cairo = canvas->soft.cairo;
+  if (!cairo || width <= 0 || height <= 0 || scale <= 0) {
+    return;
+  }
+
+  GLint viewport[4];
+  get_viewport(canvas, viewport);
+  const struct imv_svg_raster *raster = get_svg_raster(canvas, svg,
+      width, height, left, top, scale, rotation, mirrored, viewport);
+  if (!raster) {
+    return;
+  }
+
+  cairo_save(cairo);
+  soft_transform(cairo, left, top, width, height, scale, rotation, mirrored);
+  if (checkers) {
+    soft_checkers(canvas, width * scale, height * scale);
+  }
+  cairo_translate(cairo, raster->x * scale, raster->y * scale);
+  cairo_scale(cairo, scale / raster->scale, scale / raster->scale);
+  cairo_set_source_surface(cairo, raster->surface, 0, 0);
+  cairo_pattern_set_filter(cairo_get_source(cairo),
+      raster->scale == scale ? CAIRO_FILTER_NEAREST : CAIRO_FILTER_BILINEAR);
+  cairo_paint(cairo);
+  cairo_restore(cairo);
+}
 #endif
 
+void imv_canvas_set_ready_callback(struct imv_canvas *canvas,
+                                   void (*ready)(void *data), void *data)
+{
+  canvas->ready = ready;
+  canvas->ready_data = data;
+}
+
+bool imv_canvas_uploads_pending(struct imv_canvas *canvas)
+{
+  return canvas->uploads_pending;
+}
+
+void imv_canvas_set_opacity(struct imv_canvas *canvas, double opacity)
+{
+  canvas->opacity = opacity < 0.0 ? 0.0 : opacity > 1.0 ? 1.0 : opacity;
+}
+
+void imv_canvas_set_color_lut(struct imv_canvas *canvas,
+                              const unsigned char *lut, int size)
+{
+  if (canvas->software || !lut || size < 2) {
+    canvas->lut.size = 0;
+    return;
+  }
+
+  if (!canvas->lut.texture) {
+    glGenTextures(1, &canvas->lut.texture);
+    glBindTexture(GL_TEXTURE_2D, canvas->lut.texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  }
+
+  glBindTexture(GL_TEXTURE_2D, canvas->lut.texture);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, size * size);
+  glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
+  glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, size * size, size, 0, GL_RGBA,
+               GL_UNSIGNED_BYTE, lut);
+  glBindTexture(GL_TEXTURE_2D, 0);
+  canvas->lut.size = size;
+}
+
+void imv_canvas_set_texture_budget(struct imv_canvas *canvas, size_t bytes)
+{
+  canvas->cache.budget = bytes;
+  if (!canvas->software) {
+    evict_entries(canvas, NULL);
+  }
+}
+
+bool imv_canvas_preload_image(struct imv_canvas *canvas, struct imv_image *image)
+{
+  struct imv_bitmap *bitmap = imv_image_get_bitmap(image);
+  if (canvas->software || !bitmap) {
+    return false;
+  }
+
+  /* Only ever take room that's going spare, since letting go of what's been
+   * drawn to make room for what might be just swaps one upload for another */
+  struct texture_entry *entry = find_entry(canvas, bitmap, false);
+  if (!entry) {
+    const size_t size = (size_t)bitmap->width * bitmap->height
+      * texel_format(canvas, bitmap->format).size;
+    if (canvas->cache.size + size > canvas->cache.budget) {
+      return false;
+    }
+    entry = make_entry(canvas, bitmap);
+  }
+
+  const size_t left = upload_tiles(canvas, entry, bitmap, 0, 0,
+      entry->cols - 1, entry->rows - 1, UPLOAD_BUDGET);
+  if (left > 0) {
+    return false;
+  }
+  /* The budget may have run out on the very last tile */
+  for (int i = 0; i < entry->cols * entry->rows; ++i) {
+    if (!entry->tiles[i].texture) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Copies a thumbnail into a surface of its own, returning its handle */
+static unsigned int soft_upload_thumbnail(struct imv_canvas *canvas,
+                                          struct imv_bitmap *bitmap)
+{
+  cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+      bitmap->width, bitmap->height);
+  if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+    cairo_surface_destroy(surface);
+    return 0;
+  }
+  unsigned char *data = cairo_image_surface_get_data(surface);
+  const int stride = cairo_image_surface_get_stride(surface);
+  for (int y = 0; y < bitmap->height; ++y) {
+    unsigned char *dst = data + (size_t)y * stride;
+    imv_pixel_swap_red_blue(dst, bitmap->data + (size_t)y * bitmap->stride,
+                            bitmap->width);
+    imv_pixel_premultiply(dst, dst, bitmap->width);
+  }
+  cairo_surface_mark_dirty(surface);
+
+  size_t slot = 0;
+  while (slot < canvas->soft.thumbnail_count && canvas->soft.thumbnails[slot]) {
+    ++slot;
+  }
+  if (slot == canvas->soft.thumbnail_count) {
+    const size_t count = canvas->soft.thumbnail_count
+      ? canvas->soft.thumbnail_count * 2 : 64;
+    cairo_surface_t **thumbnails = realloc(canvas->soft.thumbnails,
+                                           count * sizeof *thumbnails);
+    if (!thumbnails) {
+      cairo_surface_destroy(surface);
+      return 0;
+    }
+    for (size_t i = canvas->soft.thumbnail_count; i < count; ++i) {
+      thumbnails[i] = NULL;
+    }
+    canvas->soft.thumbnails = thumbnails;
+    canvas->soft.thumbnail_count = count;
+  }
+  canvas->soft.thumbnails[slot] = surface;
+  return slot + 1;
+}
+
+unsigned int imv_canvas_upload_thumbnail(struct imv_canvas *canvas,
+                                         struct imv_bitmap *bitmap)
+{
+  if (canvas->software) {
+    return soft_upload_thumbnail(canvas, bitmap);
+  }
+
+  GLuint texture = 0;
+  glGenTextures(1, &texture);
+  if (!texture) {
+    return 0;
+  }
+
+  glBindTexture(GL_TEXTURE_2D, texture);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, bitmap->stride / 4);
+  glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
+  glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, bitmap->width, bitmap->height,
+      0, GL_RGBA, PIXEL_TYPE, bitmap->data);
+  glBindTexture(GL_TEXTURE_2D, 0);
+  return texture;
+}
+
+void imv_canvas_free_thumbnail(struct imv_canvas *canvas, unsigned int thumbnail)
+{
+  if (canvas->software) {
+    if (thumbnail && thumbnail <= canvas->soft.thumbnail_count) {
+      cairo_surface_destroy(canvas->soft.thumbnails[thumbnail - 1]);
+      canvas->soft.thumbnails[thumbnail - 1] = NULL;
+    }
+    return;
+  }
+  GLuint texture = thumbnail;
+  glDeleteTextures(1, &texture);
+}
+
+void imv_canvas_draw_thumbnail(struct imv_canvas *canvas, unsigned int thumbnail,
+                               int x, int y, int width, int height)
+{
+  if (canvas->software) {
+    cairo_t *cairo = canvas->soft.cairo;
+    if (!cairo || !thumbnail || thumbnail > canvas->soft.thumbnail_count
+        || !canvas->soft.thumbnails[thumbnail - 1] || width <= 0 || height <= 0) {
+      return;
+    }
+    cairo_surface_t *surface = canvas->soft.thumbnails[thumbnail - 1];
+    cairo_save(cairo);
+    cairo_translate(cairo, x, y);
+    cairo_scale(cairo, (double)width / cairo_image_surface_get_width(surface),
+                (double)height / cairo_image_surface_get_height(surface));
+    cairo_set_source_surface(cairo, surface, 0, 0);
+    cairo_pattern_set_extend(cairo_get_source(cairo), CAIRO_EXTEND_PAD);
+    cairo_pattern_set_filter(cairo_get_source(cairo), CAIRO_FILTER_BILINEAR);
+    cairo_rectangle(cairo, 0, 0, cairo_image_surface_get_width(surface),
+                    cairo_image_surface_get_height(surface));
+    cairo_fill(cairo);
+    cairo_restore(cairo);
+    return;
+  }
+
+  GLint viewport[4];
+  glGetIntegerv(GL_VIEWPORT, viewport);
+
+  const struct transform transform = transform_multiply(
+      transform_ortho(viewport[2], viewport[3]),
+      transform_rect(x, y, width, height));
+
+  begin_draw(canvas);
+  glBindTexture(GL_TEXTURE_2D, thumbnail);
+  draw_quad(canvas, transform, 0, 0, 1, 1, false);
+  end_draw(canvas);
+}
+
+void imv_canvas_draw_rectangle(struct imv_canvas *canvas, int x, int y,
+                               int width, int height,
+                               float r, float g, float b, float a)
+{
+  if (canvas->software) {
+    cairo_t *cairo = canvas->soft.cairo;
+    if (cairo) {
+      cairo_save(cairo);
+      cairo_set_operator(cairo, CAIRO_OPERATOR_SOURCE);
+      cairo_set_source_rgba(cairo, r, g, b, a);
+      cairo_rectangle(cairo, x, y, width, height);
+      cairo_fill(cairo);
+      cairo_restore(cairo);
+    }
+    return;
+  }
+
+  GLint viewport[4];
+  glGetIntegerv(GL_VIEWPORT, viewport);
+
+  /* A scissored clear is all a solid rectangle needs. The scissor box is
+   * measured from the bottom of the framebuffer. */
+  glEnable(GL_SCISSOR_TEST);
+  glScissor(x, viewport[3] - y - height, width, height);
+  glClearColor(r, g, b, a);
+  glClear(GL_COLOR_BUFFER_BIT);
+  glDisable(GL_SCISSOR_TEST);
+}
+
 void imv_canvas_draw_image(struct imv_canvas *canvas, struct imv_image *image,
                            int x, int y, double scale,
-                           double rotation, bool mirrored,
-                           enum upscaling_method upscaling_method,
-                           bool cache_invalidated)
+                           double rotation, bool mirrored, bool checkers,
+                           enum upscaling_method upscaling_method)
 {
   struct imv_bitmap *bitmap = imv_image_get_bitmap(image);
   if (bitmap) {
-    draw_bitmap(canvas, bitmap, x, y, scale, rotation, mirrored,
-                upscaling_method, cache_invalidated);
+    if (canvas->software) {
+      soft_draw_bitmap(canvas, bitmap, imv_image_width(image),
+                       imv_image_height(image), x, y, scale, rotation,
+                       mirrored, checkers, upscaling_method);
+    } else {
+      draw_bitmap(canvas, bitmap, imv_image_width(image), imv_image_height(image),
+                  x, y, scale, rotation, mirrored, checkers, upscaling_method,
+                  imv_image_transfer(image));
+    }
     return;
   }
 
 #ifdef IMV_BACKEND_LIBRSVG
   RsvgHandle *svg = imv_image_get_svg(image);
   if (svg) {
-    imv_canvas_clear(canvas);
-    cairo_translate(canvas->cairo, x, y);
-    cairo_scale(canvas->cairo, scale, scale);
-    cairo_translate(canvas->cairo, imv_image_width(image) / 2, imv_image_height(image) / 2);
-    if (mirrored) {
-      cairo_scale(canvas->cairo, -1, 1);
+    if (canvas->software) {
+      soft_draw_svg(canvas, svg, imv_image_width(image), imv_image_height(image),
+                    x, y, scale, rotation, mirrored, checkers);
+    } else {
+      draw_svg(canvas, svg, imv_image_width(image), imv_image_height(image),
+               x, y, scale, rotation, mirrored, checkers);
     }
-    cairo_rotate(canvas->cairo, rotation * M_PI / 180.0);
-    cairo_translate(canvas->cairo, -imv_image_width(image) / 2, -imv_image_height(image) / 2);
-    rsvg_handle_render_cairo(svg, canvas->cairo);
-    cairo_identity_matrix(canvas->cairo);
-    imv_canvas_draw(canvas);
-    return;
   }
 #endif
 }
@@ -2,20 +2,25 @@
 #define IMV_CANVAS_H
 
 #include <stdbool.h>
+#include <stddef.h>
 
 #include <pango/pangocairo.h>
 
+struct imv_bitmap;
 struct imv_canvas;
 struct imv_image;
 
 enum upscaling_method {
   UPSCALING_LINEAR,
   UPSCALING_NEAREST_NEIGHBOUR,
+  /* linear, with trilinear filtering over a mip chain when zoomed out */
+  UPSCALING_MIPMAP,
   UPSCALING_METHOD_COUNT,
 };
 
-/* Create a canvas instance */
-struct imv_canvas *imv_canvas_create(int width, int height);
+/* Create a canvas instance, drawing through the current OpenGL context, or
+ * with software set, into memory given by imv_canvas_set_target */
+struct imv_canvas *imv_canvas_create(int width, int height, bool software);
 
 /* Clean up a canvas */
 void imv_canvas_free(struct imv_canvas *canvas);
@@ -35,11 +40,6 @@ void imv_canvas_fill_rectangle(struct imv_canvas *canvas, int x, int y, int widt
 /* Fill the whole canvas with the current color */
 void imv_canvas_fill(struct imv_canvas *canvas);
 
-/* Blit the given image area with a chequerboard pattern to the current OpenGL framebuffer */
-void imv_canvas_fill_checkers(struct imv_canvas *canvas, struct imv_image *image,
-                              int x, int y, double scale,
-                              double rotation, bool mirrored);
-
 /* Select the font to draw text with */
 void imv_canvas_font(struct imv_canvas *canvas, const char *name, int size);
 
@@ -55,14 +55,71 @@ void imv_canvas_show_layout(struct imv_canvas *canvas, int x, int y,
 /* Draw some text on the canvas, returns the width used in pixels */
 int imv_canvas_printf(struct imv_canvas *canvas, int x, int y, const char *fmt, ...);
 
+/* Set the memory a software canvas draws into until the next call, as
+ * native-endian 32-bit pixels with the top byte ignored, or NULL for none */
+void imv_canvas_set_target(struct imv_canvas *canvas, void *pixels,
+                           int width, int height, int stride);
+
 /* Blit the canvas to the current OpenGL framebuffer */
 void imv_canvas_draw(struct imv_canvas *canvas);
 
-/* Blit the given image to the current OpenGL framebuffer */
+/* Blit the given image to the current OpenGL framebuffer, over a
+ * chequerboard pattern if checkers is set */
 void imv_canvas_draw_image(struct imv_canvas *canvas, struct imv_image *image,
                            int x, int y, double scale,
-                           double rotation, bool mirrored,
-                           enum upscaling_method upscaling_method,
-                           bool cache_invalidated);
+                           double rotation, bool mirrored, bool checkers,
+                           enum upscaling_method upscaling_method);
+
+/* Set how opaque images are drawn from now on, from 0.0 to 1.0, so that one
+ * can be faded in over another. Ignored by a software canvas. */
+void imv_canvas_set_opacity(struct imv_canvas *canvas, double opacity);
+
+/* Upload a small IMV_ABGR bitmap, such as a gallery thumbnail, to a texture
+ * of its own. Returns a handle to draw it with, to be released with
+ * imv_canvas_free_thumbnail, or 0 on failure */
+unsigned int imv_canvas_upload_thumbnail(struct imv_canvas *canvas,
+                                         struct imv_bitmap *bitmap);
+
+/* Release a thumbnail's texture */
+void imv_canvas_free_thumbnail(struct imv_canvas *canvas, unsigned int thumbnail);
+
+/* Blit a thumbnail to the current OpenGL framebuffer, stretched over the
+ * given rectangle */
+void imv_canvas_draw_thumbnail(struct imv_canvas *canvas, unsigned int thumbnail,
+                               int x, int y, int width, int height);
+
+/* Fill a rectangle of the current OpenGL framebuffer with a solid color */
+void imv_canvas_draw_rectangle(struct imv_canvas *canvas, int x, int y,
+                               int width, int height,
+                               float r, float g, float b, float a);
+
+/* Set a function to be called, from another thread, whenever something
+ * the canvas was preparing in the background is ready to be drawn */
+void imv_canvas_set_ready_callback(struct imv_canvas *canvas,
+                                   void (*ready)(void *data), void *data);
+
+/* Returns true if the last image drawn had parts in view still being
+ * uploaded, in which case it should be drawn again shortly */
+bool imv_canvas_uploads_pending(struct imv_canvas *canvas);
+
+/* Set a 3D colour lookup table to draw images through, such as to convert
+ * them to the display's colour profile, or NULL to draw them as they are.
+ * It samples each axis at size points, as RGBA8 texels laid out as size
+ * slices of size x size side by side, blue picking the slice, red going
+ * across it and green down it. The table is copied, so only needs setting
+ * again when it changes. Ignored by a software canvas. */
+void imv_canvas_set_color_lut(struct imv_canvas *canvas,
+                              const unsigned char *lut, int size);
+
+/* Set how many bytes of textures to keep of images drawn recently, so that
+ * going back to them needs no upload. The least recently drawn are let go
+ * first. */
+void imv_canvas_set_texture_budget(struct imv_canvas *canvas, size_t bytes);
+
+/* Upload some of an image that's likely to be drawn next, if it fits in the
+ * texture budget without letting go of anything. Returns true if there's
+ * more of it left to upload with another call. Does nothing for a software
+ * canvas. */
+bool imv_canvas_preload_image(struct imv_canvas *canvas, struct imv_image *image);
 
 #endif
@@ -0,0 +1,296 @@
+#include "color.h"
+
+#include "list.h"
+#include "log.h"
+#include "mapped_file.h"
+#include "worker_pool.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef IMV_HAVE_LCMS2
+#include <lcms2.h>
+#endif
+
+/* How many points tables sample each axis at. Small enough to build in a
+ * few milliseconds, and fine enough that interpolating between them can't
+ * be told apart from the exact conversion. */
+#define LUT_SIZE 33
+
+struct imv_color_lut {
+  int size;
+  unsigned char *data;
+};
+
+/* The table for one source profile */
+struct entry {
+  unsigned char *profile;
+  size_t len;
+  /* NULL until it's been built, or if it couldn't be */
+  struct imv_color_lut *lut;
+};
+
+struct imv_color {
+  struct imv_worker_pool *workers;
+  void (*ready)(void *data);
+  void *ready_data;
+
+  /* guards everything below, which is shared with the jobs building tables */
+  pthread_mutex_t lock;
+  /* the display's profile, or NULL for sRGB */
+  unsigned char *display;
+  size_t display_len;
+  struct list *entries;
+  /* bumped whenever the display profile changes, so that a table finished
+   * for the old one is thrown away */
+  unsigned int generation;
+};
+
+struct job {
+  struct imv_color *color;
+  struct entry *entry;
+  unsigned int generation;
+  /* copies of the profiles to convert between, so the job needs no lock
+   * while it works */
+  unsigned char *profile;
+  size_t len;
+  unsigned char *display;
+  size_t display_len;
+};
+
+static void free_lut(struct imv_color_lut *lut)
+{
+  if (lut) {
+    free(lut->data);
+    free(lut);
+  }
+}
+
+static void *copy(const void *data, size_t len)
+{
+  void *dup = data ? malloc(len) : NULL;
+  if (dup) {
+    memcpy(dup, data, len);
+  }
+  return dup;
+}
+
+#ifdef IMV_HAVE_LCMS2
+/* Samples the conversion from profile to display, or to sRGB if display is
+ * NULL, at every point of a table */
+static struct imv_color_lut *build_lut(const void *profile, size_t len,
+    const void *display, size_t display_len)
+{
+  cmsHPROFILE src = cmsOpenProfileFromMem(profile, len);
+  if (!src) {
+    imv_log(IMV_WARNING, "Ignoring unreadable ICC profile\n");
+    return NULL;
+  }
+  cmsHPROFILE dst = display ? cmsOpenProfileFromMem(display, display_len)
+    : cmsCreate_sRGBProfile();
+  if (!dst) {
+    cmsCloseProfile(src);
+    return NULL;
+  }
+
+  /* Every image is decoded to RGB, so a grey image has the same value in
+   * each channel, and a grey profile is given the green one */
+  cmsHTRANSFORM transform = NULL;
+  const cmsColorSpaceSignature space = cmsGetColorSpace(src);
+  if (space == cmsSigRgbData) {
+    transform = cmsCreateTransform(src, TYPE_RGB_16, dst, TYPE_RGB_8,
+        INTENT_PERCEPTUAL, 0);
+  } else if (space == cmsSigGrayData) {
+    transform = cmsCreateTransform(src, TYPE_GRAY_16, dst, TYPE_RGB_8,
+        INTENT_PERCEPTUAL, 0);
+  } else {
+    imv_log(IMV_DEBUG, "Ignoring ICC profile for neither RGB nor grey\n");
+  }
+  cmsCloseProfile(src);
+  cmsCloseProfile(dst);
+  if (!transform) {
+    return NULL;
+  }
+
+  struct imv_color_lut *lut = calloc(1, sizeof *lut);
+  lut->size = LUT_SIZE;
+  lut->data = malloc((size_t)LUT_SIZE * LUT_SIZE * LUT_SIZE * 4);
+
+  /* One row of a slice at a time, red going along it */
+  const int row_width = LUT_SIZE * LUT_SIZE;
+  uint16_t in[LUT_SIZE * 3];
+  unsigned char out[LUT_SIZE * 3];
+  for (int b = 0; b < LUT_SIZE; ++b) {
+    for (int g = 0; g < LUT_SIZE; ++g) {
+      for (int r = 0; r < LUT_SIZE; ++r) {
+        if (space == cmsSigGrayData) {
+          in[r] = g * 65535 / (LUT_SIZE - 1);
+        } else {
+          in[r * 3 + 0] = r * 65535 / (LUT_SIZE - 1);
+          in[r * 3 + 1] = g * 65535 / (LUT_SIZE - 1);
+          in[r * 3 + 2] = b * 65535 / (LUT_SIZE - 1);
+        }
+      }
+      cmsDoTransform(transform, in, out, LUT_SIZE);
+
+      unsigned char *texel = lut->data + ((size_t)g * row_width + b * LUT_SIZE) * 4;
+      for (int r = 0; r < LUT_SIZE; ++r) {
+        texel[r * 4 + 0] = out[r * 3 + 0];
+        texel[r * 4 + 1] = out[r * 3 + 1];
+        texel[r * 4 + 2] = out[r * 3 + 2];
+        texel[r * 4 + 3] = 255;
+      }
+    }
+  }
+
+  cmsDeleteTransform(transform);
+  return lut;
+}
+
+static void build_job(void *data)
+{
+  struct job *job = data;
+  struct imv_color *color = job->color;
+  struct imv_color_lut *lut = build_lut(job->profile, job->len,
+      job->display, job->display_len);
+
+  pthread_mutex_lock(&color->lock);
+  const bool current = job->generation == color->generation;
+  if (current) {
+    job->entry->lut = lut;
+  }
+  pthread_mutex_unlock(&color->lock);
+
+  if (!current) {
+    free_lut(lut);
+  } else if (lut && color->ready) {
+    color->ready(color->ready_data);
+  }
+
+  free(job->profile);
+  free(job->display);
+  free(job);
+}
+#endif
+
+struct imv_color *imv_color_create(struct imv_worker_pool *workers,
+    void (*ready)(void *data), void *data)
+{
+  struct imv_color *color = calloc(1, sizeof *color);
+  color->workers = workers;
+  color->ready = ready;
+  color->ready_data = data;
+  color->entries = list_create();
+  pthread_mutex_init(&color->lock, NULL);
+  return color;
+}
+
+static void clear_entries(struct imv_color *color)
+{
+  for (size_t i = 0; i < color->entries->len; ++i) {
+    struct entry *entry = color->entries->items[i];
+    free_lut(entry->lut);
+    free(entry->profile);
+    free(entry);
+  }
+  list_clear(color->entries);
+}
+
+void imv_color_free(struct imv_color *color)
+{
+  if (!color) {
+    return;
+  }
+  clear_entries(color);
+  list_free(color->entries);
+  free(color->display);
+  pthread_mutex_destroy(&color->lock);
+  free(color);
+}
+
+bool imv_color_set_display_profile(struct imv_color *color, const char *path)
+{
+  unsigned char *display = NULL;
+  size_t display_len = 0;
+  if (path) {
+    struct imv_mapped_file *file = imv_mapped_file_open(path);
+    if (!file) {
+      return false;
+    }
+    display_len = imv_mapped_file_size(file);
+    display = copy(imv_mapped_file_data(file), display_len);
+    imv_mapped_file_close(file);
+    if (!display) {
+      return false;
+    }
+  }
+
+  pthread_mutex_lock(&color->lock);
+  free(color->display);
+  color->display = display;
+  color->display_len = display_len;
+  ++color->generation;
+  clear_entries(color);
+  pthread_mutex_unlock(&color->lock);
+  return true;
+}
+
+const struct imv_color_lut *imv_color_get_lut(struct imv_color *color,
+    const void *profile, size_t len)
+{
+#ifdef IMV_HAVE_LCMS2
+  pthread_mutex_lock(&color->lock);
+  for (size_t i = 0; i < color->entries->len; ++i) {
+    struct entry *entry = color->entries->items[i];
+    if (entry->len == len && !memcmp(entry->profile, profile, len)) {
+      const struct imv_color_lut *lut = entry->lut;
+      pthread_mutex_unlock(&color->lock);
+      return lut;
+    }
+  }
+
+  /* First time we've seen this one, so build it, remembering that it's
+   * being built so that it's only done the once */
+  struct entry *entry = calloc(1, sizeof *entry);
+  entry->profile = copy(profile, len);
+  entry->len = len;
+  list_append(color->entries, entry);
+
+  struct job *job = calloc(1, sizeof *job);
+  job->color = color;
+  job->entry = entry;
+  job->generation = color->generation;
+  job->profile = copy(profile, len);
+  job->len = len;
+  job->display = copy(color->display, color->display_len);
+  job->display_len = color->display_len;
+  pthread_mutex_unlock(&color->lock);
+
+  if (!color->workers) {
+    build_job(job);
+    return entry->lut;
+  }
+  imv_worker_pool_submit(color->workers, NULL, IMV_JOB_NORMAL,
+      build_job, NULL, job);
+#else
+  (void)color;
+  (void)profile;
+  (void)len;
+#endif
+  return NULL;
+}
+
+int imv_color_lut_size(const struct imv_color_lut *lut)
+{
+  return lut->size;
+}
+
+const unsigned char *imv_color_lut_data(const struct imv_color_lut *lut)
+{
+  return lut->data;
+}
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,54 @@
+#ifndef IMV_COLOR_H
+#define IMV_COLOR_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct imv_worker_pool;
+
+/* Converts images from the ICC profiles embedded in them to the display's,
+ * by way of 3D lookup tables that the canvas draws them through. A table is
+ * built on the worker pool the first time a profile is seen, and kept for
+ * every image in that profile after it. Only create, free and
+ * set_display_profile must be called from the one thread.
+ *
+ * Without lcms2 no tables are ever built, and images are drawn as they are.
+ */
+struct imv_color;
+
+/* A table sampling the conversion at size points along each axis, as RGBA8
+ * texels. It's laid out as size slices of size x size texels side by side,
+ * blue picking the slice, red going across it and green going down it. */
+struct imv_color_lut;
+
+/* Creates a converter to sRGB, building tables on workers, or on the calling
+ * thread if workers is NULL. ready is called, from whichever thread built
+ * it, when a table that was asked for becomes available. */
+struct imv_color *imv_color_create(struct imv_worker_pool *workers,
+    void (*ready)(void *data), void *data);
+
+/* Cleans up a converter. Any jobs it submitted must have finished. */
+void imv_color_free(struct imv_color *color);
+
+/* Converts to the profile in the ICC file at path from now on, or to sRGB if
+ * path is NULL. Tables built for the previous profile are let go. Returns
+ * false if the file couldn't be read, leaving the profile as it was. */
+bool imv_color_set_display_profile(struct imv_color *color, const char *path);
+
+/* Gets the table converting from the len byte ICC profile given, or NULL if
+ * it isn't ready, in which case it's built in the background if it can be.
+ * The table remains valid until the display profile is changed or the
+ * converter is freed. */
+const struct imv_color_lut *imv_color_get_lut(struct imv_color *color,
+    const void *profile, size_t len);
+
+/* Get the number of points a table samples each axis at */
+int imv_color_lut_size(const struct imv_color_lut *lut);
+
+/* Get the texels of a table, as laid out above */
+const unsigned char *imv_color_lut_data(const struct imv_color_lut *lut);
+
+#endif
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
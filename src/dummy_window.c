@@ -3,11 +3,13 @@
 #include <stdbool.h>
 #include <unistd.h>
 
-struct imv_window *imv_window_create(int w, int h, const char *title)
+struct imv_window *imv_window_create(int w, int h, const char *title,
+    enum imv_renderer renderer)
 {
   (void)w;
   (void)h;
   (void)title;
+  (void)renderer;
   return NULL;
 }
 
@@ -76,12 +78,49 @@ void imv_window_present(struct imv_window *window)
   (void)window;
 }
 
+bool imv_window_can_present(struct imv_window *window)
+{
+  (void)window;
+  return true;
+}
+
+bool imv_window_is_software(struct imv_window *window)
+{
+  (void)window;
+  return false;
+}
+
+void *imv_window_get_pixels(struct imv_window *window, int *width, int *height,
+    int *stride)
+{
+  (void)window;
+  (void)width;
+  (void)height;
+  (void)stride;
+  return NULL;
+}
+
+bool imv_window_get_refresh(struct imv_window *window, double *presented,
+    double *interval)
+{
+  (void)window;
+  (void)presented;
+  (void)interval;
+  return false;
+}
+
 void imv_window_wait_for_event(struct imv_window *window, double timeout)
 {
   (void)window;
   (void)timeout;
 }
 
+void imv_window_set_poll_fd(struct imv_window *window, int fd)
+{
+  (void)window;
+  (void)fd;
+}
+
 void imv_window_push_event(struct imv_window *window, struct imv_event *e)
 {
   (void)window;
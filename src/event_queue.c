@@ -0,0 +1,172 @@
+#include "event_queue.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef IMV_HAVE_EVENTFD
+#include <sys/eventfd.h>
+#endif
+
+struct imv_event_queue {
+  pthread_mutex_t lock;
+  struct imv_event *events;
+  size_t len;
+  size_t cap;
+
+  /* what the last dispatch took, kept to be reused by the next */
+  struct imv_event *spare;
+  size_t spare_cap;
+
+  /* set once fds have been written to, until the next dispatch */
+  bool woken;
+  /* read end then write end, both the same with an eventfd */
+  int fds[2];
+};
+
+#ifndef IMV_HAVE_EVENTFD
+static void set_flags(int fd)
+{
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+}
+#endif
+
+struct imv_event_queue *imv_event_queue_create(void)
+{
+  int fds[2];
+#ifdef IMV_HAVE_EVENTFD
+  fds[0] = fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (fds[0] == -1) {
+    return NULL;
+  }
+#else
+  if (pipe(fds)) {
+    return NULL;
+  }
+  set_flags(fds[0]);
+  set_flags(fds[1]);
+#endif
+
+  struct imv_event_queue *queue = calloc(1, sizeof *queue);
+  pthread_mutex_init(&queue->lock, NULL);
+  queue->fds[0] = fds[0];
+  queue->fds[1] = fds[1];
+  return queue;
+}
+
+void imv_event_queue_free(struct imv_event_queue *queue)
+{
+  if (!queue) {
+    return;
+  }
+  close(queue->fds[0]);
+  if (queue->fds[1] != queue->fds[0]) {
+    close(queue->fds[1]);
+  }
+  pthread_mutex_destroy(&queue->lock);
+  free(queue->events);
+  free(queue->spare);
+  free(queue);
+}
+
+int imv_event_queue_fd(struct imv_event_queue *queue)
+{
+  return queue->fds[0];
+}
+
+/* Merges event into last, the event before it, if they're both of a kind
+ * where only the sum or the latest counts. Returns false if they aren't. */
+static bool coalesce(struct imv_event *last, const struct imv_event *event)
+{
+  if (last->type != event->type) {
+    return false;
+  }
+
+  switch (event->type) {
+    case IMV_EVENT_MOUSE_MOTION:
+      last->data.mouse_motion.x = event->data.mouse_motion.x;
+      last->data.mouse_motion.y = event->data.mouse_motion.y;
+      last->data.mouse_motion.dx += event->data.mouse_motion.dx;
+      last->data.mouse_motion.dy += event->data.mouse_motion.dy;
+      return true;
+    case IMV_EVENT_TOUCH_ZOOM_CHANGE:
+    case IMV_EVENT_TOUCH_PAN_CHANGE:
+      /* both measured from where the gesture started */
+      *last = *event;
+      return true;
+    default:
+      return false;
+  }
+}
+
+void imv_event_queue_push(struct imv_event_queue *queue,
+    const struct imv_event *event)
+{
+  pthread_mutex_lock(&queue->lock);
+  if (queue->len && coalesce(&queue->events[queue->len - 1], event)) {
+    /* the queue isn't empty, so it's already woken its consumer */
+    pthread_mutex_unlock(&queue->lock);
+    return;
+  }
+  if (queue->len == queue->cap) {
+    queue->cap = queue->cap ? queue->cap * 2 : 64;
+    queue->events = realloc(queue->events, queue->cap * sizeof *queue->events);
+  }
+  queue->events[queue->len++] = *event;
+
+  const bool wake = !queue->woken;
+  queue->woken = true;
+  pthread_mutex_unlock(&queue->lock);
+
+  if (wake) {
+    /* Either eight bytes for an eventfd, or any amount for a pipe */
+    const uint64_t one = 1;
+    (void)write(queue->fds[1], &one, sizeof one);
+  }
+}
+
+void imv_event_queue_dispatch(struct imv_event_queue *queue,
+    imv_event_handler handler, void *data,
+    void (*cleanup)(struct imv_event *event))
+{
+  pthread_mutex_lock(&queue->lock);
+  if (queue->woken) {
+    uint64_t buf[8];
+    while (read(queue->fds[0], buf, sizeof buf) > 0) {
+      /* an eventfd drains in one read, a pipe may not */
+      if (queue->fds[0] == queue->fds[1]) {
+        break;
+      }
+    }
+    queue->woken = false;
+  }
+
+  /* Swap in the spare buffer, so pushes can carry on while we work */
+  struct imv_event *events = queue->events;
+  const size_t len = queue->len;
+  const size_t cap = queue->cap;
+  queue->events = queue->spare;
+  queue->cap = queue->spare_cap;
+  queue->len = 0;
+  pthread_mutex_unlock(&queue->lock);
+
+  for (size_t i = 0; i < len; ++i) {
+    if (handler) {
+      handler(data, &events[i]);
+    }
+    if (cleanup) {
+      cleanup(&events[i]);
+    }
+  }
+
+  queue->spare = events;
+  queue->spare_cap = cap;
+}
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
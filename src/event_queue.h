@@ -0,0 +1,39 @@
+#ifndef IMV_EVENT_QUEUE_H
+#define IMV_EVENT_QUEUE_H
+
+#include "window.h"
+
+/* A queue of imv_events that any thread can push onto, and one thread takes
+ * off. Rather than waking its consumer once per event, it makes a file
+ * descriptor readable when the queue stops being empty, so that a burst of
+ * events costs one write and one read however big it is.
+ */
+struct imv_event_queue;
+
+/* Creates an event queue. Returns NULL if no file descriptor was available
+ * to wake with. */
+struct imv_event_queue *imv_event_queue_create(void);
+
+/* Cleans up an event queue, dropping any events still in it */
+void imv_event_queue_free(struct imv_event_queue *queue);
+
+/* Returns a file descriptor that's readable while events are waiting */
+int imv_event_queue_fd(struct imv_event_queue *queue);
+
+/* Adds a copy of an event to the back of the queue. Pointer motion and touch
+ * gesture changes straight after another of the same are merged into it, so
+ * a burst of them is handled as one. Safe to call from any thread. */
+void imv_event_queue_push(struct imv_event_queue *queue,
+    const struct imv_event *event);
+
+/* Takes every event waiting and calls handler for each, in the order they
+ * were pushed, then cleanup if given. Safe to push from handler, though
+ * those events wait for the next dispatch. Only call from one thread. */
+void imv_event_queue_dispatch(struct imv_event_queue *queue,
+    imv_event_handler handler, void *data,
+    void (*cleanup)(struct imv_event *event));
+
+#endif
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,189 @@
+#include "frame_cache.h"
+
+#include "memory_budget.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+struct frame {
+  struct imv_frame_cache *cache;
+  /* the cache's own copy of the pixels */
+  struct imv_bitmap *bmp;
+  int frametime;
+  /* how many bitmaps taken from the cache are using the pixels */
+  size_t users;
+  /* set once the cache has let go of it, to be freed with its last user */
+  bool dropped;
+};
+
+struct imv_frame_cache {
+  pthread_mutex_t lock;
+  struct frame **frames;
+  int frame_count;
+  /* bytes of pixels kept, and the most there may be */
+  size_t size;
+  size_t budget;
+  /* set once the cache has run out of room, after which it keeps nothing */
+  bool full;
+  /* the owner's reference, plus one per bitmap in use */
+  size_t refcount;
+};
+
+static void free_frame(struct frame *frame)
+{
+  imv_bitmap_free(frame->bmp);
+  free(frame);
+}
+
+/* Lets go of every frame, leaving those still in use to their users */
+static void drop_frames_locked(struct imv_frame_cache *cache)
+{
+  for (int i = 0; i < cache->frame_count; ++i) {
+    struct frame *frame = cache->frames[i];
+    if (!frame) {
+      continue;
+    }
+    if (frame->users) {
+      frame->dropped = true;
+    } else {
+      free_frame(frame);
+    }
+    cache->frames[i] = NULL;
+  }
+  cache->size = 0;
+  cache->full = true;
+}
+
+static void unref_locked(struct imv_frame_cache *cache)
+{
+  if (--cache->refcount > 0) {
+    pthread_mutex_unlock(&cache->lock);
+    return;
+  }
+
+  pthread_mutex_unlock(&cache->lock);
+  pthread_mutex_destroy(&cache->lock);
+  free(cache->frames);
+  free(cache);
+}
+
+static void release_frame(void *data)
+{
+  struct frame *frame = data;
+  struct imv_frame_cache *cache = frame->cache;
+
+  /* Take back the share that was lent to the bitmap, now it's let go of its
+   * own */
+  imv_memory_acquire((size_t)frame->bmp->stride * frame->bmp->height);
+
+  pthread_mutex_lock(&cache->lock);
+  if (--frame->users == 0 && frame->dropped) {
+    free_frame(frame);
+  }
+  unref_locked(cache);
+}
+
+struct imv_frame_cache *imv_frame_cache_create(int frame_count, size_t budget)
+{
+  struct imv_frame_cache *cache = calloc(1, sizeof *cache);
+  pthread_mutex_init(&cache->lock, NULL);
+  cache->frames = calloc(frame_count > 0 ? frame_count : 1, sizeof *cache->frames);
+  cache->frame_count = frame_count;
+  cache->budget = budget;
+  cache->refcount = 1;
+  return cache;
+}
+
+void imv_frame_cache_free(struct imv_frame_cache *cache)
+{
+  if (!cache) {
+    return;
+  }
+
+  pthread_mutex_lock(&cache->lock);
+  drop_frames_locked(cache);
+  unref_locked(cache);
+}
+
+void imv_frame_cache_put(struct imv_frame_cache *cache, int index,
+                         const struct imv_bitmap *bmp, int frametime)
+{
+  if (index < 0 || index >= cache->frame_count) {
+    return;
+  }
+
+  const size_t size = (size_t)bmp->width * bmp->height
+    * imv_bitmap_pixel_size(bmp->format);
+
+  pthread_mutex_lock(&cache->lock);
+  if (cache->full || cache->frames[index]) {
+    pthread_mutex_unlock(&cache->lock);
+    return;
+  }
+  if (cache->size + size > cache->budget || imv_memory_available() < size) {
+    /* Keeping only some of the frames would still mean decoding the rest
+     * every loop, so it's all or nothing */
+    drop_frames_locked(cache);
+    pthread_mutex_unlock(&cache->lock);
+    return;
+  }
+  pthread_mutex_unlock(&cache->lock);
+
+  /* The copy is made without the lock, so as not to hold up bitmaps being
+   * released meanwhile */
+  struct imv_bitmap *copy = imv_bitmap_clone((struct imv_bitmap *)bmp);
+  if (!copy) {
+    return;
+  }
+  copy->id = bmp->id;
+
+  pthread_mutex_lock(&cache->lock);
+  if (cache->full || cache->frames[index]) {
+    pthread_mutex_unlock(&cache->lock);
+    imv_bitmap_free(copy);
+    return;
+  }
+  struct frame *frame = calloc(1, sizeof *frame);
+  frame->cache = cache;
+  frame->bmp = copy;
+  frame->frametime = frametime;
+  cache->frames[index] = frame;
+  cache->size += size;
+  pthread_mutex_unlock(&cache->lock);
+}
+
+struct imv_bitmap *imv_frame_cache_get(struct imv_frame_cache *cache,
+                                       int index, int *frametime)
+{
+  if (index < 0 || index >= cache->frame_count) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&cache->lock);
+  if (!cache->full && imv_memory_available() == 0) {
+    /* Memory's short, so decoding is the better use of it */
+    drop_frames_locked(cache);
+  }
+  struct frame *frame = cache->frames[index];
+  if (!frame) {
+    pthread_mutex_unlock(&cache->lock);
+    return NULL;
+  }
+  frame->users++;
+  cache->refcount++;
+  pthread_mutex_unlock(&cache->lock);
+
+  *frametime = frame->frametime;
+  const struct imv_bitmap *src = frame->bmp;
+  struct imv_bitmap *bmp = imv_bitmap_create_borrowed(src->width, src->height,
+      src->stride, src->format, src->data, release_frame, frame);
+  bmp->id = src->id;
+  /* The bitmap counts the pixels it borrows, but they're counted already as
+   * the cache's copy, so that copy's share goes to the bitmap while it's out */
+  imv_memory_release((size_t)src->stride * src->height);
+  return bmp;
+}
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,35 @@
+#ifndef IMV_FRAME_CACHE_H
+#define IMV_FRAME_CACHE_H
+
+#include "bitmap.h"
+
+/* The decoded frames of one looping animation, kept after the first time
+ * through so that later loops are played back without decoding them again.
+ * Frames are only kept while they fit in the cache's budget and in the
+ * viewer's memory budget. Once either runs out the cache lets go of them all
+ * and keeps no more, and the animation is decoded as before. Safe to use from
+ * multiple threads. */
+struct imv_frame_cache;
+
+/* Create a cache for an animation of frame_count frames, holding up to
+ * budget bytes of them */
+struct imv_frame_cache *imv_frame_cache_create(int frame_count, size_t budget);
+
+/* Release the cache. Bitmaps taken from it remain valid, and the cache is
+ * only cleaned up once they've all been freed. */
+void imv_frame_cache_free(struct imv_frame_cache *cache);
+
+/* Keeps a copy of bmp as the frame at index, if there's room for it */
+void imv_frame_cache_put(struct imv_frame_cache *cache, int index,
+                         const struct imv_bitmap *bmp, int frametime);
+
+/* Returns a bitmap of the frame at index, along with its frametime, or NULL
+ * if it isn't kept. The bitmap shares the id of the one it was put from, as
+ * its pixels are the same, so that textures made of one serve for all. */
+struct imv_bitmap *imv_frame_cache_get(struct imv_frame_cache *cache,
+                                       int index, int *frametime);
+
+#endif
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
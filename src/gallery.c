@@ -0,0 +1,439 @@
+#include "gallery.h"
+
+#include "bitmap.h"
+#include "canvas.h"
+#include "image.h"
+#include "list.h"
+#include "navigator.h"
+#include "thumbnail_cache.h"
+#include "worker_pool.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/* Space either side of each thumbnail in the grid, in window pixels */
+#define CELL_PADDING 8
+
+/* Most thumbnails to keep in memory. Past this, those drawn longest ago are
+ * dropped, to be read back from the disk cache if they're needed again. */
+#define MAX_RESIDENT 1024
+
+/* Most thumbnails to upload per draw, to keep scrolling smooth */
+#define MAX_UPLOADS_PER_DRAW 32
+
+struct imv_bitmap *imv_image_get_bitmap(const struct imv_image *image);
+
+enum entry_state {
+  /* nothing loaded, nor being loaded */
+  ENTRY_EMPTY,
+  /* waiting for a worker to load or make the thumbnail */
+  ENTRY_QUEUED,
+  /* bitmap holds the thumbnail, ready to upload */
+  ENTRY_LOADED,
+  /* texture holds the thumbnail */
+  ENTRY_SHOWN,
+  /* no thumbnail could be made */
+  ENTRY_FAILED,
+};
+
+struct entry {
+  struct imv_gallery *gallery;
+  char *path;
+  /* guarded by the gallery's lock */
+  enum entry_state state;
+  struct imv_bitmap *bitmap;
+  /* the thumbnail's dimensions, once known */
+  int width;
+  int height;
+  /* only touched on the main thread */
+  unsigned int texture;
+  unsigned long last_drawn;
+};
+
+struct imv_gallery {
+  struct imv_canvas *canvas;
+  struct imv_worker_pool *workers;
+  struct imv_thumbnail_cache *disk;
+  imv_gallery_loader loader;
+  imv_gallery_notify notify;
+  void *data;
+
+  pthread_mutex_t lock;
+  pthread_cond_t idle;
+  /* jobs queued or running */
+  size_t pending;
+  /* entries holding a bitmap or texture */
+  size_t resident;
+
+  /* entries keyed by path, in an open addressed hash table */
+  struct entry **slots;
+  size_t capacity;
+  size_t count;
+
+  /* entries that were ENTRY_QUEUED when last looked at */
+  struct list *queued;
+
+  /* counts draws, to tell which entries are in view */
+  unsigned long frame;
+  int columns;
+  size_t first_row;
+};
+
+struct imv_gallery *imv_gallery_create(struct imv_canvas *canvas,
+    struct imv_worker_pool *workers, imv_gallery_loader loader,
+    imv_gallery_notify notify, void *data)
+{
+  struct imv_gallery *gallery = calloc(1, sizeof *gallery);
+  gallery->canvas = canvas;
+  gallery->workers = workers;
+  gallery->disk = imv_thumbnail_cache_create(NULL);
+  gallery->loader = loader;
+  gallery->notify = notify;
+  gallery->data = data;
+  pthread_mutex_init(&gallery->lock, NULL);
+  pthread_cond_init(&gallery->idle, NULL);
+  gallery->capacity = 256;
+  gallery->slots = calloc(gallery->capacity, sizeof *gallery->slots);
+  gallery->queued = list_create();
+  gallery->columns = 1;
+  return gallery;
+}
+
+void imv_gallery_free(struct imv_gallery *gallery)
+{
+  if (!gallery) {
+    return;
+  }
+
+  for (size_t i = 0; i < gallery->queued->len; ++i) {
+    imv_worker_pool_cancel(gallery->workers, gallery->queued->items[i]);
+  }
+  pthread_mutex_lock(&gallery->lock);
+  while (gallery->pending > 0) {
+    pthread_cond_wait(&gallery->idle, &gallery->lock);
+  }
+  pthread_mutex_unlock(&gallery->lock);
+
+  for (size_t i = 0; i < gallery->capacity; ++i) {
+    struct entry *entry = gallery->slots[i];
+    if (!entry) {
+      continue;
+    }
+    if (entry->bitmap) {
+      imv_bitmap_free(entry->bitmap);
+    }
+    if (entry->texture) {
+      imv_canvas_free_thumbnail(gallery->canvas, entry->texture);
+    }
+    free(entry->path);
+    free(entry);
+  }
+  free(gallery->slots);
+  list_free(gallery->queued);
+  imv_thumbnail_cache_free(gallery->disk);
+  pthread_cond_destroy(&gallery->idle);
+  pthread_mutex_destroy(&gallery->lock);
+  free(gallery);
+}
+
+static size_t hash_path(const char *path)
+{
+  uint64_t hash = 0xcbf29ce484222325;
+  for (const char *c = path; *c; ++c) {
+    hash ^= (unsigned char)*c;
+    hash *= 0x100000001b3;
+  }
+  return (size_t)hash;
+}
+
+/* Finds the slot holding path, or the empty one it belongs in */
+static struct entry **find_slot(struct entry **slots, size_t capacity,
+    const char *path)
+{
+  size_t i = hash_path(path) & (capacity - 1);
+  while (slots[i] && strcmp(slots[i]->path, path)) {
+    i = (i + 1) & (capacity - 1);
+  }
+  return &slots[i];
+}
+
+static struct entry *get_entry(struct imv_gallery *gallery, const char *path)
+{
+  struct entry **slot = find_slot(gallery->slots, gallery->capacity, path);
+  if (*slot) {
+    return *slot;
+  }
+
+  /* Keep the table no more than three quarters full */
+  if ((gallery->count + 1) * 4 > gallery->capacity * 3) {
+    const size_t capacity = gallery->capacity * 2;
+    struct entry **slots = calloc(capacity, sizeof *slots);
+    for (size_t i = 0; i < gallery->capacity; ++i) {
+      if (gallery->slots[i]) {
+        *find_slot(slots, capacity, gallery->slots[i]->path) = gallery->slots[i];
+      }
+    }
+    free(gallery->slots);
+    gallery->slots = slots;
+    gallery->capacity = capacity;
+    slot = find_slot(gallery->slots, gallery->capacity, path);
+  }
+
+  struct entry *entry = calloc(1, sizeof *entry);
+  entry->gallery = gallery;
+  entry->path = strdup(path);
+  *slot = entry;
+  gallery->count++;
+  return entry;
+}
+
+static struct imv_bitmap *make_thumbnail(struct imv_gallery *gallery,
+    const char *path)
+{
+  struct stat st;
+  if (stat(path, &st)) {
+    return NULL;
+  }
+
+  struct imv_bitmap *thumb = imv_thumbnail_cache_get(gallery->disk, path, &st);
+  if (thumb) {
+    return thumb;
+  }
+
+  struct imv_image *image = gallery->loader(path, IMV_GALLERY_THUMBNAIL_SIZE,
+      gallery->data);
+  if (!image) {
+    return NULL;
+  }
+
+  /* Vector images have no bitmap to shrink */
+  struct imv_bitmap *bitmap = imv_image_get_bitmap(image);
+  if (bitmap) {
+    thumb = imv_thumbnail_scale(bitmap, IMV_GALLERY_THUMBNAIL_SIZE);
+  }
+  imv_image_free(image);
+
+  if (thumb) {
+    imv_thumbnail_cache_put(gallery->disk, path, &st, thumb);
+  }
+  return thumb;
+}
+
+static void thumbnail_job(void *data)
+{
+  struct entry *entry = data;
+  struct imv_gallery *gallery = entry->gallery;
+
+  struct imv_bitmap *thumb = make_thumbnail(gallery, entry->path);
+
+  pthread_mutex_lock(&gallery->lock);
+  if (thumb) {
+    entry->bitmap = thumb;
+    entry->width = thumb->width;
+    entry->height = thumb->height;
+    entry->state = ENTRY_LOADED;
+    gallery->resident++;
+  } else {
+    entry->state = ENTRY_FAILED;
+  }
+  pthread_mutex_unlock(&gallery->lock);
+
+  if (thumb) {
+    gallery->notify(gallery->data);
+  }
+
+  pthread_mutex_lock(&gallery->lock);
+  gallery->pending--;
+  pthread_cond_signal(&gallery->idle);
+  pthread_mutex_unlock(&gallery->lock);
+}
+
+static void cancel_thumbnail_job(void *data)
+{
+  struct entry *entry = data;
+  struct imv_gallery *gallery = entry->gallery;
+
+  pthread_mutex_lock(&gallery->lock);
+  entry->state = ENTRY_EMPTY;
+  gallery->pending--;
+  pthread_cond_signal(&gallery->idle);
+  pthread_mutex_unlock(&gallery->lock);
+}
+
+static void request_thumbnail(struct imv_gallery *gallery, struct entry *entry)
+{
+  pthread_mutex_lock(&gallery->lock);
+  entry->state = ENTRY_QUEUED;
+  gallery->pending++;
+  pthread_mutex_unlock(&gallery->lock);
+
+  list_append(gallery->queued, entry);
+
+  /* Each entry is its own owner, so thumbnails are made in parallel and can
+   * be cancelled one by one */
+  imv_worker_pool_submit(gallery->workers, entry, IMV_JOB_NORMAL,
+      thumbnail_job, cancel_thumbnail_job, entry);
+}
+
+/* Stops making thumbnails that have been scrolled out of view before they
+ * were started */
+static void cancel_hidden(struct imv_gallery *gallery)
+{
+  size_t i = 0;
+  while (i < gallery->queued->len) {
+    struct entry *entry = gallery->queued->items[i];
+    if (entry->last_drawn != gallery->frame) {
+      imv_worker_pool_cancel(gallery->workers, entry);
+    }
+
+    pthread_mutex_lock(&gallery->lock);
+    const bool queued = entry->state == ENTRY_QUEUED;
+    pthread_mutex_unlock(&gallery->lock);
+
+    if (queued) {
+      ++i;
+    } else {
+      list_remove(gallery->queued, i);
+    }
+  }
+}
+
+static int compare_last_drawn(const void *a, const void *b)
+{
+  const struct entry *x = *(struct entry *const *)a;
+  const struct entry *y = *(struct entry *const *)b;
+  return x->last_drawn < y->last_drawn ? -1 : x->last_drawn > y->last_drawn;
+}
+
+/* Drops the thumbnails drawn longest ago once there are too many */
+static void evict(struct imv_gallery *gallery)
+{
+  pthread_mutex_lock(&gallery->lock);
+  if (gallery->resident <= MAX_RESIDENT) {
+    pthread_mutex_unlock(&gallery->lock);
+    return;
+  }
+
+  struct entry **victims = calloc(gallery->resident, sizeof *victims);
+  size_t count = 0;
+  for (size_t i = 0; i < gallery->capacity; ++i) {
+    struct entry *entry = gallery->slots[i];
+    if (entry && entry->last_drawn != gallery->frame
+        && (entry->state == ENTRY_LOADED || entry->state == ENTRY_SHOWN)) {
+      victims[count++] = entry;
+    }
+  }
+  qsort(victims, count, sizeof *victims, compare_last_drawn);
+
+  /* Go well under the limit, so this isn't needed again straight away */
+  for (size_t i = 0; i < count && gallery->resident > MAX_RESIDENT * 3 / 4; ++i) {
+    struct entry *entry = victims[i];
+    if (entry->bitmap) {
+      imv_bitmap_free(entry->bitmap);
+      entry->bitmap = NULL;
+    }
+    if (entry->texture) {
+      imv_canvas_free_thumbnail(gallery->canvas, entry->texture);
+      entry->texture = 0;
+    }
+    entry->state = ENTRY_EMPTY;
+    gallery->resident--;
+  }
+
+  pthread_mutex_unlock(&gallery->lock);
+  free(victims);
+}
+
+bool imv_gallery_draw(struct imv_gallery *gallery, struct imv_navigator *nav,
+    int width, int height, double scale)
+{
+  gallery->frame++;
+
+  const int thumb_size = IMV_GALLERY_THUMBNAIL_SIZE * scale;
+  const int cell = thumb_size + 2 * (int)(CELL_PADDING * scale);
+
+  int columns = width / cell;
+  columns = columns > 0 ? columns : 1;
+  int rows = height / cell;
+  rows = rows > 0 ? rows : 1;
+  gallery->columns = columns;
+
+  const size_t count = imv_navigator_length(nav);
+  if (count == 0) {
+    cancel_hidden(gallery);
+    return false;
+  }
+
+  /* Scroll just far enough to bring the selection into view */
+  const size_t selection = imv_navigator_index(nav);
+  const size_t selection_row = selection / columns;
+  if (selection_row < gallery->first_row) {
+    gallery->first_row = selection_row;
+  } else if (selection_row >= gallery->first_row + rows) {
+    gallery->first_row = selection_row - rows + 1;
+  }
+
+  const int left = (width - columns * cell) / 2;
+  int uploads = 0;
+  bool more = false;
+
+  /* One row more than fits, to fill any space left at the bottom */
+  for (int row = 0; row <= rows; ++row) {
+    for (int col = 0; col < columns; ++col) {
+      const size_t index = (gallery->first_row + row) * columns + col;
+      if (index >= count) {
+        break;
+      }
+
+      struct entry *entry = get_entry(gallery, imv_navigator_at(nav, index));
+      entry->last_drawn = gallery->frame;
+
+      const int x = left + col * cell;
+      const int y = row * cell;
+      if (index == selection) {
+        imv_canvas_draw_rectangle(gallery->canvas, x, y, cell, cell,
+            0.3, 0.5, 0.8, 1.0);
+      }
+
+      pthread_mutex_lock(&gallery->lock);
+      const enum entry_state state = entry->state;
+      if (state == ENTRY_LOADED && uploads < MAX_UPLOADS_PER_DRAW) {
+        entry->texture = imv_canvas_upload_thumbnail(gallery->canvas, entry->bitmap);
+        imv_bitmap_free(entry->bitmap);
+        entry->bitmap = NULL;
+        entry->state = entry->texture ? ENTRY_SHOWN : ENTRY_FAILED;
+        if (!entry->texture) {
+          gallery->resident--;
+        }
+        uploads++;
+      } else if (state == ENTRY_LOADED) {
+        more = true;
+      }
+      pthread_mutex_unlock(&gallery->lock);
+
+      if (state == ENTRY_EMPTY) {
+        request_thumbnail(gallery, entry);
+      } else if (entry->texture) {
+        const int w = entry->width * scale;
+        const int h = entry->height * scale;
+        imv_canvas_draw_thumbnail(gallery->canvas, entry->texture,
+            x + (cell - w) / 2, y + (cell - h) / 2, w, h);
+      }
+    }
+  }
+
+  cancel_hidden(gallery);
+  evict(gallery);
+  return more;
+}
+
+int imv_gallery_columns(struct imv_gallery *gallery)
+{
+  return gallery->columns;
+}
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
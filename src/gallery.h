@@ -0,0 +1,50 @@
+#ifndef IMV_GALLERY_H
+#define IMV_GALLERY_H
+
+#include <stdbool.h>
+
+/* A grid of thumbnails of the navigator's paths, drawn a screenful at a time.
+ * Thumbnails are made on the worker pool the first time they come into view,
+ * and kept in an on-disk cache for next time, so that only images never seen
+ * before need decoding.
+ */
+struct imv_gallery;
+
+struct imv_canvas;
+struct imv_image;
+struct imv_navigator;
+struct imv_worker_pool;
+
+/* The size of the square thumbnails are fitted within, in pixels */
+#define IMV_GALLERY_THUMBNAIL_SIZE 128
+
+/* Decodes the image at path, at no less than the resolution needed to fill
+ * size x size pixels. Returns NULL if it can't be loaded. Called from worker
+ * threads. */
+typedef struct imv_image *(*imv_gallery_loader)(const char *path, int size, void *data);
+
+/* Called from a worker thread whenever a thumbnail becomes ready to draw */
+typedef void (*imv_gallery_notify)(void *data);
+
+/* Creates a gallery drawing with canvas, making thumbnails on workers */
+struct imv_gallery *imv_gallery_create(struct imv_canvas *canvas,
+    struct imv_worker_pool *workers, imv_gallery_loader loader,
+    imv_gallery_notify notify, void *data);
+
+/* Cleans up a gallery, waiting for any thumbnails being made */
+void imv_gallery_free(struct imv_gallery *gallery);
+
+/* Draws the navigator's paths as a grid filling width x height pixels of the
+ * framebuffer, scrolled to keep the selection in view, with thumbnails drawn
+ * at scale pixels per thumbnail pixel. Returns true if some thumbnails that
+ * are ready weren't drawn yet, in which case it should be drawn again soon. */
+bool imv_gallery_draw(struct imv_gallery *gallery, struct imv_navigator *nav,
+    int width, int height, double scale);
+
+/* Returns how many thumbnails fit across the grid as last drawn */
+int imv_gallery_columns(struct imv_gallery *gallery);
+
+#endif
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
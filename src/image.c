@@ -3,11 +3,18 @@
 #include "bitmap.h"
 
 #include <stdlib.h>
+#include <string.h>
 
 struct imv_image {
+  /* number of holders, the image is freed when this drops to zero */
+  int refcount;
   int width;
   int height;
   struct imv_bitmap *bitmap;
+  /* the ICC profile the pixels are in, if there is one */
+  void *icc_profile;
+  size_t icc_profile_len;
+  enum imv_transfer transfer;
   #ifdef IMV_BACKEND_LIBRSVG
   RsvgHandle *svg;
   #endif
@@ -16,16 +23,27 @@ struct imv_image {
 struct imv_image *imv_image_create_from_bitmap(struct imv_bitmap *bmp)
 {
   struct imv_image *image = calloc(1, sizeof *image);
+  image->refcount = 1;
   image->width = bmp->width;
   image->height = bmp->height;
   image->bitmap = bmp;
   return image;
 }
 
+struct imv_image *imv_image_create_from_scaled_bitmap(struct imv_bitmap *bmp,
+    int width, int height)
+{
+  struct imv_image *image = imv_image_create_from_bitmap(bmp);
+  image->width = width;
+  image->height = height;
+  return image;
+}
+
 #ifdef IMV_BACKEND_LIBRSVG
 struct imv_image *imv_image_create_from_svg(RsvgHandle *handle)
 {
   struct imv_image *image = calloc(1, sizeof *image);
+  image->refcount = 1;
   image->svg = handle;
 
   RsvgDimensionData dim;
@@ -42,6 +60,10 @@ void imv_image_free(struct imv_image *image)
     return;
   }
 
+  if (--image->refcount > 0) {
+    return;
+  }
+
   if (image->bitmap) {
     imv_bitmap_free(image->bitmap);
   }
@@ -52,9 +74,42 @@ void imv_image_free(struct imv_image *image)
   }
 #endif
 
+  free(image->icc_profile);
   free(image);
 }
 
+struct imv_image *imv_image_ref(struct imv_image *image)
+{
+  if (image) {
+    image->refcount++;
+  }
+  return image;
+}
+
+size_t imv_image_size(const struct imv_image *image)
+{
+  if (!image || !image->bitmap) {
+    return 0;
+  }
+  return (size_t)image->bitmap->stride * image->bitmap->height;
+}
+
+enum imv_pixelformat imv_image_format(const struct imv_image *image)
+{
+  if (!image || !image->bitmap) {
+    return IMV_ABGR;
+  }
+  return image->bitmap->format;
+}
+
+double imv_image_resolution(const struct imv_image *image)
+{
+  if (!image || !image->bitmap || !image->width) {
+    return 1.0;
+  }
+  return (double)image->bitmap->width / image->width;
+}
+
 int imv_image_width(const struct imv_image *image)
 {
   return image ? image->width : 0;
@@ -65,6 +120,39 @@ int imv_image_height(const struct imv_image *image)
   return image ? image->height : 0;
 }
 
+void imv_image_set_icc_profile(struct imv_image *image,
+    const void *profile, size_t len)
+{
+  free(image->icc_profile);
+  image->icc_profile = NULL;
+  image->icc_profile_len = 0;
+  if (!profile || !len) {
+    return;
+  }
+
+  image->icc_profile = malloc(len);
+  if (image->icc_profile) {
+    memcpy(image->icc_profile, profile, len);
+    image->icc_profile_len = len;
+  }
+}
+
+const void *imv_image_icc_profile(const struct imv_image *image, size_t *len)
+{
+  *len = image ? image->icc_profile_len : 0;
+  return image ? image->icc_profile : NULL;
+}
+
+void imv_image_set_transfer(struct imv_image *image, enum imv_transfer transfer)
+{
+  image->transfer = transfer;
+}
+
+enum imv_transfer imv_image_transfer(const struct imv_image *image)
+{
+  return image ? image->transfer : IMV_TRANSFER_SRGB;
+}
+
 /* Non-public functions, only used by imv_canvas */
 struct imv_bitmap *imv_image_get_bitmap(const struct imv_image *image)
 {
@@ -3,27 +3,80 @@
 
 #include "bitmap.h"
 
+#include <stddef.h>
+
 #ifdef IMV_BACKEND_LIBRSVG
 #include <librsvg/rsvg.h>
 #endif
 
 struct imv_image;
 
+/* How an image's pixel values map to light. SDR images are all taken to be
+ * sRGB, while HDR ones are in BT.2020 primaries, and are tone mapped down to
+ * what an sRGB display can show. */
+enum imv_transfer {
+  IMV_TRANSFER_SRGB,
+  /* Scene light, with 1.0 as SDR white, as in OpenEXR */
+  IMV_TRANSFER_LINEAR,
+  /* SMPTE ST 2084, or perceptual quantiser */
+  IMV_TRANSFER_PQ,
+  /* ARIB STD-B67, or hybrid log-gamma */
+  IMV_TRANSFER_HLG,
+};
+
 struct imv_image *imv_image_create_from_bitmap(struct imv_bitmap *bmp);
 
+/* Creates an image from a bitmap decoded at reduced resolution, where the
+ * image is width x height at full resolution */
+struct imv_image *imv_image_create_from_scaled_bitmap(struct imv_bitmap *bmp,
+    int width, int height);
+
 #ifdef IMV_BACKEND_LIBRSVG
 struct imv_image *imv_image_create_from_svg(RsvgHandle *handle);
 #endif
 
-/* Cleans up an imv_image instance */
+/* Releases a reference to an imv_image instance, cleaning it up once no
+ * references remain */
 void imv_image_free(struct imv_image *image);
 
+/* Takes an additional reference to an image, to be released with
+ * imv_image_free. References are not thread-safe, and should only be taken
+ * and released from one thread at a time. Returns the image for convenience */
+struct imv_image *imv_image_ref(struct imv_image *image);
+
+/* Get the approximate number of bytes of pixel data held by the image */
+size_t imv_image_size(const struct imv_image *image);
+
+/* Get the pixel format the image was decoded to, IMV_ABGR if it holds no
+ * bitmap */
+enum imv_pixelformat imv_image_format(const struct imv_image *image);
+
+/* Get the resolution the image was decoded at, relative to its full
+ * resolution. 1.0 unless it was decoded at reduced resolution */
+double imv_image_resolution(const struct imv_image *image);
+
 /* Get the image width */
 int imv_image_width(const struct imv_image *image);
 
 /* Get the image height */
 int imv_image_height(const struct imv_image *image);
 
+/* Attach the ICC profile of the colour space the image's pixels are in,
+ * taking a copy of the len bytes at profile */
+void imv_image_set_icc_profile(struct imv_image *image,
+    const void *profile, size_t len);
+
+/* Get the ICC profile the image's pixels are in, setting len to its size,
+ * or NULL if it came without one, in which case it's taken to be sRGB */
+const void *imv_image_icc_profile(const struct imv_image *image, size_t *len);
+
+/* Set how the image's pixel values map to light */
+void imv_image_set_transfer(struct imv_image *image, enum imv_transfer transfer);
+
+/* Get how the image's pixel values map to light, IMV_TRANSFER_SRGB unless
+ * its backend said otherwise */
+enum imv_transfer imv_image_transfer(const struct imv_image *image);
+
 #endif
 
 
@@ -0,0 +1,219 @@
+#include "image_cache.h"
+
+#include "image.h"
+#include "list.h"
+#include "packed_image.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+struct cache_entry {
+  char *path;
+  int page;
+  struct timespec mtime;
+  /* one or the other is held */
+  struct imv_image *image;
+  struct imv_packed_image *packed;
+  size_t size;
+};
+
+struct imv_image_cache {
+  /* entries, ordered from least to most recently used */
+  struct list *entries;
+  /* total size of all entries' images, packed or not, in bytes */
+  size_t size;
+  size_t budget;
+};
+
+static void free_entry(struct cache_entry *entry)
+{
+  imv_image_free(entry->image);
+  imv_packed_image_free(entry->packed);
+  free(entry->path);
+  free(entry);
+}
+
+static void remove_entry(struct imv_image_cache *cache, size_t index)
+{
+  struct cache_entry *entry = cache->entries->items[index];
+  cache->size -= entry->size;
+  list_remove(cache->entries, index);
+  free_entry(entry);
+}
+
+static ssize_t find_entry(struct imv_image_cache *cache, const char *path,
+    int page)
+{
+  for (size_t i = 0; i < cache->entries->len; ++i) {
+    struct cache_entry *entry = cache->entries->items[i];
+    if (entry->page == page && !strcmp(entry->path, path)) {
+      return (ssize_t)i;
+    }
+  }
+  return -1;
+}
+
+static bool same_mtime(const struct timespec *a, const struct timespec *b)
+{
+  return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+/* Evict the least recently used entries until we're in budget, always
+ * sparing the most recent entry */
+static void evict(struct imv_image_cache *cache)
+{
+  while (cache->size > cache->budget && cache->entries->len > 1) {
+    remove_entry(cache, 0);
+  }
+}
+
+struct imv_image_cache *imv_image_cache_create(size_t budget)
+{
+  struct imv_image_cache *cache = calloc(1, sizeof *cache);
+  cache->entries = list_create();
+  cache->budget = budget;
+  return cache;
+}
+
+void imv_image_cache_free(struct imv_image_cache *cache)
+{
+  if (!cache) {
+    return;
+  }
+
+  imv_image_cache_clear(cache);
+  list_free(cache->entries);
+  free(cache);
+}
+
+void imv_image_cache_set_budget(struct imv_image_cache *cache, size_t budget)
+{
+  cache->budget = budget;
+  evict(cache);
+}
+
+size_t imv_image_cache_size(struct imv_image_cache *cache)
+{
+  return cache->size;
+}
+
+struct imv_image *imv_image_cache_get(struct imv_image_cache *cache,
+    const char *path, const struct timespec *mtime)
+{
+  return imv_image_cache_get_page(cache, path, 0, mtime);
+}
+
+/* Finds the up to date entry for path and page, making it the most recently
+ * used, or returns NULL */
+static struct cache_entry *use_entry(struct imv_image_cache *cache,
+    const char *path, int page, const struct timespec *mtime)
+{
+  ssize_t index = find_entry(cache, path, page);
+  if (index == -1) {
+    return NULL;
+  }
+
+  struct cache_entry *entry = cache->entries->items[index];
+  if (!same_mtime(&entry->mtime, mtime)) {
+    /* the file has changed since we decoded it */
+    remove_entry(cache, index);
+    return NULL;
+  }
+
+  /* move it to the back of the queue */
+  list_remove(cache->entries, index);
+  list_append(cache->entries, entry);
+  return entry;
+}
+
+struct imv_image *imv_image_cache_get_page(struct imv_image_cache *cache,
+    const char *path, int page, const struct timespec *mtime)
+{
+  struct cache_entry *entry = use_entry(cache, path, page, mtime);
+  if (!entry) {
+    return NULL;
+  }
+
+  if (entry->packed) {
+    /* It stays packed, the viewer holding the unpacked image for as long
+     * as it's shown */
+    return imv_packed_image_unpack(entry->packed);
+  }
+  return imv_image_ref(entry->image);
+}
+
+struct imv_image *imv_image_cache_get_decoded(struct imv_image_cache *cache,
+    const char *path, const struct timespec *mtime)
+{
+  struct cache_entry *entry = use_entry(cache, path, 0, mtime);
+  return entry && entry->image ? imv_image_ref(entry->image) : NULL;
+}
+
+bool imv_image_cache_contains(struct imv_image_cache *cache,
+    const char *path, const struct timespec *mtime)
+{
+  return imv_image_cache_contains_page(cache, path, 0, mtime);
+}
+
+bool imv_image_cache_contains_page(struct imv_image_cache *cache,
+    const char *path, int page, const struct timespec *mtime)
+{
+  ssize_t index = find_entry(cache, path, page);
+  if (index == -1) {
+    return false;
+  }
+
+  struct cache_entry *entry = cache->entries->items[index];
+  return same_mtime(&entry->mtime, mtime);
+}
+
+void imv_image_cache_put(struct imv_image_cache *cache, const char *path,
+    const struct timespec *mtime, struct imv_image *image)
+{
+  imv_image_cache_put_page(cache, path, 0, mtime, image);
+}
+
+static void add_entry(struct imv_image_cache *cache, const char *path,
+    int page, const struct timespec *mtime, struct imv_image *image,
+    struct imv_packed_image *packed)
+{
+  ssize_t index = find_entry(cache, path, page);
+  if (index != -1) {
+    remove_entry(cache, index);
+  }
+
+  struct cache_entry *entry = calloc(1, sizeof *entry);
+  entry->path = strdup(path);
+  entry->page = page;
+  entry->mtime = *mtime;
+  entry->image = image;
+  entry->packed = packed;
+  entry->size = packed ? imv_packed_image_size(packed) : imv_image_size(image);
+
+  list_append(cache->entries, entry);
+  cache->size += entry->size;
+  evict(cache);
+}
+
+void imv_image_cache_put_page(struct imv_image_cache *cache, const char *path,
+    int page, const struct timespec *mtime, struct imv_image *image)
+{
+  add_entry(cache, path, page, mtime, image, NULL);
+}
+
+void imv_image_cache_put_packed(struct imv_image_cache *cache, const char *path,
+    int page, const struct timespec *mtime, struct imv_packed_image *packed)
+{
+  add_entry(cache, path, page, mtime, NULL, packed);
+}
+
+void imv_image_cache_clear(struct imv_image_cache *cache)
+{
+  while (cache->entries->len > 0) {
+    remove_entry(cache, cache->entries->len - 1);
+  }
+}
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
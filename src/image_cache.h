@@ -0,0 +1,74 @@
+#ifndef IMV_IMAGE_CACHE_H
+#define IMV_IMAGE_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+struct imv_image;
+struct imv_packed_image;
+
+/* A least-recently-used cache of decoded images, keyed by their path, page
+ * and the modification time of the file when they were decoded. The cache holds
+ * a reference to each image it contains, and drops the least recently used
+ * entries once the total size of its images exceeds its budget. Images may
+ * also be kept packed, to fit more of them in the same budget.
+ */
+struct imv_image_cache;
+
+/* Creates an image cache holding up to budget bytes of pixel data */
+struct imv_image_cache *imv_image_cache_create(size_t budget);
+
+/* Cleans up an image cache, releasing its references to all images */
+void imv_image_cache_free(struct imv_image_cache *cache);
+
+/* Changes the budget of the cache, evicting entries as required */
+void imv_image_cache_set_budget(struct imv_image_cache *cache, size_t budget);
+
+/* Returns the total size of the images in the cache, in bytes */
+size_t imv_image_cache_size(struct imv_image_cache *cache);
+
+/* Looks up the image for path decoded from a file with the given mtime. On a
+ * hit, returns a new reference to the image that the caller must release with
+ * imv_image_free. Returns NULL on a miss. Entries for path with a different
+ * mtime are stale and are dropped. */
+struct imv_image *imv_image_cache_get(struct imv_image_cache *cache,
+    const char *path, const struct timespec *mtime);
+
+/* Returns true if the cache holds an up to date image for path, without
+ * counting as a use of it */
+bool imv_image_cache_contains(struct imv_image_cache *cache,
+    const char *path, const struct timespec *mtime);
+
+/* Adds an image to the cache, taking ownership of the reference given.
+ * Replaces any existing entry for path. */
+void imv_image_cache_put(struct imv_image_cache *cache, const char *path,
+    const struct timespec *mtime, struct imv_image *image);
+
+/* As the above, for the page'th page of a file of several. The functions
+ * without a page are for page 0. */
+struct imv_image *imv_image_cache_get_page(struct imv_image_cache *cache,
+    const char *path, int page, const struct timespec *mtime);
+bool imv_image_cache_contains_page(struct imv_image_cache *cache,
+    const char *path, int page, const struct timespec *mtime);
+void imv_image_cache_put_page(struct imv_image_cache *cache, const char *path,
+    int page, const struct timespec *mtime, struct imv_image *image);
+
+/* Adds a packed image to the cache, taking ownership of it. Getting it
+ * unpacks a new image each time, while it stays packed in the cache, so it
+ * should be got once when it's about to be shown. */
+void imv_image_cache_put_packed(struct imv_image_cache *cache, const char *path,
+    int page, const struct timespec *mtime, struct imv_packed_image *packed);
+
+/* As imv_image_cache_get, but returning NULL for images kept packed rather
+ * than unpacking them, for looking ahead at images without the cost */
+struct imv_image *imv_image_cache_get_decoded(struct imv_image_cache *cache,
+    const char *path, const struct timespec *mtime);
+
+/* Removes every entry from the cache */
+void imv_image_cache_clear(struct imv_image_cache *cache);
+
+#endif
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
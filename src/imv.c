@@ -6,10 +6,14 @@
 #include <errno.h>
 #include <getopt.h>
 #include <limits.h>
+#include <math.h>
 #include <pthread.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 #include <wordexp.h>
@@ -17,17 +21,30 @@
 #include "backend.h"
 #include "binds.h"
 #include "canvas.h"
+#include "color.h"
 #include "commands.h"
 #include "console.h"
+#include "gallery.h"
 #include "image.h"
+#include "image_cache.h"
 #include "ini.h"
 #include "ipc.h"
 #include "list.h"
 #include "log.h"
+#include "mapped_file.h"
+#include "memory_budget.h"
+#include "metadata_index.h"
 #include "navigator.h"
+#include "packed_image.h"
+#include "render.h"
 #include "source.h"
+#include "stream.h"
+#include "template.h"
+#include "trace.h"
 #include "viewport.h"
+#include "watcher.h"
 #include "window.h"
+#include "worker_pool.h"
 
 /* Some systems like GNU/Hurd don't define PATH_MAX */
 #ifndef PATH_MAX
@@ -51,13 +68,58 @@ enum internal_event_type {
   NEW_IMAGE,
   BAD_IMAGE,
   NEW_PATH,
-  COMMAND
+  COMMAND,
+  PREFETCHED_IMAGE,
+  THUMBNAIL_READY,
+  CANVAS_READY,
+  PATHS_FOUND,
+  NEW_FRAME,
+  METADATA_INDEXED
+};
+
+enum sort_mode {
+  SORT_NAME,
+  SORT_DATE,
+  SORT_MTIME,
+  SORT_SIZE,
+  SORT_PIXELS
+};
+
+enum filter_field {
+  FILTER_DATE,
+  FILTER_MTIME,
+  FILTER_SIZE,
+  FILTER_WIDTH,
+  FILTER_HEIGHT
+};
+
+/* The range of values of a field that paths are kept for, inclusive */
+struct path_filter {
+  struct imv *imv;
+  enum filter_field field;
+  int64_t min;
+  int64_t max;
 };
 
 struct color_rgb {
   unsigned char r, g, b;
 };
 
+struct prefetch_job {
+  struct imv *imv;
+  char *path;
+  int page;
+  struct timespec mtime;
+  /* size hint for the decode */
+  int target_width;
+  int target_height;
+  /* the decoded image, or NULL if it couldn't be loaded */
+  struct imv_image *image;
+  int frametime;
+  /* the image packed for the cache, if it's to be kept that way */
+  struct imv_packed_image *packed;
+};
+
 struct internal_event {
   enum internal_event_type type;
   union {
@@ -65,16 +127,29 @@ struct internal_event {
       struct imv_image *image;
       int frametime;
       bool is_new_image;
+      bool is_partial;
+      /* the page of the file it's of, and whether there are any after */
+      int page;
+      bool last_page;
     } new_image;
-    struct {
-      char *path;
-    } new_path;
     struct {
       char *text;
+      /* whether it came over IPC, from the given client, to be replied to */
+      bool from_ipc;
+      unsigned int client;
     } command;
+    struct {
+      struct prefetch_job *job;
+    } prefetched_image;
   } data;
 };
 
+/* An IPC command held back until a wait before it is over */
+struct held_command {
+  char *text;
+  unsigned int client;
+};
+
 struct imv {
   /* set to true to trigger clean exit */
   bool quit;
@@ -82,6 +157,14 @@ struct imv {
   /* indicates a new image is being loaded */
   bool loading;
 
+  /* indicates the full resolution version of the current image, which was
+   * decoded at reduced resolution, is being loaded */
+  bool refining;
+
+  /* indicates the current image is a partially decoded rendition of the
+   * image being loaded */
+  bool previewing;
+
   /* initial fullscreen state */
   bool start_fullscreen;
 
@@ -94,7 +177,7 @@ struct imv {
     /* display some textual info onscreen */
     bool enabled;
     /* the user-specified format strings for the overlay*/
-    char *text;
+    struct imv_template *text;
     struct color_rgb text_color;
     unsigned char text_alpha;
     struct color_rgb background_color;
@@ -108,20 +191,78 @@ struct imv {
       char *name;
       int size;
     } font;
+
+    /* what the overlay and console on the canvas were last drawn showing */
+    char signature[2048];
   } overlay;
 
 
   /* method for scaling up images: interpolate or nearest neighbour */
   enum upscaling_method upscaling_method;
 
+  /* draw with OpenGL or into shared memory, or pick whichever is faster */
+  enum imv_renderer renderer;
+
   /* dirty state flags */
   bool need_redraw;
   bool need_rescale;
-  bool cache_invalidated;
 
   /* traverse sub-directories for more images */
   bool recursive_load;
 
+  /* add and remove files as they come and go from directories opened */
+  bool watch_directories;
+
+  /* counting how often the main loop wakes up, to log once a second */
+  struct {
+    bool enabled;
+    int count;
+    double since;
+  } wakeups;
+
+  /* with --render, draw each image off screen and write it to a file named
+   * by output, rather than showing anything */
+  struct {
+    const char *output;
+    int width;
+    int height;
+  } render;
+
+  /* when each stage of showing the current image finished, on cur_time's
+   * clock, for the imv_*_ms variables. 0 for stages not yet reached */
+  struct {
+    /* started probing backends for it */
+    double open;
+    /* found one that would open it */
+    double opened;
+    /* had it decoded in full */
+    double decoded;
+    /* finished drawing it with nothing left uploading */
+    double uploaded;
+    /* had that frame presented */
+    double presented;
+  } timing;
+
+  /* times taken to get to the first image on screen, to report with
+   * --startup-profile. Marks come from worker threads too, hence the lock */
+  struct {
+    bool enabled;
+    bool reported;
+    /* CPU time used before imv_create, such as by library constructors */
+    double before;
+    double start;
+    pthread_mutex_t lock;
+    size_t count;
+    struct {
+      char what[96];
+      double time;
+    } marks[32];
+  } startup;
+
+  /* notices the current file, and maybe its directory, changing on disk.
+   * NULL if the system can't watch files */
+  struct imv_watcher *watcher;
+
   /* 'next' on the last image goes back to the first */
   bool loop_input;
 
@@ -134,6 +275,17 @@ struct imv {
   /* FILE to use when reading paths from stdin */
   FILE *stdin_pipe;
 
+  /* paths read from stdin waiting to be added, one after another, each
+   * terminated by a nul. Shared with the thread reading them, which only
+   * sends a NEW_PATH event when the buffer goes from empty to not */
+  struct {
+    pthread_mutex_t lock;
+    char *buf;
+    size_t len;
+    size_t cap;
+    bool notified;
+  } stdin_paths;
+
   /* scale up / down images to match window, or actual size */
   enum scaling_mode scaling_mode;
 
@@ -152,21 +304,115 @@ struct imv {
   struct {
     double duration;
     double elapsed;
+    /* seconds to fade from one image to the next over, or 0 to cut */
+    double crossfade;
   } slideshow;
 
+  /* the image the slideshow is fading out of, drawn as it last was under
+   * the one it moved on to */
+  struct {
+    struct imv_image *image;
+    int x, y;
+    double scale;
+    double rotation;
+    bool mirrored;
+    /* when the next image was first drawn over it, or 0 until it's been */
+    double start;
+  } fade;
+
   struct {
     /* for animated images, the getTime() time to display the next frame */
     double due;
-    /* how long the next frame to be put onscreen should be displayed for */
-    double duration;
-    /* the next frame of an animated image, pre-fetched */
-    struct imv_image *image;
-    /* force the next frame to load, even if early */
+    /* the upcoming frames of an animated image, decoded ahead of time, of
+     * which count start from first */
+    struct frame {
+      struct imv_image *image;
+      /* how long the frame should be displayed for */
+      double duration;
+    } *ring;
+    size_t capacity;
+    size_t first;
+    size_t count;
+    /* set while a frame is being decoded for the ring */
+    bool decoding;
+    /* force the next frame to display, even if early */
     bool force_next_frame;
-  } next_frame;
+  } frames;
 
   struct imv_image *current_image;
 
+  /* a grid of thumbnails, shown in place of the current image */
+  struct {
+    bool enabled;
+    /* created the first time it's shown */
+    struct imv_gallery *grid;
+    /* set when thumbnails were left waiting to be drawn */
+    bool more;
+  } gallery;
+
+  /* the path and mtime of the file the current source was opened from,
+   * used to add its image to the prefetch cache once decoded */
+  struct {
+    char *path;
+    struct timespec mtime;
+    /* the page shown of a file of several, and whether it's known there are
+     * none after it */
+    int page;
+    bool last_page;
+    /* set while another page is being loaded, until it turns up */
+    bool turning;
+  } current_file;
+
+  /* background decoding of the images either side of the current one */
+  struct {
+    /* how many images to decode ahead in each direction */
+    int distance;
+    /* decoded images, keyed by path and mtime */
+    struct imv_image_cache *cache;
+    /* the most the cache may hold, in bytes, with memory to spare */
+    size_t cache_size;
+    /* whether to keep prefetched images packed until they're shown */
+    bool compress;
+    /* jobs for images currently being decoded in the background */
+    struct list *pending;
+  } prefetch;
+
+  /* the order paths are shown in. Anything but name order comes from the
+   * metadata index, so paths are put in place as their directories are
+   * indexed, and any not indexed yet wait at the end. */
+  struct {
+    enum sort_mode mode;
+    bool reverse;
+    /* created once there are workers to fill it */
+    struct imv_metadata_index *index;
+    /* counts down the paths given a key in added order, to reverse it */
+    int64_t next_key;
+  } sort;
+
+  /* the range paths are kept to, from the filter command until it's given
+   * no range. Paths are only filtered once they're indexed, so it's held to
+   * as directories are indexed and more paths are added. */
+  struct {
+    bool active;
+    struct path_filter range;
+  } filter;
+
+  /* the most the canvas may keep of textures of recently drawn images, in
+   * bytes */
+  size_t texture_cache_size;
+
+  /* conversion of images with ICC profiles to the display's colours */
+  struct {
+    bool enabled;
+    /* the display's ICC profile, or NULL for sRGB */
+    char *display_profile;
+    struct imv_color *tables;
+    /* the table the canvas was last given */
+    const struct imv_color_lut *active;
+  } color;
+
+  /* number of threads to decode images with, or 0 for one per CPU */
+  int decode_threads;
 
   /* if specified by user, the path of the first image to display */
   char *starting_path;
@@ -175,7 +421,13 @@ struct imv {
   struct list *startup_commands;
 
   /* the user-specified format strings for the overlay and window title */
-  char *title_text;
+  struct imv_template *title_text;
+
+  /* expand those strings with the shell, for command substitution */
+  bool shell_expansion;
+
+  /* the window title last set */
+  char title[1024];
 
   /* imv subsystems */
   struct imv_binds *binds;
@@ -189,11 +441,51 @@ struct imv {
   struct imv_viewport *view;
   struct imv_canvas *canvas;
   struct imv_window *window;
+  struct imv_worker_pool *workers;
+
+  /* the reply to the IPC command being run, which the commands it runs
+   * add to */
+  struct {
+    bool active;
+    bool failed;
+    char text[4096];
+    size_t len;
+
+    /* a wait command is waiting on the current image to finish loading
+     * before replying to waiting_client, and holding back the IPC commands
+     * sent after it, so that replies still go out in order */
+    bool waiting;
+    unsigned int waiting_client;
+    struct list *held;
+    /* set when the last image loaded failed to, so a wait on it replies
+     * with an error */
+    bool load_failed;
+  } reply;
 
   /* if reading an image from stdin, this is the buffer for it */
   void *stdin_image_data;
   size_t stdin_image_data_len;
 
+  /* with --stream, image data on stdin is a stream of images, of which the
+   * newest is shown once the one before has decoded */
+  struct {
+    bool enabled;
+    /* whether "-" was given, so there's a thread reading the stream */
+    bool reading;
+    pthread_t thread;
+
+    /* shared with the thread reading the stream, which only sends a
+     * NEW_FRAME event when pending goes from empty to not */
+    pthread_mutex_t lock;
+    struct imv_stream_frame *pending;
+    bool notified;
+    /* frames replaced by a newer one before they could be shown */
+    unsigned long dropped;
+
+    /* the frame stdin_image_data points into */
+    struct imv_stream_frame *current;
+  } stream;
+
   struct {
     /* initial scale pinch zoom */
     double initial_zoom;
@@ -219,18 +511,35 @@ static void command_exec(struct list *args, const char *argstr, void *data);
 static void command_center(struct list *args, const char *argstr, void *data);
 static void command_reset(struct list *args, const char *argstr, void *data);
 static void command_next_frame(struct list *args, const char *argstr, void *data);
+static void command_next_page(struct list *args, const char *argstr, void *data);
+static void command_prev_page(struct list *args, const char *argstr, void *data);
+static void command_page(struct list *args, const char *argstr, void *data);
 static void command_toggle_playing(struct list *args, const char *argstr, void *data);
 static void command_set_scaling_mode(struct list *args, const char *argstr, void *data);
 static void command_set_upscaling_method(struct list *args, const char *argstr, void *data);
 static void command_set_slideshow_duration(struct list *args, const char *argstr, void *data);
 static void command_set_background(struct list *args, const char *argstr, void *data);
 static void command_bind(struct list *args, const char *argstr, void *data);
+static void command_gallery(struct list *args, const char *argstr, void *data);
+static void command_timings(struct list *args, const char *argstr, void *data);
+static void command_get(struct list *args, const char *argstr, void *data);
+static void command_wait(struct list *args, const char *argstr, void *data);
+static void command_sort(struct list *args, const char *argstr, void *data);
+static void command_filter(struct list *args, const char *argstr, void *data);
 
 static bool setup_window(struct imv *imv);
+static void handle_new_image(struct imv *imv, struct imv_image *image, int frametime);
+static void clear_frames(struct imv *imv);
+static void fill_frames(struct imv *imv);
 static void consume_internal_event(struct imv *imv, struct internal_event *event);
+static void metadata_indexed(void *data);
+static void begin_crossfade(struct imv *imv);
 static void render_window(struct imv *imv);
+static void render_and_present(struct imv *imv);
+static void draw_overlay(struct imv *imv, const char *overlay_text, int ww, int wh);
 static void update_env_vars(struct imv *imv);
-static size_t generate_env_text(struct imv *imv, char *buf, size_t len, const char *format);
+static size_t generate_env_text(struct imv *imv, char *buf, size_t len,
+    const struct imv_template *format);
 static size_t read_from_stdin(void **buffer);
 
 /* Finds the next split between commands in a string (';'). Provides a pointer
@@ -350,6 +659,61 @@ static double cur_time(void)
   return ts.tv_sec + (double)ts.tv_nsec * 0.000000001;
 }
 
+/* Notes the time something got done while starting up, for the startup
+ * profile. Once it's been reported, or if there's no room, does nothing */
+static void startup_mark(struct imv *imv, const char *fmt, ...)
+{
+  const double now = cur_time();
+  pthread_mutex_lock(&imv->startup.lock);
+  const size_t max = sizeof imv->startup.marks / sizeof *imv->startup.marks;
+  if (!imv->startup.reported && imv->startup.count < max) {
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(imv->startup.marks[imv->startup.count].what,
+        sizeof imv->startup.marks->what, fmt, args);
+    va_end(args);
+    imv->startup.marks[imv->startup.count++].time = now;
+  }
+  pthread_mutex_unlock(&imv->startup.lock);
+}
+
+/* Logs the startup profile, if asked for, and stops collecting it */
+static void startup_report(struct imv *imv)
+{
+  pthread_mutex_lock(&imv->startup.lock);
+  if (imv->startup.enabled && !imv->startup.reported) {
+    imv_log(IMV_INFO, "startup profile:\n");
+    imv_log(IMV_INFO, "  %8.1f ms CPU before imv started\n",
+        imv->startup.before * 1000.0);
+    double last = imv->startup.start;
+    for (size_t i = 0; i < imv->startup.count; ++i) {
+      const double time = imv->startup.marks[i].time;
+      imv_log(IMV_INFO, "  %8.1f ms  +%6.1f ms  %s\n",
+          (time - imv->startup.start) * 1000.0, (time - last) * 1000.0,
+          imv->startup.marks[i].what);
+      last = time;
+    }
+  }
+  imv->startup.reported = true;
+  pthread_mutex_unlock(&imv->startup.lock);
+}
+
+/* Returns how far ahead of an animation frame's due time it's worth drawing
+ * it. What's drawn now reaches the screen at the next refresh, so a frame
+ * is drawn as soon as that's the refresh nearest the time it's due. */
+static double frame_slack(struct imv *imv, double now)
+{
+  double presented, refresh;
+  if (!imv_window_get_refresh(imv->window, &presented, &refresh)) {
+    return 0.0;
+  }
+  double next = now;
+  if (presented > 0.0 && presented <= now) {
+    next = presented + ceil((now - presented) / refresh) * refresh;
+  }
+  return next - now + refresh / 2;
+}
+
 static void source_callback(struct imv_source_message *msg)
 {
   struct imv *imv = msg->user_data;
@@ -368,13 +732,18 @@ static void source_callback(struct imv_source_message *msg)
     event->type = NEW_IMAGE;
     event->data.new_image.image = msg->image;
     event->data.new_image.frametime = msg->frametime;
+    event->data.new_image.is_partial = msg->partial;
+    event->data.new_image.page = msg->page;
+    event->data.new_image.last_page = msg->last_page;
 
     /* Keep track of the last source to send us an image in order to detect
      * when we're getting a new image, as opposed to a new frame from the
-     * same image.
+     * same image. Previews of an image still loading don't count.
      */
-    event->data.new_image.is_new_image = msg->source != imv->last_source;
-    imv->last_source = msg->source;
+    if (!msg->partial) {
+      event->data.new_image.is_new_image = msg->source != imv->last_source;
+      imv->last_source = msg->source;
+    }
   } else {
     event->type = BAD_IMAGE;
   }
@@ -406,6 +775,115 @@ static void command_callback(const char *text, void *data)
   imv_window_push_event(imv->window, &e);
 }
 
+static void ipc_command_callback(const char *text, unsigned int client,
+    void *data)
+{
+  struct imv *imv = data;
+
+  struct internal_event *event = calloc(1, sizeof *event);
+  event->type = COMMAND;
+  event->data.command.text = strdup(text);
+  event->data.command.from_ipc = true;
+  event->data.command.client = client;
+
+  struct imv_event e = {
+    .type = IMV_EVENT_CUSTOM,
+    .data = {
+      .custom = event
+    }
+  };
+  imv_window_push_event(imv->window, &e);
+}
+
+/* Adds to the reply to the IPC command being run, if there is one */
+static void command_reply(struct imv *imv, const char *fmt, ...)
+{
+  if (!imv->reply.active || imv->reply.len >= sizeof imv->reply.text - 1) {
+    return;
+  }
+  va_list args;
+  va_start(args, fmt);
+  const int len = vsnprintf(imv->reply.text + imv->reply.len,
+      sizeof imv->reply.text - imv->reply.len, fmt, args);
+  va_end(args);
+  if (len > 0) {
+    imv->reply.len += len;
+  }
+  if (imv->reply.len > sizeof imv->reply.text - 1) {
+    imv->reply.len = sizeof imv->reply.text - 1;
+  }
+}
+
+/* Makes the IPC command being run, if there is one, fail with a reason */
+static void command_fail(struct imv *imv, const char *fmt, ...)
+{
+  if (!imv->reply.active) {
+    return;
+  }
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(imv->reply.text, sizeof imv->reply.text, fmt, args);
+  va_end(args);
+  imv->reply.len = strlen(imv->reply.text);
+  imv->reply.failed = true;
+}
+
+/* Runs a command sent over IPC and replies to it, taking ownership of text.
+ * Each reply is a line of "ok", followed by anything the command had to
+ * say, or "error" followed by the reason. */
+static void run_ipc_command(struct imv *imv, char *text, unsigned int client)
+{
+  if (imv->reply.waiting) {
+    struct held_command *held = calloc(1, sizeof *held);
+    held->text = text;
+    held->client = client;
+    list_append(imv->reply.held, held);
+    return;
+  }
+
+  imv->reply.active = true;
+  imv->reply.failed = false;
+  imv->reply.len = 0;
+  imv->reply.text[0] = 0;
+  const int unknown = imv_command_exec(imv->commands, text, imv);
+  imv->reply.active = false;
+
+  if (imv->reply.waiting) {
+    /* it's a wait, to be replied to once it's over */
+    imv->reply.waiting_client = client;
+  } else if (imv->ipc) {
+    char line[sizeof imv->reply.text + 16];
+    if (unknown) {
+      snprintf(line, sizeof line, "error unknown command");
+    } else if (imv->reply.failed) {
+      snprintf(line, sizeof line, "error %s", imv->reply.text);
+    } else {
+      snprintf(line, sizeof line, imv->reply.len ? "ok %s" : "ok",
+          imv->reply.text);
+    }
+    imv_ipc_reply(imv->ipc, client, line);
+  }
+  free(text);
+}
+
+/* Replies to a wait now it's over, and runs the commands held back behind
+ * it, up to the next wait if there's another */
+static void finish_wait(struct imv *imv)
+{
+  imv->reply.waiting = false;
+  if (imv->ipc) {
+    imv_ipc_reply(imv->ipc, imv->reply.waiting_client,
+        imv->reply.load_failed ? "error failed to load image" : "ok");
+  }
+
+  while (!imv->reply.waiting && imv->reply.held->len) {
+    struct held_command *held = imv->reply.held->items[0];
+    list_remove(imv->reply.held, 0);
+    run_ipc_command(imv, held->text, held->client);
+    free(held);
+  }
+}
+
 static void key_handler(struct imv *imv, const struct imv_event *event)
 {
   if (imv_console_is_active(imv->console)) {
@@ -459,6 +937,8 @@ static void event_handler(void *data, const struct imv_event *e)
         const double scale = e->data.resize.scale;
         imv_viewport_update(imv->view, ww, wh, bw, bh, imv->current_image, imv->scaling_mode);
         imv_canvas_resize(imv->canvas, bw, bh, scale);
+        /* the canvas starts out blank, so the overlay needs drawing again */
+        imv->overlay.signature[0] = '\0';
         break;
       }
     case IMV_EVENT_KEYBOARD:
@@ -578,9 +1058,17 @@ struct imv *imv_create(void)
   /* Attach log to stderr */
   imv_log_add_log_callback(&log_to_stderr, NULL);
 
+  /* Before any threads are started that might map files */
+  imv_mapped_file_init();
+
   struct imv *imv = calloc(1, sizeof *imv);
+  imv->startup.before = (double)clock() / CLOCKS_PER_SEC;
+  imv->startup.start = cur_time();
+  pthread_mutex_init(&imv->startup.lock, NULL);
   imv->initial_width = 1280;
   imv->initial_height = 720;
+  imv->render.width = 512;
+  imv->render.height = 512;
   imv->need_redraw = true;
   imv->need_rescale = true;
   imv->scaling_mode = SCALING_FULL;
@@ -593,16 +1081,17 @@ struct imv *imv_create(void)
   imv->commands = imv_commands_create();
   imv->console = imv_console_create();
   imv_console_set_command_callback(imv->console, &command_callback, imv);
-  imv->title_text = strdup(
+  imv->title_text = imv_template_create(
       "imv - [${imv_current_index}/${imv_file_count}]"
       " [${imv_width}x${imv_height}] [${imv_scale}%]"
       " $imv_current_file [$imv_scaling_mode]"
   );
-  imv->overlay.text = strdup(
+  imv->overlay.text = imv_template_create(
       "[${imv_current_index}/${imv_file_count}]"
       " [${imv_width}x${imv_height}] [${imv_scale}%]"
       " $imv_current_file [$imv_scaling_mode]"
   );
+  imv->shell_expansion = true;
   imv->overlay.text_color.r = 255;
   imv->overlay.text_color.g = 255;
   imv->overlay.text_color.b = 255;
@@ -613,6 +1102,16 @@ struct imv *imv_create(void)
   imv->overlay.background_alpha = 195;
   imv->overlay.position_at_bottom = false;
   imv->startup_commands = list_create();
+  imv->prefetch.distance = 1;
+  imv->frames.capacity = 4;
+  imv->prefetch.cache_size = 256 * 1024 * 1024;
+  imv->prefetch.cache = imv_image_cache_create(imv->prefetch.cache_size);
+  imv->prefetch.pending = list_create();
+  imv->texture_cache_size = 512 * 1024 * 1024;
+  imv->color.enabled = true;
+  pthread_mutex_init(&imv->stdin_paths.lock, NULL);
+  pthread_mutex_init(&imv->stream.lock, NULL);
+  imv->reply.held = list_create();
 
   imv_command_register(imv->commands, "quit", &command_quit);
   imv_command_register(imv->commands, "pan", &command_pan);
@@ -630,12 +1129,21 @@ struct imv *imv_create(void)
   imv_command_register(imv->commands, "center", &command_center);
   imv_command_register(imv->commands, "reset", &command_reset);
   imv_command_register(imv->commands, "next_frame", &command_next_frame);
+  imv_command_register(imv->commands, "next_page", &command_next_page);
+  imv_command_register(imv->commands, "prev_page", &command_prev_page);
+  imv_command_register(imv->commands, "page", &command_page);
   imv_command_register(imv->commands, "toggle_playing", &command_toggle_playing);
   imv_command_register(imv->commands, "scaling", &command_set_scaling_mode);
   imv_command_register(imv->commands, "upscaling", &command_set_upscaling_method);
   imv_command_register(imv->commands, "slideshow", &command_set_slideshow_duration);
   imv_command_register(imv->commands, "background", &command_set_background);
   imv_command_register(imv->commands, "bind", &command_bind);
+  imv_command_register(imv->commands, "gallery", &command_gallery);
+  imv_command_register(imv->commands, "timings", &command_timings);
+  imv_command_register(imv->commands, "get", &command_get);
+  imv_command_register(imv->commands, "wait", &command_wait);
+  imv_command_register(imv->commands, "sort", &command_sort);
+  imv_command_register(imv->commands, "filter", &command_filter);
 
   imv_command_alias(imv->commands, "q", "quit");
   imv_command_alias(imv->commands, "n", "next");
@@ -678,18 +1186,56 @@ struct imv *imv_create(void)
   add_bind(imv, "a", "zoom actual");
   add_bind(imv, "r", "reset");
   add_bind(imv, "<period>", "next_frame");
+  add_bind(imv, "<Next>", "next_page");
+  add_bind(imv, "<Prior>", "prev_page");
   add_bind(imv, "<space>", "toggle_playing");
   add_bind(imv, "t", "slideshow +1");
   add_bind(imv, "<Shift+T>", "slideshow -1");
+  add_bind(imv, "v", "gallery");
+  add_bind(imv, "<Shift+J>", "gallery down");
+  add_bind(imv, "<Shift+K>", "gallery up");
 
   return imv;
 }
 
+/* Frees an event pushed by one of imv's threads without acting on it */
+static void discard_internal_event(struct internal_event *event)
+{
+  if (event->type == NEW_IMAGE) {
+    imv_image_free(event->data.new_image.image);
+  } else if (event->type == COMMAND) {
+    free(event->data.command.text);
+  } else if (event->type == PREFETCHED_IMAGE) {
+    struct prefetch_job *job = event->data.prefetched_image.job;
+    imv_packed_image_free(job->packed);
+    imv_image_free(job->image);
+    free(job->path);
+    free(job);
+  }
+  free(event);
+}
+
+static void discard_event(void *data, const struct imv_event *e)
+{
+  (void)data;
+  if (e->type == IMV_EVENT_CUSTOM) {
+    discard_internal_event(e->data.custom);
+  }
+}
+
 void imv_free(struct imv *imv)
 {
+  /* finish any work in flight before tearing down what it depends on */
+  imv_gallery_free(imv->gallery.grid);
+  imv_metadata_index_free(imv->sort.index);
+  imv_worker_pool_free(imv->workers);
+  imv_source_set_worker_pool(NULL);
+  imv_color_free(imv->color.tables);
+  free(imv->color.display_profile);
+
   free(imv->overlay.font.name);
-  free(imv->title_text);
-  free(imv->overlay.text);
+  imv_template_free(imv->title_text);
+  imv_template_free(imv->overlay.text);
   imv_binds_free(imv->binds);
   imv_navigator_free(imv->navigator);
   if (imv->current_source) {
@@ -698,20 +1244,41 @@ void imv_free(struct imv *imv)
   imv_commands_free(imv->commands);
   imv_console_free(imv->console);
   imv_ipc_free(imv->ipc);
+  for (size_t i = 0; i < imv->reply.held->len; ++i) {
+    struct held_command *held = imv->reply.held->items[i];
+    free(held->text);
+  }
+  list_deep_free(imv->reply.held);
   imv_viewport_free(imv->view);
   imv_canvas_free(imv->canvas);
   if (imv->current_image) {
     imv_image_free(imv->current_image);
   }
-  if (imv->next_frame.image) {
-    imv_image_free(imv->next_frame.image);
-  }
-  if (imv->stdin_image_data) {
+  imv_image_free(imv->fade.image);
+  clear_frames(imv);
+  free(imv->frames.ring);
+  free(imv->current_file.path);
+  imv_image_cache_free(imv->prefetch.cache);
+  list_free(imv->prefetch.pending);
+  if (imv->stream.current) {
+    imv_stream_frame_unref(imv->stream.current);
+  } else if (imv->stdin_image_data) {
     free(imv->stdin_image_data);
   }
+  imv_stream_frame_unref(imv->stream.pending);
+  pthread_mutex_destroy(&imv->stream.lock);
+  free(imv->stdin_paths.buf);
+  pthread_mutex_destroy(&imv->stdin_paths.lock);
+  startup_report(imv);
+  pthread_mutex_destroy(&imv->startup.lock);
+  imv_trace_close();
   if (imv->window) {
+    /* With everything that pushes events gone, free what they left queued,
+     * such as images prefetched while quitting */
+    imv_window_pump_events(imv->window, &discard_event, NULL);
     imv_window_free(imv->window);
   }
+  imv_watcher_free(imv->watcher);
 
   list_free(imv->backends);
 
@@ -743,6 +1310,17 @@ static bool parse_slideshow_duration(struct imv *imv, const char *duration)
   return true;
 }
 
+static bool parse_slideshow_crossfade(struct imv *imv, const char *crossfade)
+{
+  char *end;
+  const double seconds = strtod(crossfade, &end);
+  if (end == crossfade || *end || seconds < 0.0) {
+    return false;
+  }
+  imv->slideshow.crossfade = seconds;
+  return true;
+}
+
 static bool parse_scaling_mode(struct imv *imv, const char *mode)
 {
   if (!strcmp(mode, "shrink")) {
@@ -780,14 +1358,236 @@ static bool parse_upscaling_method(struct imv *imv, const char *method)
     return true;
   }
 
+  if (!strcmp(method, "mipmap")) {
+    imv->upscaling_method = UPSCALING_MIPMAP;
+    return true;
+  }
+
+  return false;
+}
+
+static const char *sort_modes[] = {
+  "name",
+  "date",
+  "mtime",
+  "size",
+  "pixels",
+};
+
+/* Parses "<mode> [reverse]" from the words starting at start */
+static bool parse_sort(struct imv *imv, struct list *words, size_t start)
+{
+  if (words->len <= start || words->len > start + 2
+      || (words->len == start + 2 && strcmp(words->items[start + 1], "reverse"))) {
+    return false;
+  }
+
+  for (size_t i = 0; i < sizeof sort_modes / sizeof *sort_modes; ++i) {
+    if (!strcmp(words->items[start], sort_modes[i])) {
+      imv->sort.mode = i;
+      imv->sort.reverse = words->len == start + 2;
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Whether the paths are in any order but the one they were added in */
+static bool is_sorted(struct imv *imv)
+{
+  return imv->sort.mode != SORT_NAME || imv->sort.reverse;
+}
+
+static int64_t mtime_key(const struct imv_file_info *info)
+{
+  return info->mtime_sec * 1000000000 + info->mtime_nsec;
+}
+
+static int64_t sort_key(const char *path, void *data)
+{
+  struct imv *imv = data;
+  if (imv->sort.mode == SORT_NAME) {
+    /* Only used to reverse the order added, which the paths are in */
+    return imv->sort.next_key--;
+  }
+
+  struct imv_file_info info;
+  if (!imv_metadata_index_get(imv->sort.index, path, &info)) {
+    /* At the end, whichever way round, until it's known */
+    return INT64_MAX;
+  }
+
+  int64_t key = 0;
+  switch (imv->sort.mode) {
+    case SORT_DATE:
+      key = info.taken ? info.taken * 1000000000 : mtime_key(&info);
+      break;
+    case SORT_MTIME: key = mtime_key(&info); break;
+    case SORT_SIZE: key = info.size; break;
+    case SORT_PIXELS: key = (int64_t)info.width * info.height; break;
+    case SORT_NAME: break;
+  }
+  return imv->sort.reverse ? -key : key;
+}
+
+/* The index is made the first time it's needed, once there are workers to
+ * fill it */
+static bool open_index(struct imv *imv)
+{
+  if (!imv->sort.index && imv->workers) {
+    imv->sort.index = imv_metadata_index_create(NULL, imv->workers,
+        &metadata_indexed, imv);
+  }
+  return imv->sort.index;
+}
+
+/* Puts the paths in the order asked for, as far as it's known yet */
+static void apply_sort(struct imv *imv)
+{
+  struct imv_navigator *nav = imv->navigator;
+  const bool at_first = imv_navigator_index(nav) == 0;
+
+  if (!is_sorted(imv)) {
+    imv_navigator_sort(nav, NULL, NULL);
+  } else if (imv->sort.mode == SORT_NAME) {
+    imv_navigator_sort(nav, NULL, NULL);
+    imv->sort.next_key = 0;
+    imv_navigator_sort(nav, &sort_key, imv);
+  } else {
+    if (!open_index(imv)) {
+      return;
+    }
+    imv_navigator_sort(nav, &sort_key, imv);
+  }
+
+  /* Whatever's sorted to the front replaces the first path while it's the
+   * one being looked at, as it is until any others have been indexed */
+  if (at_first) {
+    imv_navigator_select_abs(nav, 0);
+  }
+  imv->need_redraw = true;
+}
+
+static const char *filter_fields[] = {
+  "date",
+  "mtime",
+  "size",
+  "width",
+  "height",
+};
+
+/* Parses one end of a filter's range. Times are given as YYYY-MM-DD, from
+ * the start of that day for the minimum, or to its end for the maximum. */
+static bool parse_filter_bound(enum filter_field field, const char *str,
+    bool is_max, int64_t *value)
+{
+  char *end;
+  if (field == FILTER_DATE || field == FILTER_MTIME) {
+    struct tm tm = {0};
+    end = strptime(str, "%Y-%m-%d", &tm);
+    if (!end || *end) {
+      return false;
+    }
+    tm.tm_mday += is_max;
+    tm.tm_isdst = -1;
+    const time_t t = mktime(&tm);
+    if (t == (time_t)-1) {
+      return false;
+    }
+    *value = is_max ? t - 1 : t;
+    return true;
+  }
+
+  const long long n = strtoll(str, &end, 10);
+  if (end == str || *end) {
+    return false;
+  }
+  *value = n;
+  return true;
+}
+
+static bool keep_path(const char *path, void *data)
+{
+  const struct path_filter *filter = data;
+  struct imv_file_info info;
+  if (!imv_metadata_index_get(filter->imv->sort.index, path, &info)) {
+    /* Kept until it's indexed, if it ever is, as for stdin */
+    return true;
+  }
+
+  int64_t value = 0;
+  switch (filter->field) {
+    case FILTER_DATE: value = info.taken ? info.taken : info.mtime_sec; break;
+    case FILTER_MTIME: value = info.mtime_sec; break;
+    case FILTER_SIZE: value = info.size; break;
+    case FILTER_WIDTH: value = info.width; break;
+    case FILTER_HEIGHT: value = info.height; break;
+  }
+  return value >= filter->min && value <= filter->max;
+}
+
+/* Closes the paths the filter doesn't keep, as far as they're indexed */
+static void apply_filter(struct imv *imv)
+{
+  if (!imv->filter.active || !open_index(imv)) {
+    return;
+  }
+  imv_navigator_filter(imv->navigator, &keep_path, &imv->filter.range);
+  imv->need_redraw = true;
+}
+
+/* Filters and sorts the paths again, as more are added or indexed */
+static void update_order(struct imv *imv)
+{
+  apply_filter(imv);
+  if (is_sorted(imv)) {
+    apply_sort(imv);
+  }
+}
+
+static bool parse_renderer(struct imv *imv, const char *renderer)
+{
+  if (!strcmp(renderer, "auto")) {
+    imv->renderer = IMV_RENDERER_AUTO;
+    return true;
+  }
+
+  if (!strcmp(renderer, "opengl")) {
+    imv->renderer = IMV_RENDERER_OPENGL;
+    return true;
+  }
+
+  if (!strcmp(renderer, "software")) {
+    imv->renderer = IMV_RENDERER_SOFTWARE;
+    return true;
+  }
+
   return false;
 }
 
+static bool parse_render_size(struct imv *imv, const char *size)
+{
+  char *end;
+  const long width = strtol(size, &end, 10);
+  if (end == size || *end != 'x') {
+    return false;
+  }
+  const char *height_str = end + 1;
+  const long height = strtol(height_str, &end, 10);
+  if (end == height_str || *end || width <= 0 || height <= 0
+      || width > INT_MAX || height > INT_MAX) {
+    return false;
+  }
+  imv->render.width = width;
+  imv->render.height = height;
+  return true;
+}
+
 static bool parse_window_title(struct imv *imv, const char *name)
 {
   if (strcmp(name, "")) {
-    free(imv->title_text);
-    imv->title_text = strdup(name);
+    imv_template_free(imv->title_text);
+    imv->title_text = imv_template_create(name);
     return true;
   }
 
@@ -869,10 +1669,28 @@ static void *load_paths_from_stdin(void *data)
     if (buf[len-1] == '\n') {
       buf[--len] = 0;
     }
-    if (len > 0) {
+    if (len == 0) {
+      continue;
+    }
+
+    pthread_mutex_lock(&imv->stdin_paths.lock);
+    if (imv->stdin_paths.len + len + 1 > imv->stdin_paths.cap) {
+      size_t cap = imv->stdin_paths.cap ? imv->stdin_paths.cap : 64 * 1024;
+      while (cap < imv->stdin_paths.len + len + 1) {
+        cap *= 2;
+      }
+      imv->stdin_paths.buf = realloc(imv->stdin_paths.buf, cap);
+      imv->stdin_paths.cap = cap;
+    }
+    memcpy(imv->stdin_paths.buf + imv->stdin_paths.len, buf, len + 1);
+    imv->stdin_paths.len += len + 1;
+    const bool notify = !imv->stdin_paths.notified;
+    imv->stdin_paths.notified = true;
+    pthread_mutex_unlock(&imv->stdin_paths.lock);
+
+    if (notify) {
       struct internal_event *event = calloc(1, sizeof *event);
       event->type = NEW_PATH;
-      event->data.new_path.path = strdup(buf);
 
       struct imv_event e = {
         .type = IMV_EVENT_CUSTOM,
@@ -886,22 +1704,89 @@ static void *load_paths_from_stdin(void *data)
   return NULL;
 }
 
-static void print_help(struct imv *imv)
+static void release_stream_frame(void *frame)
 {
-  printf("imv %s\nSee manual for usage information.\n", IMV_VERSION);
-  puts("This version of imv has been compiled with the following backends:\n");
+  imv_stream_frame_unref(frame);
+}
 
-  for (size_t i = 0; i < imv->backends->len; ++i) {
-    struct imv_backend *backend = imv->backends->items[i];
-    printf("Name: %s\n"
-           "Description: %s\n"
-           "Website: %s\n"
-           "License: %s\n\n",
-           backend->name,
-           backend->description,
-           backend->website,
-           backend->license);
-  }
+static void free_stream(void *stream)
+{
+  imv_stream_free(stream);
+}
+
+/* Reads image data from stdin as it arrives, keeping only the newest frame
+ * for the main thread to take, so that when frames come faster than they
+ * can be decoded, the ones in between are dropped rather than queued */
+static void *read_stream(void *data)
+{
+  struct imv *imv = data;
+  struct imv_stream *stream = imv_stream_create();
+  pthread_cleanup_push(free_stream, stream);
+
+  unsigned char buf[64 * 1024];
+  while (true) {
+    const ssize_t len = read(STDIN_FILENO, buf, sizeof buf);
+    if (len < 0 && errno == EINTR) {
+      continue;
+    }
+    if (len <= 0) {
+      break;
+    }
+
+    /* Only reading may be cancelled, never with the lock held */
+    int cancel_state;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel_state);
+    imv_stream_feed(stream, buf, len);
+
+    struct imv_stream_frame *frame;
+    while ((frame = imv_stream_next(stream))) {
+      pthread_mutex_lock(&imv->stream.lock);
+      if (imv->stream.pending) {
+        imv_stream_frame_unref(imv->stream.pending);
+        ++imv->stream.dropped;
+      }
+      imv->stream.pending = frame;
+      const bool notify = !imv->stream.notified;
+      imv->stream.notified = true;
+      pthread_mutex_unlock(&imv->stream.lock);
+
+      if (notify) {
+        struct internal_event *event = calloc(1, sizeof *event);
+        event->type = NEW_FRAME;
+
+        struct imv_event e = {
+          .type = IMV_EVENT_CUSTOM,
+          .data = {
+            .custom = event
+          }
+        };
+        imv_window_push_event(imv->window, &e);
+      }
+    }
+    pthread_setcancelstate(cancel_state, NULL);
+  }
+
+  imv_log(IMV_INFO, "End of stream\n");
+  pthread_cleanup_pop(1);
+  return NULL;
+}
+
+static void print_help(struct imv *imv)
+{
+  printf("imv %s\nSee manual for usage information.\n", IMV_VERSION);
+  puts("This version of imv has been compiled with the following backends:\n");
+
+  for (size_t i = 0; i < imv->backends->len; ++i) {
+    struct imv_backend *backend = imv->backends->items[i];
+    printf("Name: %s\n"
+           "Description: %s\n"
+           "Website: %s\n"
+           "License: %s\n\n",
+           backend->name,
+           backend->description,
+           backend->website,
+           backend->license);
+  }
 
   puts("imv's full source code is published under the terms of the MIT\n"
        "license, and can be found at https://sr.ht/~exec64/imv\n"
@@ -916,11 +1801,43 @@ bool imv_parse_args(struct imv *imv, int argc, char **argv)
   /* Do not print getopt errors */
   opterr = 0;
 
+  /* long only options, numbered past any short one */
+  enum {
+    OPT_STARTUP_PROFILE = 256,
+    OPT_TRACE,
+    OPT_RENDER,
+    OPT_SIZE,
+    OPT_STREAM,
+  };
+  static const struct option long_options[] = {
+    {"startup-profile", no_argument, NULL, OPT_STARTUP_PROFILE},
+    {"trace", required_argument, NULL, OPT_TRACE},
+    {"render", required_argument, NULL, OPT_RENDER},
+    {"size", required_argument, NULL, OPT_SIZE},
+    {"stream", no_argument, NULL, OPT_STREAM},
+    {NULL, 0, NULL, 0},
+  };
+
   int o;
 
- /* TODO getopt_long */
-  while ((o = getopt(argc, argv, "frdxhvlu:s:n:b:t:c:w:W:H:")) != -1) {
+  while ((o = getopt_long(argc, argv, "frdxhvlu:s:n:b:t:c:w:W:H:",
+          long_options, NULL)) != -1) {
     switch(o) {
+      case OPT_STARTUP_PROFILE: imv->startup.enabled = true;     break;
+      case OPT_TRACE:
+        if (!imv_trace_open(optarg)) {
+          imv_log(IMV_ERROR, "Unable to open trace file: %s\n", optarg);
+          return false;
+        }
+        break;
+      case OPT_RENDER: imv->render.output = optarg;              break;
+      case OPT_STREAM: imv->stream.enabled = true;               break;
+      case OPT_SIZE:
+        if (!parse_render_size(imv, optarg)) {
+          imv_log(IMV_ERROR, "Invalid render size. Aborting.\n");
+          return false;
+        }
+        break;
       case 'f': imv->start_fullscreen = true;                    break;
       case 'r': imv->recursive_load = true;                      break;
       case 'd': imv->overlay.enabled = true;                     break;
@@ -974,10 +1891,16 @@ bool imv_parse_args(struct imv *imv, int argc, char **argv)
       case 'c': list_append(imv->startup_commands, optarg); break;
       case 'w': parse_window_title(imv, optarg); break;
       case '?':
-        imv_log(IMV_ERROR, "Unknown argument '%c'. Aborting.\n", optopt);
+        if (optopt) {
+          imv_log(IMV_ERROR, "Unknown argument '%c'. Aborting.\n", optopt);
+        } else {
+          imv_log(IMV_ERROR, "Unknown argument '%s'. Aborting.\n",
+              argv[optind - 1]);
+        }
         return false;
     }
   }
+  startup_mark(imv, "parsed arguments");
 
   argc -= optind;
   argv += optind;
@@ -1001,7 +1924,16 @@ bool imv_parse_args(struct imv *imv, int argc, char **argv)
         }
         data_from_stdin = true;
 
-        imv->stdin_image_data_len = read_from_stdin(&imv->stdin_image_data);
+        if (imv->stream.enabled) {
+          if (imv->render.output) {
+            imv_log(IMV_ERROR, "Can't render a stream from stdin. Aborting.\n");
+            return false;
+          }
+          /* read as it arrives, once we're running */
+          imv->stream.reading = true;
+        } else {
+          imv->stdin_image_data_len = read_from_stdin(&imv->stdin_image_data);
+        }
       }
 
       imv_add_path(imv, argv[i]);
@@ -1016,17 +1948,955 @@ void imv_add_path(struct imv *imv, const char *path)
   imv_navigator_add(imv->navigator, path, imv->recursive_load);
 }
 
+/* Reads up to BACKEND_SNIFF_LEN bytes from the start of the file at path into
+ * head, returning how many were read, or -1 if it can't be read at all */
+static ssize_t read_head(const char *path, unsigned char *head)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+
+  size_t len = 0;
+  while (len < BACKEND_SNIFF_LEN) {
+    ssize_t n = read(fd, head + len, BACKEND_SNIFF_LEN - len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    len += n;
+  }
+  close(fd);
+  return len;
+}
+
+static enum backend_result try_backend(struct imv *imv,
+    const struct imv_backend *backend, const char *path, bool path_is_stdin,
+    struct imv_source **src)
+{
+  if (path_is_stdin) {
+    if (!backend->open_memory) {
+      /* memory loading unsupported by backend */
+      return BACKEND_UNSUPPORTED;
+    }
+    return backend->open_memory(imv->stdin_image_data,
+        imv->stdin_image_data_len, src);
+  }
+
+  if (!backend->open_path) {
+    /* path loading unsupported by backend */
+    return BACKEND_UNSUPPORTED;
+  }
+  return backend->open_path(path, src);
+}
+
+/* Opens path, or the image data read from stdin if path is "-", with the
+ * first backend that will. Going by the first few bytes of the data, backends
+ * recognising it are tried first, then any that can't tell, while those sure
+ * it isn't theirs aren't tried at all. */
+static enum backend_result open_source(struct imv *imv, const char *path,
+    struct imv_source **src)
+{
+  const bool path_is_stdin = !strcmp("-", path);
+
+  enum backend_result result = BACKEND_UNSUPPORTED;
+
+  if (!imv->backends) {
+    imv_log(IMV_ERROR, "No backends installed. Unable to load image.\n");
+    return result;
+  }
+
+  unsigned char head_buf[BACKEND_SNIFF_LEN];
+  const void *head = head_buf;
+  size_t head_len;
+  if (path_is_stdin) {
+    if (!imv->stdin_image_data || !imv->stdin_image_data_len) {
+      /* Skip if image failed to load */
+      return result;
+    }
+    head = imv->stdin_image_data;
+    head_len = imv->stdin_image_data_len;
+  } else {
+    ssize_t len = read_head(path, head_buf);
+    if (len <= 0) {
+      return BACKEND_BAD_PATH;
+    }
+    head_len = len;
+  }
+
+  const char *name = path_is_stdin ? NULL : path;
+  const enum backend_match passes[] = {BACKEND_MATCHES, BACKEND_MAY_MATCH};
+  for (size_t pass = 0; pass < sizeof passes / sizeof *passes; ++pass) {
+    for (size_t i = 0; i < imv->backends->len; ++i) {
+      const struct imv_backend *backend = imv->backends->items[i];
+      if (imv_backend_match(backend, name, head, head_len) != passes[pass]) {
+        continue;
+      }
+
+      const double init_start = cur_time();
+      if (imv_backend_init(backend)) {
+        startup_mark(imv, "initialised %s (%.1f ms)", backend->name,
+            (cur_time() - init_start) * 1000.0);
+      }
+
+      result = try_backend(imv, backend, path, path_is_stdin, src);
+      if (result == BACKEND_SUCCESS) {
+        startup_mark(imv, "opened %s with %s", path, backend->name);
+        if (path_is_stdin && imv->stream.current) {
+          /* The backend reads straight from the frame, so it has to stay
+           * around until the source is done with it */
+          imv_source_set_release(*src, release_stream_frame,
+              imv_stream_frame_ref(imv->stream.current));
+        }
+      }
+      if (result != BACKEND_UNSUPPORTED) {
+        return result;
+      }
+    }
+  }
+
+  return result;
+}
+
+/* Gets the modification time of the file at path. Returns false if it can't
+ * be determined, as is the case for image data read from stdin */
+static bool get_mtime(const char *path, struct timespec *mtime)
+{
+  if (!strcmp("-", path)) {
+    return false;
+  }
+
+  struct stat info;
+  if (stat(path, &info)) {
+    return false;
+  }
+
+  *mtime = info.st_mtim;
+  return true;
+}
+
+static void set_current_file(struct imv *imv, const char *path,
+    const struct timespec *mtime)
+{
+  free(imv->current_file.path);
+  imv->current_file.path = strdup(path);
+  imv->current_file.mtime = *mtime;
+  imv->current_file.page = 0;
+  imv->current_file.last_page = false;
+  imv->current_file.turning = false;
+  imv->reply.load_failed = false;
+
+  if (imv->watcher) {
+    imv_watcher_watch_file(imv->watcher, strcmp(path, "-") ? path : NULL);
+  }
+}
+
+static void update_title(struct imv *imv)
+{
+  char title[sizeof imv->title];
+  generate_env_text(imv, title, sizeof title, imv->title_text);
+
+  /* Setting the title is a round trip to the window system, so only do it
+   * when it changes */
+  if (strcmp(title, imv->title)) {
+    strcpy(imv->title, title);
+    imv_window_set_title(imv->window, title);
+  }
+}
+
+/* How many bytes of pixel data there's room for within the memory budget if
+ * the prefetch cache gave up everything it holds, or SIZE_MAX without one */
+static size_t memory_headroom(struct imv *imv)
+{
+  const size_t budget = imv_memory_budget();
+  if (!budget) {
+    return SIZE_MAX;
+  }
+  const size_t cached = imv_image_cache_size(imv->prefetch.cache);
+  const size_t used = imv_memory_used();
+  const size_t in_use = used > cached ? used - cached : 0;
+  return in_use < budget ? budget - in_use : 0;
+}
+
+/* Whether less than half the memory budget is left for new images */
+static bool memory_is_short(struct imv *imv)
+{
+  return memory_headroom(imv) < imv_memory_budget() / 2;
+}
+
+/* Shrinks the prefetch cache to leave the images in use within the memory
+ * budget, or lets it grow back to its configured size */
+static void fit_cache_to_budget(struct imv *imv)
+{
+  const size_t headroom = memory_headroom(imv);
+  imv_image_cache_set_budget(imv->prefetch.cache,
+      headroom < imv->prefetch.cache_size ? headroom : imv->prefetch.cache_size);
+}
+
+/* The size images are likely to be shown at, which it's enough to decode
+ * them at */
+static void get_target_size(struct imv *imv, int *width, int *height)
+{
+  *width = 0;
+  *height = 0;
+
+  /* Only when images are scaled to fit the window can we know how they'll
+   * be shown before we've seen them. Short of memory, everything is decoded
+   * to fit the window, and only refined if there turns out to be room. */
+  if (imv->scaling_mode == SCALING_FULL || imv->scaling_mode == SCALING_DOWN
+      || memory_is_short(imv)) {
+    imv_window_get_framebuffer_size(imv->window, width, height);
+  }
+}
+
+/* Opens a new source for the current image and starts loading it */
+static void open_current_file(struct imv *imv, const char *path,
+    const struct timespec *mtime)
+{
+  struct imv_source *new_source;
+  const double open = cur_time();
+  enum backend_result result = open_source(imv, path, &new_source);
+
+  if (result == BACKEND_SUCCESS) {
+    memset(&imv->timing, 0, sizeof imv->timing);
+    imv->timing.open = open;
+    imv->timing.opened = cur_time();
+    imv_trace_span("open", path, open, imv->timing.opened);
+    set_current_file(imv, path, mtime);
+    if (imv->current_source) {
+      imv_source_async_free(imv->current_source);
+    }
+    imv->current_source = new_source;
+    imv_source_set_callback(imv->current_source, &source_callback, imv);
+    imv_source_set_partial(imv->current_source, true);
+
+    int width, height;
+    get_target_size(imv, &width, &height);
+    imv_source_set_target_size(imv->current_source, width, height);
+    imv_source_async_load_first_frame(imv->current_source);
+
+    imv->loading = true;
+    imv->refining = false;
+    imv->previewing = false;
+    imv_viewport_set_playing(imv->view, true);
+
+    update_title(imv);
+  } else if (!imv->stream.reading || strcmp(path, "-")) {
+    /* Error loading path so remove it from the navigator. A stream stays,
+     * as there may be more frames to come. */
+    imv_navigator_remove(imv->navigator, path);
+    imv->loading = false;
+    imv->reply.load_failed = true;
+  }
+}
+
+/* Starts decoding the newest frame read from the stream, if there's one
+ * that hasn't been shown yet */
+static void show_stream_frame(struct imv *imv)
+{
+  pthread_mutex_lock(&imv->stream.lock);
+  struct imv_stream_frame *frame = imv->stream.pending;
+  imv->stream.pending = NULL;
+  imv->stream.notified = false;
+  pthread_mutex_unlock(&imv->stream.lock);
+
+  if (!frame) {
+    return;
+  }
+
+  /* Sources opened on the last frame hold their own reference to it */
+  imv_stream_frame_unref(imv->stream.current);
+  imv->stream.current = frame;
+  imv->stdin_image_data = imv_stream_frame_data(frame);
+  imv->stdin_image_data_len = imv_stream_frame_size(frame);
+
+  const struct timespec mtime = {0};
+  open_current_file(imv, "-", &mtime);
+}
+
+/* Displays an image taken from the prefetch cache */
+static void show_cached_image(struct imv *imv, struct imv_image *image)
+{
+  /* There's no source behind a cached image, so stop listening to the old
+   * one before it feeds us any more frames.
+   */
+  if (imv->current_source) {
+    imv_source_async_free(imv->current_source);
+    imv->current_source = NULL;
+  }
+  imv->last_source = NULL;
+  imv->refining = false;
+
+  /* Already decoded, so every stage up to the upload takes no time */
+  const double now = cur_time();
+  imv->timing.open = now;
+  imv->timing.opened = now;
+  imv->timing.decoded = now;
+  imv->timing.uploaded = 0.0;
+  imv->timing.presented = 0.0;
+
+  handle_new_image(imv, image, 0);
+  imv_viewport_set_playing(imv->view, true);
+
+  update_title(imv);
+}
+
+static struct prefetch_job *pending_prefetch(struct imv *imv, const char *path,
+                                             int page)
+{
+  for (size_t i = 0; i < imv->prefetch.pending->len; ++i) {
+    struct prefetch_job *job = imv->prefetch.pending->items[i];
+    if (job->page == page && !strcmp(job->path, path)) {
+      return job;
+    }
+  }
+  return NULL;
+}
+
+static bool is_prefetching(struct imv *imv, const char *path, int page)
+{
+  return pending_prefetch(imv, path, page) != NULL;
+}
+
+/* Returns the prefetch job the current image is waiting on, if it is */
+static struct prefetch_job *awaited_prefetch(struct imv *imv)
+{
+  if (!imv->loading || imv->current_source || !imv->current_file.path) {
+    return NULL;
+  }
+  return pending_prefetch(imv, imv->current_file.path, imv->current_file.page);
+}
+
+static void remove_pending_prefetch(struct imv *imv, struct prefetch_job *job)
+{
+  for (size_t i = 0; i < imv->prefetch.pending->len; ++i) {
+    if (imv->prefetch.pending->items[i] == job) {
+      list_remove(imv->prefetch.pending, i);
+      return;
+    }
+  }
+}
+
+static void prefetch_callback(struct imv_source_message *msg)
+{
+  struct prefetch_job *job = msg->user_data;
+  if (msg->page != job->page) {
+    /* there weren't that many pages after all */
+    imv_image_free(msg->image);
+    return;
+  }
+  job->image = msg->image;
+  job->frametime = msg->frametime;
+}
+
+static void prefetch_job(void *data)
+{
+  struct prefetch_job *job = data;
+
+  struct imv_source *src;
+  if (open_source(job->imv, job->path, &src) == BACKEND_SUCCESS) {
+    imv_source_set_callback(src, &prefetch_callback, job);
+    imv_source_set_target_size(src, job->target_width, job->target_height);
+    imv_source_set_page(src, job->page);
+    imv_source_load_first_frame(src);
+    imv_source_free(src);
+  }
+
+  if (job->imv->prefetch.compress && job->image && job->frametime == 0) {
+    job->packed = imv_packed_image_create(job->image);
+  }
+
+  struct internal_event *event = calloc(1, sizeof *event);
+  event->type = PREFETCHED_IMAGE;
+  event->data.prefetched_image.job = job;
+
+  struct imv_event e = {
+    .type = IMV_EVENT_CUSTOM,
+    .data = {
+      .custom = event
+    }
+  };
+  imv_window_push_event(job->imv->window, &e);
+}
+
+/* Called on the main thread in place of prefetch_job */
+static void cancel_prefetch_job(void *data)
+{
+  struct prefetch_job *job = data;
+  remove_pending_prefetch(job->imv, job);
+  free(job->path);
+  free(job);
+}
+
+static void prefetch_path(struct imv *imv, const char *path, int page)
+{
+  if (!imv->workers) {
+    return;
+  }
+
+  struct timespec mtime;
+  if (!get_mtime(path, &mtime)) {
+    return;
+  }
+
+  if (imv_image_cache_contains_page(imv->prefetch.cache, path, page, &mtime)
+      || is_prefetching(imv, path, page)) {
+    return;
+  }
+
+  struct prefetch_job *job = calloc(1, sizeof *job);
+  job->imv = imv;
+  job->path = strdup(path);
+  job->page = page;
+  job->mtime = mtime;
+  get_target_size(imv, &job->target_width, &job->target_height);
+
+  list_append(imv->prefetch.pending, job);
+  imv_worker_pool_submit(imv->workers, job, IMV_JOB_BACKGROUND,
+      prefetch_job, cancel_prefetch_job, job);
+}
+
+/* Starts decoding the images either side of the current one, nearest first,
+ * so that moving to them is a cache hit */
+static void prefetch_neighbours(struct imv *imv)
+{
+  /* Anything not yet started is for where we used to be, so drop it, other
+   * than the one the current image is waiting on. Work on a copy, as
+   * cancelling removes jobs from the pending list. */
+  {
+    const struct prefetch_job *awaited = awaited_prefetch(imv);
+    struct list *jobs = list_create();
+    for (size_t i = 0; i < imv->prefetch.pending->len; ++i) {
+      if (imv->prefetch.pending->items[i] != awaited) {
+        list_append(jobs, imv->prefetch.pending->items[i]);
+      }
+    }
+    for (size_t i = 0; i < jobs->len; ++i) {
+      imv_worker_pool_cancel(imv->workers, jobs->items[i]);
+    }
+    list_free(jobs);
+  }
+
+  /* Whatever memory is left is better spent on the current image */
+  fit_cache_to_budget(imv);
+
+  /* A slideshow always has the image it's moving on to ready by the time
+   * it does */
+  int most = imv->prefetch.distance;
+  if (imv->slideshow.duration > 0.0 && most < 1) {
+    most = 1;
+  }
+  const ssize_t len = imv_navigator_length(imv->navigator);
+  if (most <= 0 || len < 2 || memory_is_short(imv)) {
+    return;
+  }
+
+  const ssize_t index = imv_navigator_index(imv->navigator);
+  for (ssize_t distance = 1; distance <= most; ++distance) {
+    const ssize_t targets[] = {index + distance, index - distance};
+    for (size_t i = 0; i < sizeof targets / sizeof *targets; ++i) {
+      ssize_t target = targets[i];
+      if (target < 0 || target >= len) {
+        if (!imv->loop_input) {
+          continue;
+        }
+        target = ((target % len) + len) % len;
+      }
+      if (target != index) {
+        prefetch_path(imv, imv_navigator_at(imv->navigator, target), 0);
+      }
+    }
+  }
+}
+
+/* Starts decoding the pages either side of the current one of a file of
+ * several, so that turning to them is a cache hit */
+static void prefetch_pages(struct imv *imv)
+{
+  if (imv->prefetch.distance <= 0 || !imv->current_file.path
+      || memory_is_short(imv)) {
+    return;
+  }
+  if (!imv->current_file.last_page) {
+    prefetch_path(imv, imv->current_file.path, imv->current_file.page + 1);
+  }
+  if (imv->current_file.page > 0) {
+    prefetch_path(imv, imv->current_file.path, imv->current_file.page - 1);
+  }
+}
+
+/* Shows the given page of the current file, if it has that many. It's
+ * reloaded from the file unless it's in the prefetch cache. */
+static void turn_page(struct imv *imv, int page)
+{
+  if (!imv->current_file.path || page < 0 || page == imv->current_file.page
+      || (page > imv->current_file.page && imv->current_file.last_page)) {
+    return;
+  }
+
+  const bool from_stdin = !strcmp(imv->current_file.path, "-");
+  struct imv_image *cached = from_stdin ? NULL
+    : imv_image_cache_get_page(imv->prefetch.cache, imv->current_file.path,
+        page, &imv->current_file.mtime);
+  if (cached) {
+    imv->current_file.page = page;
+    /* Nothing's known of the pages after until one's asked for */
+    imv->current_file.last_page = false;
+    imv->current_file.turning = false;
+    show_cached_image(imv, cached);
+    prefetch_pages(imv);
+    return;
+  }
+
+  if (!imv->current_source) {
+    /* It came from the cache, so we need a source to load it with */
+    struct imv_source *src;
+    if (open_source(imv, imv->current_file.path, &src) != BACKEND_SUCCESS) {
+      return;
+    }
+    imv->current_source = src;
+    imv->last_source = NULL;
+    imv_source_set_callback(imv->current_source, &source_callback, imv);
+  }
+
+  imv->current_file.turning = true;
+  imv->loading = true;
+  imv->refining = false;
+  imv->reply.load_failed = false;
+
+  int width, height;
+  get_target_size(imv, &width, &height);
+  imv_source_set_partial(imv->current_source, true);
+  imv_source_set_target_size(imv->current_source, width, height);
+  imv_source_set_page(imv->current_source, page);
+  imv_source_async_load_first_frame(imv->current_source);
+}
+
+/* Uploads a little of whichever image next to the current one is decoded
+ * but not yet on the GPU, so that moving to it needs no upload either.
+ * Returns true if there's more to do. */
+static bool preload_neighbours(struct imv *imv)
+{
+  const ssize_t len = imv_navigator_length(imv->navigator);
+  if (len < 2) {
+    return false;
+  }
+
+  const ssize_t index = imv_navigator_index(imv->navigator);
+  const ssize_t targets[] = {index + 1, index - 1};
+  for (size_t i = 0; i < sizeof targets / sizeof *targets; ++i) {
+    ssize_t target = targets[i];
+    if (target < 0 || target >= len) {
+      if (!imv->loop_input) {
+        continue;
+      }
+      target = ((target % len) + len) % len;
+    }
+    const char *path = imv_navigator_at(imv->navigator, target);
+    struct timespec mtime;
+    if (target == index || !strcmp(path, "-") || !get_mtime(path, &mtime)) {
+      continue;
+    }
+    /* Packed images stay packed until they're shown */
+    struct imv_image *image = imv_image_cache_get_decoded(imv->prefetch.cache,
+        path, &mtime);
+    if (!image) {
+      continue;
+    }
+    const bool more = imv_canvas_preload_image(imv->canvas, image);
+    imv_image_free(image);
+    if (more) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void thumbnail_callback(struct imv_source_message *msg)
+{
+  struct imv_image **image = msg->user_data;
+  *image = msg->image;
+}
+
+/* Decodes an image for the gallery to make a thumbnail from. Runs on a
+ * worker thread. */
+static struct imv_image *load_thumbnail(const char *path, int size, void *data)
+{
+  struct imv *imv = data;
+  struct imv_image *image = NULL;
+
+  struct imv_source *src;
+  if (strcmp(path, "-") && open_source(imv, path, &src) == BACKEND_SUCCESS) {
+    imv_source_set_callback(src, &thumbnail_callback, &image);
+    imv_source_set_target_size(src, size, size);
+    imv_source_load_first_frame(src);
+    imv_source_free(src);
+  }
+  return image;
+}
+
+static void thumbnail_ready(void *data)
+{
+  struct imv *imv = data;
+
+  struct internal_event *event = calloc(1, sizeof *event);
+  event->type = THUMBNAIL_READY;
+
+  struct imv_event e = {
+    .type = IMV_EVENT_CUSTOM,
+    .data = {
+      .custom = event
+    }
+  };
+  imv_window_push_event(imv->window, &e);
+}
+
+/* Called from the canvas's threads when it has something new to draw, such
+ * as an SVG rasterised at a new scale */
+static void canvas_ready(void *data)
+{
+  struct imv *imv = data;
+
+  struct internal_event *event = calloc(1, sizeof *event);
+  event->type = CANVAS_READY;
+
+  struct imv_event e = {
+    .type = IMV_EVENT_CUSTOM,
+    .data = {
+      .custom = event
+    }
+  };
+  imv_window_push_event(imv->window, &e);
+}
+
+/* Called from the navigator's threads when directories it was reading turn
+ * up more paths */
+static void paths_found(void *data)
+{
+  struct imv *imv = data;
+
+  struct internal_event *event = calloc(1, sizeof *event);
+  event->type = PATHS_FOUND;
+
+  struct imv_event e = {
+    .type = IMV_EVENT_CUSTOM,
+    .data = {
+      .custom = event
+    }
+  };
+  imv_window_push_event(imv->window, &e);
+}
+
+/* Called from a worker when the metadata index has learnt more about the
+ * files it was asked about */
+static void metadata_indexed(void *data)
+{
+  struct imv *imv = data;
+
+  struct internal_event *event = calloc(1, sizeof *event);
+  event->type = METADATA_INDEXED;
+
+  struct imv_event e = {
+    .type = IMV_EVENT_CUSTOM,
+    .data = {
+      .custom = event
+    }
+  };
+  imv_window_push_event(imv->window, &e);
+}
+
+/* Called by the navigator as it adds the files of each directory */
+static void watch_dir(const char *dir, void *data)
+{
+  struct imv *imv = data;
+  imv_watcher_watch_dir(imv->watcher, dir);
+}
+
+/* Called when the watcher sees a file change */
+static void file_changed(enum imv_watch_event event, const char *path,
+    void *data)
+{
+  struct imv *imv = data;
+
+  if (event != IMV_WATCH_REMOVED && imv->sort.index) {
+    imv_metadata_index_refresh(imv->sort.index, path);
+  }
+
+  if (event != IMV_WATCH_REMOVED && imv->current_file.path
+      && !strcmp(path, imv->current_file.path)) {
+    imv_navigator_notify_changed(imv->navigator);
+    return;
+  }
+
+  if (!imv->watch_directories) {
+    return;
+  }
+
+  const ssize_t index = imv_navigator_find_path(imv->navigator, path);
+  const bool known = index != -1
+    && !strcmp(imv_navigator_at(imv->navigator, index), path);
+
+  if (event == IMV_WATCH_REMOVED && known) {
+    imv_navigator_remove_at(imv->navigator, index);
+    imv->need_redraw = true;
+  } else if (event != IMV_WATCH_REMOVED && !known) {
+    imv_navigator_add(imv->navigator, path, false);
+    imv->need_redraw = true;
+    /* Into place once it's indexed, at the end until then */
+    update_order(imv);
+  }
+}
+
+/* The current image was decoded at reduced resolution and we now need more
+ * detail, so load it again at full resolution */
+static void refine_current_image(struct imv *imv)
+{
+  /* Settle for what we have if the full image won't fit in the budget */
+  const size_t full_size = (size_t)imv_image_width(imv->current_image)
+    * imv_image_height(imv->current_image)
+    * imv_bitmap_pixel_size(imv_image_format(imv->current_image));
+  const size_t size = imv_image_size(imv->current_image);
+  if (full_size > size && full_size - size > memory_headroom(imv)) {
+    return;
+  }
+
+  if (!imv->current_source) {
+    /* It came from the cache, so we need a source to load it with */
+    struct imv_source *src;
+    if (open_source(imv, imv->current_file.path, &src) != BACKEND_SUCCESS) {
+      return;
+    }
+    imv->current_source = src;
+    imv->last_source = NULL;
+    imv_source_set_callback(imv->current_source, &source_callback, imv);
+    imv_source_set_page(imv->current_source, imv->current_file.page);
+  }
+
+  imv->refining = true;
+
+  /* Something better than a preview is already on screen */
+  imv_source_set_partial(imv->current_source, false);
+  imv_source_set_target_size(imv->current_source, 0, 0);
+  imv_source_async_load_first_frame(imv->current_source);
+}
+
+static void handle_prefetched_image(struct imv *imv, struct prefetch_job *job)
+{
+  remove_pending_prefetch(imv, job);
+
+  /* Animations need their source kept open, so only still images are
+   * worth keeping */
+  if (job->packed) {
+    imv_image_cache_put_packed(imv->prefetch.cache, job->path, job->page,
+        &job->mtime, job->packed);
+    fit_cache_to_budget(imv);
+  } else if (job->image && job->frametime == 0) {
+    imv_image_cache_put_page(imv->prefetch.cache, job->path, job->page,
+        &job->mtime, imv_image_ref(job->image));
+    fit_cache_to_budget(imv);
+  }
+
+  /* Was the user waiting on this one? */
+  const bool awaited = imv->loading && !imv->current_source
+    && imv->current_file.path && !strcmp(imv->current_file.path, job->path)
+    && imv->current_file.page == job->page;
+
+  if (awaited) {
+    if (job->image && job->frametime == 0) {
+      show_cached_image(imv, imv_image_ref(job->image));
+    } else {
+      /* Either it failed, or it needs a source of its own. Trying again
+       * the usual way takes care of both */
+      const struct timespec mtime = job->mtime;
+      open_current_file(imv, job->path, &mtime);
+    }
+  }
+
+  imv_image_free(job->image);
+  free(job->path);
+  free(job);
+}
+
+/* Counts a wakeup of the main loop, logging the count for the last second
+ * or more once it's up. A loop with nothing to do logs nothing at all. */
+static void count_wakeup(struct imv *imv)
+{
+  if (!imv->wakeups.enabled) {
+    return;
+  }
+
+  const double now = cur_time();
+  imv->wakeups.count++;
+  if (now - imv->wakeups.since >= 1.0) {
+    imv_log(IMV_INFO, "%d wakeups in %.1f seconds\n", imv->wakeups.count,
+        now - imv->wakeups.since);
+    imv->wakeups.count = 0;
+    imv->wakeups.since = now;
+  }
+}
+
+/* One file to draw and write with --render */
+struct render_job {
+  struct imv *imv;
+  char *path;
+  bool ok;
+};
+
+/* Decodes, scales and writes one file for --render. Runs on a worker. */
+static void render_file(void *data)
+{
+  struct render_job *job = data;
+  struct imv *imv = job->imv;
+  const int width = imv->render.width;
+  const int height = imv->render.height;
+
+  char output[PATH_MAX];
+  if (!imv_render_output_path(imv->render.output, job->path, output, sizeof output)) {
+    imv_log(IMV_ERROR, "Output path too long for %s\n", job->path);
+    return;
+  }
+
+  struct imv_image *image = NULL;
+  struct imv_source *src;
+  if (open_source(imv, job->path, &src) == BACKEND_SUCCESS) {
+    imv_source_set_callback(src, &thumbnail_callback, &image);
+    /* As when showing images, only when they're scaled to fit is it known
+     * that they can be decoded at reduced resolution */
+    if (imv->scaling_mode == SCALING_FULL || imv->scaling_mode == SCALING_DOWN) {
+      imv_source_set_target_size(src, width, height);
+    }
+    imv_source_load_first_frame(src);
+    imv_source_free(src);
+  }
+  if (!image) {
+    imv_log(IMV_ERROR, "Failed to load %s\n", job->path);
+    return;
+  }
+
+  struct imv_viewport *view = imv_viewport_create(width, height, width, height);
+  if (imv->custom_start_pan) {
+    imv_viewport_set_default_pan_factor(view, imv->initial_pan_x, imv->initial_pan_y);
+  }
+  imv_viewport_rescale(view, image, imv->scaling_mode);
+  int x, y;
+  double scale;
+  imv_viewport_get_offset(view, &x, &y);
+  imv_viewport_get_scale(view, &scale);
+  imv_viewport_free(view);
+
+  cairo_surface_t *surface = imv_render_image(image, x, y, scale, width, height,
+      imv->upscaling_method);
+  imv_image_free(image);
+
+  job->ok = surface && imv_render_write(surface, output);
+  if (!job->ok) {
+    imv_log(IMV_ERROR, "Failed to write %s\n", output);
+  }
+  if (surface) {
+    cairo_surface_destroy(surface);
+  }
+}
+
+/* Writes every image given to a file as imv would show it in a window of
+ * the render size, decoding as many at once as there are workers. Returns
+ * the exit status. */
+static int run_render(struct imv *imv)
+{
+  if (imv->paths_from_stdin) {
+    char buf[PATH_MAX];
+    while (fgets(buf, sizeof buf, stdin)) {
+      size_t len = strlen(buf);
+      if (len && buf[len - 1] == '\n') {
+        buf[--len] = '\0';
+      }
+      if (len) {
+        imv_add_path(imv, buf);
+      }
+    }
+  }
+  imv_navigator_finish_scan(imv->navigator);
+
+  const size_t count = imv_navigator_length(imv->navigator);
+  if (count > 1 && strcmp(imv->render.output, "-")
+      && !strstr(imv->render.output, "%s")) {
+    imv_log(IMV_ERROR, "Rendering several images needs a %%s in the output "
+        "path for each one's name. Aborting.\n");
+    return 1;
+  }
+
+  struct render_job *jobs = calloc(count, sizeof *jobs);
+  imv->workers = imv_worker_pool_create(imv->decode_threads);
+  /* so that a big image decodes on whichever workers are left idle */
+  imv_source_set_worker_pool(imv->workers);
+  for (size_t i = 0; i < count; ++i) {
+    jobs[i].imv = imv;
+    jobs[i].path = strdup(imv_navigator_at(imv->navigator, i));
+    imv_worker_pool_submit(imv->workers, NULL, IMV_JOB_NORMAL, &render_file,
+        NULL, &jobs[i]);
+  }
+  /* Runs every job queued before returning */
+  imv_worker_pool_free(imv->workers);
+  imv_source_set_worker_pool(NULL);
+  imv->workers = NULL;
+
+  size_t failed = 0;
+  for (size_t i = 0; i < count; ++i) {
+    failed += !jobs[i].ok;
+    free(jobs[i].path);
+  }
+  free(jobs);
+  return failed ? 1 : 0;
+}
+
 int imv_run(struct imv *imv)
 {
   if (imv->quit)
     return 0;
 
+  if (imv->render.output)
+    return run_render(imv);
+
   if (!setup_window(imv))
     return 1;
 
+  imv->workers = imv_worker_pool_create(imv->decode_threads);
+  imv_source_set_worker_pool(imv->workers);
+
+  /* Tables are drawn with as soon as they're built, like the rest of what
+   * the canvas prepares in the background */
+  imv->color.tables = imv_color_create(imv->workers, &canvas_ready, imv);
+  if (imv->color.display_profile && !imv_color_set_display_profile(
+        imv->color.tables, imv->color.display_profile)) {
+    imv_log(IMV_WARNING, "Failed to read display profile '%s', assuming sRGB\n",
+        imv->color.display_profile);
+  }
+
+  imv->frames.ring = calloc(imv->frames.capacity, sizeof *imv->frames.ring);
+
   imv->ipc = imv_ipc_create();
   if (imv->ipc) {
-    imv_ipc_set_command_callback(imv->ipc, &command_callback, imv);
+    imv_ipc_set_command_callback(imv->ipc, &ipc_command_callback, imv);
+  }
+
+  /* Watching the current file makes polling it for changes unnecessary */
+  imv->watcher = imv_watcher_create();
+  if (imv->watcher) {
+    imv_window_set_poll_fd(imv->window, imv_watcher_fd(imv->watcher));
+    imv_navigator_set_polling(imv->navigator, false);
+    if (imv->watch_directories) {
+      imv_navigator_set_dir_callback(imv->navigator, &watch_dir, imv);
+    }
+  }
+  startup_mark(imv, "started workers, IPC and watcher");
+
+  /* Directories given on the command line are being read in the background,
+   * so pick up what they've turned up so far, and hear about the rest */
+  imv_navigator_set_scan_callback(imv->navigator, &paths_found, imv);
+  imv_navigator_collect(imv->navigator);
+  if (is_sorted(imv)) {
+    apply_sort(imv);
   }
 
   /* if loading paths from stdin, kick off a thread to do that - we'll receive
@@ -1055,6 +2925,11 @@ int imv_run(struct imv *imv)
     }
   }
 
+  if (imv->stream.reading
+      && pthread_create(&imv->stream.thread, NULL, read_stream, imv)) {
+    return 1;
+  }
+
   if (imv->starting_path) {
     if (imv->paths_from_stdin) {
       int max_tries = 1000;
@@ -1090,6 +2965,8 @@ int imv_run(struct imv *imv)
         max_tries -= 1;
       }
     } else {
+      /* Where the starting image is can't be known until it's been found */
+      imv_navigator_finish_scan(imv->navigator);
       ssize_t index = imv_navigator_find_path(imv->navigator, imv->starting_path);
       if (index == -1) {
         index = (int) strtol(imv->starting_path, NULL, 10);
@@ -1120,6 +2997,8 @@ int imv_run(struct imv *imv)
 
   while (!imv->quit) {
 
+    bool selection_changed = false;
+
     /* Check if navigator wrapped around paths lists */
     if (!imv->loop_input && imv_navigator_wrapped(imv->navigator)) {
       break;
@@ -1134,73 +3013,59 @@ int imv_run(struct imv *imv)
       const char *current_path = imv_navigator_selection(imv->navigator);
       /* check we got a path back */
       if (strcmp("", current_path)) {
-
-        const bool path_is_stdin = !strcmp("-", current_path);
-        struct imv_source *new_source;
-
-        enum backend_result result = BACKEND_UNSUPPORTED;
-
-        if (!imv->backends) {
-          imv_log(IMV_ERROR, "No backends installed. Unable to load image.\n");
+        struct timespec mtime = {0};
+        struct imv_image *cached = NULL;
+        if (get_mtime(current_path, &mtime)) {
+          cached = imv_image_cache_get(imv->prefetch.cache, current_path, &mtime);
         }
 
-        for (size_t i = 0; i < imv->backends->len; ++i) {
-          const struct imv_backend *backend = imv->backends->items[i];
-          if (path_is_stdin) {
-
-            if (!backend->open_memory) {
-              /* memory loading unsupported by backend */
-              continue;
-            }
-
-            if (!imv->stdin_image_data || !imv->stdin_image_data_len) {
-              /* Skip if image failed to load */
-              continue;
-            }
-
-            result = backend->open_memory(imv->stdin_image_data,
-                imv->stdin_image_data_len, &new_source);
-          } else {
-
-            if (!backend->open_path) {
-              /* path loading unsupported by backend */
-              continue;
-            }
-
-            result = backend->open_path(current_path, &new_source);
-          }
-          if (result == BACKEND_UNSUPPORTED) {
-            /* Try the next backend */
-            continue;
-          } else {
-            break;
-          }
-        }
-
-        if (result == BACKEND_SUCCESS) {
+        if (cached) {
+          set_current_file(imv, current_path, &mtime);
+          show_cached_image(imv, cached);
+        } else if (is_prefetching(imv, current_path, 0)) {
+          /* It's already being decoded in the background, so wait for that
+           * to finish rather than decoding it twice, and no longer behind
+           * the rest of the background work */
+          set_current_file(imv, current_path, &mtime);
           if (imv->current_source) {
             imv_source_async_free(imv->current_source);
+            imv->current_source = NULL;
           }
-          imv->current_source = new_source;
-          imv_source_set_callback(imv->current_source, &source_callback, imv);
-          imv_source_async_load_first_frame(imv->current_source);
-
           imv->loading = true;
-          imv_viewport_set_playing(imv->view, true);
-
-          char title[1024];
-          generate_env_text(imv, title, sizeof title, imv->title_text);
-          imv_window_set_title(imv->window, title);
+          imv_worker_pool_set_priority(imv->workers,
+              pending_prefetch(imv, current_path, 0), IMV_JOB_NORMAL);
         } else {
-          /* Error loading path so remove it from the navigator */
-          imv_navigator_remove(imv->navigator, current_path);
+          open_current_file(imv, current_path, &mtime);
         }
+        selection_changed = true;
       } else {
-        /* No image currently selected */
+        /* No image currently selected, nor any left to load */
         if (imv->current_image) {
           imv_image_free(imv->current_image);
           imv->current_image = NULL;
         }
+        imv->loading = false;
+      }
+    }
+
+    /* Once the last frame of a stream being watched has been decoded, move
+     * on to the newest, skipping any that came and went meanwhile */
+    if (imv->stream.reading && !imv->loading
+        && !strcmp(imv_navigator_selection(imv->navigator), "-")) {
+      show_stream_frame(imv);
+    }
+
+    /* A wait is over once what it was waiting on has loaded, now that any
+     * commands before it have had their effect */
+    if (imv->reply.waiting && !imv->loading) {
+      finish_wait(imv);
+    }
+
+    /* Now we know where we are, start decoding the images around us */
+    if (selection_changed) {
+      prefetch_neighbours(imv);
+      if (imv->gallery.enabled) {
+        imv->need_redraw = true;
       }
     }
 
@@ -1209,34 +3074,54 @@ int imv_run(struct imv *imv)
       imv_viewport_rescale(imv->view, imv->current_image, imv->scaling_mode);
     }
 
+    /* If the image is being shown at more detail than it was decoded with,
+     * it's time to decode it at full resolution */
+    if (imv->current_image && !imv->loading && !imv->refining
+        && imv->current_file.path) {
+      double scale;
+      imv_viewport_get_scale(imv->view, &scale);
+      if (scale > imv_image_resolution(imv->current_image) * 1.01) {
+        refine_current_image(imv);
+      }
+    }
+
     current_time = cur_time();
+    const double slack = frame_slack(imv, current_time);
 
     /* Check if a new frame is due */
     bool should_change_frame = false;
-    if (imv->next_frame.force_next_frame && imv->next_frame.image) {
+    bool on_time = false;
+    if (imv->frames.force_next_frame && imv->frames.count) {
       should_change_frame = true;
     }
-    if (imv_viewport_is_playing(imv->view) && imv->next_frame.image
-        && imv->next_frame.due && imv->next_frame.due <= current_time) {
+    if (imv_viewport_is_playing(imv->view) && imv->frames.count
+        && imv->frames.due && imv->frames.due <= current_time + slack) {
       should_change_frame = true;
+      on_time = !imv->frames.force_next_frame;
     }
 
     if (should_change_frame) {
+      struct frame *frame = &imv->frames.ring[imv->frames.first];
       if (imv->current_image) {
         imv_image_free(imv->current_image);
       }
-      imv->current_image = imv->next_frame.image;
-      imv->next_frame.image = NULL;
-      imv->next_frame.due = current_time + imv->next_frame.duration;
-      imv->next_frame.duration = 0;
-      imv->next_frame.force_next_frame = false;
+      imv->current_image = frame->image;
+      /* Count from when this frame was due rather than when it was drawn,
+       * so that rounding to refreshes doesn't pile up into drift, unless
+       * it's fallen a whole frame behind */
+      if (on_time && imv->frames.due + frame->duration > current_time) {
+        imv->frames.due += frame->duration;
+      } else {
+        imv->frames.due = current_time + frame->duration;
+      }
+      imv->frames.first = (imv->frames.first + 1) % imv->frames.capacity;
+      imv->frames.count--;
+      imv->frames.force_next_frame = false;
 
       imv->need_redraw = true;
 
-      /* Trigger loading of a new frame, now this one's being displayed */
-      if (imv->current_source) {
-        imv_source_async_load_next_frame(imv->current_source);
-      }
+      /* Make room for another frame, now this one's being displayed */
+      fill_frames(imv);
     }
 
     /* handle slideshow */
@@ -1244,9 +3129,19 @@ int imv_run(struct imv *imv)
       double dt = current_time - last_time;
 
       imv->slideshow.elapsed += dt;
-      if (imv->slideshow.elapsed >= imv->slideshow.duration) {
+      /* Move on in time for the next image to be on the frame shown when
+       * it's due, rather than the one after */
+      if (imv->slideshow.elapsed + slack >= imv->slideshow.duration) {
+        begin_crossfade(imv);
         imv_navigator_select_rel(imv->navigator, 1);
-        imv->slideshow.elapsed = 0;
+        /* The next is timed from when this one was due, not from now, so
+         * moving on early doesn't cut it short, and the slides keep to
+         * time however long the show runs. After a stall longer than a
+         * slide, it starts afresh rather than racing to catch up. */
+        imv->slideshow.elapsed -= imv->slideshow.duration;
+        if (imv->slideshow.elapsed >= imv->slideshow.duration) {
+          imv->slideshow.elapsed = 0;
+        }
         imv->need_redraw = true;
       }
     }
@@ -1258,37 +3153,91 @@ int imv_run(struct imv *imv)
       imv->need_redraw = true;
     }
 
-    if (imv->need_redraw) {
-      imv_window_clear(imv->window, 0, 0, 0);
-      render_window(imv);
-      imv_window_present(imv->window);
+    /* Anything that comes up while the last frame is waiting to be shown is
+     * left for the one after, so it's all drawn at once */
+    if (imv->need_redraw && imv_window_can_present(imv->window)) {
+      if (imv->background.type == BACKGROUND_SOLID) {
+        imv_window_clear(imv->window, imv->background.color.r,
+            imv->background.color.g, imv->background.color.b);
+      } else {
+        imv_window_clear(imv->window, 0, 0, 0);
+      }
+      if (imv_window_is_software(imv->window)) {
+        int width, height, stride;
+        void *pixels = imv_window_get_pixels(imv->window, &width, &height, &stride);
+        if (pixels) {
+          imv_canvas_set_target(imv->canvas, pixels, width, height, stride);
+          render_and_present(imv);
+          imv_canvas_set_target(imv->canvas, NULL, 0, 0, 0);
+        }
+      } else {
+        render_and_present(imv);
+      }
+      if (!imv->startup.reported) {
+        /* Only the first frame with an image on it counts as started */
+        startup_mark(imv, imv->current_image ? "presented first image"
+            : "presented a frame");
+        if (imv->current_image) {
+          startup_report(imv);
+        }
+      }
     }
 
-    /* sleep until we have something to do */
-    double timeout = 1.0; /* seconds */
+    /* sleep until we have something to do. Everything else that can happen
+     * arrives as an event, so with nothing due we can sleep indefinitely,
+     * except without a watcher, when the navigator has to poll the current
+     * file for changes */
+    double timeout = imv->watcher ? -1.0 : 1.0; /* seconds */
+
+    /* If parts of the image are still being uploaded, or it's being faded
+     * into, come back to draw them as soon as they're ready */
+    if (imv_canvas_uploads_pending(imv->canvas) || imv->gallery.more
+        || imv->fade.image) {
+      imv->need_redraw = true;
+      if (imv_window_can_present(imv->window)) {
+        timeout = 0.001;
+      }
+    }
+
+    /* With the current image all drawn, get ahead on the next ones */
+    if (!imv->need_redraw && !imv->loading && !imv->gallery.enabled
+        && imv->current_image && preload_neighbours(imv)) {
+      timeout = 0.001;
+    }
 
     /* If we need to display the next frame of an animation soon we should
      * limit our sleep until the next frame is due.
      */
-    if (imv_viewport_is_playing(imv->view) && imv->next_frame.due != 0.0) {
-      timeout = imv->next_frame.due - current_time;
-      if (timeout < 0.001) {
-        timeout = 0.001;
+    if (imv_viewport_is_playing(imv->view) && imv->frames.due != 0.0) {
+      double timeleft = imv->frames.due - slack - current_time;
+      if (timeleft < 0.001) {
+        timeleft = 0.001;
+      }
+      if (timeout < 0.0 || timeleft < timeout) {
+        timeout = timeleft;
       }
     }
 
-    if (imv->slideshow.duration > 0) {
-      double timeleft = imv->slideshow.duration - imv->slideshow.elapsed;
-      if (timeleft > 0.0 && timeleft < timeout) {
-        timeout = timeleft + 0.001;
+    /* The slideshow only moves on while playing */
+    if (imv_viewport_is_playing(imv->view) && imv->slideshow.duration > 0) {
+      double timeleft = imv->slideshow.duration - imv->slideshow.elapsed - slack;
+      if (timeleft < 0.001) {
+        timeleft = 0.001;
+      }
+      if (timeout < 0.0 || timeleft < timeout) {
+        timeout = timeleft;
       }
     }
 
     /* Go to sleep until an input/internal event or the timeout expires */
     imv_window_wait_for_event(imv->window, timeout);
+    count_wakeup(imv);
 
     /* Handle the new events that have arrived */
     imv_window_pump_events(imv->window, event_handler, imv);
+    if (imv->watcher) {
+      imv_watcher_dispatch(imv->watcher, &file_changed, imv);
+    }
   }
 
   if (imv->list_files_at_exit) {
@@ -1311,17 +3260,27 @@ int imv_run(struct imv *imv)
     fclose(imv->stdin_pipe);
   }
 
+  if (imv->stream.reading) {
+    pthread_cancel(imv->stream.thread);
+    pthread_join(imv->stream.thread, NULL);
+    if (imv->stream.dropped) {
+      imv_log(IMV_INFO, "Dropped %lu frames from stdin\n", imv->stream.dropped);
+    }
+  }
+
   return 0;
 }
 
 static bool setup_window(struct imv *imv)
 {
-  imv->window = imv_window_create(imv->initial_width, imv->initial_height, "imv");
+  imv->window = imv_window_create(imv->initial_width, imv->initial_height, "imv",
+                                  imv->renderer);
 
   if (!imv->window) {
     imv_log(IMV_ERROR, "Failed to create window\n");
     return false;
   }
+  startup_mark(imv, "created window");
 
   {
     int ww, wh, bw, bh;
@@ -1340,48 +3299,169 @@ static bool setup_window(struct imv *imv)
   {
     int ww, wh;
     imv_window_get_size(imv->window, &ww, &wh);
-    imv->canvas = imv_canvas_create(ww, wh);
+    imv->canvas = imv_canvas_create(ww, wh,
+                                    imv_window_is_software(imv->window));
+    imv_canvas_set_ready_callback(imv->canvas, &canvas_ready, imv);
+    imv_canvas_set_texture_budget(imv->canvas, imv->texture_cache_size);
     imv_canvas_font(imv->canvas, imv->overlay.font.name, imv->overlay.font.size);
   }
+  startup_mark(imv, "created canvas");
 
   return true;
 }
 
 
+/* Frees any frames decoded ahead of time */
+static void clear_frames(struct imv *imv)
+{
+  for (size_t i = 0; i < imv->frames.count; ++i) {
+    const size_t index = (imv->frames.first + i) % imv->frames.capacity;
+    imv_image_free(imv->frames.ring[index].image);
+    imv->frames.ring[index].image = NULL;
+  }
+  imv->frames.first = 0;
+  imv->frames.count = 0;
+  imv->frames.decoding = false;
+}
+
+/* Starts decoding another frame of the current image, if there's room for
+ * it and one isn't already being decoded. Frames of a source can only be
+ * decoded in order, so the ring fills one frame at a time. */
+static void fill_frames(struct imv *imv)
+{
+  if (!imv->current_source || imv->frames.decoding
+      || imv->frames.count == imv->frames.capacity) {
+    return;
+  }
+  imv->frames.decoding = true;
+  imv_source_async_load_next_frame(imv->current_source);
+}
+
 static void handle_new_image(struct imv *imv, struct imv_image *image, int frametime)
 {
+  /* Frames of a stream are taken as one moving image, so long as they
+   * stay the same size */
+  const bool next_in_stream = imv->stream.reading && imv->current_image
+    && imv_image_width(imv->current_image) == imv_image_width(image)
+    && imv_image_height(imv->current_image) == imv_image_height(image);
+
   if (imv->current_image) {
     imv_image_free(imv->current_image);
   }
   imv->current_image = image;
   imv->need_redraw = true;
-  imv->need_rescale = true;
+  /* Keep whatever zoom the user chose while watching the image decode */
+  imv->need_rescale = !imv->previewing && !next_in_stream;
   imv->loading = false;
-  imv->next_frame.due = frametime ? cur_time() + frametime * 0.001 : 0.0;
-  imv->next_frame.duration = 0.0;
+  imv->previewing = false;
+
+  /* Any frames left over are from the previous image */
+  clear_frames(imv);
+  imv->frames.due = frametime ? cur_time() + frametime * 0.001 : 0.0;
 
   /* If this is an animated image, we should kick off loading the next frame */
-  if (imv->current_source && frametime) {
-    imv_source_async_load_next_frame(imv->current_source);
+  if (frametime) {
+    fill_frames(imv);
+  }
+}
+
+/* Shows part of the image still being loaded until the whole of it arrives */
+static void handle_partial_image(struct imv *imv, struct imv_image *image)
+{
+  if (!imv->loading) {
+    /* Too late, the complete image has been shown already */
+    imv_image_free(image);
+    return;
+  }
+
+  if (imv->current_image) {
+    imv_image_free(imv->current_image);
+  }
+  imv->current_image = image;
+  imv->need_redraw = true;
+  if (!imv->previewing) {
+    imv->need_rescale = true;
+    imv->previewing = true;
   }
 }
 
 static void handle_new_frame(struct imv *imv, struct imv_image *image, int frametime)
 {
-  if (imv->next_frame.image) {
-    imv_image_free(imv->next_frame.image);
+  imv->frames.decoding = false;
+
+  if (imv->frames.count == imv->frames.capacity) {
+    imv_image_free(image);
+    return;
   }
-  imv->next_frame.image = image;
 
-  imv->next_frame.duration = frametime * 0.001;
-}
+  const size_t last = (imv->frames.first + imv->frames.count) % imv->frames.capacity;
+  imv->frames.ring[last].image = image;
+  imv->frames.ring[last].duration = frametime * 0.001;
+  imv->frames.count++;
+
+  /* Keep decoding ahead until the ring is full */
+  fill_frames(imv);
+}
+
+static void consume_internal_event(struct imv *imv, struct internal_event *event)
+{
+  if (event->type == NEW_IMAGE) {
+    if (!event->data.new_image.is_partial && !imv->timing.decoded) {
+      imv->timing.decoded = cur_time();
+    }
+    if (!imv->current_image && !imv->startup.reported) {
+      startup_mark(imv, event->data.new_image.is_partial
+          ? "received a preview" : "received an image");
+    }
+    /* Another page of the same file counts as a new image, unless it turned
+     * out there were no more and we got the one we had again */
+    const bool new_page = !event->data.new_image.is_partial
+      && event->data.new_image.page != imv->current_file.page;
+    if (!event->data.new_image.is_partial && imv->current_file.turning) {
+      imv->current_file.turning = false;
+      if (!new_page) {
+        imv->current_file.last_page = true;
+        imv->loading = false;
+        imv_image_free(event->data.new_image.image);
+        free(event);
+        return;
+      }
+    }
+    if (!event->data.new_image.is_partial) {
+      imv->current_file.page = event->data.new_image.page;
+      imv->current_file.last_page = event->data.new_image.last_page;
+    }
+
+    /* A preview of the image being loaded vs the full resolution version of
+     * a still image vs a new image vs just a new frame of the same image */
+    if (event->data.new_image.is_partial) {
+      handle_partial_image(imv, event->data.new_image.image);
+    } else if (imv->refining && !event->data.new_image.frametime) {
+      imv->refining = false;
+      if (imv->current_image) {
+        imv_image_free(imv->current_image);
+      }
+      imv->current_image = event->data.new_image.image;
+      imv->need_redraw = true;
 
-static void consume_internal_event(struct imv *imv, struct internal_event *event)
-{
-  if (event->type == NEW_IMAGE) {
-    /* New image vs just a new frame of the same image */
-    if (event->data.new_image.is_new_image) {
+      if (strcmp(imv->current_file.path, "-")) {
+        imv_image_cache_put_page(imv->prefetch.cache, imv->current_file.path,
+            imv->current_file.page, &imv->current_file.mtime,
+            imv_image_ref(imv->current_image));
+        fit_cache_to_budget(imv);
+      }
+    } else if (event->data.new_image.is_new_image || new_page) {
       handle_new_image(imv, event->data.new_image.image, event->data.new_image.frametime);
+
+      /* Keep still images around in case we come back to them */
+      if (!event->data.new_image.frametime && imv->current_file.path
+          && strcmp(imv->current_file.path, "-")) {
+        imv_image_cache_put_page(imv->prefetch.cache, imv->current_file.path,
+            imv->current_file.page, &imv->current_file.mtime,
+            imv_image_ref(imv->current_image));
+        fit_cache_to_budget(imv);
+      }
+      prefetch_pages(imv);
     } else {
       handle_new_frame(imv, event->data.new_image.image, event->data.new_image.frametime);
     }
@@ -1390,30 +3470,82 @@ static void consume_internal_event(struct imv *imv, struct internal_event *event
     /* An image failed to load, remove it from our image list */
     const char *err_path = imv_navigator_selection(imv->navigator);
 
-    /* Special case: the image came from stdin */
-    if (strcmp(err_path, "-") == 0) {
-      if (imv->stdin_image_data) {
-        free(imv->stdin_image_data);
-        imv->stdin_image_data = NULL;
-        imv->stdin_image_data_len = 0;
+    if (strcmp(err_path, "-") == 0 && imv->stream.reading) {
+      /* A bad frame in a stream is skipped, and we carry on with the next */
+      imv_log(IMV_WARNING, "Failed to load frame from stdin.\n");
+      imv->loading = false;
+    } else {
+      /* Special case: the image came from stdin */
+      if (strcmp(err_path, "-") == 0) {
+        if (imv->stdin_image_data) {
+          free(imv->stdin_image_data);
+          imv->stdin_image_data = NULL;
+          imv->stdin_image_data_len = 0;
+        }
+        imv_log(IMV_ERROR, "Failed to load image from stdin.\n");
       }
-      imv_log(IMV_ERROR, "Failed to load image from stdin.\n");
-    }
 
-    imv_navigator_remove(imv->navigator, err_path);
+      imv_navigator_remove(imv->navigator, err_path);
+      imv->loading = false;
+      imv->reply.load_failed = true;
+    }
 
   } else if (event->type == NEW_PATH) {
-    /* Received a new path from the stdin reading thread */
-    imv_add_path(imv, event->data.new_path.path);
-    free(event->data.new_path.path);
+    /* Received new paths from the stdin reading thread. Take them all at
+     * once, so the thread can carry on filling a new buffer meanwhile. */
+    pthread_mutex_lock(&imv->stdin_paths.lock);
+    char *paths = imv->stdin_paths.buf;
+    const size_t len = imv->stdin_paths.len;
+    imv->stdin_paths.buf = NULL;
+    imv->stdin_paths.len = 0;
+    imv->stdin_paths.cap = 0;
+    imv->stdin_paths.notified = false;
+    pthread_mutex_unlock(&imv->stdin_paths.lock);
+
+    for (size_t i = 0; i < len; i += strlen(paths + i) + 1) {
+      imv_add_path(imv, paths + i);
+    }
+    free(paths);
+    /* Need to update image count in title */
+    imv->need_redraw = true;
+    update_order(imv);
+
+  } else if (event->type == PATHS_FOUND) {
     /* Need to update image count in title */
+    if (imv_navigator_collect(imv->navigator)) {
+      imv->need_redraw = true;
+      /* New paths are added at the end, out of order */
+      update_order(imv);
+    }
+
+  } else if (event->type == METADATA_INDEXED) {
+    update_order(imv);
+
+  } else if (event->type == THUMBNAIL_READY) {
+    if (imv->gallery.enabled) {
+      imv->need_redraw = true;
+    }
+
+  } else if (event->type == CANVAS_READY) {
+    imv->need_redraw = true;
+
+  } else if (event->type == NEW_FRAME) {
+    /* Nothing to do but wake up, to take it in the main loop once the
+     * frame before has been decoded */
+
+  } else if (event->type == PREFETCHED_IMAGE) {
+    handle_prefetched_image(imv, event->data.prefetched_image.job);
     imv->need_redraw = true;
 
   } else if (event->type == COMMAND) {
-    struct list *commands = list_create();
-    list_append(commands, event->data.command.text);
-    imv_command_exec_list(imv->commands, commands, imv);
-    list_deep_free(commands);
+    if (event->data.command.from_ipc) {
+      run_ipc_command(imv, event->data.command.text, event->data.command.client);
+    } else {
+      struct list *commands = list_create();
+      list_append(commands, event->data.command.text);
+      imv_command_exec_list(imv->commands, commands, imv);
+      list_deep_free(commands);
+    }
     imv->need_redraw = true;
   }
 
@@ -1421,30 +3553,129 @@ static void consume_internal_event(struct imv *imv, struct internal_event *event
   return;
 }
 
+/* Draws the window and presents it, noting how long the current image
+ * took to reach the screen once it's all been drawn */
+static void render_and_present(struct imv *imv)
+{
+  const double start = cur_time();
+  render_window(imv);
+  const double rendered = cur_time();
+  imv_trace_span("render", NULL, start, rendered);
+  imv_window_present(imv->window);
+  const double presented = cur_time();
+  imv_trace_span("present", NULL, rendered, presented);
+
+  if (imv->current_image && imv->timing.decoded && !imv->timing.uploaded
+      && !imv->gallery.enabled && !imv_canvas_uploads_pending(imv->canvas)) {
+    imv->timing.uploaded = rendered;
+    imv->timing.presented = presented;
+    imv_trace_span("show image", imv->current_file.path, imv->timing.open,
+        presented);
+    /* show the new timings if the overlay could be showing them */
+    if (imv->overlay.enabled) {
+      imv->need_redraw = true;
+    }
+  }
+}
+
+/* Gives the canvas the table converting the current image from its ICC
+ * profile to the display's, once there is one. Images without a profile
+ * are already sRGB, so drawn as they are. */
+static void update_color_lut(struct imv *imv)
+{
+  const struct imv_color_lut *lut = NULL;
+  size_t len;
+  const void *profile = imv_image_icc_profile(imv->current_image, &len);
+  /* HDR images are already in sRGB by the time the table would apply, and
+   * their profiles describe what they were before that */
+  if (imv->color.enabled && profile
+      && imv_image_transfer(imv->current_image) == IMV_TRANSFER_SRGB) {
+    lut = imv_color_get_lut(imv->color.tables, profile, len);
+  }
+
+  if (lut != imv->color.active) {
+    imv->color.active = lut;
+    imv_canvas_set_color_lut(imv->canvas, lut ? imv_color_lut_data(lut) : NULL,
+        lut ? imv_color_lut_size(lut) : 0);
+  }
+}
+
+static void end_crossfade(struct imv *imv)
+{
+  imv_image_free(imv->fade.image);
+  imv->fade.image = NULL;
+}
+
+/* Keeps the image on show to fade out of as the slideshow moves on, drawn
+ * as it is now. The textures it was last drawn with are still cached, so
+ * drawing it again costs nothing more. */
+static void begin_crossfade(struct imv *imv)
+{
+  end_crossfade(imv);
+  if (imv->slideshow.crossfade <= 0.0 || !imv->current_image
+      || imv->gallery.enabled || imv_window_is_software(imv->window)) {
+    return;
+  }
+
+  imv->fade.image = imv_image_ref(imv->current_image);
+  imv_viewport_get_offset(imv->view, &imv->fade.x, &imv->fade.y);
+  imv_viewport_get_scale(imv->view, &imv->fade.scale);
+  imv_viewport_get_rotation(imv->view, &imv->fade.rotation);
+  imv_viewport_get_mirrored(imv->view, &imv->fade.mirrored);
+  imv->fade.start = 0.0;
+}
+
+/* Draws the image being faded out of, if there is one, and returns how
+ * opaque to draw the current image over it. The fade only starts once the
+ * next image is there to draw, so a slow load holds the last one. */
+static double draw_crossfade(struct imv *imv, double now)
+{
+  if (!imv->fade.image) {
+    return 1.0;
+  }
+  if (imv->fade.image == imv->current_image) {
+    if (!imv->loading) {
+      /* moved on to the same image again, so there's nothing to fade */
+      end_crossfade(imv);
+      return 1.0;
+    }
+    imv->fade.start = 0.0;
+  } else if (!imv->fade.start) {
+    imv->fade.start = now;
+  }
+
+  const double progress = imv->fade.start
+    ? (now - imv->fade.start) / imv->slideshow.crossfade : 0.0;
+  if (imv->fade.start && progress >= 1.0) {
+    end_crossfade(imv);
+    return 1.0;
+  }
+
+  imv_canvas_draw_image(imv->canvas, imv->fade.image,
+                        imv->fade.x, imv->fade.y, imv->fade.scale,
+                        imv->fade.rotation, imv->fade.mirrored,
+                        imv->background.type == BACKGROUND_CHEQUERED,
+                        imv->upscaling_method);
+  return imv->fade.start ? progress : 0.0;
+}
+
 static void render_window(struct imv *imv)
 {
   int ww, wh;
   imv_window_get_size(imv->window, &ww, &wh);
 
   /* update window title */
-  char title_text[1024];
-  generate_env_text(imv, title_text, sizeof title_text, imv->title_text);
-  imv_window_set_title(imv->window, title_text);
-
-  /* first we draw the background */
-  if (imv->background.type == BACKGROUND_SOLID) {
-    imv_canvas_clear(imv->canvas);
-    imv_canvas_color(imv->canvas,
-        imv->background.color.r / 255.f,
-        imv->background.color.g / 255.f,
-        imv->background.color.b / 255.f,
-        1.0);
-    imv_canvas_fill(imv->canvas);
-    imv_canvas_draw(imv->canvas);
-  }
+  update_title(imv);
 
-  /* draw our actual image */
-  if (imv->current_image) {
+  /* draw the gallery or our actual image, over the background the window was
+   * cleared to */
+  imv->gallery.more = false;
+  if (imv->gallery.enabled) {
+    int bw, bh;
+    imv_window_get_framebuffer_size(imv->window, &bw, &bh);
+    imv->gallery.more = imv_gallery_draw(imv->gallery.grid, imv->navigator,
+        bw, bh, ww > 0 ? (double)bw / ww : 1.0);
+  } else if (imv->current_image) {
     int x, y;
     double scale, rotation;
     bool mirrored;
@@ -1452,21 +3683,50 @@ static void render_window(struct imv *imv)
     imv_viewport_get_scale(imv->view, &scale);
     imv_viewport_get_rotation(imv->view, &rotation);
     imv_viewport_get_mirrored(imv->view, &mirrored);
-    if (imv->background.type == BACKGROUND_CHEQUERED) {
-      imv_canvas_fill_checkers(imv->canvas, imv->current_image,
-                               x, y, scale, rotation, mirrored);
-    }
+    update_color_lut(imv);
+    const double start = cur_time();
+    const double opacity = draw_crossfade(imv, start);
+    imv_canvas_set_opacity(imv->canvas, opacity);
     imv_canvas_draw_image(imv->canvas, imv->current_image,
                           x, y, scale, rotation, mirrored,
-                          imv->upscaling_method, imv->cache_invalidated);
+                          imv->background.type == BACKGROUND_CHEQUERED,
+                          imv->upscaling_method);
+    imv_canvas_set_opacity(imv->canvas, 1.0);
+    imv_trace_span("draw image", NULL, start, cur_time());
+  } else {
+    end_crossfade(imv);
+  }
+
+  /* The overlay and console are kept on the canvas between redraws, so
+   * only draw them again if something in them has changed */
+  char overlay_text[1024] = "";
+  if (imv->overlay.enabled) {
+    generate_env_text(imv, overlay_text, sizeof overlay_text, imv->overlay.text);
   }
+  const char *prompt = imv_console_prompt(imv->console);
+  char signature[sizeof imv->overlay.signature];
+  snprintf(signature, sizeof signature, "%dx%d %d %zu %s\n%s",
+      ww, wh, imv->overlay.enabled,
+      prompt ? imv_console_prompt_cursor(imv->console) : (size_t)-1,
+      overlay_text, prompt ? prompt : "");
+
+  if (strcmp(signature, imv->overlay.signature)) {
+    strcpy(imv->overlay.signature, signature);
+    draw_overlay(imv, overlay_text, ww, wh);
+  }
+
+  imv_canvas_draw(imv->canvas);
+
+  /* redraw complete, unset the flag */
+  imv->need_redraw = false;
+}
 
+static void draw_overlay(struct imv *imv, const char *overlay_text, int ww, int wh)
+{
   imv_canvas_clear(imv->canvas);
 
-  /* if the overlay needs to be drawn, draw that too */
+  /* draw the overlay, if enabled */
   if (imv->overlay.enabled) {
-    char overlay_text[1024];
-    generate_env_text(imv, overlay_text, sizeof overlay_text, imv->overlay.text);
     PangoLayout *layout = imv_canvas_make_layout(imv->canvas, overlay_text);
 
     int width, height;
@@ -1519,12 +3779,6 @@ static void render_window(struct imv *imv)
     imv_canvas_printf(imv->canvas, x, wh - height - bottom_offset, "%s",
         imv_console_prompt(imv->console) + imv_console_prompt_cursor(imv->console));
   }
-
-  imv_canvas_draw(imv->canvas);
-
-  /* redraw complete, unset the flag */
-  imv->need_redraw = false;
-  imv->cache_invalidated = false;
 }
 
 static bool parse_bool(const char *str)
@@ -1562,6 +3816,17 @@ static int handle_ini_value(void *user, const char *section, const char *name,
   }
 
   if (!strcmp(section, "options")) {
+    if (!strcmp(name, "decode_threads")) {
+      imv->decode_threads = strtol(value, NULL, 10);
+      return 1;
+    }
+
+    if (!strcmp(name, "frame_buffer")) {
+      const long frames = strtol(value, NULL, 10);
+      imv->frames.capacity = frames > 0 ? frames : 1;
+      return 1;
+    }
+
     if (!strcmp(name, "fullscreen")) {
       imv->start_fullscreen = parse_bool(value);
       return 1;
@@ -1581,15 +3846,41 @@ static int handle_ini_value(void *user, const char *section, const char *name,
       return 1;
     }
 
+    if (!strcmp(name, "color_management")) {
+      imv->color.enabled = parse_bool(value);
+      return 1;
+    }
+
+    if (!strcmp(name, "display_profile")) {
+      free(imv->color.display_profile);
+      imv->color.display_profile = *value ? strdup(value) : NULL;
+      return 1;
+    }
+
     if (!strcmp(name, "upscaling_method")) {
       return parse_upscaling_method(imv, value);
     }
 
+    if (!strcmp(name, "renderer")) {
+      return parse_renderer(imv, value);
+    }
+
     if (!strcmp(name, "recursive")) {
       imv->recursive_load = parse_bool(value);
       return 1;
     }
 
+    if (!strcmp(name, "debug_wakeups")) {
+      imv->wakeups.enabled = parse_bool(value);
+      imv->wakeups.since = cur_time();
+      return 1;
+    }
+
+    if (!strcmp(name, "watch_directories")) {
+      imv->watch_directories = parse_bool(value);
+      return 1;
+    }
+
     if (!strcmp(name, "loop_input")) {
       imv->loop_input = parse_bool(value);
       return 1;
@@ -1622,6 +3913,13 @@ static int handle_ini_value(void *user, const char *section, const char *name,
       return 1;
     }
 
+    if (!strcmp(name, "slideshow_crossfade")) {
+      if (!parse_slideshow_crossfade(imv, value)) {
+        return false;
+      }
+      return 1;
+    }
+
     if (!strcmp(name, "overlay_text_color")) {
       if (!hex_value_to_color_rgb(value, &imv->overlay.text_color)) {
         return false;
@@ -1669,14 +3967,61 @@ static int handle_ini_value(void *user, const char *section, const char *name,
     }
 
     if (!strcmp(name, "overlay_text")) {
-      free(imv->overlay.text);
-      imv->overlay.text = strdup(value);
+      imv_template_free(imv->overlay.text);
+      imv->overlay.text = imv_template_create(value);
       return 1;
     }
 
     if (!strcmp(name, "title_text")) {
-      free(imv->title_text);
-      imv->title_text = strdup(value);
+      imv_template_free(imv->title_text);
+      imv->title_text = imv_template_create(value);
+      return 1;
+    }
+
+    if (!strcmp(name, "shell_expansion")) {
+      imv->shell_expansion = parse_bool(value);
+      return 1;
+    }
+
+    if (!strcmp(name, "prefetch")) {
+      imv->prefetch.distance = strtol(value, NULL, 10);
+      return 1;
+    }
+
+    if (!strcmp(name, "prefetch_cache_size")) {
+      size_t megabytes = strtoul(value, NULL, 10);
+      imv->prefetch.cache_size = megabytes * 1024 * 1024;
+      fit_cache_to_budget(imv);
+      return 1;
+    }
+
+    if (!strcmp(name, "sort")) {
+      struct list *words = list_from_string(value, ' ');
+      if (!parse_sort(imv, words, 0)) {
+        imv_log(IMV_WARNING, "Ignoring unknown sort order: %s\n", value);
+      }
+      list_deep_free(words);
+      return 1;
+    }
+
+    if (!strcmp(name, "prefetch_compression")) {
+      imv->prefetch.compress = parse_bool(value);
+      return 1;
+    }
+
+    if (!strcmp(name, "texture_cache_size")) {
+      size_t megabytes = strtoul(value, NULL, 10);
+      imv->texture_cache_size = megabytes * 1024 * 1024;
+      if (imv->canvas) {
+        imv_canvas_set_texture_budget(imv->canvas, imv->texture_cache_size);
+      }
+      return 1;
+    }
+
+    if (!strcmp(name, "memory_budget")) {
+      size_t megabytes = strtoul(value, NULL, 10);
+      imv_memory_set_budget(megabytes * 1024 * 1024);
+      fit_cache_to_budget(imv);
       return 1;
     }
 
@@ -1700,6 +4045,7 @@ static int handle_ini_value(void *user, const char *section, const char *name,
 static bool load_config(struct imv *imv, const char *path)
 {
   int err = ini_parse(path, handle_ini_value, imv);
+  startup_mark(imv, "loaded %s", path);
   if (err == -1) {
     imv_log(IMV_ERROR, "Unable to open config file: %s\n", path);
   } else if (err > 0) {
@@ -1965,9 +4311,43 @@ static void command_next_frame(struct list *args, const char *argstr, void *data
   (void)argstr;
   struct imv *imv = data;
   if (imv->current_source) {
-    imv_source_async_load_next_frame(imv->current_source);
-    imv->next_frame.force_next_frame = true;
+    imv->frames.force_next_frame = true;
+    fill_frames(imv);
+  }
+}
+
+static void command_next_page(struct list *args, const char *argstr, void *data)
+{
+  (void)argstr;
+  struct imv *imv = data;
+  long int offset = 1;
+  if (args->len >= 2) {
+    offset = strtol(args->items[1], NULL, 10);
+  }
+  turn_page(imv, imv->current_file.page + offset);
+}
+
+static void command_prev_page(struct list *args, const char *argstr, void *data)
+{
+  (void)argstr;
+  struct imv *imv = data;
+  long int offset = 1;
+  if (args->len >= 2) {
+    offset = strtol(args->items[1], NULL, 10);
+  }
+  turn_page(imv, imv->current_file.page - offset);
+}
+
+static void command_page(struct list *args, const char *argstr, void *data)
+{
+  (void)argstr;
+  struct imv *imv = data;
+  if (args->len != 2) {
+    return;
   }
+
+  long int page = strtol(args->items[1], NULL, 10);
+  turn_page(imv, page - 1);
 }
 
 static void command_toggle_playing(struct list *args, const char *argstr, void *data)
@@ -2023,7 +4403,6 @@ static void command_set_upscaling_method(struct list *args, const char *argstr,
   }
 
   imv->need_redraw = true;
-  imv->cache_invalidated = true;
 }
 
 static void command_set_slideshow_duration(struct list *args, const char *argstr, void *data)
@@ -2074,55 +4453,283 @@ static void command_bind(struct list *args, const char *argstr, void *data)
   }
 }
 
-static void update_env_vars(struct imv *imv)
+static void command_gallery(struct list *args, const char *argstr, void *data)
 {
-  char str[64];
+  (void)argstr;
+  struct imv *imv = data;
 
-  snprintf(str, sizeof str, "%d", getpid());
-  setenv("imv_pid", str, 1);
+  if (args->len == 1) {
+    if (!imv->gallery.grid) {
+      if (!imv->workers) {
+        imv_log(IMV_ERROR, "The gallery needs worker threads to make thumbnails\n");
+        return;
+      }
+      imv->gallery.grid = imv_gallery_create(imv->canvas, imv->workers,
+          &load_thumbnail, &thumbnail_ready, imv);
+    }
+    imv->gallery.enabled = !imv->gallery.enabled;
+    imv->need_redraw = true;
+    return;
+  }
 
-  setenv("imv_current_file", imv_navigator_selection(imv->navigator), 1);
-  setenv("imv_scaling_mode", scaling_label[imv->scaling_mode], 1);
-  setenv("imv_loading", imv->loading ? "1" : "0", 1);
+  if (!imv->gallery.enabled) {
+    return;
+  }
 
-  if (imv_navigator_length(imv->navigator)) {
-    snprintf(str, sizeof str, "%zu", imv_navigator_index(imv->navigator) + 1);
-    setenv("imv_current_index", str, 1);
+  const ssize_t columns = imv_gallery_columns(imv->gallery.grid);
+  if (!strcmp(args->items[1], "up")) {
+    imv_navigator_select_rel(imv->navigator, -columns);
+  } else if (!strcmp(args->items[1], "down")) {
+    imv_navigator_select_rel(imv->navigator, columns);
   } else {
-    setenv("imv_current_index", "0", 1);
+    imv_log(IMV_ERROR, "Unknown gallery direction: %s\n", (char *)args->items[1]);
+  }
+}
+
+static const char *lookup_variable(const char *name, void *data);
+
+static void command_timings(struct list *args, const char *argstr, void *data)
+{
+  (void)args;
+  (void)argstr;
+  struct imv *imv = data;
+
+  /* lookup_variable formats into a buffer of its own, so copy each out */
+  const char *stages[] = {"open", "decode", "upload", "present", "load"};
+  char text[5][16];
+  for (size_t i = 0; i < sizeof stages / sizeof *stages; ++i) {
+    char name[32];
+    snprintf(name, sizeof name, "imv_%s_ms", stages[i]);
+    const char *value = lookup_variable(name, imv);
+    snprintf(text[i], sizeof text[i], "%s", *value ? value : "-");
   }
+  imv_log(IMV_INFO, "%s: open %s ms, decode %s ms, upload %s ms, "
+      "present %s ms, load %s ms\n",
+      imv->current_file.path ? imv->current_file.path : "no image",
+      text[0], text[1], text[2], text[3], text[4]);
+  command_reply(imv, "open %s decode %s upload %s present %s load %s",
+      text[0], text[1], text[2], text[3], text[4]);
+}
 
-  snprintf(str, sizeof str, "%zu", imv_navigator_length(imv->navigator));
-  setenv("imv_file_count", str, 1);
+static void command_get(struct list *args, const char *argstr, void *data)
+{
+  (void)argstr;
+  struct imv *imv = data;
 
-  snprintf(str, sizeof str, "%d", imv_image_width(imv->current_image));
-  setenv("imv_width", str, 1);
+  if (args->len < 2) {
+    command_fail(imv, "get needs a variable name");
+    return;
+  }
 
-  snprintf(str, sizeof str, "%d", imv_image_height(imv->current_image));
-  setenv("imv_height", str, 1);
+  for (size_t i = 1; i < args->len; ++i) {
+    /* The imv_ may be left off */
+    const char *arg = args->items[i];
+    char name[64];
+    snprintf(name, sizeof name, "%s%s", strncmp(arg, "imv_", 4) ? "imv_" : "", arg);
+    const char *value = lookup_variable(name, imv);
+    if (!value) {
+      imv_log(IMV_ERROR, "get: unknown variable %s\n", arg);
+      command_fail(imv, "unknown variable %s", arg);
+      return;
+    }
+    if (!imv->reply.active) {
+      imv_log(IMV_INFO, "%s = %s\n", name, value);
+    }
+    /* Several values go on one line, separated by tabs */
+    command_reply(imv, "%s%s", i > 1 ? "\t" : "", value);
+  }
+}
 
-  {
+static void command_wait(struct list *args, const char *argstr, void *data)
+{
+  (void)args;
+  (void)argstr;
+  struct imv *imv = data;
+
+  /* Only a client waiting on a reply has anything to wait for */
+  if (imv->reply.active) {
+    imv->reply.waiting = true;
+  }
+}
+
+static void command_sort(struct list *args, const char *argstr, void *data)
+{
+  (void)argstr;
+  struct imv *imv = data;
+
+  if (!parse_sort(imv, args, 1)) {
+    imv_log(IMV_ERROR, "sort: expected name, date, mtime, size or pixels\n");
+    command_fail(imv, "sort needs one of name, date, mtime, size or pixels, "
+        "and optionally reverse");
+    return;
+  }
+  apply_sort(imv);
+}
+
+static void command_filter(struct list *args, const char *argstr, void *data)
+{
+  (void)argstr;
+  struct imv *imv = data;
+
+  if (args->len == 1) {
+    /* Paths added from now on are all kept */
+    imv->filter.active = false;
+    return;
+  }
+
+  if (args->len != 3 && args->len != 4) {
+    imv_log(IMV_ERROR, "filter: expected a field and a range\n");
+    command_fail(imv, "filter needs a field, a minimum and optionally a maximum");
+    return;
+  }
+
+  struct path_filter filter = {
+    .imv = imv,
+    .max = INT64_MAX,
+  };
+  size_t field = 0;
+  const size_t num_fields = sizeof filter_fields / sizeof *filter_fields;
+  while (field < num_fields && strcmp(args->items[1], filter_fields[field])) {
+    ++field;
+  }
+  if (field == num_fields) {
+    imv_log(IMV_ERROR, "filter: unknown field %s\n", (char *)args->items[1]);
+    command_fail(imv, "unknown filter field %s", (char *)args->items[1]);
+    return;
+  }
+  filter.field = field;
+
+  if (!parse_filter_bound(filter.field, args->items[2], false, &filter.min)
+      || (args->len == 4
+        && !parse_filter_bound(filter.field, args->items[3], true, &filter.max))) {
+    imv_log(IMV_ERROR, "filter: invalid range for %s\n", (char *)args->items[1]);
+    command_fail(imv, "invalid range for filter %s", (char *)args->items[1]);
+    return;
+  }
+
+  /* What's not indexed yet is filtered as it is, as are paths still to be
+   * found, so nothing waits on the filesystem */
+  imv->filter.active = true;
+  imv->filter.range = filter;
+  apply_filter(imv);
+}
+
+/* The variables imv provides to templates and to the commands it runs */
+static const char *variable_names[] = {
+  "imv_pid",
+  "imv_current_file",
+  "imv_scaling_mode",
+  "imv_loading",
+  "imv_memory_used",
+  "imv_current_index",
+  "imv_file_count",
+  "imv_current_page",
+  "imv_width",
+  "imv_height",
+  "imv_scale",
+  "imv_slideshow_duration",
+  "imv_slideshow_elapsed",
+  "imv_open_ms",
+  "imv_decode_ms",
+  "imv_upload_ms",
+  "imv_present_ms",
+  "imv_load_ms",
+};
+
+/* Formats the milliseconds from one stage to the next, or nothing if the
+ * later one's still to come */
+static const char *format_stage(char *str, size_t len, double from, double to)
+{
+  if (!from || !to) {
+    return "";
+  }
+  snprintf(str, len, "%.1f", (to - from) * 1000.0);
+  return str;
+}
+
+static const char *lookup_variable(const char *name, void *data)
+{
+  struct imv *imv = data;
+  static char str[64];
+
+  if (strncmp(name, "imv_", 4)) {
+    return NULL;
+  }
+  name += 4;
+
+  if (!strcmp(name, "pid")) {
+    snprintf(str, sizeof str, "%d", getpid());
+  } else if (!strcmp(name, "current_file")) {
+    return imv_navigator_selection(imv->navigator);
+  } else if (!strcmp(name, "scaling_mode")) {
+    return scaling_label[imv->scaling_mode];
+  } else if (!strcmp(name, "loading")) {
+    return imv->loading ? "1" : "0";
+  } else if (!strcmp(name, "memory_used")) {
+    snprintf(str, sizeof str, "%zu", imv_memory_used() / (1024 * 1024));
+  } else if (!strcmp(name, "current_index")) {
+    if (imv_navigator_length(imv->navigator)) {
+      snprintf(str, sizeof str, "%zu", imv_navigator_index(imv->navigator) + 1);
+    } else {
+      return "0";
+    }
+  } else if (!strcmp(name, "file_count")) {
+    snprintf(str, sizeof str, "%zu", imv_navigator_length(imv->navigator));
+  } else if (!strcmp(name, "current_page")) {
+    snprintf(str, sizeof str, "%d", imv->current_file.page + 1);
+  } else if (!strcmp(name, "width")) {
+    snprintf(str, sizeof str, "%d", imv_image_width(imv->current_image));
+  } else if (!strcmp(name, "height")) {
+    snprintf(str, sizeof str, "%d", imv_image_height(imv->current_image));
+  } else if (!strcmp(name, "scale")) {
     double scale;
     imv_viewport_get_scale(imv->view, &scale);
     snprintf(str, sizeof str, "%d", (int)(scale * 100.0));
-    setenv("imv_scale", str, 1);
+  } else if (!strcmp(name, "slideshow_duration")) {
+    snprintf(str, sizeof str, "%f", imv->slideshow.duration);
+  } else if (!strcmp(name, "slideshow_elapsed")) {
+    /* Moving on a little early leaves it just short of zero */
+    snprintf(str, sizeof str, "%f",
+        imv->slideshow.elapsed > 0 ? imv->slideshow.elapsed : 0);
+  } else if (!strcmp(name, "open_ms")) {
+    return format_stage(str, sizeof str, imv->timing.open, imv->timing.opened);
+  } else if (!strcmp(name, "decode_ms")) {
+    return format_stage(str, sizeof str, imv->timing.opened, imv->timing.decoded);
+  } else if (!strcmp(name, "upload_ms")) {
+    return format_stage(str, sizeof str, imv->timing.decoded, imv->timing.uploaded);
+  } else if (!strcmp(name, "present_ms")) {
+    return format_stage(str, sizeof str, imv->timing.uploaded, imv->timing.presented);
+  } else if (!strcmp(name, "load_ms")) {
+    return format_stage(str, sizeof str, imv->timing.open, imv->timing.presented);
+  } else {
+    return NULL;
   }
 
-  snprintf(str, sizeof str, "%f", imv->slideshow.duration);
-  setenv("imv_slideshow_duration", str, 1);
+  return str;
+}
 
-  snprintf(str, sizeof str, "%f", imv->slideshow.elapsed);
-  setenv("imv_slideshow_elapsed", str, 1);
+static void update_env_vars(struct imv *imv)
+{
+  for (size_t i = 0; i < sizeof variable_names / sizeof *variable_names; ++i) {
+    setenv(variable_names[i], lookup_variable(variable_names[i], imv), 1);
+  }
 }
 
-static size_t generate_env_text(struct imv *imv, char *buf, size_t buf_len, const char *format)
+static size_t generate_env_text(struct imv *imv, char *buf, size_t buf_len,
+    const struct imv_template *format)
 {
+  /* Most templates only refer to variables, which we can look up directly
+   * rather than going through the environment and the shell */
+  if (!imv->shell_expansion || !imv_template_needs_shell(format)) {
+    return imv_template_expand(format, buf, buf_len, &lookup_variable, imv);
+  }
+
   update_env_vars(imv);
 
   size_t len = 0;
   wordexp_t word;
   setenv("IFS", "", 1);
-  if (wordexp(format, &word, 0) == 0) {
+  if (wordexp(imv_template_format(format), &word, 0) == 0) {
     len += snprintf(buf, buf_len, "%s", word.we_wordv[0]);
     for (size_t i = 1; i < word.we_wordc; ++i) {
       len += snprintf(buf + len, buf_len - len, " %s", word.we_wordv[i]);
@@ -2139,30 +4746,37 @@ static size_t generate_env_text(struct imv *imv, char *buf, size_t buf_len, cons
 static size_t read_from_stdin(void **buffer)
 {
   size_t len = 0;
+  size_t cap = 0;
   ssize_t r;
-  size_t step = 4096; /* Arbitrary value of 4 KiB */
   void *new_buf;
 
   errno = 0;
   *buffer = NULL;
 
   while (1) {
-    new_buf = realloc(*buffer, len + step);
-    if (new_buf) {
-      *buffer = new_buf;
-    } else {
-      /* Failed to extend buffer */
-      int save = errno;
-      free(*buffer);
-      errno = save;
-      *buffer = NULL;
-      len = 0;
-      break;
+    if (len == cap) {
+      /* Doubling, so that a big image isn't copied over and over again as
+       * the buffer grows to fit it */
+      cap = cap ? cap * 2 : 64 * 1024;
+      new_buf = realloc(*buffer, cap);
+      if (new_buf) {
+        *buffer = new_buf;
+      } else {
+        /* Failed to extend buffer */
+        int save = errno;
+        free(*buffer);
+        errno = save;
+        *buffer = NULL;
+        len = 0;
+        break;
+      }
     }
 
-    r = read(STDIN_FILENO, (uint8_t *)*buffer + len, step);
+    r = read(STDIN_FILENO, (uint8_t *)*buffer + len, cap - len);
     if (r > 0) {
       len += (size_t)r;
+    } else if (r < 0 && errno == EINTR) {
+      continue;
     } else {
       if (r < 0) {
         /* Read error */
@@ -2170,6 +4784,7 @@ static size_t read_from_stdin(void **buffer)
         perror(NULL);
         free(*buffer);
         errno = save;
+        *buffer = NULL;
         len = 0;
       }
       break;
@@ -1,21 +1,135 @@
-#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <unistd.h>
 
 #include "ipc.h"
 
+static bool write_all(int fd, const char *buf, size_t len)
+{
+  while (len) {
+    ssize_t written = write(fd, buf, len);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written < 0) {
+      return false;
+    }
+    buf += written;
+    len -= written;
+  }
+  return true;
+}
+
+/* Sends the one command given on the command line, then prints what came
+ * back with it, if anything, or the error to stderr */
+static int send_command(int sockfd, int argc, char **argv)
+{
+  char buf[4096] = {0};
+  for (int i = 2; i < argc; ++i) {
+    strncat(buf, argv[i], sizeof buf - strlen(buf) - 1);
+    if (i + 1 < argc) {
+      strncat(buf, " ", sizeof buf - strlen(buf) - 1);
+    }
+  }
+  strncat(buf, "\n", sizeof buf - strlen(buf) - 1);
+
+  if (!write_all(sockfd, buf, strlen(buf))) {
+    perror("Failed to write");
+    return 1;
+  }
+  shutdown(sockfd, SHUT_WR);
+
+  size_t len = 0;
+  while (len < sizeof buf - 1 && !memchr(buf, '\n', len)) {
+    ssize_t got = read(sockfd, buf + len, sizeof buf - 1 - len);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got <= 0) {
+      break;
+    }
+    len += got;
+  }
+  buf[len] = 0;
+  if (!len) {
+    /* An imv from before replies were a thing */
+    return 0;
+  }
+
+  if (!strncmp(buf, "ok", 2)) {
+    if (buf[2] == ' ') {
+      fputs(buf + 3, stdout);
+    }
+    return 0;
+  }
+  fputs(buf, stderr);
+  return 1;
+}
+
+/* Sends commands from stdin, one per line, over the one connection as fast
+ * as they come, printing each reply as it arrives. Replies come back in the
+ * same order as the commands went out. */
+static int send_commands(int sockfd)
+{
+  bool input = true;
+  char buf[65536];
+
+  while (true) {
+    struct pollfd fds[] = {
+      {.fd = input ? STDIN_FILENO : -1, .events = POLLIN},
+      {.fd = sockfd, .events = POLLIN},
+    };
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("Failed to poll");
+      return 1;
+    }
+
+    if (fds[0].revents) {
+      ssize_t len = read(STDIN_FILENO, buf, sizeof buf);
+      if (len > 0) {
+        if (!write_all(sockfd, buf, len)) {
+          perror("Failed to write");
+          return 1;
+        }
+      } else if (len == 0 || errno != EINTR) {
+        /* Let imv know there's no more, so it hangs up once it's replied */
+        input = false;
+        shutdown(sockfd, SHUT_WR);
+      }
+    }
+
+    if (fds[1].revents) {
+      ssize_t len = read(sockfd, buf, sizeof buf);
+      if (len > 0) {
+        write_all(STDOUT_FILENO, buf, len);
+      } else if (len == 0 || errno != EINTR) {
+        return 0;
+      }
+    }
+  }
+}
+
 int main(int argc, char **argv)
 {
-  if (argc < 3) {
-    fprintf(stderr, "Usage: %s <pid> <command>\n", argv[0]);
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <pid> [command]\n", argv[0]);
     return 0;
   }
 
   int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
-  assert(sockfd);
+  if (sockfd < 0) {
+    perror("Failed to create socket");
+    return 1;
+  }
 
   struct sockaddr_un desc = {
     .sun_family = AF_UNIX
@@ -27,20 +141,8 @@ int main(int argc, char **argv)
     return 1;
   }
 
-  char buf[4096] = {0};
-  for (int i = 2; i < argc; ++i) {
-    strncat(buf, argv[i], sizeof buf - 1);
-    if (i + 1 < argc) {
-      strncat(buf, " ", sizeof buf - 1);
-    }
-  }
-  strncat(buf, "\n", sizeof buf - 1);
-
-  if (write(sockfd, buf, strlen(buf)) == -1) {
-    perror("Failed to write");
-    return 1;
-  }
-
+  const int ret = argc > 2 ? send_command(sockfd, argc, argv)
+    : send_commands(sockfd);
   close(sockfd);
-  return 0;
+  return ret;
 }
@@ -1,69 +1,286 @@
 #include "ipc.h"
 
+#include "list.h"
+
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <unistd.h>
 
+/* The longest a line may get before its client is taken to be confused and
+ * disconnected */
+#define MAX_LINE_LEN (1024 * 1024)
+
 struct imv_ipc {
   int fd;
+  /* written to whenever there are replies for the serving thread to send,
+   * or it's time for it to stop */
+  int wake[2];
+  pthread_t thread;
+
+  /* guards everything below, which the serving thread shares with whoever
+   * calls imv_ipc_reply */
+  pthread_mutex_t lock;
+  struct list *connections;
+  unsigned int next_id;
+  bool quit;
+
   imv_ipc_callback callback;
   void *data;
 };
 
 struct connection {
-  struct imv_ipc *ipc;
   int fd;
+  unsigned int id;
+
+  /* what's been read and not yet made into commands, only touched by the
+   * serving thread */
+  char *in;
+  size_t in_len;
+  size_t in_cap;
+
+  /* replies waiting to be sent */
+  char *out;
+  size_t out_len;
+  size_t out_cap;
+
+  /* commands passed on but not yet replied to */
+  size_t pending;
+  /* the client has sent all it will, so can be let go once it's replied to */
+  bool eof;
+  /* the connection is broken, and should be dropped */
+  bool closed;
 };
 
-static void *wait_for_commands(void* void_conn)
+static void set_flags(int fd, int flags)
 {
-  struct connection *conn = void_conn;
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | flags);
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+}
 
-  while (1) {
-    char buf[1024];
-    ssize_t len = recv(conn->fd, buf, sizeof buf - 1, 0);
-    if (len <= 0) {
-      break;
+static void wake(struct imv_ipc *ipc)
+{
+  /* A full pipe is plenty awake already */
+  (void)write(ipc->wake[1], "", 1);
+}
+
+static void free_connection(struct connection *conn)
+{
+  close(conn->fd);
+  free(conn->in);
+  free(conn->out);
+  free(conn);
+}
+
+/* Passes each complete line read on to the callback */
+static void dispatch_lines(struct imv_ipc *ipc, struct connection *conn,
+                           bool all)
+{
+  size_t start = 0;
+  while (start < conn->in_len) {
+    char *line = conn->in + start;
+    char *end = memchr(line, '\n', conn->in_len - start);
+    if (!end) {
+      if (!all) {
+        break;
+      }
+      /* The client has gone quiet without ending its last line */
+      end = conn->in + conn->in_len;
     }
+    start = end - conn->in + 1;
 
-    buf[len] = 0;
-    while (len > 0 && isspace(buf[len-1])) {
-      buf[len-1] = 0;
-      --len;
+    *end = 0;
+    while (end > line && isspace((unsigned char)end[-1])) {
+      *--end = 0;
     }
+    if (!*line) {
+      continue;
+    }
+
+    pthread_mutex_lock(&ipc->lock);
+    ++conn->pending;
+    const imv_ipc_callback callback = ipc->callback;
+    void *data = ipc->data;
+    pthread_mutex_unlock(&ipc->lock);
 
-    if (conn->ipc->callback) {
-      conn->ipc->callback(buf, conn->ipc->data);
+    if (callback) {
+      callback(line, conn->id, data);
+    } else {
+      imv_ipc_reply(ipc, conn->id, "error not ready");
     }
   }
 
-  close(conn->fd);
-  free(conn);
-  return NULL;
+  if (start >= conn->in_len) {
+    conn->in_len = 0;
+  } else {
+    memmove(conn->in, conn->in + start, conn->in_len - start);
+    conn->in_len -= start;
+  }
 }
 
-static void *wait_for_connections(void* void_ipc)
+static void read_commands(struct imv_ipc *ipc, struct connection *conn)
 {
-  struct imv_ipc *ipc = void_ipc;
-  (void)ipc;
+  while (true) {
+    if (conn->in_len == conn->in_cap) {
+      /* Make room by passing on the lines already complete, so that only
+       * the line still being read counts towards the limit */
+      dispatch_lines(ipc, conn, false);
+    }
+    if (conn->in_len == conn->in_cap) {
+      if (conn->in_cap >= MAX_LINE_LEN) {
+        conn->closed = true;
+        return;
+      }
+      conn->in_cap = conn->in_cap ? conn->in_cap * 2 : 4096;
+      conn->in = realloc(conn->in, conn->in_cap + 1);
+    }
+
+    ssize_t len = recv(conn->fd, conn->in + conn->in_len,
+        conn->in_cap - conn->in_len, 0);
+    if (len < 0 && errno == EINTR) {
+      continue;
+    }
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      /* Everything there is for now has been read */
+      dispatch_lines(ipc, conn, false);
+      return;
+    }
+    if (len <= 0) {
+      /* Leave room to terminate a last line left without a newline */
+      conn->in[conn->in_len] = 0;
+      dispatch_lines(ipc, conn, true);
+      if (len < 0) {
+        conn->closed = true;
+      }
+      conn->eof = true;
+      return;
+    }
 
-  while (1) {
-    int client = accept(ipc->fd, NULL, NULL);
-    if (client == -1) {
+    conn->in_len += len;
+  }
+}
+
+/* Sends as much of what's waiting to go as the socket will take. Expects
+ * the lock to be held. */
+static void send_replies(struct connection *conn)
+{
+  size_t sent = 0;
+  while (sent < conn->out_len) {
+    ssize_t len = send(conn->fd, conn->out + sent, conn->out_len - sent,
+        MSG_NOSIGNAL);
+    if (len < 0 && errno == EINTR) {
+      continue;
+    }
+    if (len < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        /* Most likely a client that didn't wait to hear back */
+        conn->closed = true;
+      }
       break;
     }
-    struct connection *conn = calloc(1, sizeof *conn);
-    conn->ipc = ipc;
-    conn->fd = client;
+    sent += len;
+  }
+  memmove(conn->out, conn->out + sent, conn->out_len - sent);
+  conn->out_len -= sent;
+}
 
-    pthread_t thread;
-    pthread_create(&thread, NULL, wait_for_commands, conn);
-    pthread_detach(thread);
+static void accept_connection(struct imv_ipc *ipc)
+{
+  int client = accept(ipc->fd, NULL, NULL);
+  if (client == -1) {
+    return;
   }
+  set_flags(client, O_NONBLOCK);
+
+  struct connection *conn = calloc(1, sizeof *conn);
+  conn->fd = client;
+
+  pthread_mutex_lock(&ipc->lock);
+  conn->id = ++ipc->next_id;
+  list_append(ipc->connections, conn);
+  pthread_mutex_unlock(&ipc->lock);
+}
+
+/* Serves every client from one thread, so that a client sending thousands
+ * of commands costs no more than one sending a single one */
+static void *serve(void *data)
+{
+  struct imv_ipc *ipc = data;
+  struct pollfd *fds = NULL;
+  size_t fds_cap = 0;
+
+  while (true) {
+    /* Only this thread adds or removes connections, so they stay where they
+     * are between building the poll list and going through it */
+    pthread_mutex_lock(&ipc->lock);
+    if (ipc->quit) {
+      pthread_mutex_unlock(&ipc->lock);
+      break;
+    }
+    const size_t count = ipc->connections->len;
+    if (count + 2 > fds_cap) {
+      fds_cap = count + 2;
+      fds = realloc(fds, fds_cap * sizeof *fds);
+    }
+    fds[0] = (struct pollfd){.fd = ipc->fd, .events = POLLIN};
+    fds[1] = (struct pollfd){.fd = ipc->wake[0], .events = POLLIN};
+    for (size_t i = 0; i < count; ++i) {
+      struct connection *conn = ipc->connections->items[i];
+      /* A client that's hung up would otherwise wake us over and over
+       * while its last commands are being run */
+      fds[i + 2] = (struct pollfd){
+        .fd = conn->eof && !conn->out_len ? -1 : conn->fd,
+        .events = (conn->eof ? 0 : POLLIN) | (conn->out_len ? POLLOUT : 0),
+      };
+    }
+    pthread_mutex_unlock(&ipc->lock);
+
+    if (poll(fds, count + 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+
+    if (fds[1].revents & POLLIN) {
+      char buf[64];
+      while (read(ipc->wake[0], buf, sizeof buf) > 0);
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+      struct connection *conn = ipc->connections->items[i];
+      if (fds[i + 2].revents & (POLLIN | POLLHUP | POLLERR) && !conn->eof) {
+        read_commands(ipc, conn);
+      }
+    }
+
+    pthread_mutex_lock(&ipc->lock);
+    for (size_t i = count; i-- > 0;) {
+      struct connection *conn = ipc->connections->items[i];
+      if (conn->out_len) {
+        send_replies(conn);
+      }
+      if (conn->closed || (conn->eof && !conn->pending && !conn->out_len)) {
+        list_remove(ipc->connections, i);
+        free_connection(conn);
+      }
+    }
+    pthread_mutex_unlock(&ipc->lock);
+
+    if (fds[0].revents & POLLIN) {
+      accept_connection(ipc);
+    }
+  }
+
+  free(fds);
   return NULL;
 }
 
@@ -73,6 +290,7 @@ struct imv_ipc *imv_ipc_create(void)
   if (sockfd < 0) {
     return NULL;
   }
+  set_flags(sockfd, O_NONBLOCK);
 
   struct sockaddr_un desc = {
     .sun_family = AF_UNIX
@@ -86,21 +304,40 @@ struct imv_ipc *imv_ipc_create(void)
     return NULL;
   }
 
-  if (listen(sockfd, 5) == -1) {
+  if (listen(sockfd, 16) == -1) {
     close(sockfd);
     return NULL;
   }
 
   struct imv_ipc *ipc = calloc(1, sizeof *ipc);
   if (ipc == NULL) {
+    close(sockfd);
     return NULL;
   }
   ipc->fd = sockfd;
+  ipc->connections = list_create();
+  pthread_mutex_init(&ipc->lock, NULL);
 
-  pthread_t thread;
-  pthread_create(&thread, NULL, wait_for_connections, ipc);
-  pthread_detach(thread);
+  if (pipe(ipc->wake)) {
+    goto fail;
+  }
+  set_flags(ipc->wake[0], O_NONBLOCK);
+  set_flags(ipc->wake[1], O_NONBLOCK);
+
+  if (pthread_create(&ipc->thread, NULL, serve, ipc)) {
+    close(ipc->wake[0]);
+    close(ipc->wake[1]);
+    goto fail;
+  }
   return ipc;
+
+fail:
+  unlink(desc.sun_path);
+  close(sockfd);
+  list_free(ipc->connections);
+  pthread_mutex_destroy(&ipc->lock);
+  free(ipc);
+  return NULL;
 }
 
 void imv_ipc_free(struct imv_ipc *ipc)
@@ -109,10 +346,27 @@ void imv_ipc_free(struct imv_ipc *ipc)
     return;
   }
 
+  pthread_mutex_lock(&ipc->lock);
+  ipc->quit = true;
+  pthread_mutex_unlock(&ipc->lock);
+  wake(ipc);
+  pthread_join(ipc->thread, NULL);
+
   char ipc_filename[1024];
   imv_ipc_path(ipc_filename, sizeof ipc_filename, getpid());
   unlink(ipc_filename);
   close(ipc->fd);
+  close(ipc->wake[0]);
+  close(ipc->wake[1]);
+
+  /* Get the last replies out, such as to a quit command, if they'll go */
+  for (size_t i = 0; i < ipc->connections->len; ++i) {
+    struct connection *conn = ipc->connections->items[i];
+    send_replies(conn);
+    free_connection(conn);
+  }
+  list_free(ipc->connections);
+  pthread_mutex_destroy(&ipc->lock);
 
   free(ipc);
 }
@@ -120,7 +374,42 @@ void imv_ipc_free(struct imv_ipc *ipc)
 void imv_ipc_set_command_callback(struct imv_ipc *ipc,
     imv_ipc_callback callback, void *data)
 {
+  pthread_mutex_lock(&ipc->lock);
   ipc->callback = callback;
   ipc->data = data;
+  pthread_mutex_unlock(&ipc->lock);
 }
 
+void imv_ipc_reply(struct imv_ipc *ipc, unsigned int client, const char *text)
+{
+  const size_t len = strlen(text);
+
+  pthread_mutex_lock(&ipc->lock);
+  for (size_t i = 0; i < ipc->connections->len; ++i) {
+    struct connection *conn = ipc->connections->items[i];
+    if (conn->id != client) {
+      continue;
+    }
+
+    if (conn->out_len + len + 1 > conn->out_cap) {
+      size_t cap = conn->out_cap ? conn->out_cap : 4096;
+      while (cap < conn->out_len + len + 1) {
+        cap *= 2;
+      }
+      conn->out = realloc(conn->out, cap);
+      conn->out_cap = cap;
+    }
+    /* Each reply is one line, whatever's in it */
+    for (size_t c = 0; c < len; ++c) {
+      conn->out[conn->out_len++] = text[c] == '\n' ? ' ' : text[c];
+    }
+    conn->out[conn->out_len++] = '\n';
+    if (conn->pending) {
+      --conn->pending;
+    }
+    break;
+  }
+  pthread_mutex_unlock(&ipc->lock);
+
+  wake(ipc);
+}
@@ -5,6 +5,10 @@
 
 /* imv_ipc provides a listener on a unix socket that listens for commands.
  * When a command is received, a callback function is called.
+ *
+ * Clients may stay connected and send any number of commands, one per line.
+ * Each command gets one line in reply, in the order they were sent, given
+ * with imv_ipc_reply once it has been run.
  */
 struct imv_ipc;
 
@@ -14,7 +18,10 @@ struct imv_ipc *imv_ipc_create(void);
 /* Cleans up an imv_ipc instance */
 void imv_ipc_free(struct imv_ipc *ipc);
 
-typedef void (*imv_ipc_callback)(const char *command, void *data);
+/* Called with each command received, from the thread serving clients, along
+ * with an identifier for the client to reply to */
+typedef void (*imv_ipc_callback)(const char *command, unsigned int client,
+    void *data);
 
 /* When a command is received, imv_ipc will call the callback function passed
  * in. Only one callback function at a time can be connected. The data argument
@@ -23,6 +30,12 @@ typedef void (*imv_ipc_callback)(const char *command, void *data);
 void imv_ipc_set_command_callback(struct imv_ipc *ipc,
     imv_ipc_callback callback, void *data);
 
+/* Sends a line of text to a client in reply to the oldest of its commands
+ * not yet replied to. A reply to a client that has since gone is dropped.
+ * May be called from any thread.
+ */
+void imv_ipc_reply(struct imv_ipc *ipc, unsigned int client, const char *text);
+
 /* Given a pid, emits the path of the unix socket that would connect to an imv
  * instance with that pid
  */
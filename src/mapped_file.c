@@ -0,0 +1,238 @@
+/* For MAP_ANONYMOUS */
+#define _DEFAULT_SOURCE
+
+#include "mapped_file.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* How many mappings are guarded against the file shrinking under them. Any
+ * more files are read into memory instead. */
+#define MAX_GUARDED 256
+
+struct imv_mapped_file {
+  void *data;
+  size_t size;
+  /* the guard's slot, or -1 if the file was read rather than mapped */
+  int slot;
+};
+
+/* Where each guarded mapping is, for the SIGBUS handler to recognise faults
+ * in. Slots are only claimed and cleared under g_lock, and the handler reads
+ * them without it, which can't see a slot half filled in as start is set
+ * last and cleared first. */
+static struct {
+  volatile uintptr_t start;
+  volatile size_t size;
+} g_guarded[MAX_GUARDED];
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sigaction g_prev_action;
+static uintptr_t g_page_size;
+
+/* Reading a mapping past the end of a file that was truncated after it was
+ * mapped raises SIGBUS. Rather than crash, as the file's being replaced and
+ * will be reloaded, the missing pages are filled in with zeroes, which the
+ * decoder sees as a corrupt image. */
+static void handle_sigbus(int sig, siginfo_t *info, void *context)
+{
+  const int saved_errno = errno;
+  const uintptr_t addr = (uintptr_t)info->si_addr;
+  for (size_t i = 0; i < MAX_GUARDED; ++i) {
+    const uintptr_t start = g_guarded[i].start;
+    if (start && addr >= start && addr - start < g_guarded[i].size) {
+      void *page = (void *)(addr & ~(g_page_size - 1));
+      if (mmap(page, g_page_size, PROT_READ,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED) {
+        errno = saved_errno;
+        return;
+      }
+      break;
+    }
+  }
+
+  /* Not one of ours, so it's handled as it would have been without us */
+  if (g_prev_action.sa_flags & SA_SIGINFO) {
+    g_prev_action.sa_sigaction(sig, info, context);
+  } else if (g_prev_action.sa_handler != SIG_DFL
+      && g_prev_action.sa_handler != SIG_IGN) {
+    g_prev_action.sa_handler(sig);
+  } else {
+    /* Faulting again once this returns gets the default */
+    signal(sig, SIG_DFL);
+  }
+  errno = saved_errno;
+}
+
+void imv_mapped_file_init(void)
+{
+  g_page_size = sysconf(_SC_PAGESIZE);
+  struct sigaction action = {
+    .sa_sigaction = &handle_sigbus,
+    .sa_flags = SA_SIGINFO,
+  };
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGBUS, &action, &g_prev_action);
+}
+
+/* Whether the handler is there to catch faults, which it isn't before
+ * imv_mapped_file_init, or once something else has replaced it */
+static bool handler_installed(void)
+{
+  struct sigaction current;
+  return !sigaction(SIGBUS, NULL, &current)
+    && (current.sa_flags & SA_SIGINFO)
+    && current.sa_sigaction == &handle_sigbus;
+}
+
+/* Claims a guard slot for a mapping, returning -1 if there's none free */
+static int guard(void *data, size_t size)
+{
+  pthread_mutex_lock(&g_lock);
+  int slot = -1;
+  for (int i = 0; i < MAX_GUARDED; ++i) {
+    if (!g_guarded[i].start) {
+      g_guarded[i].size = size;
+      g_guarded[i].start = (uintptr_t)data;
+      slot = i;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&g_lock);
+  return slot;
+}
+
+static void unguard(int slot)
+{
+  pthread_mutex_lock(&g_lock);
+  g_guarded[slot].start = 0;
+  g_guarded[slot].size = 0;
+  pthread_mutex_unlock(&g_lock);
+}
+
+/* Reads up to size bytes of fd onto the heap, for when a mapping can't be
+ * guarded. Sets size to what there turned out to be. */
+static void *read_file(int fd, size_t *size)
+{
+  unsigned char *data = malloc(*size);
+  if (!data) {
+    return NULL;
+  }
+
+  size_t got = 0;
+  while (got < *size) {
+    const ssize_t len = read(fd, data + got, *size - got);
+    if (len < 0 && errno == EINTR) {
+      continue;
+    }
+    if (len <= 0) {
+      break;
+    }
+    got += len;
+  }
+
+  if (got == 0) {
+    free(data);
+    return NULL;
+  }
+  *size = got;
+  return data;
+}
+
+struct imv_mapped_file *imv_mapped_file_open(const char *path)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  struct stat info;
+  if (fstat(fd, &info) || !S_ISREG(info.st_mode) || info.st_size <= 0) {
+    close(fd);
+    return NULL;
+  }
+
+  struct imv_mapped_file *file = calloc(1, sizeof *file);
+  file->size = info.st_size;
+  file->slot = -1;
+
+  /* A mapping without the guard could crash imv, so it's read instead */
+  if (handler_installed()) {
+    /* The mapping keeps the file open by itself */
+    void *data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+      file->slot = guard(data, file->size);
+      if (file->slot >= 0) {
+        file->data = data;
+      } else {
+        munmap(data, file->size);
+      }
+    }
+  }
+  if (!file->data) {
+    file->data = read_file(fd, &file->size);
+  }
+  close(fd);
+
+  if (!file->data) {
+    free(file);
+    return NULL;
+  }
+  return file;
+}
+
+void imv_mapped_file_close(struct imv_mapped_file *file)
+{
+  if (!file) {
+    return;
+  }
+  if (file->slot >= 0) {
+    unguard(file->slot);
+    munmap(file->data, file->size);
+  } else {
+    free(file->data);
+  }
+  free(file);
+}
+
+void imv_mapped_file_will_read(struct imv_mapped_file *file, size_t offset,
+    size_t len)
+{
+  /* Anything read already has nothing left to read ahead */
+  if (file->slot < 0 || offset >= file->size) {
+    return;
+  }
+  if (len > file->size - offset) {
+    len = file->size - offset;
+  }
+
+  /* Advice is given by the page, so the range is widened to whole pages */
+  const size_t page_size = sysconf(_SC_PAGESIZE);
+  const size_t start = offset & ~(page_size - 1);
+  char *addr = (char *)file->data + start;
+  len += offset - start;
+
+  /* The sooner the kernel starts reading, the less decoders will wait on it */
+  posix_madvise(addr, len, POSIX_MADV_SEQUENTIAL);
+  posix_madvise(addr, len, POSIX_MADV_WILLNEED);
+}
+
+void *imv_mapped_file_data(struct imv_mapped_file *file)
+{
+  return file->data;
+}
+
+size_t imv_mapped_file_size(struct imv_mapped_file *file)
+{
+  return file->size;
+}
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
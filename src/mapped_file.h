@@ -0,0 +1,41 @@
+#ifndef IMV_MAPPED_FILE_H
+#define IMV_MAPPED_FILE_H
+
+#include <stddef.h>
+
+/* A whole file mapped read-only into memory, for backends to hand straight
+ * to decoders that read from memory, without copying it onto the heap.
+ */
+struct imv_mapped_file;
+
+/* Installs the SIGBUS handler that guards mappings against their files
+ * shrinking under them. Call once, from the main thread, before any other
+ * threads are started. Without it, or if anything replaces the handler
+ * after, files are read into memory rather than mapped. */
+void imv_mapped_file_init(void);
+
+/* Maps the file at path. Returns NULL if the file can't be opened or read,
+ * which includes it being empty. Should the file be truncated while mapped,
+ * reading what's gone from the end of it gives zeroes rather than SIGBUS.
+ * Mappings that can't be guarded that way are read into memory instead. */
+struct imv_mapped_file *imv_mapped_file_open(const char *path);
+
+/* Unmaps a file. Does nothing if file is NULL. */
+void imv_mapped_file_close(struct imv_mapped_file *file);
+
+/* Tells the kernel len bytes from offset are about to be read through from
+ * start to end, so it can start reading them ahead. Decoders that read the
+ * whole file ask for all of it, those that pick out parts only those. */
+void imv_mapped_file_will_read(struct imv_mapped_file *file, size_t offset,
+    size_t len);
+
+/* Returns the file's contents */
+void *imv_mapped_file_data(struct imv_mapped_file *file);
+
+/* Returns the size of the file's contents, in bytes */
+size_t imv_mapped_file_size(struct imv_mapped_file *file);
+
+#endif
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
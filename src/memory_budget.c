@@ -0,0 +1,59 @@
+#include "memory_budget.h"
+
+#include <pthread.h>
+#include <stdint.h>
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t g_used = 0;
+static size_t g_budget = 0;
+
+void imv_memory_acquire(size_t bytes)
+{
+  pthread_mutex_lock(&g_lock);
+  g_used += bytes;
+  pthread_mutex_unlock(&g_lock);
+}
+
+void imv_memory_release(size_t bytes)
+{
+  pthread_mutex_lock(&g_lock);
+  g_used = bytes < g_used ? g_used - bytes : 0;
+  pthread_mutex_unlock(&g_lock);
+}
+
+size_t imv_memory_used(void)
+{
+  pthread_mutex_lock(&g_lock);
+  const size_t used = g_used;
+  pthread_mutex_unlock(&g_lock);
+  return used;
+}
+
+void imv_memory_set_budget(size_t bytes)
+{
+  pthread_mutex_lock(&g_lock);
+  g_budget = bytes;
+  pthread_mutex_unlock(&g_lock);
+}
+
+size_t imv_memory_budget(void)
+{
+  pthread_mutex_lock(&g_lock);
+  const size_t budget = g_budget;
+  pthread_mutex_unlock(&g_lock);
+  return budget;
+}
+
+size_t imv_memory_available(void)
+{
+  pthread_mutex_lock(&g_lock);
+  size_t available = SIZE_MAX;
+  if (g_budget) {
+    available = g_used < g_budget ? g_budget - g_used : 0;
+  }
+  pthread_mutex_unlock(&g_lock);
+  return available;
+}
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,29 @@
+#ifndef IMV_MEMORY_BUDGET_H
+#define IMV_MEMORY_BUDGET_H
+
+#include <stddef.h>
+
+/* Keeps count of the bytes of pixel data held by every imv_bitmap, whether
+ * allocated by imv or borrowed from a decoder, and by packed images, against
+ * a budget for the whole viewer. imv uses the count to decide how much to
+ * keep cached and prefetched, and at what resolution to decode. Safe to use from any thread.
+ */
+
+/* Counts bytes of pixel data as being held, or no longer held */
+void imv_memory_acquire(size_t bytes);
+void imv_memory_release(size_t bytes);
+
+/* Returns the number of bytes of pixel data currently held */
+size_t imv_memory_used(void);
+
+/* Sets the budget in bytes, or 0 for no limit, which is the default */
+void imv_memory_set_budget(size_t bytes);
+size_t imv_memory_budget(void);
+
+/* Returns how many more bytes fit in the budget, or SIZE_MAX without one */
+size_t imv_memory_available(void);
+
+#endif
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
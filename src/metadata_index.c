@@ -0,0 +1,798 @@
+/* For d_type and its DT_ constants */
+#define _DEFAULT_SOURCE
+
+#include "metadata_index.h"
+
+#include "log.h"
+#include "worker_pool.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Some systems like GNU/Hurd don't define PATH_MAX */
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+#define MAGIC "IMVM"
+#define VERSION 1
+
+/* Each directory's file is this header, then the directory's path, then a
+ * record_header and name for each file in it, in the host's byte order. The
+ * cache belongs to one machine, so there's no need for anything portable. */
+struct header {
+  char magic[4];
+  uint32_t version;
+  uint32_t count;
+  uint32_t dir_len;
+};
+
+struct record_header {
+  struct imv_file_info info;
+  uint32_t name_len;
+};
+
+static uint16_t get16(const unsigned char *p, bool little)
+{
+  return little ? p[0] | p[1] << 8 : p[0] << 8 | p[1];
+}
+
+static uint32_t get32(const unsigned char *p, bool little)
+{
+  return little
+    ? (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24
+    : (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | (uint32_t)p[3];
+}
+
+/* Parses an EXIF date, "YYYY:MM:DD HH:MM:SS", as local time */
+static int64_t parse_exif_date(const unsigned char *str, size_t len)
+{
+  char buf[20];
+  if (len < 19) {
+    return 0;
+  }
+  memcpy(buf, str, 19);
+  buf[19] = '\0';
+
+  struct tm tm = {0};
+  if (sscanf(buf, "%d:%d:%d %d:%d:%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+        &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6 || tm.tm_year < 1900) {
+    return 0;
+  }
+  tm.tm_year -= 1900;
+  tm.tm_mon -= 1;
+  tm.tm_isdst = -1;
+  const time_t t = mktime(&tm);
+  return t == (time_t)-1 ? 0 : (int64_t)t;
+}
+
+/* Looks up an ASCII date tag in the IFD at offset, as well as the offset of
+ * the EXIF sub-IFD if exif_ifd isn't NULL */
+static int64_t find_ifd_date(const unsigned char *tiff, size_t len, bool little,
+    uint32_t offset, uint16_t date_tag, uint32_t *exif_ifd)
+{
+  if (offset > len || len - offset < 2) {
+    return 0;
+  }
+  const uint16_t count = get16(tiff + offset, little);
+  int64_t date = 0;
+  for (uint16_t i = 0; i < count; ++i) {
+    const size_t entry = offset + 2 + (size_t)i * 12;
+    if (entry + 12 > len) {
+      break;
+    }
+    const uint16_t tag = get16(tiff + entry, little);
+    const uint32_t value = get32(tiff + entry + 8, little);
+    if (tag == date_tag && value < len) {
+      date = parse_exif_date(tiff + value, len - value);
+    } else if (tag == 0x8769 && exif_ifd) {
+      *exif_ifd = value;
+    }
+  }
+  return date;
+}
+
+/* Reads when the photo was taken from the EXIF data of an APP1 segment,
+ * preferring DateTimeOriginal to the IFD0 DateTime */
+static int64_t exif_taken(const unsigned char *exif, size_t len)
+{
+  if (len < 14 || memcmp(exif, "Exif\0\0", 6)) {
+    return 0;
+  }
+  const unsigned char *tiff = exif + 6;
+  len -= 6;
+  const bool little = tiff[0] == 'I';
+  if ((tiff[0] != 'I' && tiff[0] != 'M') || tiff[1] != tiff[0]) {
+    return 0;
+  }
+
+  uint32_t exif_ifd = 0;
+  const int64_t modified = find_ifd_date(tiff, len, little,
+      get32(tiff + 4, little), 0x0132, &exif_ifd);
+  const int64_t original = exif_ifd
+    ? find_ifd_date(tiff, len, little, exif_ifd, 0x9003, NULL) : 0;
+  return original ? original : modified;
+}
+
+/* Walks a JPEG's segments up to its frame header, for the dimensions and
+ * any EXIF date on the way */
+static void read_jpeg(FILE *f, struct imv_file_info *info)
+{
+  unsigned char buf[4];
+  while (fread(buf, 1, 2, f) == 2 && buf[0] == 0xff) {
+    unsigned char marker = buf[1];
+    while (marker == 0xff) {
+      int c = fgetc(f);
+      if (c == EOF) {
+        return;
+      }
+      marker = c;
+    }
+    if (marker == 0xd8 || marker == 0x01 || (marker >= 0xd0 && marker <= 0xd7)) {
+      continue;
+    }
+    if (marker == 0xd9 || marker == 0xda || fread(buf, 1, 2, f) != 2) {
+      return;
+    }
+    const size_t len = get16(buf, false);
+    if (len < 2) {
+      return;
+    }
+
+    const bool is_frame = marker >= 0xc0 && marker <= 0xcf
+      && marker != 0xc4 && marker != 0xc8 && marker != 0xcc;
+    if (is_frame) {
+      unsigned char frame[5];
+      if (fread(frame, 1, sizeof frame, f) == sizeof frame) {
+        info->height = get16(frame + 1, false);
+        info->width = get16(frame + 3, false);
+      }
+      return;
+    }
+
+    if (marker == 0xe1 && !info->taken) {
+      unsigned char *segment = malloc(len - 2);
+      if (segment && fread(segment, 1, len - 2, f) == len - 2) {
+        info->taken = exif_taken(segment, len - 2);
+        free(segment);
+        continue;
+      }
+      free(segment);
+      return;
+    }
+
+    if (fseek(f, (long)len - 2, SEEK_CUR)) {
+      return;
+    }
+  }
+}
+
+static void read_header(const char *path, struct imv_file_info *info)
+{
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    return;
+  }
+
+  unsigned char head[24];
+  const size_t len = fread(head, 1, sizeof head, f);
+  if (len >= 2 && head[0] == 0xff && head[1] == 0xd8) {
+    fseek(f, 2, SEEK_SET);
+    read_jpeg(f, info);
+  } else if (len >= 24 && !memcmp(head, "\x89PNG\r\n\x1a\n", 8)
+      && !memcmp(head + 12, "IHDR", 4)) {
+    info->width = get32(head + 16, false);
+    info->height = get32(head + 20, false);
+  } else if (len >= 10 && (!memcmp(head, "GIF87a", 6) || !memcmp(head, "GIF89a", 6))) {
+    info->width = get16(head + 6, true);
+    info->height = get16(head + 8, true);
+  }
+  fclose(f);
+}
+
+static void read_file_info(const char *path, const struct stat *st,
+    struct imv_file_info *info)
+{
+  memset(info, 0, sizeof *info);
+  info->size = st->st_size;
+  info->mtime_sec = st->st_mtim.tv_sec;
+  info->mtime_nsec = st->st_mtim.tv_nsec;
+  read_header(path, info);
+}
+
+bool imv_file_info_read(const char *path, struct imv_file_info *info)
+{
+  struct stat st;
+  if (stat(path, &st)) {
+    return false;
+  }
+  read_file_info(path, &st, info);
+  return true;
+}
+
+/* A path and its info, in an open addressed hash table */
+struct slot {
+  char *path;
+  uint32_t hash;
+  /* For directories: set while a job reading it is queued or running, set
+   * to read it again once that's done, and set once it's been read again
+   * for a file missing from it, until it's refreshed */
+  bool queued;
+  bool stale;
+  bool retried;
+  struct imv_file_info info;
+};
+
+struct table {
+  struct slot *slots;
+  /* a power of two, or zero */
+  size_t size;
+  size_t count;
+};
+
+static uint32_t hash_path(const char *path)
+{
+  uint32_t hash = 0x811c9dc5;
+  for (const char *c = path; *c; ++c) {
+    hash ^= (unsigned char)*c;
+    hash *= 0x01000193;
+  }
+  return hash;
+}
+
+static struct slot *table_find(struct table *table, const char *path)
+{
+  if (!table->size) {
+    return NULL;
+  }
+  const uint32_t hash = hash_path(path);
+  const size_t mask = table->size - 1;
+  for (size_t i = hash & mask; table->slots[i].path; i = (i + 1) & mask) {
+    if (table->slots[i].hash == hash && !strcmp(table->slots[i].path, path)) {
+      return &table->slots[i];
+    }
+  }
+  return NULL;
+}
+
+/* Puts path in the table, keeping it no more than half full, and returns its
+ * slot. The table takes ownership of path. */
+static struct slot *table_insert(struct table *table, char *path)
+{
+  struct slot *existing = table_find(table, path);
+  if (existing) {
+    free(path);
+    return existing;
+  }
+
+  if ((table->count + 1) * 2 > table->size) {
+    struct slot *old_slots = table->slots;
+    const size_t old_size = table->size;
+    table->size = old_size ? old_size * 2 : 256;
+    table->slots = calloc(table->size, sizeof *table->slots);
+    const size_t mask = table->size - 1;
+    for (size_t i = 0; i < old_size; ++i) {
+      if (old_slots[i].path) {
+        size_t j = old_slots[i].hash & mask;
+        while (table->slots[j].path) {
+          j = (j + 1) & mask;
+        }
+        table->slots[j] = old_slots[i];
+      }
+    }
+    free(old_slots);
+  }
+
+  const uint32_t hash = hash_path(path);
+  const size_t mask = table->size - 1;
+  size_t i = hash & mask;
+  while (table->slots[i].path) {
+    i = (i + 1) & mask;
+  }
+  table->slots[i] = (struct slot){.path = path, .hash = hash};
+  table->count++;
+  return &table->slots[i];
+}
+
+static void table_clear(struct table *table)
+{
+  for (size_t i = 0; i < table->size; ++i) {
+    free(table->slots[i].path);
+  }
+  free(table->slots);
+  memset(table, 0, sizeof *table);
+}
+
+struct imv_metadata_index {
+  /* where the directories' files are kept, or NULL */
+  char *dir;
+  struct imv_worker_pool *workers;
+  imv_metadata_notify notify;
+  void *data;
+
+  pthread_mutex_t lock;
+  pthread_cond_t idle;
+  /* info by absolute path */
+  struct table records;
+  /* every directory asked about, whether read yet or not */
+  struct table dirs;
+  /* directory jobs queued or running */
+  size_t pending;
+  /* set once notify has been called, until the next get */
+  bool notified;
+};
+
+struct dir_job {
+  struct imv_metadata_index *index;
+  char *dir;
+};
+
+/* Creates dir and any missing parents */
+static bool make_dirs(const char *dir)
+{
+  char path[PATH_MAX];
+  if (snprintf(path, sizeof path, "%s", dir) >= (int)sizeof path) {
+    return false;
+  }
+
+  for (char *p = path + 1; *p; ++p) {
+    if (*p == '/') {
+      *p = '\0';
+      if (mkdir(path, 0700) && errno != EEXIST) {
+        return false;
+      }
+      *p = '/';
+    }
+  }
+  return !mkdir(path, 0700) || errno == EEXIST;
+}
+
+static bool read_all(int fd, void *buf, size_t len)
+{
+  char *p = buf;
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+static bool write_all(int fd, const void *buf, size_t len)
+{
+  const char *p = buf;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+/* The name of dir's file in the cache, an FNV-1a hash of its path */
+static bool cache_file(struct imv_metadata_index *index, const char *dir,
+    char file[PATH_MAX])
+{
+  uint64_t hash = 0xcbf29ce484222325;
+  for (const char *c = dir; *c; ++c) {
+    hash ^= (unsigned char)*c;
+    hash *= 0x100000001b3;
+  }
+  return index->dir && snprintf(file, PATH_MAX, "%s/%016llx", index->dir,
+      (unsigned long long)hash) < PATH_MAX;
+}
+
+/* Reads what was known of dir's files last time into table */
+static void load_dir(struct imv_metadata_index *index, const char *dir,
+    struct table *table)
+{
+  char file[PATH_MAX];
+  if (!cache_file(index, dir, file)) {
+    return;
+  }
+  int fd = open(file, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return;
+  }
+
+  /* All in one read, as it's wanted all at once */
+  struct stat st;
+  unsigned char *data = NULL;
+  struct header header;
+  const size_t dir_len = strlen(dir);
+  if (fstat(fd, &st) || (size_t)st.st_size < sizeof header
+      || !(data = malloc(st.st_size)) || !read_all(fd, data, st.st_size)) {
+    goto end;
+  }
+  memcpy(&header, data, sizeof header);
+  if (memcmp(header.magic, MAGIC, sizeof header.magic)
+      || header.version != VERSION || header.dir_len != dir_len
+      || (size_t)st.st_size - sizeof header < dir_len
+      || memcmp(data + sizeof header, dir, dir_len)) {
+    /* stale, or another directory's with the same hash */
+    goto end;
+  }
+
+  size_t pos = sizeof header + dir_len;
+  for (uint32_t i = 0; i < header.count; ++i) {
+    struct record_header record;
+    if ((size_t)st.st_size - pos < sizeof record) {
+      break;
+    }
+    memcpy(&record, data + pos, sizeof record);
+    pos += sizeof record;
+    if ((size_t)st.st_size - pos < record.name_len) {
+      break;
+    }
+
+    char *path = malloc(dir_len + record.name_len + 2);
+    memcpy(path, dir, dir_len);
+    path[dir_len] = '/';
+    memcpy(path + dir_len + 1, data + pos, record.name_len);
+    path[dir_len + 1 + record.name_len] = '\0';
+    pos += record.name_len;
+    table_insert(table, path)->info = record.info;
+  }
+
+end:
+  free(data);
+  close(fd);
+}
+
+/* Writes the info of dir's files for next time */
+static void save_dir(struct imv_metadata_index *index, const char *dir,
+    struct table *table)
+{
+  char file[PATH_MAX], tmp[PATH_MAX];
+  if (!cache_file(index, dir, file)
+      || snprintf(tmp, sizeof tmp, "%s.XXXXXX", file) >= (int)sizeof tmp) {
+    return;
+  }
+  /* Written under a temporary name and moved into place, so readers never
+   * see half a directory */
+  int fd = mkstemp(tmp);
+  if (fd < 0) {
+    return;
+  }
+
+  const size_t dir_len = strlen(dir);
+  struct header header = {
+    .version = VERSION,
+    .count = table->count,
+    .dir_len = dir_len,
+  };
+  memcpy(header.magic, MAGIC, sizeof header.magic);
+
+  /* Gathered into one buffer, to write in one go */
+  size_t size = sizeof header + dir_len;
+  for (size_t i = 0; i < table->size; ++i) {
+    if (table->slots[i].path) {
+      size += sizeof(struct record_header) + strlen(table->slots[i].path) - dir_len - 1;
+    }
+  }
+  unsigned char *data = malloc(size);
+  bool ok = data;
+  if (ok) {
+    unsigned char *p = data;
+    memcpy(p, &header, sizeof header);
+    p += sizeof header;
+    memcpy(p, dir, dir_len);
+    p += dir_len;
+    for (size_t i = 0; i < table->size; ++i) {
+      const struct slot *slot = &table->slots[i];
+      if (!slot->path) {
+        continue;
+      }
+      const char *name = slot->path + dir_len + 1;
+      struct record_header record = {
+        .info = slot->info,
+        .name_len = strlen(name),
+      };
+      memcpy(p, &record, sizeof record);
+      p += sizeof record;
+      memcpy(p, name, record.name_len);
+      p += record.name_len;
+    }
+    ok = write_all(fd, data, size);
+  }
+  free(data);
+  ok = !close(fd) && ok;
+
+  if (!ok || rename(tmp, file)) {
+    unlink(tmp);
+  }
+}
+
+/* Adds the records in table to the index, and lets its owner know */
+static void publish(struct imv_metadata_index *index, struct table *table)
+{
+  pthread_mutex_lock(&index->lock);
+  for (size_t i = 0; i < table->size; ++i) {
+    const struct slot *slot = &table->slots[i];
+    if (slot->path) {
+      table_insert(&index->records, strdup(slot->path))->info = slot->info;
+    }
+  }
+
+  if (index->notify && !index->notified) {
+    index->notified = true;
+    pthread_mutex_unlock(&index->lock);
+    index->notify(index->data);
+    return;
+  }
+  pthread_mutex_unlock(&index->lock);
+}
+
+static bool same_status(const struct imv_file_info *info, const struct stat *st)
+{
+  return info->size == (int64_t)st->st_size
+    && info->mtime_sec == (int64_t)st->st_mtim.tv_sec
+    && info->mtime_nsec == (int64_t)st->st_mtim.tv_nsec;
+}
+
+/* Gathers the info of every file in dir, checking what was known of them
+ * last time against the filesystem, and reading the headers of only those
+ * that are new or have changed */
+static void read_dir(struct imv_metadata_index *index, const char *dir)
+{
+  struct table cached = {0};
+  load_dir(index, dir, &cached);
+  if (cached.count) {
+    publish(index, &cached);
+  }
+
+  struct table current = {0};
+  bool changed = false;
+  DIR *d = opendir(dir);
+  struct dirent *entry;
+  while (d && (entry = readdir(d))) {
+#ifdef DT_DIR
+    if (entry->d_type == DT_DIR) {
+      continue;
+    }
+#endif
+    if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
+      continue;
+    }
+
+    char path[PATH_MAX];
+    struct stat st;
+    if (snprintf(path, sizeof path, "%s/%s", dir, entry->d_name) >= (int)sizeof path
+        || stat(path, &st) || !S_ISREG(st.st_mode)) {
+      continue;
+    }
+
+    struct slot *slot = table_insert(&current, strdup(path));
+    const struct slot *known = table_find(&cached, path);
+    if (known && same_status(&known->info, &st)) {
+      slot->info = known->info;
+    } else {
+      read_file_info(path, &st, &slot->info);
+      changed = true;
+    }
+  }
+  if (d) {
+    closedir(d);
+  }
+
+  /* Files gone since last time change it too */
+  changed = changed || current.count != cached.count;
+  if (changed) {
+    publish(index, &current);
+    save_dir(index, dir, &current);
+  }
+  table_clear(&current);
+  table_clear(&cached);
+}
+
+static void queue_dir(struct imv_metadata_index *index, char *dir);
+
+static void finish_job(struct dir_job *job, bool cancelled)
+{
+  struct imv_metadata_index *index = job->index;
+
+  pthread_mutex_lock(&index->lock);
+  struct slot *slot = table_find(&index->dirs, job->dir);
+  const bool again = slot && slot->stale && !cancelled;
+  if (slot) {
+    slot->queued = again;
+    slot->stale = false;
+  }
+  if (again) {
+    /* Asked to be refreshed while being read, which may have been too late
+     * for what changed */
+    index->pending++;
+  }
+  index->pending--;
+  pthread_cond_broadcast(&index->idle);
+  pthread_mutex_unlock(&index->lock);
+
+  if (again) {
+    queue_dir(index, job->dir);
+  } else {
+    free(job->dir);
+  }
+  free(job);
+}
+
+static void dir_job(void *data)
+{
+  struct dir_job *job = data;
+  read_dir(job->index, job->dir);
+  finish_job(job, false);
+}
+
+/* Called in place of dir_job if the index is freed before it runs */
+static void cancel_dir_job(void *data)
+{
+  finish_job(data, true);
+}
+
+/* Reads dir in the background, or right away without workers. Takes
+ * ownership of dir, which must have been marked queued and counted as
+ * pending. */
+static void queue_dir(struct imv_metadata_index *index, char *dir)
+{
+  struct dir_job *job = calloc(1, sizeof *job);
+  job->index = index;
+  job->dir = dir;
+  if (index->workers) {
+    /* All owned by the index, so they're read one at a time, leaving the
+     * rest of the workers to decoding */
+    imv_worker_pool_submit(index->workers, index, IMV_JOB_BACKGROUND,
+        dir_job, cancel_dir_job, job);
+  } else {
+    dir_job(job);
+  }
+}
+
+/* Returns a copy of the directory part of path, or NULL if there's none */
+static char *dir_of(const char *path)
+{
+  const char *sep = strrchr(path, '/');
+  return sep && sep != path ? strndup(path, sep - path) : NULL;
+}
+
+struct imv_metadata_index *imv_metadata_index_create(const char *dir,
+    struct imv_worker_pool *workers, imv_metadata_notify notify, void *data)
+{
+  char buf[PATH_MAX];
+  if (!dir) {
+    const char *base = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if (base && *base) {
+      snprintf(buf, sizeof buf, "%s/imv/metadata", base);
+      dir = buf;
+    } else if (home && *home) {
+      snprintf(buf, sizeof buf, "%s/.cache/imv/metadata", home);
+      dir = buf;
+    }
+  }
+
+  struct imv_metadata_index *index = calloc(1, sizeof *index);
+  if (dir && make_dirs(dir)) {
+    index->dir = strdup(dir);
+  } else if (dir) {
+    imv_log(IMV_WARNING, "Can't create metadata directory %s: %s\n",
+        dir, strerror(errno));
+  }
+  index->workers = workers;
+  index->notify = notify;
+  index->data = data;
+  pthread_mutex_init(&index->lock, NULL);
+  pthread_cond_init(&index->idle, NULL);
+  return index;
+}
+
+void imv_metadata_index_free(struct imv_metadata_index *index)
+{
+  if (!index) {
+    return;
+  }
+
+  if (index->workers) {
+    imv_worker_pool_cancel(index->workers, index);
+  }
+  pthread_mutex_lock(&index->lock);
+  while (index->pending > 0) {
+    pthread_cond_wait(&index->idle, &index->lock);
+  }
+  pthread_mutex_unlock(&index->lock);
+
+  table_clear(&index->records);
+  table_clear(&index->dirs);
+  pthread_cond_destroy(&index->idle);
+  pthread_mutex_destroy(&index->lock);
+  free(index->dir);
+  free(index);
+}
+
+bool imv_metadata_index_get(struct imv_metadata_index *index,
+    const char *path, struct imv_file_info *info)
+{
+  pthread_mutex_lock(&index->lock);
+  index->notified = false;
+  const struct slot *slot = table_find(&index->records, path);
+  if (slot) {
+    *info = slot->info;
+    pthread_mutex_unlock(&index->lock);
+    return true;
+  }
+
+  char *dir = dir_of(path);
+  struct slot *dir_slot = dir ? table_find(&index->dirs, dir) : NULL;
+  if (dir && !dir_slot) {
+    dir_slot = table_insert(&index->dirs, strdup(dir));
+  } else if (!dir_slot || dir_slot->queued || dir_slot->retried) {
+    /* It's being read, or has been since the file went missing from it */
+    free(dir);
+    pthread_mutex_unlock(&index->lock);
+    return false;
+  } else {
+    /* Read before the file turned up, perhaps, so read once more */
+    dir_slot->retried = true;
+  }
+  dir_slot->queued = true;
+  index->pending++;
+  pthread_mutex_unlock(&index->lock);
+
+  queue_dir(index, dir);
+  if (index->workers) {
+    return false;
+  }
+
+  pthread_mutex_lock(&index->lock);
+  index->notified = false;
+  slot = table_find(&index->records, path);
+  if (slot) {
+    *info = slot->info;
+  }
+  pthread_mutex_unlock(&index->lock);
+  return slot;
+}
+
+void imv_metadata_index_refresh(struct imv_metadata_index *index,
+    const char *path)
+{
+  char *dir = dir_of(path);
+  if (!dir) {
+    return;
+  }
+
+  pthread_mutex_lock(&index->lock);
+  struct slot *slot = table_find(&index->dirs, dir);
+  if (!slot || slot->queued) {
+    /* Never asked about, so nothing to refresh, or it's read again after
+     * the read under way */
+    if (slot) {
+      slot->stale = true;
+    }
+    free(dir);
+    pthread_mutex_unlock(&index->lock);
+    return;
+  }
+  slot->queued = true;
+  slot->retried = false;
+  index->pending++;
+  pthread_mutex_unlock(&index->lock);
+
+  queue_dir(index, dir);
+}
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,64 @@
+#ifndef IMV_METADATA_INDEX_H
+#define IMV_METADATA_INDEX_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct imv_worker_pool;
+
+/* What's known about an image file without decoding it */
+struct imv_file_info {
+  int64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  /* when the photo was taken according to its EXIF data, as a time_t for
+   * the local time it gives, or 0 if it doesn't say */
+  int64_t taken;
+  /* the image's dimensions, or 0 where its header couldn't be read */
+  int32_t width;
+  int32_t height;
+};
+
+/* Reads the status of the file at path and the header of the image in it,
+ * as far as it's a JPEG, PNG or GIF. Returns false if it can't be stat'd. */
+bool imv_file_info_read(const char *path, struct imv_file_info *info);
+
+/* The file info of every file in the directories it's been asked about,
+ * gathered a directory at a time on the worker pool, and kept on disk between
+ * runs in a file per directory. A directory seen before is loaded from its
+ * file in one go, and then checked against the filesystem in the background,
+ * so that sorting by what's in the index needn't wait on the filesystem.
+ * All functions but create and free are safe to call from any thread.
+ */
+struct imv_metadata_index;
+
+/* Called from a worker thread when file info becomes known. It's called once
+ * until the next imv_metadata_index_get, however many directories finish. */
+typedef void (*imv_metadata_notify)(void *data);
+
+/* Creates an index kept in dir, which is created if it doesn't exist. If dir
+ * is NULL, $XDG_CACHE_HOME/imv/metadata is used, and if there's no usable
+ * directory the index is only kept in memory. Without workers, directories
+ * are read the moment they're asked about. */
+struct imv_metadata_index *imv_metadata_index_create(const char *dir,
+    struct imv_worker_pool *workers, imv_metadata_notify notify, void *data);
+
+/* Cleans up an index, waiting for any directories being read */
+void imv_metadata_index_free(struct imv_metadata_index *index);
+
+/* Looks up path, an absolute path, filling info and returning true if it's
+ * known. Otherwise false is returned, and the file's directory is queued to
+ * be read if it's not been yet, or read again if the file's not been looked
+ * for since it was. */
+bool imv_metadata_index_get(struct imv_metadata_index *index,
+    const char *path, struct imv_file_info *info);
+
+/* Reads the directory of path again, as a file in it has changed or been
+ * added, if the directory's been asked about */
+void imv_metadata_index_refresh(struct imv_metadata_index *index,
+    const char *path);
+
+#endif
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -1,9 +1,14 @@
+/* For d_type and its DT_ constants */
+#define _DEFAULT_SOURCE
+
 #include "navigator.h"
 
 #include <assert.h>
 #include <dirent.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -18,107 +23,639 @@
 #define PATH_MAX 4096
 #endif
 
+/* How many directories are read at once */
+#define SCAN_THREADS 4
+
+/* How much of the arena each block holds, unless a path needs more */
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+/* A path, stored in the arena. seq increases with every path added, so the
+ * paths list can be searched by it, as long as it's in the order added. */
 struct nav_item {
+  size_t seq;
+  uint32_t hash;
+  char path[];
+};
+
+/* Paths are packed one after another into big blocks, so each costs little
+ * more than its length. The blocks only go away all at once, leaving the
+ * space of removed paths unused until then. */
+struct arena_block {
+  struct arena_block *next;
+  size_t used;
+  size_t size;
+  char data[];
+};
+
+/* A path waiting to be added, and if it's a directory, the contents found
+ * inside it so far. Together they form a tree whose depth-first order is
+ * the order paths are added in, however the directories are read. */
+struct scan_node {
   char *path;
+  bool is_dir;
+  /* a link to a file, to be resolved once its place by name is known */
+  bool is_link;
+  bool recursive;
+  /* set once the directory's children are known */
+  bool read;
+  /* scan_node *, sorted by name */
+  struct list *children;
+  /* index of the next child to add */
+  size_t next;
 };
 
 struct imv_navigator {
+  /* nav_item *, in the arena */
   struct list *paths;
+  struct arena_block *arena;
+  size_t next_seq;
+  /* set while the paths list is sorted in some other order than added */
+  bool sorted;
+
+  /* An open addressing hash table of every nav_item, for finding paths
+   * without searching through them all. Its size is a power of two. */
+  struct {
+    struct nav_item **slots;
+    size_t size;
+    size_t count;
+  } index;
+
   size_t cur_path;
   time_t last_change;
   time_t last_check;
   int last_move_direction;
   int changed;
   int wrapped;
+  /* whether poll_changed stats the current file to see if it changed */
+  bool polling;
+
+  /* Directories are read by background threads, which fill in the scan tree
+   * under lock. The main thread adds paths from the front of the tree as each
+   * part becomes complete, so they're always in the same order. */
+  struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    pthread_t threads[SCAN_THREADS];
+    int num_threads;
+    bool quit;
+    /* directory scan_nodes waiting to be read, the next at the back */
+    struct list *queue;
+    /* the chain of scan_nodes from the root to where adding is up to */
+    struct list *stack;
+    /* bumped when the tree is thrown away, so that threads reading one of
+     * its directories know to discard what they found */
+    unsigned generation;
+    void (*callback)(void *data);
+    void *callback_data;
+    /* set once callback has been called, until the next collect */
+    bool notified;
+    void (*dir_callback)(const char *dir, void *data);
+    void *dir_callback_data;
+  } scan;
 };
 
+static struct scan_node *create_node(char *path, bool is_dir, bool recursive)
+{
+  struct scan_node *node = calloc(1, sizeof *node);
+  node->path = path;
+  node->is_dir = is_dir;
+  node->recursive = recursive;
+  node->children = list_create();
+  return node;
+}
+
+static void free_node(struct scan_node *node)
+{
+  if (!node) {
+    return;
+  }
+  for (size_t i = node->next; i < node->children->len; ++i) {
+    free_node(node->children->items[i]);
+  }
+  list_free(node->children);
+  free(node->path);
+  free(node);
+}
+
+static int compare_nodes(const void *a, const void *b)
+{
+  const struct scan_node *const *left = a;
+  const struct scan_node *const *right = b;
+  const char *left_name = strrchr((*left)->path, '/') + 1;
+  const char *right_name = strrchr((*right)->path, '/') + 1;
+  return strcoll(left_name, right_name);
+}
+
+/* Lists the contents of base, an absolute path, as sorted scan_nodes, using
+ * d_type to avoid stat where the filesystem reports it */
+static struct list *read_dir(const char *base, bool recursive)
+{
+  struct list *children = list_create();
+
+  DIR *d = opendir(base);
+  if (!d) {
+    return children;
+  }
+
+  struct dirent *entry;
+  char path_buf[PATH_MAX+1];
+  while ((entry = readdir(d))) {
+    if (!strcmp(entry->d_name, "..") || !strcmp(entry->d_name, ".")) {
+      continue;
+    }
+    snprintf(path_buf, sizeof path_buf, "%s/%s", base, entry->d_name);
+
+    bool is_dir = false;
+    bool is_link = false;
+#ifdef DT_DIR
+    if (entry->d_type == DT_DIR) {
+      is_dir = true;
+    } else if (entry->d_type != DT_REG) {
+      is_link = entry->d_type == DT_LNK;
+#else
+    {
+#endif
+      struct stat info;
+      if (stat(path_buf, &info)) {
+        continue;
+      }
+      is_dir = S_ISDIR(info.st_mode);
+    }
+
+    if (is_dir && !recursive) {
+      continue;
+    }
+
+    struct scan_node *node = create_node(strdup(path_buf), is_dir, recursive);
+    node->is_link = is_link && !is_dir;
+    list_append(children, node);
+  }
+  closedir(d);
+
+  qsort(children->items, children->len, sizeof *children->items, compare_nodes);
+
+  /* Only links can lead somewhere outside base, so only they need resolving
+   * to give the same paths realpath would */
+  for (size_t i = 0; i < children->len; ++i) {
+    struct scan_node *node = children->items[i];
+    char *path = node->is_link ? realpath(node->path, NULL) : NULL;
+    if (path) {
+      free(node->path);
+      node->path = path;
+    }
+  }
+  return children;
+}
+
+static void *scan_thread(void *data)
+{
+  struct imv_navigator *nav = data;
+
+  pthread_mutex_lock(&nav->scan.lock);
+  while (true) {
+    while (!nav->scan.quit && nav->scan.queue->len == 0) {
+      pthread_cond_wait(&nav->scan.wake, &nav->scan.lock);
+    }
+    if (nav->scan.quit) {
+      break;
+    }
+
+    struct scan_node *node = nav->scan.queue->items[nav->scan.queue->len - 1];
+    list_remove(nav->scan.queue, nav->scan.queue->len - 1);
+    const unsigned generation = nav->scan.generation;
+    char *path = strdup(node->path);
+    const bool recursive = node->recursive;
+    pthread_mutex_unlock(&nav->scan.lock);
+
+    char *base = realpath(path, NULL);
+    struct list *children = base ? read_dir(base, recursive) : list_create();
+    free(path);
+
+    pthread_mutex_lock(&nav->scan.lock);
+    if (generation != nav->scan.generation) {
+      /* node was freed along with the rest of its tree */
+      for (size_t i = 0; i < children->len; ++i) {
+        free_node(children->items[i]);
+      }
+      list_free(children);
+      free(base);
+      continue;
+    }
+
+    if (base) {
+      free(node->path);
+      node->path = base;
+    }
+    list_free(node->children);
+    node->children = children;
+    node->read = true;
+
+    /* Queue subdirectories so the first is read next, as it's the first
+     * whose contents will be needed */
+    for (size_t i = children->len; i > 0; --i) {
+      struct scan_node *child = children->items[i - 1];
+      if (child->is_dir) {
+        list_append(nav->scan.queue, child);
+        pthread_cond_signal(&nav->scan.wake);
+      }
+    }
+
+    pthread_cond_broadcast(&nav->scan.done);
+    void (*callback)(void *data) = nav->scan.callback;
+    void *callback_data = nav->scan.callback_data;
+    if (callback && !nav->scan.notified) {
+      nav->scan.notified = true;
+      pthread_mutex_unlock(&nav->scan.lock);
+      callback(callback_data);
+      pthread_mutex_lock(&nav->scan.lock);
+    }
+  }
+  pthread_mutex_unlock(&nav->scan.lock);
+  return NULL;
+}
+
+static uint32_t hash_path(const char *path)
+{
+  uint32_t hash = 0x811c9dc5;
+  for (const char *c = path; *c; ++c) {
+    hash ^= (unsigned char)*c;
+    hash *= 0x01000193;
+  }
+  return hash;
+}
+
+static void index_insert(struct imv_navigator *nav, struct nav_item *item)
+{
+  const size_t mask = nav->index.size - 1;
+  size_t slot = item->hash & mask;
+  while (nav->index.slots[slot]) {
+    slot = (slot + 1) & mask;
+  }
+  nav->index.slots[slot] = item;
+  nav->index.count++;
+}
+
+/* Keeps the table no more than half full */
+static void index_grow(struct imv_navigator *nav)
+{
+  if ((nav->index.count + 1) * 2 <= nav->index.size) {
+    return;
+  }
+
+  struct nav_item **old_slots = nav->index.slots;
+  const size_t old_size = nav->index.size;
+
+  nav->index.size = old_size ? old_size * 2 : 256;
+  nav->index.slots = calloc(nav->index.size, sizeof *nav->index.slots);
+  nav->index.count = 0;
+  for (size_t i = 0; i < old_size; ++i) {
+    if (old_slots[i]) {
+      index_insert(nav, old_slots[i]);
+    }
+  }
+  free(old_slots);
+}
+
+static void index_remove(struct imv_navigator *nav, struct nav_item *item)
+{
+  const size_t mask = nav->index.size - 1;
+  size_t slot = item->hash & mask;
+  while (nav->index.slots[slot] != item) {
+    slot = (slot + 1) & mask;
+  }
+  nav->index.slots[slot] = NULL;
+  nav->index.count--;
+
+  /* Move back any items after it that would no longer be found with the
+   * gap in their probe sequence */
+  size_t next = (slot + 1) & mask;
+  while (nav->index.slots[next]) {
+    const size_t home = nav->index.slots[next]->hash & mask;
+    if (((next - home) & mask) >= ((next - slot) & mask)) {
+      nav->index.slots[slot] = nav->index.slots[next];
+      nav->index.slots[next] = NULL;
+      slot = next;
+    }
+    next = (next + 1) & mask;
+  }
+}
+
+/* Returns the first item added with the given path, or NULL */
+static struct nav_item *index_find(struct imv_navigator *nav, const char *path)
+{
+  if (!nav->index.size) {
+    return NULL;
+  }
+
+  const uint32_t hash = hash_path(path);
+  const size_t mask = nav->index.size - 1;
+  struct nav_item *found = NULL;
+  for (size_t slot = hash & mask; nav->index.slots[slot];
+      slot = (slot + 1) & mask) {
+    struct nav_item *item = nav->index.slots[slot];
+    if (item->hash == hash && !strcmp(item->path, path)
+        && (!found || item->seq < found->seq)) {
+      found = item;
+    }
+  }
+  return found;
+}
+
+/* Returns the position of item in the paths list */
+static size_t item_position(struct imv_navigator *nav, struct nav_item *item)
+{
+  if (nav->sorted) {
+    size_t pos = 0;
+    while (nav->paths->items[pos] != item) {
+      ++pos;
+    }
+    return pos;
+  }
+
+  size_t low = 0;
+  size_t high = nav->paths->len;
+  while (low < high) {
+    const size_t mid = low + (high - low) / 2;
+    const struct nav_item *other = nav->paths->items[mid];
+    if (other->seq < item->seq) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+/* Copies path into the arena as a new item, and indexes it */
+static struct nav_item *store_item(struct imv_navigator *nav, const char *path)
+{
+  const size_t len = strlen(path) + 1;
+  /* Keep the next item aligned for its seq */
+  const size_t align = sizeof(size_t);
+  const size_t need = (sizeof(struct nav_item) + len + align - 1) & ~(align - 1);
+
+  struct arena_block *block = nav->arena;
+  if (!block || block->size - block->used < need) {
+    const size_t size = need > ARENA_BLOCK_SIZE ? need : ARENA_BLOCK_SIZE;
+    block = malloc(sizeof *block + size);
+    block->next = nav->arena;
+    block->used = 0;
+    block->size = size;
+    nav->arena = block;
+  }
+
+  struct nav_item *item = (struct nav_item *)(block->data + block->used);
+  block->used += need;
+  item->seq = nav->next_seq++;
+  item->hash = hash_path(path);
+  memcpy(item->path, path, len);
+
+  index_grow(nav);
+  index_insert(nav, item);
+  return item;
+}
+
+/* Removes the item at index from the paths list */
+static void remove_item(struct imv_navigator *nav, size_t index)
+{
+  index_remove(nav, nav->paths->items[index]);
+  list_remove(nav->paths, index);
+}
+
+/* Forgets every path, freeing the arena */
+static void clear_items(struct imv_navigator *nav)
+{
+  while (nav->arena) {
+    struct arena_block *next = nav->arena->next;
+    free(nav->arena);
+    nav->arena = next;
+  }
+  list_clear(nav->paths);
+  if (nav->index.slots) {
+    memset(nav->index.slots, 0, nav->index.size * sizeof *nav->index.slots);
+  }
+  nav->index.count = 0;
+  nav->next_seq = 0;
+  nav->sorted = false;
+}
+
+/* Throws away the scan tree, leaving an empty root. Must hold the lock. */
+static void reset_tree(struct imv_navigator *nav)
+{
+  /* Each node on the stack has been taken from its parent's children, so
+   * isn't freed along with them */
+  for (size_t i = nav->scan.stack->len; i > 0; --i) {
+    free_node(nav->scan.stack->items[i - 1]);
+  }
+  list_clear(nav->scan.stack);
+  list_clear(nav->scan.queue);
+  nav->scan.generation++;
+
+  struct scan_node *root = create_node(NULL, true, false);
+  root->read = true;
+  list_append(nav->scan.stack, root);
+}
+
 struct imv_navigator *imv_navigator_create(void)
 {
   struct imv_navigator *nav = calloc(1, sizeof *nav);
   nav->last_move_direction = 1;
+  nav->polling = true;
   nav->paths = list_create();
+
+  pthread_mutex_init(&nav->scan.lock, NULL);
+  pthread_cond_init(&nav->scan.wake, NULL);
+  pthread_cond_init(&nav->scan.done, NULL);
+  nav->scan.queue = list_create();
+  nav->scan.stack = list_create();
+  reset_tree(nav);
   return nav;
 }
 
 void imv_navigator_free(struct imv_navigator *nav)
 {
-  for (size_t i = 0; i < nav->paths->len; ++i) {
-    struct nav_item *nav_item = nav->paths->items[i];
-    free(nav_item->path);
+  pthread_mutex_lock(&nav->scan.lock);
+  nav->scan.quit = true;
+  pthread_cond_broadcast(&nav->scan.wake);
+  pthread_mutex_unlock(&nav->scan.lock);
+  for (int i = 0; i < nav->scan.num_threads; ++i) {
+    pthread_join(nav->scan.threads[i], NULL);
   }
-  list_deep_free(nav->paths);
+  reset_tree(nav);
+  free_node(nav->scan.stack->items[0]);
+  list_free(nav->scan.stack);
+  list_free(nav->scan.queue);
+  pthread_cond_destroy(&nav->scan.done);
+  pthread_cond_destroy(&nav->scan.wake);
+  pthread_mutex_destroy(&nav->scan.lock);
+
+  clear_items(nav);
+  list_free(nav->paths);
+  free(nav->index.slots);
   free(nav);
 }
 
-static int add_item(struct imv_navigator *nav, const char *path)
+/* Takes ownership of path, which must already be absolute if it can be */
+static void append_item(struct imv_navigator *nav, char *path)
 {
-  struct nav_item *nav_item = calloc(1, sizeof *nav_item);
-
-  nav_item->path = realpath(path, NULL);
-  if (!nav_item->path) {
-    nav_item->path = strdup(path);
-  }
-
-  list_append(nav->paths, nav_item);
+  list_append(nav->paths, store_item(nav, path));
+  free(path);
 
   if (nav->paths->len == 1) {
     nav->cur_path = 0;
     nav->changed = 1;
   }
+}
 
+static int add_item(struct imv_navigator *nav, const char *path)
+{
+  char *real_path = realpath(path, NULL);
+  append_item(nav, real_path ? real_path : strdup(path));
   return 0;
 }
 
+/* Whether paths are waiting on directories to be read. Must hold the lock */
+static bool is_scanning(struct imv_navigator *nav)
+{
+  struct scan_node *root = nav->scan.stack->items[0];
+  return nav->scan.stack->len > 1 || root->next < root->children->len;
+}
+
+/* Adds every path at the front of the tree whose place in the order is
+ * settled. Must hold the lock. */
+static bool collect(struct imv_navigator *nav)
+{
+  const size_t prev_len = nav->paths->len;
+  nav->scan.notified = false;
+
+  while (true) {
+    struct scan_node *top = nav->scan.stack->items[nav->scan.stack->len - 1];
+    if (!top->read) {
+      break;
+    }
+
+    /* A directory starting to be added */
+    if (top->next == 0 && nav->scan.stack->len > 1 && nav->scan.dir_callback) {
+      nav->scan.dir_callback(top->path, nav->scan.dir_callback_data);
+    }
+
+    if (top->next == top->children->len) {
+      if (nav->scan.stack->len == 1) {
+        /* Nothing left to add, so start the root afresh */
+        list_clear(top->children);
+        top->next = 0;
+        break;
+      }
+      list_remove(nav->scan.stack, nav->scan.stack->len - 1);
+      free_node(top);
+      continue;
+    }
+
+    struct scan_node *child = top->children->items[top->next++];
+    if (child->is_dir) {
+      list_append(nav->scan.stack, child);
+    } else {
+      append_item(nav, child->path);
+      child->path = NULL;
+      free_node(child);
+    }
+  }
+
+  return nav->paths->len != prev_len;
+}
+
+static void start_threads(struct imv_navigator *nav)
+{
+  while (nav->scan.num_threads < SCAN_THREADS) {
+    if (pthread_create(&nav->scan.threads[nav->scan.num_threads], NULL,
+          scan_thread, nav)) {
+      break;
+    }
+    nav->scan.num_threads++;
+  }
+}
+
 int imv_navigator_add(struct imv_navigator *nav, const char *path,
                        int recursive)
 {
-  char path_buf[PATH_MAX+1];
   struct stat path_info;
-  if ((stat(path, &path_info) == 0) &&
-      S_ISDIR(path_info.st_mode)) {
-    int result = 0;
-    struct dirent **dir_list;
-    int total_dirs = scandir(path, &dir_list, 0, alphasort);
-    if (total_dirs >= 0) {
-      for (int i = 0; i < total_dirs; ++i) {
-        struct dirent *dir = dir_list[i];
-        if (strcmp(dir->d_name, "..") == 0 || strcmp(dir->d_name, ".") == 0) {
-          continue;
-        }
-        snprintf(path_buf, sizeof path_buf, "%s/%s", path, dir->d_name);
-        struct stat new_path_info;
-        if (stat(path_buf, &new_path_info)) {
-          switch (errno) {
-          case ELOOP:
-          case ENOTDIR:
-          case ENOENT: continue;
-          default: result = 1; break;
-          }
-        }
-        int is_dir = S_ISDIR(new_path_info.st_mode);
-        if (is_dir && recursive) {
-          if (imv_navigator_add(nav, path_buf, recursive) != 0) {
-            result = 1;
-            break;
-          }
-        } else if (!is_dir) {
-          if (add_item(nav, path_buf) != 0) {
-            result = 1;
-            break;
-          }
-        }
-        free(dir_list[i]);
-      }
-      free(dir_list);
-    }
-    return result;
-  } else {
+  const bool is_dir = stat(path, &path_info) == 0 && S_ISDIR(path_info.st_mode);
+
+  pthread_mutex_lock(&nav->scan.lock);
+  if (!is_dir && !is_scanning(nav)) {
+    /* Nothing to wait behind, so there's no need to queue it */
+    pthread_mutex_unlock(&nav->scan.lock);
     return add_item(nav, path);
   }
 
+  if (is_dir) {
+    start_threads(nav);
+    if (!nav->scan.num_threads) {
+      pthread_mutex_unlock(&nav->scan.lock);
+      return 1;
+    }
+  }
+
+  struct scan_node *root = nav->scan.stack->items[0];
+  char *real_path = is_dir ? NULL : realpath(path, NULL);
+  struct scan_node *node = create_node(real_path ? real_path : strdup(path),
+      is_dir, recursive);
+  list_append(root->children, node);
+
+  if (is_dir) {
+    list_append(nav->scan.queue, node);
+    pthread_cond_signal(&nav->scan.wake);
+  }
+  pthread_mutex_unlock(&nav->scan.lock);
   return 0;
 }
 
+void imv_navigator_set_scan_callback(struct imv_navigator *nav,
+    void (*callback)(void *data), void *data)
+{
+  pthread_mutex_lock(&nav->scan.lock);
+  nav->scan.callback = callback;
+  nav->scan.callback_data = data;
+  pthread_mutex_unlock(&nav->scan.lock);
+}
+
+void imv_navigator_set_dir_callback(struct imv_navigator *nav,
+    void (*callback)(const char *dir, void *data), void *data)
+{
+  pthread_mutex_lock(&nav->scan.lock);
+  nav->scan.dir_callback = callback;
+  nav->scan.dir_callback_data = data;
+  pthread_mutex_unlock(&nav->scan.lock);
+}
+
+bool imv_navigator_collect(struct imv_navigator *nav)
+{
+  pthread_mutex_lock(&nav->scan.lock);
+  const bool added = collect(nav);
+  pthread_mutex_unlock(&nav->scan.lock);
+  return added;
+}
+
+bool imv_navigator_scanning(struct imv_navigator *nav)
+{
+  pthread_mutex_lock(&nav->scan.lock);
+  const bool scanning = is_scanning(nav);
+  pthread_mutex_unlock(&nav->scan.lock);
+  return scanning;
+}
+
+void imv_navigator_finish_scan(struct imv_navigator *nav)
+{
+  pthread_mutex_lock(&nav->scan.lock);
+  collect(nav);
+  while (is_scanning(nav)) {
+    pthread_cond_wait(&nav->scan.done, &nav->scan.lock);
+    collect(nav);
+  }
+  pthread_mutex_unlock(&nav->scan.lock);
+}
+
 const char *imv_navigator_selection(struct imv_navigator *nav)
 {
   const char *path = imv_navigator_at(nav, nav->cur_path);
@@ -186,38 +723,11 @@ void imv_navigator_select_abs(struct imv_navigator *nav, ssize_t index)
 
 void imv_navigator_remove(struct imv_navigator *nav, const char *path)
 {
-  bool found = false;
-  size_t removed = 0;
-  for (size_t i = 0; i < nav->paths->len; ++i) {
-    struct nav_item *item = nav->paths->items[i];
-    if (!strcmp(item->path, path)) {
-      free(item->path);
-      free(item);
-      list_remove(nav->paths, i);
-      removed = i;
-      found = true;
-      break;
-    }
-  }
-
-  if (!found) {
+  struct nav_item *item = index_find(nav, path);
+  if (!item) {
     return;
   }
-
-  if (nav->cur_path == removed) {
-    /* We just removed the current path */
-    if (nav->last_move_direction < 0) {
-      /* Move left */
-      imv_navigator_select_rel(nav, -1);
-    } else {
-      /* Try to stay where we are, unless we ran out of room */
-      if (nav->cur_path == nav->paths->len) {
-        nav->cur_path = 0;
-        nav->wrapped = 1;
-      }
-    }
-  }
-  nav->changed = 1;
+  imv_navigator_remove_at(nav, item_position(nav, item));
 }
 
 void imv_navigator_remove_at(struct imv_navigator *nav, size_t index)
@@ -225,12 +735,12 @@ void imv_navigator_remove_at(struct imv_navigator *nav, size_t index)
   if (index >= nav->paths->len) {
     return;
   }
-  struct nav_item *item = nav->paths->items[index];
-  free(item->path);
-  free(item);
-  list_remove(nav->paths, index);
+  remove_item(nav, index);
 
-  if (nav->cur_path == index) {
+  if (nav->cur_path > index) {
+    /* Keep the same path selected */
+    nav->cur_path--;
+  } else if (nav->cur_path == index) {
     /* We just removed the current path */
     if (nav->last_move_direction < 0) {
       /* Move left */
@@ -248,14 +758,14 @@ void imv_navigator_remove_at(struct imv_navigator *nav, size_t index)
 
 void imv_navigator_remove_all(struct imv_navigator *nav)
 {
-  for (size_t i = 0; i < nav->paths->len; ++i) {
-    struct nav_item *item = nav->paths->items[i];
-    free(item->path);
-    free(item);
-  }
-  list_clear(nav->paths);
+  clear_items(nav);
   nav->cur_path = 0;
   nav->changed = 1;
+
+  /* Drop whatever had yet to be added too */
+  pthread_mutex_lock(&nav->scan.lock);
+  reset_tree(nav);
+  pthread_mutex_unlock(&nav->scan.lock);
 }
 
 ssize_t imv_navigator_find_path(struct imv_navigator *nav, const char *path)
@@ -263,15 +773,11 @@ ssize_t imv_navigator_find_path(struct imv_navigator *nav, const char *path)
   char *real_path = realpath(path, NULL);
   if (real_path) {
     /* first try to match the exact path if path can be resolved */
-    for (size_t i = 0; i < nav->paths->len; ++i) {
-      struct nav_item *item = nav->paths->items[i];
-      if (!strcmp(item->path, real_path)) {
-        free(real_path);
-        return (ssize_t)i;
-      }
-    }
-
+    struct nav_item *item = index_find(nav, real_path);
     free(real_path);
+    if (item) {
+      return (ssize_t)item_position(nav, item);
+    }
   }
 
   /* no exact matches or path cannot be resolved, try the final portion of the path */
@@ -295,7 +801,7 @@ int imv_navigator_poll_changed(struct imv_navigator *nav)
     return 1;
   }
 
-  if (nav->paths->len == 0) {
+  if (nav->paths->len == 0 || !nav->polling) {
     return 0;
   };
 
@@ -319,6 +825,16 @@ int imv_navigator_poll_changed(struct imv_navigator *nav)
   return 0;
 }
 
+void imv_navigator_set_polling(struct imv_navigator *nav, bool polling)
+{
+  nav->polling = polling;
+}
+
+void imv_navigator_notify_changed(struct imv_navigator *nav)
+{
+  nav->changed = 1;
+}
+
 int imv_navigator_wrapped(struct imv_navigator *nav)
 {
   return nav->wrapped;
@@ -329,6 +845,80 @@ size_t imv_navigator_length(struct imv_navigator *nav)
   return nav->paths->len;
 }
 
+struct sort_entry {
+  int64_t key;
+  struct nav_item *item;
+};
+
+static int compare_entries(const void *a, const void *b)
+{
+  const struct sort_entry *lhs = a, *rhs = b;
+  if (lhs->key != rhs->key) {
+    return lhs->key < rhs->key ? -1 : 1;
+  }
+  return lhs->item->seq < rhs->item->seq ? -1 : lhs->item->seq > rhs->item->seq;
+}
+
+void imv_navigator_sort(struct imv_navigator *nav,
+    int64_t (*key)(const char *path, void *data), void *data)
+{
+  const size_t len = nav->paths->len;
+  if (len == 0 || (!key && !nav->sorted)) {
+    nav->sorted = key != NULL;
+    return;
+  }
+
+  /* Each key is worked out once, rather than on every comparison */
+  struct sort_entry *entries = malloc(len * sizeof *entries);
+  for (size_t i = 0; i < len; ++i) {
+    struct nav_item *item = nav->paths->items[i];
+    entries[i].item = item;
+    entries[i].key = key ? key(item->path, data) : 0;
+  }
+  qsort(entries, len, sizeof *entries, &compare_entries);
+
+  struct nav_item *cur = nav->paths->items[nav->cur_path];
+  for (size_t i = 0; i < len; ++i) {
+    nav->paths->items[i] = entries[i].item;
+    if (entries[i].item == cur) {
+      nav->cur_path = i;
+    }
+  }
+  free(entries);
+  nav->sorted = key != NULL;
+}
+
+void imv_navigator_filter(struct imv_navigator *nav,
+    bool (*keep)(const char *path, void *data), void *data)
+{
+  const size_t prev_path = nav->cur_path;
+  size_t cur_path = 0;
+  bool cur_found = false;
+  size_t len = 0;
+  for (size_t i = 0; i < nav->paths->len; ++i) {
+    struct nav_item *item = nav->paths->items[i];
+    if (i == prev_path) {
+      /* The current path, or the first one kept after it */
+      cur_path = len;
+      cur_found = true;
+    }
+    if (keep(item->path, data)) {
+      nav->paths->items[len++] = item;
+    } else {
+      index_remove(nav, item);
+      if (i == prev_path) {
+        nav->changed = 1;
+      }
+    }
+  }
+  nav->paths->len = len;
+
+  if (!cur_found || cur_path >= len) {
+    cur_path = len > 0 ? len - 1 : 0;
+  }
+  nav->cur_path = cur_path;
+}
+
 char *imv_navigator_at(struct imv_navigator *nav, size_t index)
 {
   if (index < nav->paths->len) {
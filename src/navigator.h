@@ -1,6 +1,8 @@
 #ifndef IMV_NAVIGATOR_H
 #define IMV_NAVIGATOR_H
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <unistd.h>
 
 /* Creates an instance of imv_navigator */
@@ -13,10 +15,34 @@ void imv_navigator_free(struct imv_navigator *nav);
  * If a directory is given, all files within that directory are added.
  * An internal copy of path is made.
  * If recursive is non-zero then subdirectories are recursed into.
+ * Directories are read in the background, and their files are only added
+ * by imv_navigator_collect. Paths given after a directory wait behind it,
+ * so paths always end up in the order they'd be added in one at a time.
  * Non-zero return code denotes failure. */
 int imv_navigator_add(struct imv_navigator *nav, const char *path,
                        int recursive);
 
+/* Sets a function to be called from a background thread when reading a
+ * directory has found more paths for imv_navigator_collect to add. It's
+ * called once until the next collect, however many directories are read. */
+void imv_navigator_set_scan_callback(struct imv_navigator *nav,
+    void (*callback)(void *data), void *data);
+
+/* Sets a function to be called by imv_navigator_collect with the absolute
+ * path of each directory whose files it's about to start adding */
+void imv_navigator_set_dir_callback(struct imv_navigator *nav,
+    void (*callback)(const char *dir, void *data), void *data);
+
+/* Adds the paths found by reading directories so far, as far as their order
+ * is settled. Returns true if any were added. */
+bool imv_navigator_collect(struct imv_navigator *nav);
+
+/* Returns true while paths are waiting on directories to be read */
+bool imv_navigator_scanning(struct imv_navigator *nav);
+
+/* Waits for every directory to be read, adding all the paths found */
+void imv_navigator_finish_scan(struct imv_navigator *nav);
+
 /* Returns a read-only reference to the current path. The pointer is only
  * guaranteed to be valid until the next call to an imv_navigator method. */
 const char *imv_navigator_selection(struct imv_navigator *nav);
@@ -48,6 +74,15 @@ ssize_t imv_navigator_find_path(struct imv_navigator *nav, const char *path);
  * changed since last called */
 int imv_navigator_poll_changed(struct imv_navigator *nav);
 
+/* Sets whether imv_navigator_poll_changed checks the current file's mtime
+ * once a second. On by default, and best turned off when something else is
+ * watching the file and calls imv_navigator_notify_changed. */
+void imv_navigator_set_polling(struct imv_navigator *nav, bool polling);
+
+/* Makes the next imv_navigator_poll_changed return 1, as the current file
+ * is known to have changed */
+void imv_navigator_notify_changed(struct imv_navigator *nav);
+
 /* Check whether navigator wrapped around paths list */
 int imv_navigator_wrapped(struct imv_navigator *nav);
 
@@ -57,6 +92,18 @@ size_t imv_navigator_length(struct imv_navigator *nav);
 /* Return a path for a given index */
 char *imv_navigator_at(struct imv_navigator *nav, size_t index);
 
+/* Sorts the paths by the key returned for each, paths with equal keys
+ * staying in the order they were added, and keeps the same path selected.
+ * key is called once per path. With a NULL key the paths go back to the
+ * order they were added in. Paths added later go on the end unsorted. */
+void imv_navigator_sort(struct imv_navigator *nav,
+    int64_t (*key)(const char *path, void *data), void *data);
+
+/* Removes every path keep returns false for. If the current path goes, the
+ * next one kept after it is selected, or the last if there's none. */
+void imv_navigator_filter(struct imv_navigator *nav,
+    bool (*keep)(const char *path, void *data), void *data);
+
 
 #endif
 
@@ -0,0 +1,17 @@
+#ifndef IMV_OPENGL_H
+#define IMV_OPENGL_H
+
+/* The OpenGL API imv renders with: desktop OpenGL by default, or OpenGL ES
+ * 3.0 when built with IMV_GLES for embedded displays */
+#ifdef IMV_GLES
+#include <GLES3/gl3.h>
+#else
+#define GL_GLEXT_PROTOTYPES
+#include <GL/gl.h>
+#include <GL/glext.h>
+#endif
+
+#endif
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
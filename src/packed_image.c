@@ -0,0 +1,227 @@
+#include "packed_image.h"
+
+#include "bitmap.h"
+#include "image.h"
+#include "memory_budget.h"
+#include "pixel.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef IMV_HAVE_LZ4
+#include <lz4.h>
+#endif
+
+struct imv_bitmap *imv_image_get_bitmap(const struct imv_image *image);
+
+struct imv_packed_image {
+  /* the packed data, and the number of bytes of it */
+  unsigned char *data;
+  size_t size;
+  /* the size of the data once decompressed, with rows tightly packed */
+  size_t raw_size;
+  bool compressed;
+  /* whether alpha was left out, being 255 throughout */
+  bool opaque;
+
+  /* everything needed to put the image back together */
+  int bitmap_width;
+  int bitmap_height;
+  enum imv_pixelformat format;
+  unsigned long id;
+  int width;
+  int height;
+  void *icc_profile;
+  size_t icc_profile_len;
+  enum imv_transfer transfer;
+};
+
+static bool is_opaque(const struct imv_bitmap *bmp)
+{
+  if (bmp->format != IMV_ABGR) {
+    return false;
+  }
+  for (int y = 0; y < bmp->height; ++y) {
+    const unsigned char *row = bmp->data + (size_t)y * bmp->stride;
+    for (int x = 0; x < bmp->width; ++x) {
+      if (row[x * 4 + 3] != 255) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+/* Copies bmp's pixels to dst with no gaps between rows, leaving out alpha if
+ * it's opaque */
+static void copy_pixels(unsigned char *dst, const struct imv_bitmap *bmp,
+    bool opaque)
+{
+  const size_t row_size = (size_t)bmp->width * imv_bitmap_pixel_size(bmp->format);
+  for (int y = 0; y < bmp->height; ++y) {
+    const unsigned char *row = bmp->data + (size_t)y * bmp->stride;
+    if (!opaque) {
+      memcpy(dst, row, row_size);
+      dst += row_size;
+      continue;
+    }
+    for (int x = 0; x < bmp->width; ++x) {
+      *dst++ = row[x * 4];
+      *dst++ = row[x * 4 + 1];
+      *dst++ = row[x * 4 + 2];
+    }
+  }
+}
+
+#ifdef IMV_HAVE_LZ4
+/* Compresses raw_size bytes at raw in place of the packed data, if it comes
+ * out any smaller. Takes ownership of raw. */
+static void compress(struct imv_packed_image *packed, unsigned char *raw)
+{
+  packed->data = raw;
+  packed->size = packed->raw_size;
+  if (packed->raw_size > LZ4_MAX_INPUT_SIZE) {
+    return;
+  }
+
+  const int bound = LZ4_compressBound((int)packed->raw_size);
+  char *out = malloc(bound);
+  if (!out) {
+    return;
+  }
+  const int len = LZ4_compress_default((const char *)raw, out,
+      (int)packed->raw_size, bound);
+  if (len <= 0 || (size_t)len >= packed->raw_size) {
+    free(out);
+    return;
+  }
+
+  /* Give back what the bound set aside beyond what was used */
+  char *shrunk = realloc(out, len);
+  packed->data = (unsigned char *)(shrunk ? shrunk : out);
+  packed->size = len;
+  packed->compressed = true;
+  free(raw);
+}
+#endif
+
+struct imv_packed_image *imv_packed_image_create(const struct imv_image *image)
+{
+  const struct imv_bitmap *bmp = image ? imv_image_get_bitmap(image) : NULL;
+  if (!bmp) {
+    return NULL;
+  }
+
+  struct imv_packed_image *packed = calloc(1, sizeof *packed);
+  packed->opaque = is_opaque(bmp);
+  packed->raw_size = (size_t)bmp->width * bmp->height
+    * (packed->opaque ? 3 : imv_bitmap_pixel_size(bmp->format));
+
+  unsigned char *raw = malloc(packed->raw_size);
+  if (!raw) {
+    free(packed);
+    return NULL;
+  }
+  copy_pixels(raw, bmp, packed->opaque);
+
+#ifdef IMV_HAVE_LZ4
+  compress(packed, raw);
+#else
+  packed->data = raw;
+  packed->size = packed->raw_size;
+#endif
+
+  if (packed->size >= imv_image_size(image)) {
+    free(packed->data);
+    free(packed);
+    return NULL;
+  }
+
+  packed->bitmap_width = bmp->width;
+  packed->bitmap_height = bmp->height;
+  packed->format = bmp->format;
+  packed->id = bmp->id;
+  packed->width = imv_image_width(image);
+  packed->height = imv_image_height(image);
+  packed->transfer = imv_image_transfer(image);
+
+  size_t icc_len;
+  const void *icc = imv_image_icc_profile(image, &icc_len);
+  if (icc && (packed->icc_profile = malloc(icc_len))) {
+    memcpy(packed->icc_profile, icc, icc_len);
+    packed->icc_profile_len = icc_len;
+  }
+
+  imv_memory_acquire(packed->size);
+  return packed;
+}
+
+void imv_packed_image_free(struct imv_packed_image *packed)
+{
+  if (!packed) {
+    return;
+  }
+
+  imv_memory_release(packed->size);
+  free(packed->data);
+  free(packed->icc_profile);
+  free(packed);
+}
+
+size_t imv_packed_image_size(const struct imv_packed_image *packed)
+{
+  return packed->size;
+}
+
+struct imv_image *imv_packed_image_unpack(const struct imv_packed_image *packed)
+{
+  struct imv_bitmap *bmp = imv_bitmap_create(packed->bitmap_width,
+      packed->bitmap_height, packed->format);
+  if (!bmp) {
+    return NULL;
+  }
+  bmp->id = packed->id;
+
+  /* Opaque pixels are expanded into the bitmap from wherever the three byte
+   * ones end up, while the rest land in the bitmap as they are */
+  const unsigned char *raw = packed->data;
+  unsigned char *decompressed = NULL;
+  if (packed->compressed) {
+#ifdef IMV_HAVE_LZ4
+    unsigned char *dst = bmp->data;
+    if (packed->opaque) {
+      dst = decompressed = malloc(packed->raw_size);
+      if (!decompressed) {
+        imv_bitmap_free(bmp);
+        return NULL;
+      }
+    }
+    const int len = LZ4_decompress_safe((const char *)packed->data,
+        (char *)dst, (int)packed->size, (int)packed->raw_size);
+    if (len != (int)packed->raw_size) {
+      free(decompressed);
+      imv_bitmap_free(bmp);
+      return NULL;
+    }
+    raw = dst;
+#endif
+  }
+
+  if (packed->opaque) {
+    imv_pixel_rgb_to_rgba(bmp->data, raw,
+        (size_t)packed->bitmap_width * packed->bitmap_height);
+  } else if (raw != bmp->data) {
+    memcpy(bmp->data, raw, packed->raw_size);
+  }
+  free(decompressed);
+
+  struct imv_image *image = imv_image_create_from_scaled_bitmap(bmp,
+      packed->width, packed->height);
+  imv_image_set_icc_profile(image, packed->icc_profile, packed->icc_profile_len);
+  imv_image_set_transfer(image, packed->transfer);
+  return image;
+}
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
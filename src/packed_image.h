@@ -0,0 +1,33 @@
+#ifndef IMV_PACKED_IMAGE_H
+#define IMV_PACKED_IMAGE_H
+
+#include <stddef.h>
+
+struct imv_image;
+
+/* The pixels of an image held in less memory than decoded, for images that
+ * are kept around without being shown. The alpha channel of opaque 8-bit
+ * images is left out, and the rest is compressed with LZ4 where imv is built
+ * with it. Packing and unpacking only read the image they're given, so may be
+ * done on any thread.
+ */
+struct imv_packed_image;
+
+/* Packs a copy of image's pixels, returning NULL if it has none, as for
+ * SVGs, or if packing them wouldn't make them any smaller */
+struct imv_packed_image *imv_packed_image_create(const struct imv_image *image);
+
+void imv_packed_image_free(struct imv_packed_image *packed);
+
+/* Get the number of bytes the packed pixels take */
+size_t imv_packed_image_size(const struct imv_packed_image *packed);
+
+/* Unpacks a new image with the same pixels, size, colour space and bitmap id
+ * as the one packed, so that textures made of one serve for both. Returns
+ * NULL if there's no memory for it. */
+struct imv_image *imv_packed_image_unpack(const struct imv_packed_image *packed);
+
+#endif
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,473 @@
+#include "pixel.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PIXEL_X86
+#include <immintrin.h>
+#define TARGET(isa) __attribute__((target(isa)))
+#elif defined(__ARM_NEON)
+#define PIXEL_NEON
+#include <arm_neon.h>
+#endif
+
+/* Each kernel has a plain C version, which also finishes off whatever is left
+ * over at the end of a run after the vector versions have done all they can
+ * in whole registers.
+ */
+
+static void rgb_to_rgba_c(unsigned char *dst, const unsigned char *src,
+    size_t count)
+{
+  for (size_t i = 0; i < count; ++i, dst += 4, src += 3) {
+    dst[0] = src[0];
+    dst[1] = src[1];
+    dst[2] = src[2];
+    dst[3] = 0xff;
+  }
+}
+
+static void swap_red_blue_c(unsigned char *dst, const unsigned char *src,
+    size_t count)
+{
+  for (size_t i = 0; i < count; ++i, dst += 4, src += 4) {
+    const unsigned char first = src[0];
+    dst[0] = src[2];
+    dst[1] = src[1];
+    dst[2] = first;
+    dst[3] = src[3];
+  }
+}
+
+/* Exactly c * a / 255, rounded to the nearest */
+static unsigned char mul_alpha(unsigned c, unsigned a)
+{
+  const unsigned t = c * a + 128;
+  return (t + (t >> 8)) >> 8;
+}
+
+static void premultiply_c(unsigned char *dst, const unsigned char *src,
+    size_t count)
+{
+  for (size_t i = 0; i < count; ++i, dst += 4, src += 4) {
+    const unsigned a = src[3];
+    dst[0] = mul_alpha(src[0], a);
+    dst[1] = mul_alpha(src[1], a);
+    dst[2] = mul_alpha(src[2], a);
+    dst[3] = a;
+  }
+}
+
+static void narrow_16_c(unsigned char *dst, const uint16_t *src, size_t count)
+{
+  for (size_t i = 0; i < count; ++i) {
+    dst[i] = src[i] >> 8;
+  }
+}
+
+#ifdef PIXEL_X86
+
+TARGET("sse2")
+static void swap_red_blue_sse2(unsigned char *dst, const unsigned char *src,
+    size_t count)
+{
+  /* On 32-bit lanes, the first byte is the lowest */
+  const __m128i keep = _mm_set1_epi32((int)0xff00ff00);
+  const __m128i low = _mm_set1_epi32(0xff);
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    const __m128i p = _mm_loadu_si128((const __m128i *)(src + i * 4));
+    const __m128i out = _mm_or_si128(_mm_and_si128(p, keep),
+        _mm_or_si128(_mm_and_si128(_mm_srli_epi32(p, 16), low),
+          _mm_slli_epi32(_mm_and_si128(p, low), 16)));
+    _mm_storeu_si128((__m128i *)(dst + i * 4), out);
+  }
+  swap_red_blue_c(dst + i * 4, src + i * 4, count - i);
+}
+
+/* Premultiplies two pixels widened to 16-bit lanes, leaving alpha alone */
+TARGET("sse2")
+static __m128i premultiply_pair_sse2(__m128i p)
+{
+  __m128i a = _mm_shufflelo_epi16(p, _MM_SHUFFLE(3, 3, 3, 3));
+  a = _mm_shufflehi_epi16(a, _MM_SHUFFLE(3, 3, 3, 3));
+  __m128i t = _mm_add_epi16(_mm_mullo_epi16(p, a), _mm_set1_epi16(128));
+  t = _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+  const __m128i alpha = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+  return _mm_or_si128(_mm_andnot_si128(alpha, t), _mm_and_si128(alpha, p));
+}
+
+TARGET("sse2")
+static void premultiply_sse2(unsigned char *dst, const unsigned char *src,
+    size_t count)
+{
+  const __m128i zero = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    const __m128i p = _mm_loadu_si128((const __m128i *)(src + i * 4));
+    const __m128i lo = premultiply_pair_sse2(_mm_unpacklo_epi8(p, zero));
+    const __m128i hi = premultiply_pair_sse2(_mm_unpackhi_epi8(p, zero));
+    _mm_storeu_si128((__m128i *)(dst + i * 4), _mm_packus_epi16(lo, hi));
+  }
+  premultiply_c(dst + i * 4, src + i * 4, count - i);
+}
+
+TARGET("sse2")
+static void narrow_16_sse2(unsigned char *dst, const uint16_t *src, size_t count)
+{
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    const __m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+    const __m128i b = _mm_loadu_si128((const __m128i *)(src + i + 8));
+    _mm_storeu_si128((__m128i *)(dst + i),
+        _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)));
+  }
+  narrow_16_c(dst + i, src + i, count - i);
+}
+
+TARGET("avx2")
+static void rgb_to_rgba_avx2(unsigned char *dst, const unsigned char *src,
+    size_t count)
+{
+  /* Each load takes 32 bytes to use 24 of them, so stop while there's still
+   * enough left that the spare 8 exist */
+  const __m256i spread = _mm256_setr_epi32(0, 1, 2, 3, 3, 4, 5, 6);
+  const __m256i shuffle = _mm256_setr_epi8(
+      0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+      0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+  const __m256i opaque = _mm256_set1_epi32((int)0xff000000);
+  size_t i = 0;
+  for (; i + 11 <= count; i += 8) {
+    __m256i p = _mm256_loadu_si256((const __m256i *)(src + i * 3));
+    p = _mm256_shuffle_epi8(_mm256_permutevar8x32_epi32(p, spread), shuffle);
+    _mm256_storeu_si256((__m256i *)(dst + i * 4), _mm256_or_si256(p, opaque));
+  }
+  rgb_to_rgba_c(dst + i * 4, src + i * 3, count - i);
+}
+
+TARGET("avx2")
+static void swap_red_blue_avx2(unsigned char *dst, const unsigned char *src,
+    size_t count)
+{
+  const __m256i shuffle = _mm256_setr_epi8(
+      2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+      2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    const __m256i p = _mm256_loadu_si256((const __m256i *)(src + i * 4));
+    _mm256_storeu_si256((__m256i *)(dst + i * 4),
+        _mm256_shuffle_epi8(p, shuffle));
+  }
+  swap_red_blue_c(dst + i * 4, src + i * 4, count - i);
+}
+
+TARGET("avx2")
+static __m256i premultiply_pair_avx2(__m256i p)
+{
+  const __m256i broadcast = _mm256_setr_epi8(
+      6, 7, 6, 7, 6, 7, 6, 7, 14, 15, 14, 15, 14, 15, 14, 15,
+      6, 7, 6, 7, 6, 7, 6, 7, 14, 15, 14, 15, 14, 15, 14, 15);
+  const __m256i a = _mm256_shuffle_epi8(p, broadcast);
+  __m256i t = _mm256_add_epi16(_mm256_mullo_epi16(p, a), _mm256_set1_epi16(128));
+  t = _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+  const __m256i alpha = _mm256_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0,
+      -1, 0, 0, 0, -1, 0, 0, 0);
+  return _mm256_blendv_epi8(t, p, alpha);
+}
+
+TARGET("avx2")
+static void premultiply_avx2(unsigned char *dst, const unsigned char *src,
+    size_t count)
+{
+  /* Unpacking and packing both work within 128-bit lanes, so undo each
+   * other without the pixels changing places */
+  const __m256i zero = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    const __m256i p = _mm256_loadu_si256((const __m256i *)(src + i * 4));
+    const __m256i lo = premultiply_pair_avx2(_mm256_unpacklo_epi8(p, zero));
+    const __m256i hi = premultiply_pair_avx2(_mm256_unpackhi_epi8(p, zero));
+    _mm256_storeu_si256((__m256i *)(dst + i * 4), _mm256_packus_epi16(lo, hi));
+  }
+  premultiply_c(dst + i * 4, src + i * 4, count - i);
+}
+
+TARGET("avx2")
+static void narrow_16_avx2(unsigned char *dst, const uint16_t *src, size_t count)
+{
+  size_t i = 0;
+  for (; i + 32 <= count; i += 32) {
+    const __m256i a = _mm256_loadu_si256((const __m256i *)(src + i));
+    const __m256i b = _mm256_loadu_si256((const __m256i *)(src + i + 16));
+    /* packing interleaves the lanes of a and b, which the permute undoes */
+    const __m256i packed = _mm256_packus_epi16(_mm256_srli_epi16(a, 8),
+        _mm256_srli_epi16(b, 8));
+    _mm256_storeu_si256((__m256i *)(dst + i),
+        _mm256_permute4x64_epi64(packed, _MM_SHUFFLE(3, 1, 2, 0)));
+  }
+  narrow_16_c(dst + i, src + i, count - i);
+}
+
+#endif
+
+#ifdef PIXEL_NEON
+
+static void rgb_to_rgba_neon(unsigned char *dst, const unsigned char *src,
+    size_t count)
+{
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    const uint8x16x3_t p = vld3q_u8(src + i * 3);
+    const uint8x16x4_t out = {{p.val[0], p.val[1], p.val[2], vdupq_n_u8(0xff)}};
+    vst4q_u8(dst + i * 4, out);
+  }
+  rgb_to_rgba_c(dst + i * 4, src + i * 3, count - i);
+}
+
+static void swap_red_blue_neon(unsigned char *dst, const unsigned char *src,
+    size_t count)
+{
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    uint8x16x4_t p = vld4q_u8(src + i * 4);
+    const uint8x16_t first = p.val[0];
+    p.val[0] = p.val[2];
+    p.val[2] = first;
+    vst4q_u8(dst + i * 4, p);
+  }
+  swap_red_blue_c(dst + i * 4, src + i * 4, count - i);
+}
+
+/* The same rounding as mul_alpha, eight at a time */
+static uint8x8_t mul_alpha_neon(uint8x8_t c, uint8x8_t a)
+{
+  const uint16x8_t t = vmull_u8(c, a);
+  return vraddhn_u16(t, vrshrq_n_u16(t, 8));
+}
+
+static void premultiply_neon(unsigned char *dst, const unsigned char *src,
+    size_t count)
+{
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    uint8x8x4_t p = vld4_u8(src + i * 4);
+    p.val[0] = mul_alpha_neon(p.val[0], p.val[3]);
+    p.val[1] = mul_alpha_neon(p.val[1], p.val[3]);
+    p.val[2] = mul_alpha_neon(p.val[2], p.val[3]);
+    vst4_u8(dst + i * 4, p);
+  }
+  premultiply_c(dst + i * 4, src + i * 4, count - i);
+}
+
+static void narrow_16_neon(unsigned char *dst, const uint16_t *src, size_t count)
+{
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    const uint8x8_t a = vshrn_n_u16(vld1q_u16(src + i), 8);
+    const uint8x8_t b = vshrn_n_u16(vld1q_u16(src + i + 8), 8);
+    vst1q_u8(dst + i, vcombine_u8(a, b));
+  }
+  narrow_16_c(dst + i, src + i, count - i);
+}
+
+#endif
+
+struct kernels {
+  const char *isa;
+  void (*rgb_to_rgba)(unsigned char *dst, const unsigned char *src, size_t count);
+  void (*swap_red_blue)(unsigned char *dst, const unsigned char *src, size_t count);
+  void (*premultiply)(unsigned char *dst, const unsigned char *src, size_t count);
+  void (*narrow_16)(unsigned char *dst, const uint16_t *src, size_t count);
+};
+
+static const struct kernels all_kernels[] = {
+#ifdef PIXEL_X86
+  {"avx2", rgb_to_rgba_avx2, swap_red_blue_avx2, premultiply_avx2, narrow_16_avx2},
+  /* There's no shuffling bytes about in SSE2, so expansion stays in C */
+  {"sse2", rgb_to_rgba_c, swap_red_blue_sse2, premultiply_sse2, narrow_16_sse2},
+#endif
+#ifdef PIXEL_NEON
+  {"neon", rgb_to_rgba_neon, swap_red_blue_neon, premultiply_neon, narrow_16_neon},
+#endif
+  {"c", rgb_to_rgba_c, swap_red_blue_c, premultiply_c, narrow_16_c},
+};
+
+static const struct kernels *kernels = &all_kernels[sizeof all_kernels / sizeof *all_kernels - 1];
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+static bool cpu_has(const char *isa)
+{
+#ifdef PIXEL_X86
+  __builtin_cpu_init();
+  if (!strcmp(isa, "avx2")) {
+    return __builtin_cpu_supports("avx2");
+  } else if (!strcmp(isa, "sse2")) {
+    return __builtin_cpu_supports("sse2");
+  }
+#endif
+  /* NEON is part of every CPU it's compiled for, as is C */
+  (void)isa;
+  return true;
+}
+
+/* Picks the first, and so widest, set of kernels the CPU can run */
+static void choose_kernels(void)
+{
+  for (size_t i = 0; i < sizeof all_kernels / sizeof *all_kernels; ++i) {
+    if (cpu_has(all_kernels[i].isa)) {
+      kernels = &all_kernels[i];
+      return;
+    }
+  }
+}
+
+static const struct kernels *get_kernels(void)
+{
+  pthread_once(&kernels_once, choose_kernels);
+  return kernels;
+}
+
+void imv_pixel_rgb_to_rgba(unsigned char *dst, const unsigned char *src,
+    size_t count)
+{
+  get_kernels()->rgb_to_rgba(dst, src, count);
+}
+
+void imv_pixel_swap_red_blue(unsigned char *dst, const unsigned char *src,
+    size_t count)
+{
+  get_kernels()->swap_red_blue(dst, src, count);
+}
+
+void imv_pixel_premultiply(unsigned char *dst, const unsigned char *src,
+    size_t count)
+{
+  get_kernels()->premultiply(dst, src, count);
+}
+
+void imv_pixel_narrow_16(unsigned char *dst, const uint16_t *src, size_t count)
+{
+  get_kernels()->narrow_16(dst, src, count);
+}
+
+void imv_pixel_flip_vertical(unsigned char *data, size_t stride,
+    size_t row_bytes, int height)
+{
+  /* memcpy is as vectorised as anything here could be, so rows are swapped
+   * through a small buffer with it */
+  if (height < 2) {
+    return;
+  }
+
+  unsigned char buf[4096];
+  unsigned char *top = data;
+  unsigned char *bottom = data + (size_t)(height - 1) * stride;
+  for (; top < bottom; top += stride, bottom -= stride) {
+    for (size_t done = 0; done < row_bytes; done += sizeof buf) {
+      const size_t n = row_bytes - done < sizeof buf ? row_bytes - done : sizeof buf;
+      memcpy(buf, top + done, n);
+      memcpy(top + done, bottom + done, n);
+      memcpy(bottom + done, buf, n);
+    }
+  }
+}
+
+static float half_to_float(uint16_t h)
+{
+  const int exponent = (h >> 10) & 0x1f;
+  const int mantissa = h & 0x3ff;
+  float value;
+  if (exponent == 0) {
+    value = ldexpf(mantissa, -24);
+  } else if (exponent == 0x1f) {
+    value = mantissa ? NAN : INFINITY;
+  } else {
+    value = ldexpf(mantissa + 1024, exponent - 25);
+  }
+  return h & 0x8000 ? -value : value;
+}
+
+/* Every half float has a place in a table of what it narrows to, which is a
+ * good deal quicker than converting them one at a time */
+static unsigned char half_table[65536];
+static pthread_once_t half_table_once = PTHREAD_ONCE_INIT;
+
+static void build_half_table(void)
+{
+  for (size_t i = 0; i < sizeof half_table; ++i) {
+    const float value = half_to_float(i);
+    /* NaN fails both tests, and becomes 0 */
+    half_table[i] = value > 0.0f ? value < 1.0f ? value * 255.0f + 0.5f : 255 : 0;
+  }
+}
+
+void imv_pixel_narrow_half(unsigned char *dst, const uint16_t *src,
+    size_t count)
+{
+  pthread_once(&half_table_once, build_half_table);
+  for (size_t i = 0; i < count; ++i) {
+    dst[i] = half_table[src[i]];
+  }
+}
+
+static uint16_t float_to_half(float f)
+{
+  union { float f; uint32_t u; } bits = {f};
+  const uint16_t sign = (bits.u >> 16) & 0x8000;
+  const uint32_t magnitude = bits.u & 0x7fffffff;
+  if (magnitude > 0x7f800000) {
+    return sign | 0x7e00;
+  } else if (magnitude >= 0x477ff000) {
+    /* 65520 and up round to infinity */
+    return sign | 0x7c00;
+  } else if (magnitude < 0x38800000) {
+    /* Too small for a normal half, so it's a multiple of 2^-24 */
+    return sign | (uint16_t)lrintf(fabsf(f) * 16777216.0f);
+  }
+  /* Rebias the exponent from 127 to 15 and round the mantissa to the nearest
+   * even 10 bits, letting any carry go into the exponent */
+  const uint32_t h = magnitude - 0x38000000;
+  return sign | (h + 0xfff + ((h >> 13) & 1)) >> 13;
+}
+
+void imv_pixel_float_to_half(uint16_t *dst, const float *src, size_t count)
+{
+  for (size_t i = 0; i < count; ++i) {
+    dst[i] = float_to_half(src[i]);
+  }
+}
+
+void imv_pixel_rgb16_to_rgba16(uint16_t *dst, const uint16_t *src,
+    size_t count)
+{
+  /* Going backwards lets dst be src, if it has room for the alpha */
+  for (size_t i = count; i-- > 0;) {
+    const uint16_t r = src[i * 3], g = src[i * 3 + 1], b = src[i * 3 + 2];
+    dst[i * 4] = r;
+    dst[i * 4 + 1] = g;
+    dst[i * 4 + 2] = b;
+    dst[i * 4 + 3] = 0xffff;
+  }
+}
+
+const char *imv_pixel_isa(void)
+{
+  return get_kernels()->isa;
+}
+
+bool imv_pixel_use_isa(const char *isa)
+{
+  get_kernels();
+  for (size_t i = 0; i < sizeof all_kernels / sizeof *all_kernels; ++i) {
+    if (!strcmp(all_kernels[i].isa, isa) && cpu_has(isa)) {
+      kernels = &all_kernels[i];
+      return true;
+    }
+  }
+  return false;
+}
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,60 @@
+#ifndef IMV_PIXEL_H
+#define IMV_PIXEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Kernels for the pixel conversions backends most often need to reach one of
+ * imv's formats. Each works on a run of pixels, typically a row, using the
+ * widest vector instructions the CPU turns out to have at runtime.
+ */
+
+/* Expands count packed 3-byte pixels at src into opaque 4-byte pixels at dst,
+ * the extra byte being an alpha of 255 after the other three. */
+void imv_pixel_rgb_to_rgba(unsigned char *dst, const unsigned char *src,
+    size_t count);
+
+/* Swaps the first and third bytes of count 4-byte pixels, turning RGBA into
+ * BGRA and back again. dst may be src. */
+void imv_pixel_swap_red_blue(unsigned char *dst, const unsigned char *src,
+    size_t count);
+
+/* Multiplies the first three bytes of count 4-byte pixels by the fourth, their
+ * alpha, as cairo wants them. dst may be src. */
+void imv_pixel_premultiply(unsigned char *dst, const unsigned char *src,
+    size_t count);
+
+/* Narrows count 16-bit samples to 8 bits, keeping the high byte of each */
+void imv_pixel_narrow_16(unsigned char *dst, const uint16_t *src, size_t count);
+
+/* Narrows count half floats to 8 bits, clamping them to between 0 and 1 */
+void imv_pixel_narrow_half(unsigned char *dst, const uint16_t *src,
+    size_t count);
+
+/* Converts count floats to half floats, rounding to the nearest */
+void imv_pixel_float_to_half(uint16_t *dst, const float *src, size_t count);
+
+/* Expands count packed 3-channel 16-bit pixels at src into opaque 4-channel
+ * ones at dst, as imv_pixel_rgb_to_rgba does 8-bit ones. dst may be src,
+ * given room for the result. */
+void imv_pixel_rgb16_to_rgba16(uint16_t *dst, const uint16_t *src,
+    size_t count);
+
+/* Reverses the order of height rows of row_bytes bytes, stride bytes apart,
+ * turning a bottom-up image top-down */
+void imv_pixel_flip_vertical(unsigned char *data, size_t stride,
+    size_t row_bytes, int height);
+
+/* Returns the name of the instruction set the kernels are using */
+const char *imv_pixel_isa(void);
+
+/* Makes the kernels use the named instruction set in place of the one picked
+ * for the CPU, so each can be tested. Returns false if the CPU doesn't have
+ * it, or there are no kernels for it. */
+bool imv_pixel_use_isa(const char *isa);
+
+#endif
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,219 @@
+#include "render.h"
+
+#include "bitmap.h"
+#include "image.h"
+#include "pixel.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct imv_bitmap *imv_image_get_bitmap(const struct imv_image *image);
+#ifdef IMV_BACKEND_LIBRSVG
+RsvgHandle *imv_image_get_svg(const struct imv_image *image);
+#endif
+
+/* Keeps PNGs written to stdout from different threads from interleaving */
+static pthread_mutex_t g_stdout_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Copies bitmap into a surface of cairo's premultiplied native ARGB */
+static cairo_surface_t *bitmap_surface(const struct imv_bitmap *bitmap)
+{
+  cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+      bitmap->width, bitmap->height);
+  if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+    cairo_surface_destroy(surface);
+    return NULL;
+  }
+
+  unsigned char *data = cairo_image_surface_get_data(surface);
+  const int stride = cairo_image_surface_get_stride(surface);
+  for (int y = 0; y < bitmap->height; ++y) {
+    unsigned char *dst = data + (size_t)y * stride;
+    const unsigned char *src = bitmap->data + (size_t)y * bitmap->stride;
+    if (bitmap->format == IMV_ABGR) {
+      imv_pixel_swap_red_blue(dst, src, bitmap->width);
+      imv_pixel_premultiply(dst, dst, bitmap->width);
+    } else if (bitmap->format == IMV_ARGB) {
+      imv_pixel_premultiply(dst, src, bitmap->width);
+    } else {
+      /* cairo has no deeper formats, so these are narrowed on the way */
+      imv_bitmap_narrow_pixels(bitmap->format, dst, src, bitmap->width);
+      imv_pixel_swap_red_blue(dst, dst, bitmap->width);
+      imv_pixel_premultiply(dst, dst, bitmap->width);
+    }
+  }
+  cairo_surface_mark_dirty(surface);
+  return surface;
+}
+
+static cairo_filter_t filter_for(enum upscaling_method upscaling_method,
+                                 double scale)
+{
+  if (scale == 1.0 || upscaling_method == UPSCALING_NEAREST_NEIGHBOUR) {
+    return CAIRO_FILTER_NEAREST;
+  }
+  /* GOOD averages over every pixel when shrinking, unlike BILINEAR */
+  return scale < 1.0 ? CAIRO_FILTER_GOOD : CAIRO_FILTER_BILINEAR;
+}
+
+cairo_surface_t *imv_render_image(const struct imv_image *image,
+    int x, int y, double scale, int width, int height,
+    enum upscaling_method upscaling_method)
+{
+  /* The part of the window the image covers */
+  const int left = x > 0 ? x : 0;
+  const int top = y > 0 ? y : 0;
+  const double right = fmin(x + imv_image_width(image) * scale, width);
+  const double bottom = fmin(y + imv_image_height(image) * scale, height);
+  const int out_width = (int)ceil(right) - left;
+  const int out_height = (int)ceil(bottom) - top;
+  if (out_width <= 0 || out_height <= 0) {
+    return NULL;
+  }
+
+  cairo_surface_t *out = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+      out_width, out_height);
+  if (cairo_surface_status(out) != CAIRO_STATUS_SUCCESS) {
+    cairo_surface_destroy(out);
+    return NULL;
+  }
+
+  cairo_t *cairo = cairo_create(out);
+  cairo_translate(cairo, x - left, y - top);
+  cairo_scale(cairo, scale, scale);
+
+  bool drawn = false;
+  const struct imv_bitmap *bitmap = imv_image_get_bitmap(image);
+  if (bitmap) {
+    cairo_surface_t *src = bitmap_surface(bitmap);
+    if (src) {
+      /* A bitmap decoded at reduced resolution still covers the whole image */
+      cairo_scale(cairo, (double)imv_image_width(image) / bitmap->width,
+                  (double)imv_image_height(image) / bitmap->height);
+      cairo_set_source_surface(cairo, src, 0, 0);
+      cairo_pattern_set_extend(cairo_get_source(cairo), CAIRO_EXTEND_PAD);
+      cairo_pattern_set_filter(cairo_get_source(cairo), filter_for(
+            upscaling_method, scale * imv_image_width(image) / bitmap->width));
+      cairo_rectangle(cairo, 0, 0, bitmap->width, bitmap->height);
+      cairo_fill(cairo);
+      cairo_surface_destroy(src);
+      drawn = true;
+    }
+  }
+#ifdef IMV_BACKEND_LIBRSVG
+  RsvgHandle *svg = imv_image_get_svg(image);
+  if (svg) {
+    rsvg_handle_render_cairo(svg, cairo);
+    drawn = true;
+  }
+#endif
+  cairo_destroy(cairo);
+
+  if (!drawn) {
+    cairo_surface_destroy(out);
+    return NULL;
+  }
+  cairo_surface_flush(out);
+  return out;
+}
+
+bool imv_render_output_path(const char *output, const char *path,
+    char *buf, size_t len)
+{
+  const char *name = strrchr(path, '/');
+  name = name ? name + 1 : path;
+  const char *dot = strrchr(name, '.');
+  const int name_len = dot && dot != name ? (int)(dot - name) : (int)strlen(name);
+
+  if (!len) {
+    return false;
+  }
+  buf[0] = '\0';
+
+  size_t used = 0;
+  for (const char *c = output; *c; ++c) {
+    int n;
+    if (c[0] == '%' && c[1] == 's') {
+      n = snprintf(buf + used, len - used, "%.*s", name_len, name);
+      ++c;
+    } else if (c[0] == '%' && c[1] == '%') {
+      n = snprintf(buf + used, len - used, "%%");
+      ++c;
+    } else {
+      n = snprintf(buf + used, len - used, "%c", *c);
+    }
+    if (n < 0 || (size_t)n >= len - used) {
+      return false;
+    }
+    used += n;
+  }
+  return true;
+}
+
+static cairo_status_t write_stdout(void *closure, const unsigned char *data,
+                                   unsigned int length)
+{
+  (void)closure;
+  return fwrite(data, 1, length, stdout) == length
+    ? CAIRO_STATUS_SUCCESS : CAIRO_STATUS_WRITE_ERROR;
+}
+
+static bool write_raw(cairo_surface_t *surface, const char *path)
+{
+  FILE *file = fopen(path, "wb");
+  if (!file) {
+    return false;
+  }
+
+  const int width = cairo_image_surface_get_width(surface);
+  const int height = cairo_image_surface_get_height(surface);
+  const int stride = cairo_image_surface_get_stride(surface);
+  const unsigned char *data = cairo_image_surface_get_data(surface);
+  unsigned char *row = malloc((size_t)width * 4);
+  bool ok = row;
+  for (int y = 0; ok && y < height; ++y) {
+    const unsigned char *src = data + (size_t)y * stride;
+    for (int x = 0; x < width; ++x) {
+      uint32_t pixel;
+      memcpy(&pixel, src + x * 4, sizeof pixel);
+      const unsigned a = pixel >> 24;
+      unsigned char *dst = row + x * 4;
+      for (int c = 0; c < 3; ++c) {
+        const unsigned value = (pixel >> (16 - c * 8)) & 0xff;
+        dst[c] = a ? (value * 255 + a / 2) / a : 0;
+      }
+      dst[3] = a;
+    }
+    ok = fwrite(row, 1, (size_t)width * 4, file) == (size_t)width * 4;
+  }
+  free(row);
+
+  if (fclose(file)) {
+    ok = false;
+  }
+  return ok;
+}
+
+bool imv_render_write(cairo_surface_t *surface, const char *path)
+{
+  if (!strcmp(path, "-")) {
+    pthread_mutex_lock(&g_stdout_lock);
+    const bool ok = cairo_surface_write_to_png_stream(surface, &write_stdout,
+        NULL) == CAIRO_STATUS_SUCCESS && !fflush(stdout);
+    pthread_mutex_unlock(&g_stdout_lock);
+    return ok;
+  }
+
+  const size_t len = strlen(path);
+  if (len > 4 && !strcmp(path + len - 4, ".raw")) {
+    return write_raw(surface, path);
+  }
+  return cairo_surface_write_to_png(surface, path) == CAIRO_STATUS_SUCCESS;
+}
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,37 @@
+#ifndef IMV_RENDER_H
+#define IMV_RENDER_H
+
+#include <cairo.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "canvas.h"
+
+struct imv_image;
+
+/* Drawing images off screen, for writing them to files rather than showing
+ * them. Safe to use from any thread, on different images.
+ */
+
+/* Draws image with its top left corner at (x, y), scaled by scale, into a
+ * width x height window as the canvas would. Returns a surface of just the
+ * part of the window it covers, or NULL if it covers none of it. */
+cairo_surface_t *imv_render_image(const struct imv_image *image,
+    int x, int y, double scale, int width, int height,
+    enum upscaling_method upscaling_method);
+
+/* Writes surface to path, as raw straight alpha RGBA bytes, row after row,
+ * if the path ends in ".raw", and as a PNG otherwise. A path of "-" writes
+ * the PNG to stdout. Returns false if it couldn't be written. */
+bool imv_render_write(cairo_surface_t *surface, const char *path);
+
+/* Makes the name of the file to write path's image to, being the output
+ * template with each %s replaced by path's file name without its extension,
+ * and %% by a %. Returns false if it doesn't fit in len bytes. */
+bool imv_render_output_path(const char *output, const char *path,
+    char *buf, size_t len);
+
+#endif
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
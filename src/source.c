@@ -1,9 +1,14 @@
 #include "source.h"
 #include "source_private.h"
+#include "trace.h"
+#include "worker_pool.h"
 
 #include <pthread.h>
 #include <stdlib.h>
 
+/* The pool async work is performed on */
+static struct imv_worker_pool *g_worker_pool = NULL;
+
 struct imv_source {
   /* pointers to implementation's functions */
   const struct imv_source_vtable *vtable;
@@ -18,10 +23,27 @@ struct imv_source {
    */
   pthread_mutex_t busy;
 
+  /* The size hint and page to pass to the implementation before the next
+   * first frame load, and whether to send partial images ahead of the first
+   * frame. Set from the main thread, so guarded by their own mutex. */
+  pthread_mutex_t target_lock;
+  int target_width;
+  int target_height;
+  int page;
+  bool partial;
+
+  /* The page being, or last, loaded. Only touched while busy is held, or from
+   * within a load. */
+  int loaded_page;
+
   /* callback function */
   imv_source_callback callback;
   /* callback data */
   void *callback_data;
+
+  /* called with release_data once the source is freed */
+  void (*release)(void *data);
+  void *release_data;
 };
 
 struct imv_source *imv_source_create(const struct imv_source_vtable *vtable, void *private)
@@ -30,45 +52,74 @@ struct imv_source *imv_source_create(const struct imv_source_vtable *vtable, voi
   source->vtable = vtable;
   source->private = private;
   pthread_mutex_init(&source->busy, NULL);
+  pthread_mutex_init(&source->target_lock, NULL);
   return source;
 }
 
-static void *free_thread(void *src)
+void imv_source_set_worker_pool(struct imv_worker_pool *pool)
+{
+  g_worker_pool = pool;
+}
+
+struct imv_worker_pool *imv_source_worker_pool(void)
+{
+  return g_worker_pool;
+}
+
+static void free_job(void *src)
 {
   imv_source_free(src);
-  return NULL;
 }
 
 void imv_source_async_free(struct imv_source *src)
 {
-  pthread_t thread;
-  pthread_create(&thread, NULL, free_thread, src);
-  pthread_detach(thread);
+  if (!g_worker_pool) {
+    imv_source_free(src);
+    return;
+  }
+
+  /* Nobody's interested in any frames still waiting to be loaded. Any job
+   * already running finishes before the free, as they share an owner. */
+  imv_worker_pool_cancel(g_worker_pool, src);
+  imv_worker_pool_submit(g_worker_pool, src, IMV_JOB_NORMAL, free_job, NULL, src);
+}
+
+static void cancel_load_job(void *src)
+{
+  /* nothing to clean up */
+  (void)src;
 }
 
-static void *first_frame_thread(void *src)
+static void first_frame_job(void *src)
 {
   imv_source_load_first_frame(src);
-  return NULL;
 }
 
 void imv_source_async_load_first_frame(struct imv_source *src)
 {
-  pthread_t thread;
-  pthread_create(&thread, NULL, first_frame_thread, src);
-  pthread_detach(thread);
+  if (!g_worker_pool) {
+    imv_source_load_first_frame(src);
+    return;
+  }
+
+  imv_worker_pool_submit(g_worker_pool, src, IMV_JOB_NORMAL,
+      first_frame_job, cancel_load_job, src);
 }
 
-static void *next_frame_thread(void *src)
+static void next_frame_job(void *src)
 {
   imv_source_load_next_frame(src);
-  return NULL;
 }
+
 void imv_source_async_load_next_frame(struct imv_source *src)
 {
-  pthread_t thread;
-  pthread_create(&thread, NULL, next_frame_thread, src);
-  pthread_detach(thread);
+  if (!g_worker_pool) {
+    imv_source_load_next_frame(src);
+    return;
+  }
+
+  imv_worker_pool_submit(g_worker_pool, src, IMV_JOB_NORMAL,
+      next_frame_job, cancel_load_job, src);
 }
 
 void imv_source_free(struct imv_source *src)
@@ -77,9 +128,37 @@ void imv_source_free(struct imv_source *src)
   src->vtable->free(src->private);
   pthread_mutex_unlock(&src->busy);
   pthread_mutex_destroy(&src->busy);
+  pthread_mutex_destroy(&src->target_lock);
+  if (src->release) {
+    src->release(src->release_data);
+  }
   free(src);
 }
 
+/* Finds the page to load when asked for page, which is the last there is if
+ * there aren't that many. Only the pages up to the one found are looked at. */
+static int find_page(struct imv_source *src, int page)
+{
+  if (!src->vtable->has_page || page <= 0) {
+    return 0;
+  }
+  if (src->vtable->has_page(src->private, page)) {
+    return page;
+  }
+
+  /* Everything up to the end has been found by now, so each look is quick */
+  int lo = 0, hi = page;
+  while (hi - lo > 1) {
+    const int mid = lo + (hi - lo) / 2;
+    if (src->vtable->has_page(src->private, mid)) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
 void imv_source_load_first_frame(struct imv_source *src)
 {
   if (!src->vtable->load_first_frame) {
@@ -90,12 +169,47 @@ void imv_source_load_first_frame(struct imv_source *src)
     return;
   }
 
+  pthread_mutex_lock(&src->target_lock);
+  const int width = src->target_width;
+  const int height = src->target_height;
+  const int wanted_page = src->page;
+  const bool partial = src->partial;
+  pthread_mutex_unlock(&src->target_lock);
+
+  if (src->vtable->set_target_size) {
+    src->vtable->set_target_size(src->private, width, height);
+  }
+
+  const int page = find_page(src, wanted_page);
+  src->loaded_page = page;
+  if (src->vtable->set_page) {
+    src->vtable->set_page(src->private, page);
+  }
+
+  if (partial && src->vtable->load_preview) {
+    struct imv_image *preview = NULL;
+    const double start = imv_trace_now();
+    src->vtable->load_preview(src->private, &preview);
+    imv_trace_span("decode preview", NULL, start, imv_trace_now());
+    if (preview) {
+      imv_source_push_partial(src, preview);
+    }
+  }
+
   struct imv_source_message msg = {
     .source = src,
-    .user_data = src->callback_data
+    .user_data = src->callback_data,
+    .page = page
   };
 
+  const double start = imv_trace_now();
   src->vtable->load_first_frame(src->private, &msg.image, &msg.frametime);
+  imv_trace_span("decode", NULL, start, imv_trace_now());
+
+  /* Finding out whether there's another page is only ever a step further
+   * than has been looked already */
+  msg.last_page = !src->vtable->has_page
+    || !src->vtable->has_page(src->private, page + 1);
 
   pthread_mutex_unlock(&src->busy);
 
@@ -114,19 +228,72 @@ void imv_source_load_next_frame(struct imv_source *src)
 
   struct imv_source_message msg = {
     .source = src,
-    .user_data = src->callback_data
+    .user_data = src->callback_data,
+    .page = src->loaded_page
   };
 
+  const double start = imv_trace_now();
   src->vtable->load_next_frame(src->private, &msg.image, &msg.frametime);
+  imv_trace_span("decode next frame", NULL, start, imv_trace_now());
 
   pthread_mutex_unlock(&src->busy);
 
   src->callback(&msg);
 }
 
+void imv_source_push_partial(struct imv_source *src, struct imv_image *image)
+{
+  struct imv_source_message msg = {
+    .source = src,
+    .user_data = src->callback_data,
+    .image = image,
+    .partial = 1,
+    .page = src->loaded_page
+  };
+
+  src->callback(&msg);
+}
+
+bool imv_source_wants_partial(struct imv_source *src)
+{
+  pthread_mutex_lock(&src->target_lock);
+  const bool partial = src->partial;
+  pthread_mutex_unlock(&src->target_lock);
+  return partial;
+}
+
+void imv_source_set_partial(struct imv_source *src, bool enabled)
+{
+  pthread_mutex_lock(&src->target_lock);
+  src->partial = enabled;
+  pthread_mutex_unlock(&src->target_lock);
+}
+
+void imv_source_set_page(struct imv_source *src, int page)
+{
+  pthread_mutex_lock(&src->target_lock);
+  src->page = page;
+  pthread_mutex_unlock(&src->target_lock);
+}
+
+void imv_source_set_target_size(struct imv_source *src, int width, int height)
+{
+  pthread_mutex_lock(&src->target_lock);
+  src->target_width = width;
+  src->target_height = height;
+  pthread_mutex_unlock(&src->target_lock);
+}
+
 void imv_source_set_callback(struct imv_source *src, imv_source_callback callback,
     void *data)
 {
   src->callback = callback;
   src->callback_data = data;
 }
+
+void imv_source_set_release(struct imv_source *src, void (*release)(void *data),
+    void *data)
+{
+  src->release = release;
+  src->release_data = data;
+}
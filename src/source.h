@@ -1,6 +1,8 @@
 #ifndef IMV_SOURCE_H
 #define IMV_SOURCE_H
 
+#include <stdbool.h>
+
 /* While imv_image represents a single frame of an image, be it a bitmap or
  * vector image, imv_source represents an open handle to an image file, which
  * can emit one or more imv_images.
@@ -9,9 +11,15 @@ struct imv_source;
 
 struct imv_source_message;
 struct imv_image;
+struct imv_worker_pool;
+
+/* Sets the worker pool used by the async functions below. Without one, they
+ * block like their synchronous counterparts. */
+void imv_source_set_worker_pool(struct imv_worker_pool *pool);
 
 /* Clean up a source. Blocks if the source is active in the background. Async
- * version does not block, performing cleanup in another thread */
+ * version does not block, cancelling any queued loads and performing cleanup
+ * in the background */
 void imv_source_async_free(struct imv_source *src);
 void imv_source_free(struct imv_source *src);
 
@@ -25,11 +33,33 @@ void imv_source_load_first_frame(struct imv_source *src);
 void imv_source_async_load_next_frame(struct imv_source *src);
 void imv_source_load_next_frame(struct imv_source *src);
 
+/* Hint that the image will be shown no larger than it takes to fit it
+ * within width x height pixels, letting backends that can decode at reduced
+ * resolution do so. Takes effect from the next call to load the first frame.
+ * A size of 0x0 asks for the full resolution, which is the default. */
+void imv_source_set_target_size(struct imv_source *src, int width, int height);
+
+/* Asks for the page'th page of a file of several, counting from 0, from the
+ * next call to load the first frame. If there aren't that many, the last
+ * page is loaded instead. Sources of one page always load that one. */
+void imv_source_set_page(struct imv_source *src, int page);
+
+/* Sets whether the callback should be sent partial images, such as embedded
+ * thumbnails or early passes of an interlaced image, ahead of the first
+ * frame. Off by default. */
+void imv_source_set_partial(struct imv_source *src, bool enabled);
+
 typedef void (*imv_source_callback)(struct imv_source_message *message);
 
 /* Sets the callback function to be called when frame loading completes */
 void imv_source_set_callback(struct imv_source *src, imv_source_callback callback, void *data);
 
+/* Sets a function to be called with data once the source has been freed, to
+ * let go of something it reads from, such as memory given to a backend's
+ * open_memory that has to outlive the source */
+void imv_source_set_release(struct imv_source *src, void (*release)(void *data),
+                            void *data);
+
 struct imv_source_message {
   /* Pointer to sender of message */
   struct imv_source *source;
@@ -42,6 +72,17 @@ struct imv_source_message {
 
   /* If an animated gif, the frame's duration in milliseconds, else 0 */
   int frametime;
+
+  /* If non-zero, image is an incomplete rendition of the frame still being
+   * loaded, such as an early pass of an interlaced image, to show until the
+   * complete frame arrives in a later message */
+  int partial;
+
+  /* The page of the file the image is of, counting from 0 */
+  int page;
+
+  /* If non-zero, there are no pages after this one */
+  int last_page;
 };
 
 #endif
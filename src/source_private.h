@@ -1,8 +1,11 @@
 #ifndef IMV_SOURCE_PRIVATE_H
 #define IMV_SOURCE_PRIVATE_H
 
+#include <stdbool.h>
+
 struct imv_image;
 struct imv_source;
+struct imv_worker_pool;
 
 /* This is the interface a source needs to implement to function correctly.
  * Backends act as a "factory" for sources by calling imv_source_create
@@ -23,6 +26,36 @@ struct imv_source_vtable {
    */
   void (*load_next_frame)(void *private, struct imv_image **image, int *frametime);
 
+  /* Optional. Loads a quick, low resolution stand-in for the first frame,
+   * such as a thumbnail embedded in the file, to show while load_first_frame
+   * runs. If there's none to be had cheaply, image shall be NULL. The image
+   * should have the full image's dimensions, using
+   * imv_image_create_from_scaled_bitmap.
+   */
+  void (*load_preview)(void *private, struct imv_image **image);
+
+  /* Optional. Hints that the image will be shown no larger than it takes to
+   * fit it within width x height pixels, before the next load_first_frame.
+   * The backend may then decode at a reduced resolution, so long as the
+   * result would still fill that area at its aspect ratio, producing an image
+   * with imv_image_create_from_scaled_bitmap. A size of 0x0 asks for the full
+   * resolution.
+   */
+  void (*set_target_size)(void *private, int width, int height);
+
+  /* Optional. For files holding several pages, such as multi-page TIFFs,
+   * returns whether there's a page'th page, counting from 0. Pages should be
+   * found as they're asked after rather than all when the source is opened,
+   * as there may be very many of them, and once found be quick to ask after
+   * again. Without it, sources have the one page.
+   */
+  bool (*has_page)(void *private, int page);
+
+  /* Optional, along with has_page. Makes load_first_frame load the page'th
+   * page from then on. Only called with pages has_page has found.
+   */
+  void (*set_page)(void *private, int page);
+
   /* Cleans up the private data of a source */
   void (*free)(void *private);
 };
@@ -30,4 +63,18 @@ struct imv_source_vtable {
 /* Build a source given its vtable and a pointer to the private data */
 struct imv_source *imv_source_create(const struct imv_source_vtable *vt, void *private);
 
+/* May be called by load_first_frame to hand out a partially decoded version
+ * of the image ahead of the finished one. Ownership of image passes to the
+ * receiver, so it must not share pixels the decoder is still writing to.
+ */
+void imv_source_push_partial(struct imv_source *src, struct imv_image *image);
+
+/* The pool sources load on, which load_first_frame may queue jobs of its own
+ * on to split up a decode, or NULL if there's none */
+struct imv_worker_pool *imv_source_worker_pool(void);
+
+/* Whether partial images from src would be shown, so whether they're worth
+ * the trouble of producing */
+bool imv_source_wants_partial(struct imv_source *src);
+
 #endif
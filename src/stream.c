@@ -0,0 +1,310 @@
+#include "stream.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* No frame is trusted to be bigger than this, so that garbage read as a
+ * length, or a frame that never ends, can't take all the memory there is */
+#define MAX_FRAME_SIZE (256 * 1024 * 1024)
+
+static const unsigned char jpeg_signature[] = {0xFF, 0xD8, 0xFF};
+static const unsigned char png_signature[] = {
+  0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'
+};
+
+enum state {
+  /* looking at the start of the next frame */
+  STATE_START,
+  /* at a marker between the segments of a JPEG */
+  STATE_JPEG_SEGMENTS,
+  /* in a JPEG's entropy coded data, which ends at the next marker */
+  STATE_JPEG_ENTROPY,
+  /* at the start of a PNG chunk */
+  STATE_PNG_CHUNKS,
+  /* in a frame of a length given up front */
+  STATE_SIZED,
+};
+
+struct imv_stream {
+  /* data fed in, of which the current frame starts at head */
+  unsigned char *buf;
+  size_t head;
+  size_t len;
+  size_t cap;
+
+  enum state state;
+  /* how far into the current frame it's been parsed */
+  size_t pos;
+  /* the size of the current frame in STATE_SIZED */
+  size_t size;
+};
+
+struct imv_stream_frame {
+  int refs;
+  size_t size;
+  unsigned char data[];
+};
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct imv_stream *imv_stream_create(void)
+{
+  return calloc(1, sizeof(struct imv_stream));
+}
+
+void imv_stream_free(struct imv_stream *stream)
+{
+  if (!stream) {
+    return;
+  }
+  free(stream->buf);
+  free(stream);
+}
+
+void imv_stream_feed(struct imv_stream *stream, const void *data, size_t len)
+{
+  if (stream->len + len > stream->cap && stream->head) {
+    /* Make room by dropping the frames already taken */
+    memmove(stream->buf, stream->buf + stream->head, stream->len - stream->head);
+    stream->len -= stream->head;
+    stream->head = 0;
+  }
+  if (stream->len + len > stream->cap) {
+    /* Doubling, so that a big frame arriving in small reads doesn't get
+     * copied over and over */
+    size_t cap = stream->cap ? stream->cap : 64 * 1024;
+    while (cap < stream->len + len) {
+      cap *= 2;
+    }
+    stream->buf = realloc(stream->buf, cap);
+    stream->cap = cap;
+  }
+  memcpy(stream->buf + stream->len, data, len);
+  stream->len += len;
+}
+
+static uint32_t read_be32(const unsigned char *p)
+{
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+/* Whether the len bytes at p could be the start of a frame of the given
+ * signature, with more data to come */
+static bool may_be(const unsigned char *p, size_t len,
+                   const unsigned char *signature, size_t signature_len)
+{
+  return len < signature_len && !memcmp(p, signature, len);
+}
+
+/* Skips ahead to the next thing that looks like the start of a JPEG or
+ * PNG, keeping a few bytes back if there's none in case one is on its way */
+static void resync(struct imv_stream *stream)
+{
+  stream->state = STATE_START;
+  stream->pos = 0;
+
+  for (size_t i = stream->head + 1; i < stream->len; ++i) {
+    const unsigned char *p = stream->buf + i;
+    const size_t avail = stream->len - i;
+    if ((p[0] == jpeg_signature[0] && (avail < sizeof jpeg_signature
+            ? may_be(p, avail, jpeg_signature, sizeof jpeg_signature)
+            : !memcmp(p, jpeg_signature, sizeof jpeg_signature)))
+        || (p[0] == png_signature[0] && (avail < sizeof png_signature
+            ? may_be(p, avail, png_signature, sizeof png_signature)
+            : !memcmp(p, png_signature, sizeof png_signature)))) {
+      stream->head = i;
+      return;
+    }
+  }
+  stream->head = stream->len = 0;
+}
+
+/* Takes the first end bytes of the current frame, of which the image data
+ * starts at start */
+static struct imv_stream_frame *cut(struct imv_stream *stream,
+                                    size_t start, size_t end)
+{
+  struct imv_stream_frame *frame = malloc(sizeof *frame + (end - start));
+  frame->refs = 1;
+  frame->size = end - start;
+  memcpy(frame->data, stream->buf + stream->head + start, end - start);
+
+  stream->head += end;
+  stream->state = STATE_START;
+  stream->pos = 0;
+  if (stream->head == stream->len) {
+    stream->head = stream->len = 0;
+  }
+  return frame;
+}
+
+struct imv_stream_frame *imv_stream_next(struct imv_stream *stream)
+{
+  while (true) {
+    const unsigned char *p = stream->buf + stream->head;
+    const size_t avail = stream->len - stream->head;
+
+    if (stream->state != STATE_START && stream->pos > MAX_FRAME_SIZE) {
+      resync(stream);
+      continue;
+    }
+
+    switch (stream->state) {
+      case STATE_START:
+        if (avail >= sizeof jpeg_signature
+            && !memcmp(p, jpeg_signature, sizeof jpeg_signature)) {
+          /* Just past the SOI marker */
+          stream->state = STATE_JPEG_SEGMENTS;
+          stream->pos = 2;
+        } else if (avail >= sizeof png_signature
+            && !memcmp(p, png_signature, sizeof png_signature)) {
+          stream->state = STATE_PNG_CHUNKS;
+          stream->pos = sizeof png_signature;
+        } else if (may_be(p, avail, jpeg_signature, sizeof jpeg_signature)
+            || may_be(p, avail, png_signature, sizeof png_signature)
+            || avail < 4) {
+          return NULL;
+        } else {
+          const uint32_t size = read_be32(p);
+          if (size == 0 || size > MAX_FRAME_SIZE) {
+            resync(stream);
+          } else {
+            stream->state = STATE_SIZED;
+            stream->pos = 4;
+            stream->size = size;
+          }
+        }
+        break;
+
+      case STATE_JPEG_SEGMENTS: {
+        if (stream->pos + 2 > avail) {
+          return NULL;
+        }
+        const unsigned char *marker = p + stream->pos;
+        if (marker[0] != 0xFF) {
+          resync(stream);
+          break;
+        }
+        if (marker[1] == 0xFF) {
+          /* fill byte before a marker */
+          stream->pos += 1;
+        } else if (marker[1] == 0xD9) {
+          return cut(stream, 0, stream->pos + 2);
+        } else if (marker[1] == 0x01 || (marker[1] >= 0xD0 && marker[1] <= 0xD8)) {
+          /* markers without a segment */
+          stream->pos += 2;
+        } else {
+          if (stream->pos + 4 > avail) {
+            return NULL;
+          }
+          const size_t length = (size_t)marker[2] << 8 | marker[3];
+          if (length < 2) {
+            resync(stream);
+            break;
+          }
+          /* Segments such as EXIF data, which may hold a whole thumbnail
+           * JPEG of their own, are stepped over without looking inside */
+          stream->pos += 2 + length;
+          if (marker[1] == 0xDA) {
+            stream->state = STATE_JPEG_ENTROPY;
+          }
+        }
+        break;
+      }
+
+      case STATE_JPEG_ENTROPY: {
+        /* Pick up where the last look left off, so that a frame arriving in
+         * many small reads is only scanned through once */
+        while (stream->pos < avail) {
+          const unsigned char *ff = memchr(p + stream->pos, 0xFF, avail - stream->pos);
+          if (!ff) {
+            stream->pos = avail;
+            break;
+          }
+          stream->pos = ff - p;
+          if (stream->pos + 1 >= avail) {
+            return NULL;
+          }
+          const unsigned char next = ff[1];
+          if (next == 0x00 || (next >= 0xD0 && next <= 0xD7)) {
+            /* a stuffed 0xFF, or a restart marker within the data */
+            stream->pos += 2;
+          } else if (next == 0xFF) {
+            stream->pos += 1;
+          } else {
+            stream->state = STATE_JPEG_SEGMENTS;
+            break;
+          }
+        }
+        if (stream->state == STATE_JPEG_ENTROPY) {
+          return NULL;
+        }
+        break;
+      }
+
+      case STATE_PNG_CHUNKS: {
+        if (stream->pos + 8 > avail) {
+          return NULL;
+        }
+        const uint32_t length = read_be32(p + stream->pos);
+        if (length > MAX_FRAME_SIZE) {
+          resync(stream);
+          break;
+        }
+        /* length, type, data, then CRC */
+        const size_t end = stream->pos + 12 + length;
+        if (!memcmp(p + stream->pos + 4, "IEND", 4)) {
+          if (end > avail) {
+            return NULL;
+          }
+          return cut(stream, 0, end);
+        }
+        stream->pos = end;
+        break;
+      }
+
+      case STATE_SIZED:
+        if (4 + stream->size > avail) {
+          return NULL;
+        }
+        return cut(stream, 4, 4 + stream->size);
+    }
+  }
+}
+
+struct imv_stream_frame *imv_stream_frame_ref(struct imv_stream_frame *frame)
+{
+  pthread_mutex_lock(&g_lock);
+  ++frame->refs;
+  pthread_mutex_unlock(&g_lock);
+  return frame;
+}
+
+void imv_stream_frame_unref(struct imv_stream_frame *frame)
+{
+  if (!frame) {
+    return;
+  }
+  pthread_mutex_lock(&g_lock);
+  const bool last = --frame->refs == 0;
+  pthread_mutex_unlock(&g_lock);
+  if (last) {
+    free(frame);
+  }
+}
+
+void *imv_stream_frame_data(struct imv_stream_frame *frame)
+{
+  return frame->data;
+}
+
+size_t imv_stream_frame_size(struct imv_stream_frame *frame)
+{
+  return frame->size;
+}
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
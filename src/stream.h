@@ -0,0 +1,49 @@
+#ifndef IMV_STREAM_H
+#define IMV_STREAM_H
+
+#include <stddef.h>
+
+/* Splits a stream of images sent one after another, such as MJPEG from
+ * ffmpeg's image2pipe, into frames of one image each. JPEG and PNG frames are
+ * found by their own structure. Anything else must be preceded by its length
+ * in bytes, as a 32-bit big-endian number.
+ */
+struct imv_stream;
+
+/* One image's worth of data cut from a stream. Frames are reference counted,
+ * so they can be handed to decoders on other threads.
+ */
+struct imv_stream_frame;
+
+/* Creates an empty stream */
+struct imv_stream *imv_stream_create(void);
+
+/* Cleans up a stream, along with any data not yet made into a frame */
+void imv_stream_free(struct imv_stream *stream);
+
+/* Adds len bytes of data to the end of the stream */
+void imv_stream_feed(struct imv_stream *stream, const void *data, size_t len);
+
+/* Takes the oldest complete frame from the stream, or returns NULL if more
+ * data is needed first. Data that can't be the start of a frame is skipped
+ * up to the next JPEG or PNG signature. The caller owns a reference to the
+ * frame returned. */
+struct imv_stream_frame *imv_stream_next(struct imv_stream *stream);
+
+/* Takes another reference to frame, returning it */
+struct imv_stream_frame *imv_stream_frame_ref(struct imv_stream_frame *frame);
+
+/* Drops a reference to frame, freeing it with the last. Does nothing if
+ * frame is NULL. */
+void imv_stream_frame_unref(struct imv_stream_frame *frame);
+
+/* Returns the frame's image data */
+void *imv_stream_frame_data(struct imv_stream_frame *frame);
+
+/* Returns the size of the frame's image data, in bytes */
+size_t imv_stream_frame_size(struct imv_stream_frame *frame);
+
+#endif
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
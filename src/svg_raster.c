@@ -0,0 +1,218 @@
+#include "svg_raster.h"
+
+#ifdef IMV_BACKEND_LIBRSVG
+
+#include "memory_budget.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+struct imv_svg_raster *imv_svg_raster_render(RsvgHandle *handle, double scale,
+    double x, double y, double width, double height)
+{
+  const int pixel_width = ceil(width * scale);
+  const int pixel_height = ceil(height * scale);
+  cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+      pixel_width > 0 ? pixel_width : 1, pixel_height > 0 ? pixel_height : 1);
+  if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+    cairo_surface_destroy(surface);
+    return NULL;
+  }
+
+  cairo_t *cairo = cairo_create(surface);
+  cairo_scale(cairo, scale, scale);
+  cairo_translate(cairo, -x, -y);
+  rsvg_handle_render_cairo(handle, cairo);
+  cairo_destroy(cairo);
+  cairo_surface_flush(surface);
+
+  /* Counted like a bitmap, as it takes the place of one */
+  imv_memory_acquire((size_t)cairo_image_surface_get_stride(surface)
+      * cairo_image_surface_get_height(surface));
+
+  struct imv_svg_raster *raster = calloc(1, sizeof *raster);
+  raster->handle = g_object_ref(handle);
+  raster->scale = scale;
+  raster->x = x;
+  raster->y = y;
+  raster->width = width;
+  raster->height = height;
+  raster->surface = surface;
+  return raster;
+}
+
+void imv_svg_raster_free(struct imv_svg_raster *raster)
+{
+  if (!raster) {
+    return;
+  }
+  imv_memory_release((size_t)cairo_image_surface_get_stride(raster->surface)
+      * cairo_image_surface_get_height(raster->surface));
+  cairo_surface_destroy(raster->surface);
+  g_object_unref(raster->handle);
+  free(raster);
+}
+
+struct request {
+  RsvgHandle *handle;
+  double scale;
+  double x, y, width, height;
+};
+
+struct imv_svg_rasteriser {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  /* signalled when there's a request waiting, or it's time to quit */
+  pthread_cond_t wake;
+  /* signalled when nothing is waiting or rendering */
+  pthread_cond_t idle;
+
+  /* the newest request, holding a reference to its handle, if waiting */
+  struct request request;
+  bool waiting;
+  bool rendering;
+  bool quit;
+
+  /* the newest finished raster not yet taken */
+  struct imv_svg_raster *done;
+
+  void (*notify)(void *data);
+  void *data;
+};
+
+static void *render_requests(void *data)
+{
+  struct imv_svg_rasteriser *rasteriser = data;
+
+  pthread_mutex_lock(&rasteriser->lock);
+  while (true) {
+    while (!rasteriser->waiting && !rasteriser->quit) {
+      pthread_cond_wait(&rasteriser->wake, &rasteriser->lock);
+    }
+    if (rasteriser->quit) {
+      break;
+    }
+
+    const struct request request = rasteriser->request;
+    rasteriser->waiting = false;
+    rasteriser->rendering = true;
+    pthread_mutex_unlock(&rasteriser->lock);
+
+    struct imv_svg_raster *raster = imv_svg_raster_render(request.handle,
+        request.scale, request.x, request.y, request.width, request.height);
+    g_object_unref(request.handle);
+
+    pthread_mutex_lock(&rasteriser->lock);
+    imv_svg_raster_free(rasteriser->done);
+    rasteriser->done = raster;
+    rasteriser->rendering = false;
+    if (!rasteriser->waiting) {
+      pthread_cond_broadcast(&rasteriser->idle);
+    }
+    pthread_mutex_unlock(&rasteriser->lock);
+
+    if (raster && rasteriser->notify) {
+      rasteriser->notify(rasteriser->data);
+    }
+    pthread_mutex_lock(&rasteriser->lock);
+  }
+  pthread_mutex_unlock(&rasteriser->lock);
+  return NULL;
+}
+
+struct imv_svg_rasteriser *imv_svg_rasteriser_create(void (*notify)(void *data),
+    void *data)
+{
+  struct imv_svg_rasteriser *rasteriser = calloc(1, sizeof *rasteriser);
+  rasteriser->notify = notify;
+  rasteriser->data = data;
+  pthread_mutex_init(&rasteriser->lock, NULL);
+  pthread_cond_init(&rasteriser->wake, NULL);
+  pthread_cond_init(&rasteriser->idle, NULL);
+
+  if (pthread_create(&rasteriser->thread, NULL, render_requests, rasteriser)) {
+    pthread_cond_destroy(&rasteriser->idle);
+    pthread_cond_destroy(&rasteriser->wake);
+    pthread_mutex_destroy(&rasteriser->lock);
+    free(rasteriser);
+    return NULL;
+  }
+  return rasteriser;
+}
+
+void imv_svg_rasteriser_free(struct imv_svg_rasteriser *rasteriser)
+{
+  if (!rasteriser) {
+    return;
+  }
+
+  pthread_mutex_lock(&rasteriser->lock);
+  rasteriser->quit = true;
+  pthread_cond_signal(&rasteriser->wake);
+  pthread_mutex_unlock(&rasteriser->lock);
+  pthread_join(rasteriser->thread, NULL);
+
+  if (rasteriser->waiting) {
+    g_object_unref(rasteriser->request.handle);
+  }
+  imv_svg_raster_free(rasteriser->done);
+  pthread_cond_destroy(&rasteriser->idle);
+  pthread_cond_destroy(&rasteriser->wake);
+  pthread_mutex_destroy(&rasteriser->lock);
+  free(rasteriser);
+}
+
+void imv_svg_rasteriser_request(struct imv_svg_rasteriser *rasteriser,
+    RsvgHandle *handle, double scale,
+    double x, double y, double width, double height)
+{
+  const struct request request = {
+    .handle = g_object_ref(handle),
+    .scale = scale,
+    .x = x,
+    .y = y,
+    .width = width,
+    .height = height,
+  };
+
+  pthread_mutex_lock(&rasteriser->lock);
+  if (rasteriser->waiting) {
+    g_object_unref(rasteriser->request.handle);
+  }
+  rasteriser->request = request;
+  rasteriser->waiting = true;
+  pthread_cond_signal(&rasteriser->wake);
+  pthread_mutex_unlock(&rasteriser->lock);
+}
+
+bool imv_svg_rasteriser_busy(struct imv_svg_rasteriser *rasteriser)
+{
+  pthread_mutex_lock(&rasteriser->lock);
+  const bool busy = rasteriser->waiting || rasteriser->rendering;
+  pthread_mutex_unlock(&rasteriser->lock);
+  return busy;
+}
+
+void imv_svg_rasteriser_wait(struct imv_svg_rasteriser *rasteriser)
+{
+  pthread_mutex_lock(&rasteriser->lock);
+  while (rasteriser->waiting || rasteriser->rendering) {
+    pthread_cond_wait(&rasteriser->idle, &rasteriser->lock);
+  }
+  pthread_mutex_unlock(&rasteriser->lock);
+}
+
+struct imv_svg_raster *imv_svg_rasteriser_take(struct imv_svg_rasteriser *rasteriser)
+{
+  pthread_mutex_lock(&rasteriser->lock);
+  struct imv_svg_raster *raster = rasteriser->done;
+  rasteriser->done = NULL;
+  pthread_mutex_unlock(&rasteriser->lock);
+  return raster;
+}
+
+#endif
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,66 @@
+#ifndef IMV_SVG_RASTER_H
+#define IMV_SVG_RASTER_H
+
+#ifdef IMV_BACKEND_LIBRSVG
+
+#include <cairo.h>
+#include <librsvg/rsvg.h>
+#include <stdbool.h>
+
+/* An area of an SVG rendered to pixels at some scale, so that it can be
+ * drawn again and again without rendering the vector each time.
+ */
+struct imv_svg_raster {
+  /* the SVG rendered, which the raster holds a reference to */
+  RsvgHandle *handle;
+  /* raster pixels per image pixel */
+  double scale;
+  /* the area of the image covered, in image pixels */
+  double x, y, width, height;
+  /* width * scale x height * scale pixels of cairo's premultiplied ARGB32 */
+  cairo_surface_t *surface;
+};
+
+/* Renders the width x height area at (x, y) of handle's image, at scale */
+struct imv_svg_raster *imv_svg_raster_render(RsvgHandle *handle, double scale,
+    double x, double y, double width, double height);
+
+/* Cleans up a raster. Does nothing if raster is NULL. */
+void imv_svg_raster_free(struct imv_svg_raster *raster);
+
+/* A thread rendering rasters in the background, one at a time. Only the
+ * newest request is kept, so one made while another is rendering replaces
+ * any still waiting rather than queueing behind it.
+ */
+struct imv_svg_rasteriser;
+
+/* Creates a rasteriser, which calls notify from its thread each time a
+ * raster is ready to be taken */
+struct imv_svg_rasteriser *imv_svg_rasteriser_create(void (*notify)(void *data),
+    void *data);
+
+/* Cleans up a rasteriser, waiting for the raster it's rendering to finish */
+void imv_svg_rasteriser_free(struct imv_svg_rasteriser *rasteriser);
+
+/* Asks for an area of handle's image to be rendered, as imv_svg_raster_render
+ * would, replacing any earlier request not yet started */
+void imv_svg_rasteriser_request(struct imv_svg_rasteriser *rasteriser,
+    RsvgHandle *handle, double scale,
+    double x, double y, double width, double height);
+
+/* Returns whether a request is waiting or being rendered */
+bool imv_svg_rasteriser_busy(struct imv_svg_rasteriser *rasteriser);
+
+/* Waits until no request is waiting or being rendered */
+void imv_svg_rasteriser_wait(struct imv_svg_rasteriser *rasteriser);
+
+/* Takes the raster finished most recently, or returns NULL if there's none
+ * that hasn't been taken. The caller frees it with imv_svg_raster_free. */
+struct imv_svg_raster *imv_svg_rasteriser_take(struct imv_svg_rasteriser *rasteriser);
+
+#endif
+
+#endif
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,230 @@
+#include "template.h"
+
+#include "list.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum segment_type {
+  SEGMENT_TEXT,
+  SEGMENT_VARIABLE,
+};
+
+struct segment {
+  enum segment_type type;
+  /* the literal text, or the variable's name */
+  char *str;
+};
+
+struct imv_template {
+  char *format;
+  struct list *segments;
+  bool needs_shell;
+};
+
+/* The literal text being accumulated between variables */
+struct text {
+  char *buf;
+  size_t len;
+  size_t cap;
+};
+
+static void text_append(struct text *text, const char *str, size_t len)
+{
+  if (text->len + len + 1 > text->cap) {
+    text->cap = (text->len + len + 1) * 2;
+    text->buf = realloc(text->buf, text->cap);
+  }
+  memcpy(text->buf + text->len, str, len);
+  text->len += len;
+  text->buf[text->len] = '\0';
+}
+
+static void add_segment(struct imv_template *tmpl, enum segment_type type, char *str)
+{
+  struct segment *segment = malloc(sizeof *segment);
+  segment->type = type;
+  segment->str = str;
+  list_append(tmpl->segments, segment);
+}
+
+static void flush_text(struct imv_template *tmpl, struct text *text)
+{
+  if (text->len) {
+    add_segment(tmpl, SEGMENT_TEXT, strndup(text->buf, text->len));
+    text->len = 0;
+  }
+}
+
+static bool is_name_start(char c)
+{
+  return isalpha((unsigned char)c) || c == '_';
+}
+
+static bool is_name_char(char c)
+{
+  return isalnum((unsigned char)c) || c == '_';
+}
+
+/* Parses the expansion at str, which starts with a '$', adding it to the
+ * template. Returns a pointer to the first character after it. */
+static const char *parse_dollar(struct imv_template *tmpl, struct text *text,
+                                const char *str)
+{
+  const char *name = str + 1;
+
+  if (is_name_start(*name)) {
+    const char *end = name;
+    while (is_name_char(*end)) {
+      ++end;
+    }
+    flush_text(tmpl, text);
+    add_segment(tmpl, SEGMENT_VARIABLE, strndup(name, end - name));
+    return end;
+  }
+
+  if (*name == '{' && is_name_start(name[1])) {
+    const char *end = name + 1;
+    while (is_name_char(*end)) {
+      ++end;
+    }
+    if (*end == '}') {
+      flush_text(tmpl, text);
+      add_segment(tmpl, SEGMENT_VARIABLE, strndup(name + 1, end - name - 1));
+      return end + 1;
+    }
+  }
+
+  /* Anything else is left as it is: a lone '$' is just text, but command
+   * substitution, parameter modifiers and the like need a real shell */
+  if (*name == '(' || *name == '{' || isdigit((unsigned char)*name)
+      || (*name && strchr("@*#?-$!", *name))) {
+    tmpl->needs_shell = true;
+  }
+  text_append(text, str, 1);
+  return name;
+}
+
+struct imv_template *imv_template_create(const char *format)
+{
+  struct imv_template *tmpl = calloc(1, sizeof *tmpl);
+  tmpl->format = strdup(format);
+  tmpl->segments = list_create();
+
+  struct text text = {0};
+  bool in_single_quotes = false;
+  bool in_double_quotes = false;
+  /* whitespace outside quotes separates words, which are joined with a
+   * single space, so runs of it collapse and it's dropped from the ends */
+  bool pending_space = false;
+  bool started = false;
+
+  const char *str = format;
+  while (*str) {
+    const bool quoted = in_single_quotes || in_double_quotes;
+
+    if (!quoted && isspace((unsigned char)*str)) {
+      pending_space = started;
+      ++str;
+      continue;
+    }
+
+    if (pending_space) {
+      text_append(&text, " ", 1);
+      pending_space = false;
+    }
+    started = true;
+
+    if (in_single_quotes) {
+      if (*str == '\'') {
+        in_single_quotes = false;
+      } else {
+        text_append(&text, str, 1);
+      }
+      ++str;
+    } else if (*str == '\'' && !in_double_quotes) {
+      in_single_quotes = true;
+      ++str;
+    } else if (*str == '"') {
+      in_double_quotes = !in_double_quotes;
+      ++str;
+    } else if (*str == '\\' && str[1]) {
+      /* Inside double quotes, backslashes only escape a few characters */
+      if (in_double_quotes && !strchr("$`\"\\\n", str[1])) {
+        text_append(&text, str, 2);
+      } else if (str[1] != '\n') {
+        text_append(&text, str + 1, 1);
+      }
+      str += 2;
+    } else if (*str == '$') {
+      str = parse_dollar(tmpl, &text, str);
+    } else {
+      if (*str == '`' || (*str == '~' && str == format)) {
+        tmpl->needs_shell = true;
+      }
+      text_append(&text, str, 1);
+      ++str;
+    }
+  }
+
+  flush_text(tmpl, &text);
+  free(text.buf);
+  return tmpl;
+}
+
+void imv_template_free(struct imv_template *tmpl)
+{
+  if (!tmpl) {
+    return;
+  }
+  for (size_t i = 0; i < tmpl->segments->len; ++i) {
+    struct segment *segment = tmpl->segments->items[i];
+    free(segment->str);
+    free(segment);
+  }
+  list_free(tmpl->segments);
+  free(tmpl->format);
+  free(tmpl);
+}
+
+const char *imv_template_format(const struct imv_template *tmpl)
+{
+  return tmpl->format;
+}
+
+bool imv_template_needs_shell(const struct imv_template *tmpl)
+{
+  return tmpl->needs_shell;
+}
+
+size_t imv_template_expand(const struct imv_template *tmpl, char *buf, size_t len,
+                           imv_template_lookup lookup, void *data)
+{
+  size_t used = 0;
+  if (len) {
+    buf[0] = '\0';
+  }
+
+  for (size_t i = 0; i < tmpl->segments->len; ++i) {
+    const struct segment *segment = tmpl->segments->items[i];
+    const char *value = segment->str;
+    if (segment->type == SEGMENT_VARIABLE) {
+      value = lookup ? lookup(segment->str, data) : NULL;
+      if (!value) {
+        value = getenv(segment->str);
+      }
+      if (!value) {
+        value = "";
+      }
+    }
+    used += snprintf(buf + (used < len ? used : len),
+                     used < len ? len - used : 0, "%s", value);
+  }
+
+  return used;
+}
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
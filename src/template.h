@@ -0,0 +1,41 @@
+#ifndef IMV_TEMPLATE_H
+#define IMV_TEMPLATE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* A text template, such as the window title or overlay text, parsed once in
+ * advance so that it can be expanded cheaply whenever it's shown.
+ *
+ * Templates follow the shell's syntax for the parts of it they support:
+ * $name and ${name} are replaced with variables, quotes and backslashes
+ * quote as usual, and unquoted whitespace collapses to a single space. */
+struct imv_template;
+
+/* Returns the value of a variable, or NULL if it's not one the caller
+ * provides, in which case the environment is consulted instead. The value
+ * need only remain valid until the next call. */
+typedef const char *(*imv_template_lookup)(const char *name, void *data);
+
+/* Parses format into a template */
+struct imv_template *imv_template_create(const char *format);
+
+/* Cleans up a template */
+void imv_template_free(struct imv_template *tmpl);
+
+/* Returns the text the template was created from */
+const char *imv_template_format(const struct imv_template *tmpl);
+
+/* Returns true if the template uses shell features it doesn't support
+ * itself, such as command substitution, which are left unexpanded */
+bool imv_template_needs_shell(const struct imv_template *tmpl);
+
+/* Expands the template into buf, truncating it to fit len bytes, and
+ * returns the length of the untruncated text */
+size_t imv_template_expand(const struct imv_template *tmpl, char *buf, size_t len,
+                           imv_template_lookup lookup, void *data);
+
+#endif
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,316 @@
+#include "thumbnail_cache.h"
+
+#include "bitmap.h"
+#include "log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Some systems like GNU/Hurd don't define PATH_MAX */
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+#define MAGIC "IMVT"
+#define VERSION 1
+
+/* Each file is this header, then the path of the image it was made from,
+ * then its pixels, tightly packed, in the host's byte order. The cache
+ * belongs to one machine, so there's no need for anything portable. */
+struct header {
+  char magic[4];
+  uint32_t version;
+  uint32_t width;
+  uint32_t height;
+  int64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint32_t path_len;
+};
+
+struct imv_thumbnail_cache {
+  char *dir;
+};
+
+/* Creates dir and any missing parents */
+static bool make_dirs(const char *dir)
+{
+  char path[PATH_MAX];
+  if (snprintf(path, sizeof path, "%s", dir) >= (int)sizeof path) {
+    return false;
+  }
+
+  for (char *p = path + 1; *p; ++p) {
+    if (*p == '/') {
+      *p = '\0';
+      if (mkdir(path, 0700) && errno != EEXIST) {
+        return false;
+      }
+      *p = '/';
+    }
+  }
+  return !mkdir(path, 0700) || errno == EEXIST;
+}
+
+struct imv_thumbnail_cache *imv_thumbnail_cache_create(const char *dir)
+{
+  char buf[PATH_MAX];
+  if (!dir) {
+    const char *base = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if (base && *base) {
+      snprintf(buf, sizeof buf, "%s/imv/thumbnails", base);
+    } else if (home && *home) {
+      snprintf(buf, sizeof buf, "%s/.cache/imv/thumbnails", home);
+    } else {
+      return NULL;
+    }
+    dir = buf;
+  }
+
+  if (!make_dirs(dir)) {
+    imv_log(IMV_WARNING, "Can't create thumbnail directory %s: %s\n",
+        dir, strerror(errno));
+    return NULL;
+  }
+
+  struct imv_thumbnail_cache *cache = calloc(1, sizeof *cache);
+  cache->dir = strdup(dir);
+  return cache;
+}
+
+void imv_thumbnail_cache_free(struct imv_thumbnail_cache *cache)
+{
+  if (!cache) {
+    return;
+  }
+  free(cache->dir);
+  free(cache);
+}
+
+/* Fills key with the absolute form of path, and file with the name of its
+ * thumbnail, an FNV-1a hash of the key */
+static bool get_names(struct imv_thumbnail_cache *cache, const char *path,
+    char key[PATH_MAX], char file[PATH_MAX])
+{
+  if (!realpath(path, key)) {
+    return false;
+  }
+
+  uint64_t hash = 0xcbf29ce484222325;
+  for (const char *c = key; *c; ++c) {
+    hash ^= (unsigned char)*c;
+    hash *= 0x100000001b3;
+  }
+
+  return snprintf(file, PATH_MAX, "%s/%016llx", cache->dir,
+      (unsigned long long)hash) < PATH_MAX;
+}
+
+static bool read_all(int fd, void *buf, size_t len)
+{
+  char *p = buf;
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+static bool write_all(int fd, const void *buf, size_t len)
+{
+  const char *p = buf;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+struct imv_bitmap *imv_thumbnail_cache_get(struct imv_thumbnail_cache *cache,
+    const char *path, const struct stat *st)
+{
+  char key[PATH_MAX], file[PATH_MAX];
+  if (!cache || !get_names(cache, path, key, file)) {
+    return NULL;
+  }
+
+  int fd = open(file, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  struct imv_bitmap *bmp = NULL;
+  struct header header;
+  char stored_key[PATH_MAX];
+
+  if (!read_all(fd, &header, sizeof header)
+      || memcmp(header.magic, MAGIC, sizeof header.magic)
+      || header.version != VERSION
+      || header.size != (int64_t)st->st_size
+      || header.mtime_sec != (int64_t)st->st_mtim.tv_sec
+      || header.mtime_nsec != (int64_t)st->st_mtim.tv_nsec
+      || header.path_len != strlen(key)
+      || !read_all(fd, stored_key, header.path_len)
+      || memcmp(stored_key, key, header.path_len)
+      || header.width == 0 || header.width > 4096
+      || header.height == 0 || header.height > 4096) {
+    /* stale, or another file's with the same hash */
+    goto end;
+  }
+
+  bmp = imv_bitmap_create(header.width, header.height, IMV_ABGR);
+  if (bmp && !read_all(fd, bmp->data, (size_t)bmp->stride * bmp->height)) {
+    imv_bitmap_free(bmp);
+    bmp = NULL;
+  }
+
+end:
+  close(fd);
+  return bmp;
+}
+
+bool imv_thumbnail_cache_put(struct imv_thumbnail_cache *cache,
+    const char *path, const struct stat *st, const struct imv_bitmap *thumbnail)
+{
+  char key[PATH_MAX], file[PATH_MAX];
+  if (!cache || !get_names(cache, path, key, file)) {
+    return false;
+  }
+
+  /* Written under a temporary name and moved into place, so readers never
+   * see half a thumbnail */
+  char tmp[PATH_MAX];
+  if (snprintf(tmp, sizeof tmp, "%s.XXXXXX", file) >= (int)sizeof tmp) {
+    return false;
+  }
+  int fd = mkstemp(tmp);
+  if (fd < 0) {
+    return false;
+  }
+
+  struct header header = {
+    .version = VERSION,
+    .width = thumbnail->width,
+    .height = thumbnail->height,
+    .size = st->st_size,
+    .mtime_sec = st->st_mtim.tv_sec,
+    .mtime_nsec = st->st_mtim.tv_nsec,
+    .path_len = strlen(key),
+  };
+  memcpy(header.magic, MAGIC, sizeof header.magic);
+
+  bool ok = write_all(fd, &header, sizeof header)
+    && write_all(fd, key, header.path_len);
+  for (int y = 0; ok && y < thumbnail->height; ++y) {
+    ok = write_all(fd, thumbnail->data + (size_t)y * thumbnail->stride,
+        (size_t)thumbnail->width * 4);
+  }
+  ok = !close(fd) && ok;
+
+  if (!ok || rename(tmp, file)) {
+    unlink(tmp);
+    return false;
+  }
+  return true;
+}
+
+/* Swaps red and blue in a native-endian 32-bit pixel */
+static uint32_t swap_red_blue(uint32_t pixel)
+{
+  return (pixel & 0xff00ff00) | ((pixel >> 16) & 0xff) | ((pixel & 0xff) << 16);
+}
+
+struct imv_bitmap *imv_thumbnail_scale(const struct imv_bitmap *bitmap, int size)
+{
+  /* Thumbnails are 8-bit whatever they're of */
+  if (imv_bitmap_pixel_size(bitmap->format) != 4) {
+    struct imv_bitmap *narrowed = imv_bitmap_narrow(bitmap);
+    if (!narrowed) {
+      return NULL;
+    }
+    struct imv_bitmap *thumb = imv_thumbnail_scale(narrowed, size);
+    imv_bitmap_free(narrowed);
+    return thumb;
+  }
+
+  int width = bitmap->width;
+  int height = bitmap->height;
+  if (width > size || height > size) {
+    if (width >= height) {
+      height = (int)((double)height * size / width + 0.5);
+      width = size;
+    } else {
+      width = (int)((double)width * size / height + 0.5);
+      height = size;
+    }
+    width = width > 0 ? width : 1;
+    height = height > 0 ? height : 1;
+  }
+
+  struct imv_bitmap *thumb = imv_bitmap_create(width, height, IMV_ABGR);
+  if (!thumb) {
+    return NULL;
+  }
+
+  /* Average every source pixel falling within each destination pixel. Each
+   * channel is a byte, so this works on the bytes without caring which is
+   * which until the end. */
+  for (int y = 0; y < height; ++y) {
+    const int sy0 = (int)((int64_t)y * bitmap->height / height);
+    int sy1 = (int)((int64_t)(y + 1) * bitmap->height / height);
+    sy1 = sy1 > sy0 ? sy1 : sy0 + 1;
+
+    for (int x = 0; x < width; ++x) {
+      const int sx0 = (int)((int64_t)x * bitmap->width / width);
+      int sx1 = (int)((int64_t)(x + 1) * bitmap->width / width);
+      sx1 = sx1 > sx0 ? sx1 : sx0 + 1;
+
+      uint64_t sum[4] = {0, 0, 0, 0};
+      for (int sy = sy0; sy < sy1; ++sy) {
+        const unsigned char *src = bitmap->data + (size_t)sy * bitmap->stride
+          + (size_t)sx0 * 4;
+        for (int sx = sx0; sx < sx1; ++sx, src += 4) {
+          sum[0] += src[0];
+          sum[1] += src[1];
+          sum[2] += src[2];
+          sum[3] += src[3];
+        }
+      }
+
+      const uint64_t count = (uint64_t)(sy1 - sy0) * (sx1 - sx0);
+      unsigned char pixel[4];
+      for (int c = 0; c < 4; ++c) {
+        pixel[c] = (sum[c] + count / 2) / count;
+      }
+
+      uint32_t word;
+      memcpy(&word, pixel, sizeof word);
+      if (bitmap->format == IMV_ARGB) {
+        word = swap_red_blue(word);
+      }
+      memcpy(thumb->data + (size_t)y * thumb->stride + (size_t)x * 4,
+          &word, sizeof word);
+    }
+  }
+
+  return thumb;
+}
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
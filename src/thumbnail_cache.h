@@ -0,0 +1,43 @@
+#ifndef IMV_THUMBNAIL_CACHE_H
+#define IMV_THUMBNAIL_CACHE_H
+
+#include <stdbool.h>
+
+struct imv_bitmap;
+struct stat;
+
+/* Thumbnails of image files, kept on disk between runs so that each is only
+ * made once. A thumbnail is stored under a name derived from the absolute
+ * path of its file, along with the size and mtime the file had, so that a
+ * thumbnail of a file that has since changed is never returned. All
+ * functions but create and free are safe to call from any thread.
+ */
+struct imv_thumbnail_cache;
+
+/* Creates a cache kept in dir, which is created if it doesn't exist. If dir
+ * is NULL, $XDG_CACHE_HOME/imv/thumbnails is used. Returns NULL if there's
+ * no usable directory. */
+struct imv_thumbnail_cache *imv_thumbnail_cache_create(const char *dir);
+
+/* Cleans up a cache, leaving its files in place */
+void imv_thumbnail_cache_free(struct imv_thumbnail_cache *cache);
+
+/* Looks up the thumbnail for path, where st is the file's current status.
+ * Returns NULL on a miss. */
+struct imv_bitmap *imv_thumbnail_cache_get(struct imv_thumbnail_cache *cache,
+    const char *path, const struct stat *st);
+
+/* Stores the thumbnail for path, made from the file as described by st.
+ * Returns false if it couldn't be written. */
+bool imv_thumbnail_cache_put(struct imv_thumbnail_cache *cache,
+    const char *path, const struct stat *st, const struct imv_bitmap *thumbnail);
+
+/* Scales bitmap down to fit within size x size pixels with a box filter,
+ * producing a tightly packed IMV_ABGR bitmap. Bitmaps already small enough
+ * are copied as they are. */
+struct imv_bitmap *imv_thumbnail_scale(const struct imv_bitmap *bitmap, int size);
+
+#endif
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,120 @@
+#include "trace.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *g_file = NULL;
+static bool g_first = true;
+
+/* The small ids threads are shown under, handed out as they first record
+ * something, as pthread_t needn't be a number */
+static pthread_once_t g_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t g_thread_key;
+static unsigned long g_thread_count = 0;
+
+static void create_key(void)
+{
+  pthread_key_create(&g_thread_key, NULL);
+}
+
+/* Called with g_lock held */
+static unsigned long thread_id(void)
+{
+  pthread_once(&g_key_once, create_key);
+  unsigned long id = (unsigned long)pthread_getspecific(g_thread_key);
+  if (!id) {
+    id = ++g_thread_count;
+    pthread_setspecific(g_thread_key, (void *)id);
+  }
+  return id;
+}
+
+/* Writes str as a JSON string, escaping what has to be */
+static void write_string(FILE *file, const char *str)
+{
+  fputc('"', file);
+  for (const unsigned char *c = (const unsigned char *)str; *c; ++c) {
+    if (*c == '"' || *c == '\\') {
+      fprintf(file, "\\%c", *c);
+    } else if (*c < 0x20) {
+      fprintf(file, "\\u%04x", *c);
+    } else {
+      fputc(*c, file);
+    }
+  }
+  fputc('"', file);
+}
+
+bool imv_trace_open(const char *path)
+{
+  FILE *file = fopen(path, "w");
+  if (!file) {
+    return false;
+  }
+
+  imv_trace_close();
+
+  pthread_mutex_lock(&g_lock);
+  g_file = file;
+  g_first = true;
+  fputs("[\n", g_file);
+  pthread_mutex_unlock(&g_lock);
+  return true;
+}
+
+void imv_trace_close(void)
+{
+  pthread_mutex_lock(&g_lock);
+  if (g_file) {
+    fputs("\n]\n", g_file);
+    fclose(g_file);
+    g_file = NULL;
+  }
+  pthread_mutex_unlock(&g_lock);
+}
+
+bool imv_trace_enabled(void)
+{
+  pthread_mutex_lock(&g_lock);
+  const bool enabled = g_file;
+  pthread_mutex_unlock(&g_lock);
+  return enabled;
+}
+
+double imv_trace_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + (double)ts.tv_nsec * 0.000000001;
+}
+
+void imv_trace_span(const char *name, const char *detail,
+                    double start, double end)
+{
+  pthread_mutex_lock(&g_lock);
+  if (!g_file) {
+    pthread_mutex_unlock(&g_lock);
+    return;
+  }
+
+  /* Complete events, in microseconds */
+  fputs(g_first ? "" : ",\n", g_file);
+  g_first = false;
+  fputs("{\"name\":", g_file);
+  write_string(g_file, name);
+  fprintf(g_file, ",\"ph\":\"X\",\"pid\":%d,\"tid\":%lu,\"ts\":%.3f,\"dur\":%.3f",
+      (int)getpid(), thread_id(), start * 1000000.0, (end - start) * 1000000.0);
+  if (detail) {
+    fputs(",\"args\":{\"detail\":", g_file);
+    write_string(g_file, detail);
+    fputc('}', g_file);
+  }
+  fputc('}', g_file);
+  pthread_mutex_unlock(&g_lock);
+}
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
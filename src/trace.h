@@ -0,0 +1,35 @@
+#ifndef IMV_TRACE_H
+#define IMV_TRACE_H
+
+#include <stdbool.h>
+
+/* Records how long each stage of loading and showing images takes, as
+ * Chrome trace event JSON, which Perfetto and chrome://tracing can show as
+ * a timeline of every thread. Nothing is recorded until a file is opened
+ * for it. Safe to use from any thread.
+ */
+
+/* Starts writing spans to the file at path, replacing anything in it.
+ * Returns false if it can't be opened. */
+bool imv_trace_open(const char *path);
+
+/* Finishes the file being written, if there is one */
+void imv_trace_close(void);
+
+/* Returns whether spans are being recorded, for callers to skip the work of
+ * describing them when they aren't */
+bool imv_trace_enabled(void);
+
+/* Returns the time now in seconds, on the monotonic clock spans are
+ * measured with */
+double imv_trace_now(void);
+
+/* Records that the stage called name ran from start to end, in seconds from
+ * imv_trace_now. detail, such as the path of the image, may be NULL. */
+void imv_trace_span(const char *name, const char *detail,
+                    double start, double end);
+
+#endif
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -14,6 +14,8 @@ struct imv_viewport {
     int width, height;
   } buffer; /* rendering buffer dimensions */
   int x, y;
+  /* what's left of moves too small to shift the buffer by a whole pixel */
+  double move_rem_x, move_rem_y;
   double pan_factor_x, pan_factor_y;
   int redraw;
   int playing;
@@ -22,8 +24,9 @@ struct imv_viewport {
 
 static void input_xy_to_render_xy(struct imv_viewport *view, int *x, int *y)
 {
-  *x *= view->buffer.width / view->window.width;
-  *y *= view->buffer.height / view->window.height;
+  /* in floating point, as with a fractional scale the ratio isn't whole */
+  *x = (double)*x * view->buffer.width / view->window.width;
+  *y = (double)*y * view->buffer.height / view->window.height;
 }
 
 struct imv_viewport *imv_viewport_create(int window_width, int window_height,
@@ -38,6 +41,7 @@ struct imv_viewport *imv_viewport_create(int window_width, int window_height,
   view->rotation = 0;
   view->mirrored = false;
   view->x = view->y = view->redraw = 0;
+  view->move_rem_x = view->move_rem_y = 0;
   view->pan_factor_x = view->pan_factor_y = 0.5;
   view->playing = 1;
   view->locked = 0;
@@ -129,10 +133,17 @@ static void imv_viewport_keep_in_view(struct imv_viewport *view, const struct im
 void imv_viewport_move(struct imv_viewport *view, int x, int y,
     const struct imv_image *image)
 {
-  input_xy_to_render_xy(view, &x, &y);
-
-  view->x += x;
-  view->y += y;
+  /* with a fractional scale a move rarely comes to whole pixels, so the rest
+   * is kept for next time rather than dropped */
+  const double dx = (double)x * view->buffer.width / view->window.width
+    + view->move_rem_x;
+  const double dy = (double)y * view->buffer.height / view->window.height
+    + view->move_rem_y;
+  view->move_rem_x = dx - (int)dx;
+  view->move_rem_y = dy - (int)dy;
+
+  view->x += (int)dx;
+  view->y += (int)dy;
   imv_viewport_keep_in_view(view, image);
 
   view->redraw = 1;
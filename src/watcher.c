@@ -0,0 +1,372 @@
+#include "watcher.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "list.h"
+#include "log.h"
+
+/* Some systems like GNU/Hurd don't define PATH_MAX */
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+#if defined(IMV_HAVE_INOTIFY)
+#include <sys/inotify.h>
+
+/* Directories are watched rather than files, so files replaced by another
+ * renamed over them aren't lost */
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_TO | IN_MOVED_FROM \
+    | IN_DELETE | IN_ONLYDIR)
+
+struct watch {
+  int wd;
+  char *dir;
+  /* whether every file in dir is of interest, or only the watched file */
+  bool whole;
+};
+
+struct imv_watcher {
+  int fd;
+  /* struct watch * */
+  struct list *watches;
+  /* the watched file, and the watch on its directory */
+  char *file;
+  const char *file_name;
+  struct watch *file_watch;
+};
+
+struct imv_watcher *imv_watcher_create(void)
+{
+  int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd == -1) {
+    imv_log(IMV_WARNING, "Can't watch files: %s\n", strerror(errno));
+    return NULL;
+  }
+
+  struct imv_watcher *watcher = calloc(1, sizeof *watcher);
+  watcher->fd = fd;
+  watcher->watches = list_create();
+  return watcher;
+}
+
+static void free_watch(struct watch *watch)
+{
+  free(watch->dir);
+  free(watch);
+}
+
+void imv_watcher_free(struct imv_watcher *watcher)
+{
+  if (!watcher) {
+    return;
+  }
+  for (size_t i = 0; i < watcher->watches->len; ++i) {
+    free_watch(watcher->watches->items[i]);
+  }
+  list_free(watcher->watches);
+  free(watcher->file);
+  close(watcher->fd);
+  free(watcher);
+}
+
+int imv_watcher_fd(struct imv_watcher *watcher)
+{
+  return watcher->fd;
+}
+
+static struct watch *find_watch(struct imv_watcher *watcher, int wd)
+{
+  for (size_t i = 0; i < watcher->watches->len; ++i) {
+    struct watch *watch = watcher->watches->items[i];
+    if (watch->wd == wd) {
+      return watch;
+    }
+  }
+  return NULL;
+}
+
+static struct watch *add_watch(struct imv_watcher *watcher, const char *dir,
+    bool whole)
+{
+  /* The same directory by another name gives the same wd */
+  int wd = inotify_add_watch(watcher->fd, dir, WATCH_MASK);
+  if (wd == -1) {
+    imv_log(IMV_WARNING, "Can't watch %s: %s\n", dir, strerror(errno));
+    return NULL;
+  }
+
+  struct watch *watch = find_watch(watcher, wd);
+  if (!watch) {
+    watch = calloc(1, sizeof *watch);
+    watch->wd = wd;
+    watch->dir = strdup(dir);
+    list_append(watcher->watches, watch);
+  }
+  watch->whole = watch->whole || whole;
+  return watch;
+}
+
+/* Forgets a watch, which the kernel has already dropped if removed is set */
+static void drop_watch(struct imv_watcher *watcher, struct watch *watch,
+    bool removed)
+{
+  if (!removed) {
+    inotify_rm_watch(watcher->fd, watch->wd);
+  }
+  if (watcher->file_watch == watch) {
+    watcher->file_watch = NULL;
+  }
+  for (size_t i = 0; i < watcher->watches->len; ++i) {
+    if (watcher->watches->items[i] == watch) {
+      list_remove(watcher->watches, i);
+      break;
+    }
+  }
+  free_watch(watch);
+}
+
+void imv_watcher_watch_file(struct imv_watcher *watcher, const char *path)
+{
+  struct watch *old_watch = watcher->file_watch;
+  free(watcher->file);
+  watcher->file = NULL;
+  watcher->file_name = NULL;
+  watcher->file_watch = NULL;
+
+  if (path) {
+    watcher->file = strdup(path);
+    char *sep = strrchr(watcher->file, '/');
+    if (!sep) {
+      watcher->file_name = watcher->file;
+      watcher->file_watch = add_watch(watcher, ".", false);
+    } else {
+      watcher->file_name = sep + 1;
+      char *dir = strndup(watcher->file, sep == watcher->file ? 1 : sep - watcher->file);
+      watcher->file_watch = add_watch(watcher, dir, false);
+      free(dir);
+    }
+  }
+
+  if (old_watch && old_watch != watcher->file_watch && !old_watch->whole) {
+    drop_watch(watcher, old_watch, false);
+  }
+}
+
+bool imv_watcher_watch_dir(struct imv_watcher *watcher, const char *dir)
+{
+  return add_watch(watcher, dir, true) != NULL;
+}
+
+void imv_watcher_dispatch(struct imv_watcher *watcher,
+    imv_watch_callback callback, void *data)
+{
+  /* long, to be aligned for struct inotify_event */
+  long buf[4096 / sizeof(long)];
+
+  while (true) {
+    ssize_t len = read(watcher->fd, buf, sizeof buf);
+    if (len <= 0) {
+      break;
+    }
+
+    const char *end = (const char *)buf + len;
+    for (const char *p = (const char *)buf; p < end;) {
+      const struct inotify_event *event = (const struct inotify_event *)p;
+      p += sizeof *event + event->len;
+
+      if (event->mask & IN_Q_OVERFLOW) {
+        imv_log(IMV_WARNING, "Too many file changes to keep up with\n");
+        continue;
+      }
+
+      struct watch *watch = find_watch(watcher, event->wd);
+      if (!watch) {
+        continue;
+      }
+      if (event->mask & IN_IGNORED) {
+        drop_watch(watcher, watch, true);
+        continue;
+      }
+      if (!event->len || (event->mask & IN_ISDIR)) {
+        continue;
+      }
+
+      enum imv_watch_event type = IMV_WATCH_CHANGED;
+      if (event->mask & IN_MOVED_TO) {
+        type = IMV_WATCH_CREATED;
+      } else if (event->mask & (IN_MOVED_FROM | IN_DELETE)) {
+        type = IMV_WATCH_REMOVED;
+      }
+
+      if (watch == watcher->file_watch && !strcmp(event->name, watcher->file_name)) {
+        callback(type, watcher->file, data);
+      } else if (watch->whole) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof path, "%s/%s", watch->dir, event->name);
+        callback(type, path, data);
+      }
+    }
+  }
+}
+
+#elif defined(IMV_HAVE_KQUEUE)
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+
+/* kqueue watches open files, not names, so only the one file is watched,
+ * and opened again whenever it's replaced */
+#define WATCH_FFLAGS (NOTE_WRITE | NOTE_EXTEND | NOTE_ATTRIB | NOTE_DELETE \
+    | NOTE_RENAME)
+
+struct imv_watcher {
+  int fd;
+  char *file;
+  int file_fd;
+};
+
+struct imv_watcher *imv_watcher_create(void)
+{
+  int fd = kqueue();
+  if (fd == -1) {
+    imv_log(IMV_WARNING, "Can't watch files: %s\n", strerror(errno));
+    return NULL;
+  }
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+  struct imv_watcher *watcher = calloc(1, sizeof *watcher);
+  watcher->fd = fd;
+  watcher->file_fd = -1;
+  return watcher;
+}
+
+void imv_watcher_free(struct imv_watcher *watcher)
+{
+  if (!watcher) {
+    return;
+  }
+  if (watcher->file_fd != -1) {
+    close(watcher->file_fd);
+  }
+  free(watcher->file);
+  close(watcher->fd);
+  free(watcher);
+}
+
+int imv_watcher_fd(struct imv_watcher *watcher)
+{
+  return watcher->fd;
+}
+
+/* Opens the watched file afresh. Returns false if it's gone. */
+static bool open_file(struct imv_watcher *watcher)
+{
+  /* Closing the old file removes its event */
+  if (watcher->file_fd != -1) {
+    close(watcher->file_fd);
+    watcher->file_fd = -1;
+  }
+  if (!watcher->file) {
+    return false;
+  }
+
+  watcher->file_fd = open(watcher->file, O_RDONLY | O_CLOEXEC);
+  if (watcher->file_fd == -1) {
+    return false;
+  }
+
+  struct kevent change;
+  EV_SET(&change, watcher->file_fd, EVFILT_VNODE, EV_ADD | EV_CLEAR,
+      WATCH_FFLAGS, 0, NULL);
+  return kevent(watcher->fd, &change, 1, NULL, 0, NULL) != -1;
+}
+
+void imv_watcher_watch_file(struct imv_watcher *watcher, const char *path)
+{
+  free(watcher->file);
+  watcher->file = path ? strdup(path) : NULL;
+  open_file(watcher);
+}
+
+bool imv_watcher_watch_dir(struct imv_watcher *watcher, const char *dir)
+{
+  (void)watcher;
+  (void)dir;
+  return false;
+}
+
+void imv_watcher_dispatch(struct imv_watcher *watcher,
+    imv_watch_callback callback, void *data)
+{
+  const struct timespec no_wait = {0, 0};
+  struct kevent events[8];
+
+  int count;
+  while ((count = kevent(watcher->fd, NULL, 0, events, 8, &no_wait)) > 0) {
+    bool changed = false;
+    bool replaced = false;
+    for (int i = 0; i < count; ++i) {
+      changed = true;
+      replaced = replaced || (events[i].fflags & (NOTE_DELETE | NOTE_RENAME));
+    }
+
+    if (!changed || !watcher->file) {
+      continue;
+    }
+    if (replaced && !open_file(watcher)) {
+      callback(IMV_WATCH_REMOVED, watcher->file, data);
+    } else {
+      callback(IMV_WATCH_CHANGED, watcher->file, data);
+    }
+  }
+}
+
+#else
+
+struct imv_watcher *imv_watcher_create(void)
+{
+  return NULL;
+}
+
+void imv_watcher_free(struct imv_watcher *watcher)
+{
+  (void)watcher;
+}
+
+int imv_watcher_fd(struct imv_watcher *watcher)
+{
+  (void)watcher;
+  return -1;
+}
+
+void imv_watcher_watch_file(struct imv_watcher *watcher, const char *path)
+{
+  (void)watcher;
+  (void)path;
+}
+
+bool imv_watcher_watch_dir(struct imv_watcher *watcher, const char *dir)
+{
+  (void)watcher;
+  (void)dir;
+  return false;
+}
+
+void imv_watcher_dispatch(struct imv_watcher *watcher,
+    imv_watch_callback callback, void *data)
+{
+  (void)watcher;
+  (void)callback;
+  (void)data;
+}
+
+#endif
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
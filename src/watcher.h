@@ -0,0 +1,49 @@
+#ifndef IMV_WATCHER_H
+#define IMV_WATCHER_H
+
+#include <stdbool.h>
+
+/* Watches files and directories for changes using inotify, or kqueue where
+ * that's all there is, through a single file descriptor that can be polled
+ * alongside others. Not thread-safe.
+ */
+struct imv_watcher;
+
+enum imv_watch_event {
+  /* a file was written to, or touched */
+  IMV_WATCH_CHANGED,
+  /* a file appeared, having been moved into place */
+  IMV_WATCH_CREATED,
+  /* a file was deleted, or moved away */
+  IMV_WATCH_REMOVED,
+};
+
+typedef void (*imv_watch_callback)(enum imv_watch_event event,
+    const char *path, void *data);
+
+/* Creates a watcher. Returns NULL if the system can't watch files. */
+struct imv_watcher *imv_watcher_create(void);
+
+/* Cleans up a watcher */
+void imv_watcher_free(struct imv_watcher *watcher);
+
+/* Returns a file descriptor that becomes readable when there are events to
+ * dispatch */
+int imv_watcher_fd(struct imv_watcher *watcher);
+
+/* Watches path, in place of the file watched before. Files replaced by
+ * renaming another over them are still followed. NULL stops watching. */
+void imv_watcher_watch_file(struct imv_watcher *watcher, const char *path);
+
+/* Watches for every file in dir changing, appearing or going away. Returns
+ * false if dir can't be watched. */
+bool imv_watcher_watch_dir(struct imv_watcher *watcher, const char *dir);
+
+/* Calls callback for each event that has arrived, without blocking */
+void imv_watcher_dispatch(struct imv_watcher *watcher,
+    imv_watch_callback callback, void *data);
+
+#endif
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
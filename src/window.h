@@ -62,8 +62,19 @@ struct imv_event {
   } data;
 };
 
-/* Create a new window */
-struct imv_window *imv_window_create(int w, int h, const char *title);
+/* How a window's frames are drawn */
+enum imv_renderer {
+  /* through OpenGL if the hardware accelerates it, otherwise in software */
+  IMV_RENDERER_AUTO,
+  IMV_RENDERER_OPENGL,
+  /* into memory shared with the display server, without OpenGL */
+  IMV_RENDERER_SOFTWARE,
+};
+
+/* Create a new window. Windows that can't draw in software use OpenGL
+ * whatever renderer asks for. */
+struct imv_window *imv_window_create(int w, int h, const char *title,
+    enum imv_renderer renderer);
 
 /* Clean up an imv_window instance */
 void imv_window_free(struct imv_window *window);
@@ -96,9 +107,37 @@ void imv_window_get_mouse_position(struct imv_window *window, double *x, double
 /* Swap the framebuffers. Present anything rendered since the last call. */
 void imv_window_present(struct imv_window *window);
 
-/* Blocks until an event is received, or the timeout (in seconds) expires */
+/* Returns true if the window draws in software, into the memory given by
+ * imv_window_get_pixels, rather than through OpenGL */
+bool imv_window_is_software(struct imv_window *window);
+
+/* Gets the memory to draw the next frame into, as native-endian 32-bit
+ * pixels with the top byte ignored, stride bytes apart. The same memory is
+ * returned until imv_window_present. Returns NULL for windows that draw
+ * through OpenGL, or if there's nowhere to draw yet. */
+void *imv_window_get_pixels(struct imv_window *window, int *width, int *height,
+    int *stride);
+
+/* Returns false while the frame presented last has yet to be taken up by
+ * the display, in which case drawing another would be wasted.
+ * imv_window_wait_for_event wakes up once it's worth presenting again. */
+bool imv_window_can_present(struct imv_window *window);
+
+/* Gets the time the last frame reached the screen, on the CLOCK_MONOTONIC
+ * clock, and the time between refreshes of the display, both in seconds.
+ * presented is zero if it isn't known. Returns false if the refresh rate
+ * isn't known. */
+bool imv_window_get_refresh(struct imv_window *window, double *presented,
+    double *interval);
+
+/* Blocks until an event is received, or the timeout (in seconds) expires.
+ * A negative timeout never expires. */
 void imv_window_wait_for_event(struct imv_window *window, double timeout);
 
+/* Sets an extra file descriptor for imv_window_wait_for_event to wake up
+ * for when it becomes readable, or -1 for none */
+void imv_window_set_poll_fd(struct imv_window *window, int fd);
+
 /* Push an event to the event queue. An internal copy of the event is made.
  * Wakes up imv_window_wait_for_event */
 void imv_window_push_event(struct imv_window *window, struct imv_event *e);
@@ -1,15 +1,23 @@
 #include "window.h"
+#include "event_queue.h"
 #include "keyboard.h"
 #include "list.h"
+#include "log.h"
+#include "opengl.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <poll.h>
 #include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <time.h>
+#include <unistd.h>
 
 #include <wayland-client.h>
 #include <wayland-egl.h>
@@ -18,7 +26,9 @@
 #include <wayland-util.h>
 #include <wayland-cursor.h>
 #include <EGL/egl.h>
-#include <GL/gl.h>
+#include "fractional-scale-v1-client-protocol.h"
+#include "presentation-time-client-protocol.h"
+#include "viewporter-client-protocol.h"
 #include "xdg-shell-client-protocol.h"
 
 #define imv_min(a,b) ((a) > (b) ? (b) : (a))
@@ -48,6 +58,18 @@ struct imv_cursor {
   int32_t                hotspot_x, hotspot_y;
 };
 
+/* A buffer shared with the compositor for drawing into without OpenGL */
+struct shm_buffer {
+  struct wl_buffer *wl_buffer;
+  void *data;
+  size_t size;
+  int width;
+  int height;
+  int stride;
+  /* set while the compositor holds the buffer */
+  bool busy;
+};
+
 struct imv_window {
   struct wl_display    *wl_display;
   struct wl_registry   *wl_registry;
@@ -61,19 +83,53 @@ struct imv_window {
   struct wl_keyboard   *wl_keyboard;
   struct wl_pointer    *wl_pointer;
   struct wl_touch      *wl_touch;
+  struct wp_presentation *wp_presentation;
+  struct wp_viewporter *wp_viewporter;
+  struct wp_fractional_scale_manager_v1 *wp_fractional_scale_manager;
   EGLDisplay           egl_display;
   EGLContext           egl_context;
   EGLSurface           egl_surface;
   struct wl_egl_window *egl_window;
 
+  /* Without OpenGL, frames are drawn into two shared memory buffers in
+   * turn, one being drawn into while the compositor shows the other */
+  struct {
+    bool enabled;
+    struct shm_buffer buffers[2];
+    /* the buffer being drawn into, until it's presented */
+    struct shm_buffer *current;
+  } software;
+
   bool xdg_configured;
 
+  /* Where the compositor offers both, the window is drawn at its exact
+   * fractional scale, and the buffer scaled back to the window's size by
+   * the viewport rather than by an integer buffer scale */
+  struct wp_viewport *wp_viewport;
+  struct wp_fractional_scale_v1 *wp_fractional_scale;
+  /* the scale the compositor would have us draw at, in 120ths, or zero
+   * until it says */
+  uint32_t preferred_scale;
+
+  /* Drawing is paced by frame callbacks: after presenting, there's no point
+   * drawing again until the compositor says the frame has been used */
+  struct wl_callback *frame_callback;
+  /* feedback on the last frame presented, if the compositor gives it */
+  struct wp_presentation_feedback *feedback;
+  clockid_t presentation_clock;
+  /* when the last frame reached the screen, on the monotonic clock, and
+   * the time between refreshes of the display it was shown on, in seconds,
+   * or zero where unknown */
+  double presented;
+  double refresh;
+
   struct imv_keyboard *keyboard;
   struct imv_cursor   cursor;
   struct list         *wl_outputs;
 
   int display_fd;
-  int pipe_fds[2];
+  struct imv_event_queue *events;
+  int poll_fd;
 
   timer_t timer_id;
   int repeat_scancode; /* scancode of key to repeat */
@@ -83,7 +139,9 @@ struct imv_window {
   int width;
   int height;
   bool fullscreen;
-  int scale;
+  double scale;
+  /* the title last sent to the compositor */
+  char *title;
 
   struct {
     struct {
@@ -114,18 +172,11 @@ struct output_data {
   struct wl_output *wl_output;
   int scale;
   int pending_scale;
+  /* of the current mode, in mHz */
+  int refresh;
   bool contains_window;
 };
 
-static void set_nonblocking(int fd)
-{
-  int flags = fcntl(fd, F_GETFL);
-  assert(flags != -1);
-  flags |= O_NONBLOCK;
-  int rc = fcntl(fd, F_SETFL, flags);
-  assert(rc != -1);
-}
-
 static void handle_ping_xdg_wm_base(void *data, struct xdg_wm_base *xdg,
     uint32_t serial)
 {
@@ -733,11 +784,12 @@ static void output_mode(void *data, struct wl_output *wl_output, uint32_t flags,
     int32_t width, int32_t height, int32_t refresh)
 {
   (void)data;
-  (void)wl_output;
-  (void)flags;
   (void)width;
   (void)height;
-  (void)refresh;
+  if (flags & WL_OUTPUT_MODE_CURRENT) {
+    struct output_data *output_data = wl_output_get_user_data(wl_output);
+    output_data->refresh = refresh;
+  }
 }
 
 static void output_done(void *data, struct wl_output *wl_output)
@@ -761,6 +813,18 @@ static const struct wl_output_listener output_listener = {
   .scale = output_scale
 };
 
+static void presentation_clock_id(void *data,
+    struct wp_presentation *presentation, uint32_t clk_id)
+{
+  (void)presentation;
+  struct imv_window *window = data;
+  window->presentation_clock = clk_id;
+}
+
+static const struct wp_presentation_listener presentation_listener = {
+  .clock_id = presentation_clock_id
+};
+
 static void on_global(void *data, struct wl_registry *registry, uint32_t id,
     const char *interface, uint32_t version)
 {
@@ -790,6 +854,17 @@ static void on_global(void *data, struct wl_registry *registry, uint32_t id,
   } else if (!strcmp(interface, "wl_shm")) {
     version = imv_min(version, 2);
     window->wl_shm = wl_registry_bind(registry, id, &wl_shm_interface, version);
+  } else if (!strcmp(interface, "wp_presentation")) {
+    window->wp_presentation =
+      wl_registry_bind(registry, id, &wp_presentation_interface, 1);
+    wp_presentation_add_listener(window->wp_presentation,
+        &presentation_listener, window);
+  } else if (!strcmp(interface, "wp_viewporter")) {
+    window->wp_viewporter =
+      wl_registry_bind(registry, id, &wp_viewporter_interface, 1);
+  } else if (!strcmp(interface, "wp_fractional_scale_manager_v1")) {
+    window->wp_fractional_scale_manager = wl_registry_bind(registry, id,
+        &wp_fractional_scale_manager_v1_interface, 1);
   }
 }
 
@@ -800,43 +875,83 @@ static void on_remove_global(void *data, struct wl_registry *registry, uint32_t
   (void)id;
 }
 
+/* The size in buffer pixels of a length in surface coordinates, rounded
+ * as the fractional scale protocol says the compositor expects */
+static int buffer_length(struct imv_window *window, int length)
+{
+  return (int)(length * window->scale + 0.5);
+}
+
+/* Resizes the buffers to the window's size and scale, and lets imv know */
+static void apply_size(struct imv_window *window)
+{
+  const int buffer_width = buffer_length(window, window->width);
+  const int buffer_height = buffer_length(window, window->height);
+  if (window->egl_window) {
+    wl_egl_window_resize(window->egl_window, buffer_width, buffer_height, 0, 0);
+    glViewport(0, 0, buffer_width, buffer_height);
+  }
+  if (window->wp_viewport) {
+    wp_viewport_set_destination(window->wp_viewport,
+        window->width, window->height);
+  }
+
+  struct imv_event e = {
+    .type = IMV_EVENT_RESIZE,
+    .data = {
+      .resize = {
+        .width = window->width,
+        .height = window->height,
+        .buffer_width = buffer_width,
+        .buffer_height = buffer_height,
+        .scale = window->scale,
+      }
+    }
+  };
+  imv_window_push_event(window, &e);
+}
+
 static void update_scale(struct imv_window *window)
 {
   if (!window->xdg_configured) {
     return;
   }
-  int new_scale = 1;
-  for (size_t i = 0; i < window->wl_outputs->len; ++i) {
-    struct output_data *data = window->wl_outputs->items[i];
-    if (data->contains_window && data->scale > new_scale) {
-      new_scale = data->scale;
+  double new_scale = 1.0;
+  if (window->wp_viewport) {
+    if (window->preferred_scale) {
+      new_scale = window->preferred_scale / 120.0;
+    }
+  } else {
+    for (size_t i = 0; i < window->wl_outputs->len; ++i) {
+      struct output_data *data = window->wl_outputs->items[i];
+      if (data->contains_window && data->scale > new_scale) {
+        new_scale = data->scale;
+      }
     }
   }
 
   if (new_scale != window->scale) {
     window->scale = new_scale;
-    wl_surface_set_buffer_scale(window->wl_surface, window->scale);
-    size_t buffer_width = window->width * window->scale;
-    size_t buffer_height = window->height * window->scale;
-    wl_egl_window_resize(window->egl_window, buffer_width, buffer_height, 0, 0);
-    glViewport(0, 0, buffer_width, buffer_height);
-
-    struct imv_event e = {
-      .type = IMV_EVENT_RESIZE,
-      .data = {
-        .resize = {
-          .width = window->width,
-          .height = window->height,
-          .buffer_width = buffer_width,
-          .buffer_height = buffer_height,
-          .scale = window->scale,
-        }
-      }
-    };
-    imv_window_push_event(window, &e);
+    if (!window->wp_viewport) {
+      wl_surface_set_buffer_scale(window->wl_surface, (int)window->scale);
+    }
+    apply_size(window);
   }
 }
 
+static void fractional_scale_preferred(void *data,
+    struct wp_fractional_scale_v1 *fractional_scale, uint32_t scale)
+{
+  (void)fractional_scale;
+  struct imv_window *window = data;
+  window->preferred_scale = scale;
+  update_scale(window);
+}
+
+static const struct wp_fractional_scale_v1_listener fractional_scale_listener = {
+  .preferred_scale = fractional_scale_preferred
+};
+
 static const struct wl_registry_listener registry_listener = {
     .global = on_global,
     .global_remove = on_remove_global
@@ -896,24 +1011,7 @@ static void toplevel_configure(void *data, struct xdg_toplevel *toplevel,
       window->fullscreen = true;
     }
   }
-  size_t buffer_width = window->width * window->scale;
-  size_t buffer_height = window->height * window->scale;
-  wl_egl_window_resize(window->egl_window, buffer_width, buffer_height, 0, 0);
-  glViewport(0, 0, buffer_width, buffer_height);
-
-  struct imv_event e = {
-    .type = IMV_EVENT_RESIZE,
-    .data = {
-      .resize = {
-        .width = window->width,
-        .height = window->height,
-        .buffer_width = buffer_width,
-        .buffer_height = buffer_height,
-        .scale = window->scale,
-      }
-    }
-  };
-  imv_window_push_event(window, &e);
+  apply_size(window);
 }
 
 static void toplevel_close(void *data, struct xdg_toplevel *toplevel)
@@ -940,12 +1038,11 @@ static bool connect_to_wayland(struct imv_window *window)
   }
 
   window->display_fd = wl_display_get_fd(window->wl_display);
-  if (pipe(window->pipe_fds)) {
+  window->events = imv_event_queue_create();
+  if (!window->events) {
     wl_display_disconnect(window->wl_display);
     return false;
   }
-  set_nonblocking(window->pipe_fds[0]);
-  set_nonblocking(window->pipe_fds[1]);
 
   window->wl_registry = wl_display_get_registry(window->wl_display);
   assert(window->wl_registry);
@@ -956,15 +1053,69 @@ static bool connect_to_wayland(struct imv_window *window)
   assert(window->wl_xdg);
   assert(window->wl_seat);
 
-  window->egl_display = eglGetDisplay(window->wl_display);
-  eglInitialize(window->egl_display, NULL, NULL);
-
   return true;
 }
 
-static void create_window(struct imv_window *window, int width, int height,
-    const char *title)
+static void destroy_gl(struct imv_window *window)
 {
+  if (window->egl_display == EGL_NO_DISPLAY) {
+    return;
+  }
+  eglMakeCurrent(window->egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+      EGL_NO_CONTEXT);
+  if (window->egl_surface != EGL_NO_SURFACE) {
+    eglDestroySurface(window->egl_display, window->egl_surface);
+    window->egl_surface = EGL_NO_SURFACE;
+  }
+  if (window->egl_context != EGL_NO_CONTEXT) {
+    eglDestroyContext(window->egl_display, window->egl_context);
+    window->egl_context = EGL_NO_CONTEXT;
+  }
+  if (window->egl_window) {
+    wl_egl_window_destroy(window->egl_window);
+    window->egl_window = NULL;
+  }
+  eglTerminate(window->egl_display);
+  window->egl_display = EGL_NO_DISPLAY;
+}
+
+/* Returns whether the current context is rendered on the CPU, in which case
+ * we can do better drawing into memory ourselves */
+static bool is_software_renderer(void)
+{
+  const char *renderer = (const char *)glGetString(GL_RENDERER);
+  return renderer && (strstr(renderer, "llvmpipe")
+      || strstr(renderer, "softpipe") || strstr(renderer, "swrast")
+      || strstr(renderer, "Software"));
+}
+
+/* Sets up OpenGL rendering to the window's surface. Returns false if that's
+ * not possible, or if the renderer's left to us and there's only software
+ * OpenGL on offer. */
+static bool create_gl(struct imv_window *window, int width, int height,
+    enum imv_renderer renderer)
+{
+  window->egl_display = eglGetDisplay(window->wl_display);
+  if (window->egl_display == EGL_NO_DISPLAY
+      || !eglInitialize(window->egl_display, NULL, NULL)) {
+    window->egl_display = EGL_NO_DISPLAY;
+    return false;
+  }
+
+#ifdef IMV_GLES
+  eglBindAPI(EGL_OPENGL_ES_API);
+  EGLint attributes[] = {
+    EGL_RED_SIZE,   8,
+    EGL_GREEN_SIZE, 8,
+    EGL_BLUE_SIZE,  8,
+    EGL_RENDERABLE_TYPE, EGL_OPENGL_ES3_BIT,
+    EGL_NONE
+  };
+  EGLint context_attributes[] = {
+    EGL_CONTEXT_MAJOR_VERSION, 3,
+    EGL_NONE
+  };
+#else
   eglBindAPI(EGL_OPENGL_API);
   EGLint attributes[] = {
     EGL_RED_SIZE,   8,
@@ -972,16 +1123,59 @@ static void create_window(struct imv_window *window, int width, int height,
     EGL_BLUE_SIZE,  8,
     EGL_NONE
   };
+  EGLint *context_attributes = NULL;
+#endif
   EGLConfig config;
-  EGLint num_config;
-  eglChooseConfig(window->egl_display, attributes, &config, 1, &num_config);
-  window->egl_context = eglCreateContext(window->egl_display, config, EGL_NO_CONTEXT, NULL);
-  assert(window->egl_context);
+  EGLint num_config = 0;
+  if (!eglChooseConfig(window->egl_display, attributes, &config, 1, &num_config)
+      || num_config < 1) {
+    destroy_gl(window);
+    return false;
+  }
+  window->egl_context = eglCreateContext(window->egl_display, config,
+      EGL_NO_CONTEXT, context_attributes);
+  if (window->egl_context == EGL_NO_CONTEXT) {
+    destroy_gl(window);
+    return false;
+  }
+
+  window->egl_window = wl_egl_window_create(window->wl_surface, width, height);
+  window->egl_surface = eglCreateWindowSurface(window->egl_display, config, window->egl_window, NULL);
+  if (window->egl_surface == EGL_NO_SURFACE
+      || !eglMakeCurrent(window->egl_display, window->egl_surface,
+                         window->egl_surface, window->egl_context)) {
+    destroy_gl(window);
+    return false;
+  }
+
+  if (renderer == IMV_RENDERER_AUTO && is_software_renderer()) {
+    destroy_gl(window);
+    return false;
+  }
 
+  /* We wait for frame callbacks ourselves, between events, rather than
+   * letting eglSwapBuffers block on them */
+  eglSwapInterval(window->egl_display, 0);
+  return true;
+}
+
+static void create_window(struct imv_window *window, int width, int height,
+    const char *title, enum imv_renderer renderer)
+{
   window->wl_surface = wl_compositor_create_surface(window->wl_compositor);
   assert(window->wl_surface);
   wl_surface_add_listener(window->wl_surface, &surface_listener, window);
 
+  if (window->wp_viewporter && window->wp_fractional_scale_manager) {
+    window->wp_viewport = wp_viewporter_get_viewport(window->wp_viewporter,
+        window->wl_surface);
+    window->wp_fractional_scale =
+      wp_fractional_scale_manager_v1_get_fractional_scale(
+          window->wp_fractional_scale_manager, window->wl_surface);
+    wp_fractional_scale_v1_add_listener(window->wp_fractional_scale,
+        &fractional_scale_listener, window);
+  }
+
   window->wl_xdg_surface = xdg_wm_base_get_xdg_surface(window->wl_xdg, window->wl_surface);
   assert(window->wl_xdg_surface);
 
@@ -992,23 +1186,126 @@ static void create_window(struct imv_window *window, int width, int height,
 
   xdg_toplevel_add_listener(window->wl_xdg_toplevel, &toplevel_listener, window);
   xdg_toplevel_set_title(window->wl_xdg_toplevel, title);
+  window->title = strdup(title);
   xdg_toplevel_set_app_id(window->wl_xdg_toplevel, "imv");
 
-  window->egl_window = wl_egl_window_create(window->wl_surface, width, height);
-  window->egl_surface = eglCreateWindowSurface(window->egl_display, config, window->egl_window, NULL);
-  eglMakeCurrent(window->egl_display, window->egl_surface, window->egl_surface, window->egl_context);
+  if (renderer == IMV_RENDERER_SOFTWARE
+      || !create_gl(window, width, height, renderer)) {
+    if (renderer == IMV_RENDERER_OPENGL) {
+      imv_log(IMV_WARNING, "Failed to set up OpenGL, drawing in software\n");
+    }
+    assert(window->wl_shm);
+    window->software.enabled = true;
+  }
 
   window->width = width;
   window->height = height;
+  if (window->wp_viewport) {
+    wp_viewport_set_destination(window->wp_viewport, width, height);
+  }
 
   wl_surface_commit(window->wl_surface);
   wl_display_roundtrip(window->wl_display);
 }
 
+static void destroy_shm_buffer(struct shm_buffer *buffer)
+{
+  if (buffer->wl_buffer) {
+    wl_buffer_destroy(buffer->wl_buffer);
+    munmap(buffer->data, buffer->size);
+  }
+  memset(buffer, 0, sizeof *buffer);
+}
+
+static void buffer_release(void *data, struct wl_buffer *wl_buffer)
+{
+  (void)wl_buffer;
+  struct shm_buffer *buffer = data;
+  buffer->busy = false;
+}
+
+static const struct wl_buffer_listener buffer_listener = {
+  .release = buffer_release
+};
+
+/* Opens an anonymous shared memory file of size bytes, or returns -1 */
+static int create_shm_file(size_t size)
+{
+  static unsigned counter;
+  char name[64];
+  for (int attempt = 0; attempt < 100; ++attempt) {
+    snprintf(name, sizeof name, "/imv-%ld-%u", (long)getpid(), counter++);
+    const int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0) {
+      shm_unlink(name);
+      if (ftruncate(fd, size)) {
+        close(fd);
+        return -1;
+      }
+      return fd;
+    }
+    if (errno != EEXIST) {
+      break;
+    }
+  }
+  return -1;
+}
+
+static bool create_shm_buffer(struct imv_window *window,
+    struct shm_buffer *buffer, int width, int height)
+{
+  const int stride = width * 4;
+  const size_t size = (size_t)stride * height;
+  const int fd = create_shm_file(size);
+  if (fd < 0) {
+    return false;
+  }
+
+  void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED) {
+    close(fd);
+    return false;
+  }
+
+  struct wl_shm_pool *pool = wl_shm_create_pool(window->wl_shm, fd, size);
+  buffer->wl_buffer = wl_shm_pool_create_buffer(pool, 0, width, height,
+      stride, WL_SHM_FORMAT_XRGB8888);
+  wl_shm_pool_destroy(pool);
+  close(fd);
+
+  wl_buffer_add_listener(buffer->wl_buffer, &buffer_listener, buffer);
+  buffer->data = data;
+  buffer->size = size;
+  buffer->width = width;
+  buffer->height = height;
+  buffer->stride = stride;
+  buffer->busy = false;
+  return true;
+}
+
+/* Returns a buffer the compositor isn't holding, or NULL if it has both */
+static struct shm_buffer *free_shm_buffer(struct imv_window *window)
+{
+  for (int i = 0; i < 2; ++i) {
+    if (!window->software.buffers[i].busy) {
+      return &window->software.buffers[i];
+    }
+  }
+  return NULL;
+}
+
 static void shutdown_wayland(struct imv_window *window)
 {
-  close(window->pipe_fds[0]);
-  close(window->pipe_fds[1]);
+  imv_event_queue_free(window->events);
+  if (window->frame_callback) {
+    wl_callback_destroy(window->frame_callback);
+  }
+  if (window->feedback) {
+    wp_presentation_feedback_destroy(window->feedback);
+  }
+  if (window->wp_presentation) {
+    wp_presentation_destroy(window->wp_presentation);
+  }
   if (window->wl_touch) {
     wl_touch_destroy(window->wl_touch);
   }
@@ -1033,10 +1330,22 @@ static void shutdown_wayland(struct imv_window *window)
   if (window->wl_xdg) {
     xdg_wm_base_destroy(window->wl_xdg);
   }
-  if (window->egl_window) {
-    wl_egl_window_destroy(window->egl_window);
+  destroy_gl(window);
+  for (int i = 0; i < 2; ++i) {
+    destroy_shm_buffer(&window->software.buffers[i]);
+  }
+  if (window->wp_fractional_scale) {
+    wp_fractional_scale_v1_destroy(window->wp_fractional_scale);
+  }
+  if (window->wp_viewport) {
+    wp_viewport_destroy(window->wp_viewport);
+  }
+  if (window->wp_fractional_scale_manager) {
+    wp_fractional_scale_manager_v1_destroy(window->wp_fractional_scale_manager);
+  }
+  if (window->wp_viewporter) {
+    wp_viewporter_destroy(window->wp_viewporter);
   }
-  eglTerminate(window->egl_display);
   if (window->wl_surface) {
     wl_surface_destroy(window->wl_surface);
   }
@@ -1085,13 +1394,13 @@ static void load_cursor(struct imv_window *window)
   cursor->hotspot_y = image->hotspot_y;
 }
 
-struct imv_window *imv_window_create(int width, int height, const char *title)
+struct imv_window *imv_window_create(int width, int height, const char *title,
+    enum imv_renderer renderer)
 {
-  /* Ensure event writes will always be atomic */
-  assert(sizeof(struct imv_event) <= PIPE_BUF);
-
   struct imv_window *window = calloc(1, sizeof *window);
-  window->scale = 1;
+  window->scale = 1.0;
+  window->poll_fd = -1;
+  window->presentation_clock = CLOCK_MONOTONIC;
 
   window->keyboard = imv_keyboard_create();
   assert(window->keyboard);
@@ -1100,7 +1409,7 @@ struct imv_window *imv_window_create(int width, int height, const char *title)
   if (!connect_to_wayland(window)) {
     return NULL;
   }
-  create_window(window, width, height, title);
+  create_window(window, width, height, title, renderer);
   load_cursor(window);
 
   struct sigevent timer_handler = {
@@ -1120,15 +1429,33 @@ void imv_window_free(struct imv_window *window)
   touch_cancel(window, NULL);
   shutdown_wayland(window);
   list_deep_free(window->wl_outputs);
+  free(window->title);
   free(window);
 }
 
 void imv_window_clear(struct imv_window *window, unsigned char r,
     unsigned char g, unsigned char b)
 {
-  (void)window;
-  glClearColor(r / 255.0f, g / 255.0f, b / 255.0f, 1.0);
-  glClear(GL_COLOR_BUFFER_BIT);
+  if (!window->software.enabled) {
+    glClearColor(r / 255.0f, g / 255.0f, b / 255.0f, 1.0);
+    glClear(GL_COLOR_BUFFER_BIT);
+    return;
+  }
+
+  int width, height, stride;
+  unsigned char *pixels = imv_window_get_pixels(window, &width, &height, &stride);
+  if (!pixels || height <= 0) {
+    return;
+  }
+  /* Fill the first row, then copy it down */
+  const uint32_t color = 0xff000000u | (uint32_t)r << 16 | g << 8 | b;
+  uint32_t *row = (uint32_t *)pixels;
+  for (int x = 0; x < width; ++x) {
+    row[x] = color;
+  }
+  for (int y = 1; y < height; ++y) {
+    memcpy(pixels + (size_t)y * stride, pixels, (size_t)width * 4);
+  }
 }
 
 void imv_window_get_size(struct imv_window *window, int *w, int *h)
@@ -1144,15 +1471,20 @@ void imv_window_get_size(struct imv_window *window, int *w, int *h)
 void imv_window_get_framebuffer_size(struct imv_window *window, int *w, int *h)
 {
   if (w) {
-    *w = window->width * window->scale;
+    *w = buffer_length(window, window->width);
   }
   if (h) {
-    *h = window->height * window->scale;
+    *h = buffer_length(window, window->height);
   }
 }
 
 void imv_window_set_title(struct imv_window *window, const char *title)
 {
+  if (window->title && !strcmp(window->title, title)) {
+    return;
+  }
+  free(window->title);
+  window->title = strdup(title);
   xdg_toplevel_set_title(window->wl_xdg_toplevel, title);
 }
 
@@ -1188,18 +1520,189 @@ void imv_window_get_mouse_position(struct imv_window *window, double *x, double
   }
 }
 
+static double clock_seconds(clockid_t clock)
+{
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec + ts.tv_nsec * 0.000000001;
+}
+
+static void frame_done(void *data, struct wl_callback *callback, uint32_t time)
+{
+  (void)time;
+  struct imv_window *window = data;
+  wl_callback_destroy(callback);
+  window->frame_callback = NULL;
+
+  /* Without feedback, this is the nearest we have to knowing when the last
+   * frame was shown */
+  if (!window->wp_presentation) {
+    window->presented = clock_seconds(CLOCK_MONOTONIC);
+  }
+}
+
+static const struct wl_callback_listener frame_listener = {
+  .done = frame_done
+};
+
+static void feedback_sync_output(void *data,
+    struct wp_presentation_feedback *feedback, struct wl_output *output)
+{
+  (void)data;
+  (void)feedback;
+  (void)output;
+}
+
+static void feedback_presented(void *data,
+    struct wp_presentation_feedback *feedback,
+    uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec,
+    uint32_t refresh, uint32_t seq_hi, uint32_t seq_lo, uint32_t flags)
+{
+  (void)seq_hi;
+  (void)seq_lo;
+  (void)flags;
+  struct imv_window *window = data;
+
+  const uint64_t seconds = (uint64_t)tv_sec_hi << 32 | tv_sec_lo;
+  double presented = seconds + tv_nsec * 0.000000001;
+  if (window->presentation_clock != CLOCK_MONOTONIC) {
+    presented += clock_seconds(CLOCK_MONOTONIC)
+      - clock_seconds(window->presentation_clock);
+  }
+  window->presented = presented;
+  window->refresh = refresh * 0.000000001;
+
+  wp_presentation_feedback_destroy(feedback);
+  window->feedback = NULL;
+}
+
+static void feedback_discarded(void *data,
+    struct wp_presentation_feedback *feedback)
+{
+  struct imv_window *window = data;
+  wp_presentation_feedback_destroy(feedback);
+  window->feedback = NULL;
+}
+
+static const struct wp_presentation_feedback_listener feedback_listener = {
+  .sync_output = feedback_sync_output,
+  .presented = feedback_presented,
+  .discarded = feedback_discarded
+};
+
 void imv_window_present(struct imv_window *window)
 {
-  if (window->xdg_configured) {
+  if (!window->xdg_configured) {
+    return;
+  }
+
+  /* Both apply to the next commit, which eglSwapBuffers makes with OpenGL */
+  if (!window->frame_callback) {
+    window->frame_callback = wl_surface_frame(window->wl_surface);
+    wl_callback_add_listener(window->frame_callback, &frame_listener, window);
+  }
+  if (window->wp_presentation) {
+    if (window->feedback) {
+      wp_presentation_feedback_destroy(window->feedback);
+    }
+    window->feedback = wp_presentation_feedback(window->wp_presentation,
+        window->wl_surface);
+    wp_presentation_feedback_add_listener(window->feedback,
+        &feedback_listener, window);
+  }
+
+  if (!window->software.enabled) {
     eglSwapBuffers(window->egl_display, window->egl_surface);
+    return;
+  }
+
+  struct shm_buffer *buffer = window->software.current;
+  if (buffer) {
+    wl_surface_attach(window->wl_surface, buffer->wl_buffer, 0, 0);
+    wl_surface_damage(window->wl_surface, 0, 0, INT32_MAX, INT32_MAX);
+    buffer->busy = true;
+    window->software.current = NULL;
   }
+  wl_surface_commit(window->wl_surface);
+}
+
+bool imv_window_can_present(struct imv_window *window)
+{
+  if (window->frame_callback) {
+    return false;
+  }
+  /* In software, there has to be a buffer free to draw into. The release
+   * of one wakes imv_window_wait_for_event like the frame callback. */
+  return !window->software.enabled || window->software.current
+      || free_shm_buffer(window);
+}
+
+bool imv_window_is_software(struct imv_window *window)
+{
+  return window->software.enabled;
+}
+
+void *imv_window_get_pixels(struct imv_window *window, int *width, int *height,
+    int *stride)
+{
+  if (!window->software.enabled) {
+    return NULL;
+  }
+
+  struct shm_buffer *buffer = window->software.current;
+  if (!buffer) {
+    buffer = free_shm_buffer(window);
+    if (!buffer) {
+      return NULL;
+    }
+    const int buffer_width = buffer_length(window, window->width);
+    const int buffer_height = buffer_length(window, window->height);
+    if (buffer->width != buffer_width || buffer->height != buffer_height) {
+      destroy_shm_buffer(buffer);
+      if (!create_shm_buffer(window, buffer, buffer_width, buffer_height)) {
+        imv_log(IMV_ERROR, "Failed to create a shared memory buffer\n");
+        return NULL;
+      }
+    }
+    window->software.current = buffer;
+  }
+
+  *width = buffer->width;
+  *height = buffer->height;
+  *stride = buffer->stride;
+  return buffer->data;
+}
+
+bool imv_window_get_refresh(struct imv_window *window, double *presented,
+    double *interval)
+{
+  double refresh = window->refresh;
+  if (refresh <= 0.0) {
+    /* Fall back on the mode of the fastest output we're on */
+    int mhz = 0;
+    for (size_t i = 0; i < window->wl_outputs->len; ++i) {
+      struct output_data *data = window->wl_outputs->items[i];
+      if (data->contains_window && data->refresh > mhz) {
+        mhz = data->refresh;
+      }
+    }
+    if (mhz <= 0) {
+      return false;
+    }
+    refresh = 1000.0 / mhz;
+  }
+
+  *presented = window->presented;
+  *interval = refresh;
+  return true;
 }
 
 void imv_window_wait_for_event(struct imv_window *window, double timeout)
 {
   struct pollfd fds[] = {
     {.fd = window->display_fd,  .events = POLLIN},
-    {.fd = window->pipe_fds[0], .events = POLLIN}
+    {.fd = imv_event_queue_fd(window->events), .events = POLLIN},
+    {.fd = window->poll_fd,     .events = POLLIN}
   };
   nfds_t nfds = sizeof fds / sizeof *fds;
 
@@ -1222,26 +1725,19 @@ void imv_window_wait_for_event(struct imv_window *window, double timeout)
   }
 }
 
+void imv_window_set_poll_fd(struct imv_window *window, int fd)
+{
+  window->poll_fd = fd;
+}
+
 void imv_window_push_event(struct imv_window *window, struct imv_event *e)
 {
-  /* Push it down the pipe */
-  (void)write(window->pipe_fds[1], e, sizeof *e);
+  imv_event_queue_push(window->events, e);
 }
 
 void imv_window_pump_events(struct imv_window *window, imv_event_handler handler, void *data)
 {
   wl_display_dispatch_pending(window->wl_display);
 
-  while (1) {
-    struct imv_event e;
-    ssize_t len = read(window->pipe_fds[0], &e, sizeof e);
-    if (len <= 0) {
-      break;
-    }
-    assert(len == sizeof e);
-    if (handler) {
-      handler(data, &e);
-    }
-    cleanup_event(&e);
-  }
+  imv_event_queue_dispatch(window->events, handler, data, &cleanup_event);
 }
@@ -0,0 +1,261 @@
+#include "worker_pool.h"
+
+#include "list.h"
+#include "log.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+struct job {
+  const void *owner;
+  enum imv_job_priority priority;
+  imv_job_fn fn;
+  imv_job_fn cancel;
+  void *data;
+};
+
+struct worker {
+  struct imv_worker_pool *pool;
+  pthread_t thread;
+  /* the job this worker is currently running, if any */
+  struct job *job;
+};
+
+struct imv_worker_pool {
+  pthread_mutex_t lock;
+  /* signalled when a job is queued or finishes */
+  pthread_cond_t changed;
+  /* queued jobs, in the order they should be started */
+  struct list *queue;
+  struct worker *workers;
+  int worker_count;
+  bool quit;
+};
+
+/* Must be called with the lock held */
+static bool owner_is_running(struct imv_worker_pool *pool, const void *owner)
+{
+  for (int i = 0; i < pool->worker_count; ++i) {
+    if (pool->workers[i].job && pool->workers[i].job->owner == owner) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Removes and returns the first job in the queue that can be started right
+ * now. Must be called with the lock held */
+static struct job *take_job(struct imv_worker_pool *pool)
+{
+  for (size_t i = 0; i < pool->queue->len; ++i) {
+    struct job *job = pool->queue->items[i];
+    if (job->owner && owner_is_running(pool, job->owner)) {
+      /* it must wait its turn */
+      continue;
+    }
+
+    /* the owner's earlier jobs must run first, skipping another of theirs */
+    bool earlier_job = false;
+    for (size_t j = 0; job->owner && j < i; ++j) {
+      struct job *other = pool->queue->items[j];
+      if (other->owner == job->owner) {
+        earlier_job = true;
+        break;
+      }
+    }
+    if (earlier_job) {
+      continue;
+    }
+
+    list_remove(pool->queue, i);
+    return job;
+  }
+  return NULL;
+}
+
+static void *worker_thread(void *data)
+{
+  struct worker *worker = data;
+  struct imv_worker_pool *pool = worker->pool;
+
+  pthread_mutex_lock(&pool->lock);
+  while (true) {
+    struct job *job = take_job(pool);
+    if (job) {
+      worker->job = job;
+      pthread_mutex_unlock(&pool->lock);
+
+      job->fn(job->data);
+
+      pthread_mutex_lock(&pool->lock);
+      worker->job = NULL;
+      free(job);
+
+      /* another of this owner's jobs may now be able to start */
+      pthread_cond_broadcast(&pool->changed);
+      continue;
+    }
+
+    if (pool->quit && pool->queue->len == 0) {
+      break;
+    }
+
+    pthread_cond_wait(&pool->changed, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  return NULL;
+}
+
+struct imv_worker_pool *imv_worker_pool_create(int threads)
+{
+  if (threads <= 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cpus > 0 ? (int)cpus : 1;
+  }
+
+  struct imv_worker_pool *pool = calloc(1, sizeof *pool);
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->changed, NULL);
+  pool->queue = list_create();
+  pool->workers = calloc(threads, sizeof *pool->workers);
+
+  for (int i = 0; i < threads; ++i) {
+    struct worker *worker = &pool->workers[pool->worker_count];
+    worker->pool = pool;
+    if (pthread_create(&worker->thread, NULL, worker_thread, worker)) {
+      imv_log(IMV_ERROR, "Failed to create worker thread\n");
+      break;
+    }
+    pool->worker_count++;
+  }
+
+  if (pool->worker_count == 0) {
+    imv_worker_pool_free(pool);
+    return NULL;
+  }
+
+  return pool;
+}
+
+/* Removes the matching cancellable jobs from the queue, then cancels them
+ * without the lock held, in case they queue work of their own. */
+static void cancel_jobs(struct imv_worker_pool *pool, const void *owner, bool all)
+{
+  struct list *cancelled = list_create();
+
+  pthread_mutex_lock(&pool->lock);
+  for (size_t i = 0; i < pool->queue->len;) {
+    struct job *job = pool->queue->items[i];
+    if (job->cancel && (all || job->owner == owner)) {
+      list_remove(pool->queue, i);
+      list_append(cancelled, job);
+    } else {
+      ++i;
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  for (size_t i = 0; i < cancelled->len; ++i) {
+    struct job *job = cancelled->items[i];
+    job->cancel(job->data);
+  }
+  list_deep_free(cancelled);
+}
+
+void imv_worker_pool_free(struct imv_worker_pool *pool)
+{
+  if (!pool) {
+    return;
+  }
+
+  cancel_jobs(pool, NULL, true);
+
+  pthread_mutex_lock(&pool->lock);
+  pool->quit = true;
+  pthread_cond_broadcast(&pool->changed);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (int i = 0; i < pool->worker_count; ++i) {
+    pthread_join(pool->workers[i].thread, NULL);
+  }
+
+  list_deep_free(pool->queue);
+  free(pool->workers);
+  pthread_cond_destroy(&pool->changed);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool);
+}
+
+/* Queues a job behind every job of the same or more pressing priority. Must
+ * be called with the lock held */
+static void enqueue(struct imv_worker_pool *pool, struct job *job)
+{
+  size_t index = pool->queue->len;
+  while (index > 0) {
+    struct job *prev = pool->queue->items[index - 1];
+    if (prev->priority <= job->priority) {
+      break;
+    }
+    --index;
+  }
+  list_insert(pool->queue, index, job);
+}
+
+void imv_worker_pool_submit(struct imv_worker_pool *pool, const void *owner,
+    enum imv_job_priority priority, imv_job_fn fn, imv_job_fn cancel, void *data)
+{
+  struct job *job = calloc(1, sizeof *job);
+  job->owner = owner;
+  job->priority = priority;
+  job->fn = fn;
+  job->cancel = cancel;
+  job->data = data;
+
+  pthread_mutex_lock(&pool->lock);
+  enqueue(pool, job);
+  pthread_cond_broadcast(&pool->changed);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void imv_worker_pool_cancel(struct imv_worker_pool *pool, const void *owner)
+{
+  cancel_jobs(pool, owner, false);
+}
+
+void imv_worker_pool_set_priority(struct imv_worker_pool *pool,
+    const void *owner, enum imv_job_priority priority)
+{
+  struct list *moved = list_create();
+
+  pthread_mutex_lock(&pool->lock);
+  for (size_t i = 0; i < pool->queue->len;) {
+    struct job *job = pool->queue->items[i];
+    if (job->owner == owner) {
+      list_remove(pool->queue, i);
+      list_append(moved, job);
+    } else {
+      ++i;
+    }
+  }
+  /* requeued in their original order, so the owner's jobs stay in order */
+  for (size_t i = 0; i < moved->len; ++i) {
+    struct job *job = moved->items[i];
+    job->priority = priority;
+    enqueue(pool, job);
+  }
+  pthread_cond_broadcast(&pool->changed);
+  pthread_mutex_unlock(&pool->lock);
+
+  list_free(moved);
+}
+
+int imv_worker_pool_size(struct imv_worker_pool *pool)
+{
+  return pool->worker_count;
+}
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
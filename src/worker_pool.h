@@ -0,0 +1,49 @@
+#ifndef IMV_WORKER_POOL_H
+#define IMV_WORKER_POOL_H
+
+/* A fixed set of worker threads that run jobs from a shared queue. Each job
+ * may be given an owner: jobs with the same owner never run concurrently and
+ * run in the order they were queued, and queued jobs can be cancelled by
+ * owner.
+ */
+struct imv_worker_pool;
+
+typedef void (*imv_job_fn)(void *data);
+
+enum imv_job_priority {
+  /* work the user is waiting on */
+  IMV_JOB_NORMAL,
+  /* speculative work, only run when there's nothing more pressing */
+  IMV_JOB_BACKGROUND
+};
+
+/* Creates a pool of the given number of threads. If threads is zero or less,
+ * one thread per online CPU is used */
+struct imv_worker_pool *imv_worker_pool_create(int threads);
+
+/* Cancels all cancellable queued jobs, then waits for all remaining jobs to
+ * finish before cleaning up the pool */
+void imv_worker_pool_free(struct imv_worker_pool *pool);
+
+/* Queues fn(data) to be run on a worker. owner may be NULL. If cancel is not
+ * NULL, the job is cancellable, and cancel(data) is called in place of fn if
+ * the job is cancelled before it starts. */
+void imv_worker_pool_submit(struct imv_worker_pool *pool, const void *owner,
+    enum imv_job_priority priority, imv_job_fn fn, imv_job_fn cancel, void *data);
+
+/* Cancels all cancellable jobs queued by owner that have not started yet.
+ * The jobs' cancel functions are called from the calling thread. */
+void imv_worker_pool_cancel(struct imv_worker_pool *pool, const void *owner);
+
+/* Moves the jobs queued by owner that have not started yet to the given
+ * priority, such as when speculative work turns out to be awaited after all */
+void imv_worker_pool_set_priority(struct imv_worker_pool *pool,
+    const void *owner, enum imv_job_priority priority);
+
+/* Returns the number of worker threads in the pool */
+int imv_worker_pool_size(struct imv_worker_pool *pool);
+
+#endif
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -16,6 +16,7 @@
 #include <xcb/xcb.h>
 #include <xkbcommon/xkbcommon-x11.h>
 
+#include "event_queue.h"
 #include "keyboard.h"
 #include "log.h"
 
@@ -27,6 +28,10 @@ struct imv_window {
   Atom       x_fullscreen;
   Atom       wm_delete_window;
   Atom       wm_protocols;
+  Atom       wm_name;
+  Atom       utf8_string;
+  /* the title last set on the window */
+  char       *title;
   int width;
   int height;
   struct {
@@ -40,18 +45,10 @@ struct imv_window {
   } pointer;
 
   struct imv_keyboard *keyboard;
-  int pipe_fds[2];
+  struct imv_event_queue *events;
+  int poll_fd;
 };
 
-static void set_nonblocking(int fd)
-{
-  int flags = fcntl(fd, F_GETFL);
-  assert(flags != -1);
-  flags |= O_NONBLOCK;
-  int rc = fcntl(fd, F_SETFL, flags);
-  assert(rc != -1);
-}
-
 static void setup_keymap(struct imv_window *window)
 {
   xcb_connection_t *conn = xcb_connect(NULL, NULL);
@@ -93,17 +90,16 @@ static void setup_keymap(struct imv_window *window)
   xcb_disconnect(conn);
 }
 
-struct imv_window *imv_window_create(int w, int h, const char *title)
+struct imv_window *imv_window_create(int w, int h, const char *title,
+    enum imv_renderer renderer)
 {
-  /* Ensure event writes will always be atomic */
-  assert(sizeof(struct imv_event) <= PIPE_BUF);
-
+  (void)renderer;
   struct imv_window *window = calloc(1, sizeof *window);
   window->pointer.last.x = -1;
   window->pointer.last.y = -1;
-  (void)pipe(window->pipe_fds);
-  set_nonblocking(window->pipe_fds[0]);
-  set_nonblocking(window->pipe_fds[1]);
+  window->poll_fd = -1;
+  window->events = imv_event_queue_create();
+  assert(window->events);
 
   window->x_display = XOpenDisplay(NULL);
   if (window->x_display == NULL) {
@@ -147,6 +143,8 @@ struct imv_window *imv_window_create(int w, int h, const char *title)
   window->wm_protocols = XInternAtom(window->x_display, "WM_PROTOCOLS", false);
   window->wm_delete_window = XInternAtom(window->x_display, "WM_DELETE_WINDOW", false);
   XSetWMProtocols(window->x_display, window->x_window, &window->wm_delete_window, 1);
+  window->wm_name = XInternAtom(window->x_display, "_NET_WM_NAME", False);
+  window->utf8_string = XInternAtom(window->x_display, "UTF8_STRING", False);
   imv_window_set_title(window, title);
 
   window->x_glc = glXCreateContext(window->x_display, vi, NULL, GL_TRUE);
@@ -166,12 +164,12 @@ struct imv_window *imv_window_create(int w, int h, const char *title)
 void imv_window_free(struct imv_window *window)
 {
   imv_keyboard_free(window->keyboard);
-  close(window->pipe_fds[0]);
-  close(window->pipe_fds[1]);
+  imv_event_queue_free(window->events);
   glXMakeCurrent(window->x_display, None, NULL);
   glXDestroyContext(window->x_display, window->x_glc);
   XDestroyWindow(window->x_display, window->x_window);
   XCloseDisplay(window->x_display);
+  free(window->title);
   free(window);
 }
 
@@ -205,14 +203,16 @@ void imv_window_get_framebuffer_size(struct imv_window *window, int *w, int *h)
 
 void imv_window_set_title(struct imv_window *window, const char *title)
 {
-  Atom atom_wm_name;
-  Atom atom_utf8;
+  if (window->title && !strcmp(window->title, title)) {
+    return;
+  }
+  free(window->title);
+  window->title = strdup(title);
 
   XStoreName(window->x_display, window->x_window, title);
-  atom_wm_name = XInternAtom(window->x_display, "_NET_WM_NAME", False);
-  atom_utf8 = XInternAtom(window->x_display, "UTF8_STRING", False);
-  XChangeProperty(window->x_display, window->x_window, atom_wm_name, atom_utf8,
-      8, PropModeReplace, (unsigned char*)title, strlen(title));
+  XChangeProperty(window->x_display, window->x_window, window->wm_name,
+      window->utf8_string, 8, PropModeReplace, (unsigned char*)title,
+      strlen(title));
 }
 
 bool imv_window_is_fullscreen(struct imv_window *window)
@@ -282,21 +282,64 @@ void imv_window_present(struct imv_window *window)
   glXSwapBuffers(window->x_display, window->x_window);
 }
 
+bool imv_window_can_present(struct imv_window *window)
+{
+  (void)window;
+  return true;
+}
+
+bool imv_window_is_software(struct imv_window *window)
+{
+  (void)window;
+  return false;
+}
+
+void *imv_window_get_pixels(struct imv_window *window, int *width, int *height,
+    int *stride)
+{
+  (void)window;
+  (void)width;
+  (void)height;
+  (void)stride;
+  return NULL;
+}
+
+bool imv_window_get_refresh(struct imv_window *window, double *presented,
+    double *interval)
+{
+  (void)window;
+  (void)presented;
+  (void)interval;
+  return false;
+}
+
 void imv_window_wait_for_event(struct imv_window *window, double timeout)
 {
+  /* Xlib may have read events off the connection already, which polling
+   * it won't see, or be holding requests whose replies are awaited */
+  XFlush(window->x_display);
+  if (XPending(window->x_display)) {
+    return;
+  }
+
   struct pollfd fds[] = {
     {.fd = ConnectionNumber(window->x_display), .events = POLLIN},
-    {.fd = window->pipe_fds[0], .events = POLLIN}
+    {.fd = imv_event_queue_fd(window->events), .events = POLLIN},
+    {.fd = window->poll_fd, .events = POLLIN}
   };
   nfds_t nfds = sizeof fds / sizeof *fds;
 
   poll(fds, nfds, timeout * 1000);
 }
 
+void imv_window_set_poll_fd(struct imv_window *window, int fd)
+{
+  window->poll_fd = fd;
+}
+
 void imv_window_push_event(struct imv_window *window, struct imv_event *e)
 {
-  /* Push it down the pipe */
-  (void)write(window->pipe_fds[1], e, sizeof *e);
+  imv_event_queue_push(window->events, e);
 }
 
 static void handle_keyboard(struct imv_window *window, imv_event_handler handler, void *data, const XEvent *xev)
@@ -400,6 +443,16 @@ void imv_window_pump_events(struct imv_window *window, imv_event_handler handler
         }
       }
     } else if (xev.type == MotionNotify) {
+      /* Only the latest of a run of motion matters, as the distance moved
+       * is measured from where the pointer was last seen */
+      XEvent next;
+      while (XPending(window->x_display)) {
+        XPeekEvent(window->x_display, &next);
+        if (next.type != MotionNotify) {
+          break;
+        }
+        XNextEvent(window->x_display, &xev);
+      }
       window->pointer.current.x = xev.xmotion.x;
       window->pointer.current.y = xev.xmotion.y;
       int dx = window->pointer.current.x - window->pointer.last.x;
@@ -437,16 +490,6 @@ void imv_window_pump_events(struct imv_window *window, imv_event_handler handler
     }
   }
 
-  /* Handle any events in the pipe */
-  while (1) {
-    struct imv_event e;
-    ssize_t len = read(window->pipe_fds[0], &e, sizeof e);
-    if (len <= 0) {
-      break;
-    }
-    assert(len == sizeof e);
-    if (handler) {
-      handler(data, &e);
-    }
-  }
+  /* Handle any events pushed from elsewhere */
+  imv_event_queue_dispatch(window->events, handler, data, NULL);
 }
@@ -0,0 +1,112 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include "backend.h"
+
+static const struct imv_backend_signature signatures[] = {
+  {0, "\x89PNG", 4},
+  {4, "ftyp", 4},
+  {0, NULL, 0},
+};
+
+static const char *const extensions[] = {"svg", "svgz", NULL};
+
+static void test_backend_signatures(void **state)
+{
+  (void)state;
+
+  const struct imv_backend backend = {
+    .name = "signed",
+    .signatures = signatures,
+    .extensions = extensions,
+  };
+
+  assert_int_equal(imv_backend_match(&backend, NULL, "\x89PNG\r\n", 6),
+      BACKEND_MATCHES);
+  assert_int_equal(imv_backend_match(&backend, "a.jpg", "\0\0\0\x18" "ftypheic", 12),
+      BACKEND_MATCHES);
+
+  /* the bytes are what count, whatever the name says */
+  assert_int_equal(imv_backend_match(&backend, "a.svg", "GIF89a", 6),
+      BACKEND_NO_MATCH);
+
+  /* too short to hold the signature */
+  assert_int_equal(imv_backend_match(&backend, NULL, "\0\0\0\x18" "ft", 6),
+      BACKEND_NO_MATCH);
+  assert_int_equal(imv_backend_match(&backend, NULL, "", 0),
+      BACKEND_NO_MATCH);
+}
+
+static void test_backend_extensions(void **state)
+{
+  (void)state;
+
+  const struct imv_backend backend = {
+    .name = "unsigned",
+    .extensions = extensions,
+  };
+
+  assert_int_equal(imv_backend_match(&backend, "dir/a.svg", "<?xml", 5),
+      BACKEND_MATCHES);
+  assert_int_equal(imv_backend_match(&backend, "A.SVGZ", "\x1f\x8b", 2),
+      BACKEND_MATCHES);
+  assert_int_equal(imv_backend_match(&backend, "a.png", "<?xml", 5),
+      BACKEND_MAY_MATCH);
+  assert_int_equal(imv_backend_match(&backend, "dir.svg/a", "<?xml", 5),
+      BACKEND_MAY_MATCH);
+  assert_int_equal(imv_backend_match(&backend, NULL, "<?xml", 5),
+      BACKEND_MAY_MATCH);
+
+  const struct imv_backend catch_all = {
+    .name = "catch-all",
+  };
+  assert_int_equal(imv_backend_match(&catch_all, "a.svg", "<?xml", 5),
+      BACKEND_MAY_MATCH);
+}
+
+static int init_calls;
+
+static void count_init(void)
+{
+  ++init_calls;
+}
+
+static void test_backend_init(void **state)
+{
+  (void)state;
+
+  const struct imv_backend backend = {
+    .name = "lazy",
+    .init = &count_init,
+  };
+  const struct imv_backend other = {
+    .name = "also lazy",
+    .init = &count_init,
+  };
+  const struct imv_backend eager = {
+    .name = "nothing to set up",
+  };
+
+  assert_true(imv_backend_init(&backend));
+  assert_int_equal(init_calls, 1);
+  assert_false(imv_backend_init(&backend));
+  assert_int_equal(init_calls, 1);
+  assert_true(imv_backend_init(&other));
+  assert_int_equal(init_calls, 2);
+  assert_false(imv_backend_init(&eager));
+}
+
+int main(void)
+{
+  const struct CMUnitTest tests[] = {
+    cmocka_unit_test(test_backend_signatures),
+    cmocka_unit_test(test_backend_extensions),
+    cmocka_unit_test(test_backend_init),
+  };
+
+  return cmocka_run_group_tests(tests, NULL, NULL);
+}
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
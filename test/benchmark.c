@@ -0,0 +1,797 @@
+/* Times opening and decoding images with every backend built in, converting
+ * pixels with the vectorised kernels, and drawing images with the software
+ * canvas, over a corpus of large images it writes first. No window or GPU
+ * is needed, so it can run anywhere the tests can.
+ *
+ * Run it with `meson test --benchmark` or `ninja benchmark`, or directly as
+ *
+ *   benchmark [width height [repeats]]
+ *
+ * to choose the size of the images made. Each figure given is the best of
+ * the repeats, with the mean alongside to show how noisy it was.
+ */
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "backend.h"
+#include "canvas.h"
+#include "image.h"
+#include "mapped_file.h"
+#include "pixel.h"
+#include "source.h"
+#include "worker_pool.h"
+
+#ifdef IMV_BACKEND_LIBPNG
+#include <png.h>
+#endif
+
+#ifdef IMV_BACKEND_LIBJPEG
+#include <turbojpeg.h>
+#endif
+
+#ifdef IMV_BACKEND_LIBTIFF
+#include <tiffio.h>
+#endif
+
+#ifdef IMV_BACKEND_LIBJXL
+#include <jxl/encode.h>
+#endif
+
+#ifdef IMV_BACKEND_LIBHEIF
+#include <libheif/heif.h>
+#endif
+
+extern const struct imv_backend imv_backend_freeimage;
+extern const struct imv_backend imv_backend_libpng;
+extern const struct imv_backend imv_backend_librsvg;
+extern const struct imv_backend imv_backend_libtiff;
+extern const struct imv_backend imv_backend_libjpeg;
+extern const struct imv_backend imv_backend_libnsgif;
+extern const struct imv_backend imv_backend_libheif;
+extern const struct imv_backend imv_backend_libjxl;
+
+static const struct imv_backend *backends[] = {
+#ifdef IMV_BACKEND_FREEIMAGE
+  &imv_backend_freeimage,
+#endif
+#ifdef IMV_BACKEND_LIBTIFF
+  &imv_backend_libtiff,
+#endif
+#ifdef IMV_BACKEND_LIBPNG
+  &imv_backend_libpng,
+#endif
+#ifdef IMV_BACKEND_LIBJPEG
+  &imv_backend_libjpeg,
+#endif
+#ifdef IMV_BACKEND_LIBRSVG
+  &imv_backend_librsvg,
+#endif
+#ifdef IMV_BACKEND_LIBNSGIF
+  &imv_backend_libnsgif,
+#endif
+#ifdef IMV_BACKEND_LIBHEIF
+  &imv_backend_libheif,
+#endif
+#ifdef IMV_BACKEND_LIBJXL
+  &imv_backend_libjxl,
+#endif
+  NULL,
+};
+
+/* How many frames of an animation are decoded after the first */
+#define NEXT_FRAMES 4
+
+/* The frames of the animated GIF written */
+#define GIF_FRAMES 3
+
+/* The size of the window the canvas is timed drawing to */
+#define WINDOW_WIDTH 1920
+#define WINDOW_HEIGHT 1080
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + (double)ts.tv_nsec * 0.000000001;
+}
+
+/* Best and mean of several timings */
+struct timing {
+  double best;
+  double total;
+  int count;
+};
+
+static void add_timing(struct timing *timing, double seconds)
+{
+  if (!timing->count || seconds < timing->best) {
+    timing->best = seconds;
+  }
+  timing->total += seconds;
+  timing->count++;
+}
+
+static void print_timing(const char *stage, const char *what,
+                         const struct timing *timing, double megapixels)
+{
+  printf("%-8s %-28s best %9.2f ms  mean %9.2f ms  %8.1f MP/s\n",
+      stage, what, timing->best * 1000.0,
+      timing->total / timing->count * 1000.0, megapixels / timing->best);
+}
+
+/* Fills width x height IMV_ABGR pixels with gradients and a little noise,
+ * so that they compress about as well as a photo would. frame shifts the
+ * pattern, for the frames of an animation to differ. */
+static void make_pixels(unsigned char *rgba, int width, int height, int frame)
+{
+  uint32_t seed = 2463534242u + frame;
+  for (int y = 0; y < height; ++y) {
+    unsigned char *row = rgba + (size_t)y * width * 4;
+    for (int x = 0; x < width; ++x) {
+      seed ^= seed << 13;
+      seed ^= seed >> 17;
+      seed ^= seed << 5;
+      const int noise = (int)(seed & 15) - 8;
+      const int r = (x + frame * 32) * 255 / width + noise;
+      const int g = y * 255 / height + noise;
+      const int b = 128 + 127 * sin((x + y) * 0.01) + noise;
+      row[x * 4 + 0] = r < 0 ? 0 : r > 255 ? 255 : r;
+      row[x * 4 + 1] = g < 0 ? 0 : g > 255 ? 255 : g;
+      row[x * 4 + 2] = b < 0 ? 0 : b > 255 ? 255 : b;
+      row[x * 4 + 3] = 255;
+    }
+  }
+}
+
+#ifdef IMV_BACKEND_LIBPNG
+static bool write_png(const char *path, const unsigned char *rgba,
+                      int width, int height)
+{
+  png_image image;
+  memset(&image, 0, sizeof image);
+  image.version = PNG_IMAGE_VERSION;
+  image.width = width;
+  image.height = height;
+  image.format = PNG_FORMAT_RGBA;
+  return png_image_write_to_file(&image, path, 0, rgba, 0, NULL);
+}
+#endif
+
+#ifdef IMV_BACKEND_LIBJPEG
+static bool write_jpeg(const char *path, const unsigned char *rgba,
+                       int width, int height)
+{
+  tjhandle handle = tjInitCompress();
+  if (!handle) {
+    return false;
+  }
+
+  unsigned char *jpeg = NULL;
+  unsigned long size = 0;
+  bool ok = !tjCompress2(handle, rgba, width, 0, height, TJPF_RGBA,
+      &jpeg, &size, TJSAMP_420, 90, 0);
+  tjDestroy(handle);
+
+  if (ok) {
+    FILE *file = fopen(path, "wb");
+    ok = file && fwrite(jpeg, 1, size, file) == size;
+    if (file && fclose(file)) {
+      ok = false;
+    }
+  }
+  tjFree(jpeg);
+  return ok;
+}
+#endif
+
+#ifdef IMV_BACKEND_LIBTIFF
+/* Tiled and deflated, as big TIFFs usually are */
+static bool write_tiff(const char *path, const unsigned char *rgba,
+                       int width, int height)
+{
+  TIFF *tiff = TIFFOpen(path, "w");
+  if (!tiff) {
+    return false;
+  }
+
+  const int tile_size = 256;
+  TIFFSetField(tiff, TIFFTAG_IMAGEWIDTH, width);
+  TIFFSetField(tiff, TIFFTAG_IMAGELENGTH, height);
+  TIFFSetField(tiff, TIFFTAG_SAMPLESPERPIXEL, 4);
+  TIFFSetField(tiff, TIFFTAG_BITSPERSAMPLE, 8);
+  TIFFSetField(tiff, TIFFTAG_EXTRASAMPLES, 1, (uint16_t[]){EXTRASAMPLE_UNASSALPHA});
+  TIFFSetField(tiff, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
+  TIFFSetField(tiff, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+  TIFFSetField(tiff, TIFFTAG_COMPRESSION, COMPRESSION_ADOBE_DEFLATE);
+  TIFFSetField(tiff, TIFFTAG_TILEWIDTH, tile_size);
+  TIFFSetField(tiff, TIFFTAG_TILELENGTH, tile_size);
+
+  const size_t tile_row = (size_t)tile_size * 4;
+  unsigned char *tile = malloc(tile_row * tile_size);
+  bool ok = tile;
+  for (int ty = 0; ok && ty < height; ty += tile_size) {
+    for (int tx = 0; ok && tx < width; tx += tile_size) {
+      memset(tile, 0, tile_row * tile_size);
+      const int tile_width = width - tx < tile_size ? width - tx : tile_size;
+      for (int y = 0; y < tile_size && ty + y < height; ++y) {
+        memcpy(tile + y * tile_row,
+            rgba + ((size_t)(ty + y) * width + tx) * 4, (size_t)tile_width * 4);
+      }
+      ok = TIFFWriteTile(tiff, tile, tx, ty, 0, 0) >= 0;
+    }
+  }
+  free(tile);
+  TIFFClose(tiff);
+  return ok;
+}
+#endif
+
+#ifdef IMV_BACKEND_LIBNSGIF
+/* Bits packed into GIF's LZW stream, least significant first, and split
+ * into the sub-blocks of up to 255 bytes it's stored as */
+struct gif_writer {
+  FILE *file;
+  unsigned char block[255];
+  int block_len;
+  uint32_t bits;
+  int bit_count;
+};
+
+static void gif_put_code(struct gif_writer *writer, unsigned code, int width)
+{
+  writer->bits |= (uint32_t)code << writer->bit_count;
+  writer->bit_count += width;
+  while (writer->bit_count >= 8) {
+    writer->block[writer->block_len++] = writer->bits & 0xff;
+    writer->bits >>= 8;
+    writer->bit_count -= 8;
+    if (writer->block_len == sizeof writer->block) {
+      fputc(writer->block_len, writer->file);
+      fwrite(writer->block, 1, writer->block_len, writer->file);
+      writer->block_len = 0;
+    }
+  }
+}
+
+static void gif_put_u16(FILE *file, unsigned value)
+{
+  fputc(value & 0xff, file);
+  fputc(value >> 8, file);
+}
+
+/* An animation with a 3-3-2 palette. Its LZW data doesn't compress at all:
+ * a clear code every so often keeps codes 9 bits wide, with no dictionary
+ * to build, which is quick to write and as hard to decode as any. */
+static bool write_gif(const char *path, const unsigned char *first,
+                      int width, int height)
+{
+  FILE *file = fopen(path, "wb");
+  if (!file) {
+    return false;
+  }
+
+  fputs("GIF89a", file);
+  gif_put_u16(file, width);
+  gif_put_u16(file, height);
+  fputc(0xf7, file); /* 256 colour global palette */
+  fputc(0, file);
+  fputc(0, file);
+  for (int i = 0; i < 256; ++i) {
+    fputc((i >> 5) * 255 / 7, file);
+    fputc(((i >> 2) & 7) * 255 / 7, file);
+    fputc((i & 3) * 255 / 3, file);
+  }
+
+  /* loop forever */
+  fputs("\x21\xff\x0bNETSCAPE2.0\x03\x01", file);
+  gif_put_u16(file, 0);
+  fputc(0, file);
+
+  unsigned char *rgba = malloc((size_t)width * height * 4);
+  if (!rgba) {
+    fclose(file);
+    return false;
+  }
+
+  const unsigned clear = 256, end = 257;
+  for (int frame = 0; frame < GIF_FRAMES; ++frame) {
+    const unsigned char *pixels = first;
+    if (frame) {
+      make_pixels(rgba, width, height, frame);
+      pixels = rgba;
+    }
+
+    /* 100ms per frame */
+    fputs("\x21\xf9\x04", file);
+    fputc(0, file);
+    gif_put_u16(file, 10);
+    fputc(0, file);
+    fputc(0, file);
+
+    fputc(0x2c, file);
+    gif_put_u16(file, 0);
+    gif_put_u16(file, 0);
+    gif_put_u16(file, width);
+    gif_put_u16(file, height);
+    fputc(0, file);
+
+    fputc(8, file); /* minimum code size */
+    struct gif_writer writer = {.file = file};
+    const size_t count = (size_t)width * height;
+    for (size_t i = 0; i < count; ++i) {
+      if (i % 250 == 0) {
+        gif_put_code(&writer, clear, 9);
+      }
+      const unsigned char *p = pixels + i * 4;
+      gif_put_code(&writer, (p[0] & 0xe0) | ((p[1] >> 3) & 0x1c) | (p[2] >> 6), 9);
+    }
+    gif_put_code(&writer, end, 9);
+    gif_put_code(&writer, 0, 7); /* flush */
+    if (writer.block_len) {
+      fputc(writer.block_len, file);
+      fwrite(writer.block, 1, writer.block_len, file);
+    }
+    fputc(0, file);
+  }
+  fputc(0x3b, file);
+  free(rgba);
+
+  return !fclose(file);
+}
+#endif
+
+#ifdef IMV_BACKEND_LIBJXL
+static bool write_jxl(const char *path, const unsigned char *rgba,
+                      int width, int height)
+{
+  JxlEncoder *encoder = JxlEncoderCreate(NULL);
+  if (!encoder) {
+    return false;
+  }
+
+  JxlBasicInfo info;
+  JxlEncoderInitBasicInfo(&info);
+  info.xsize = width;
+  info.ysize = height;
+  info.bits_per_sample = 8;
+  info.num_color_channels = 3;
+  info.num_extra_channels = 1;
+  info.alpha_bits = 8;
+  info.uses_original_profile = JXL_FALSE;
+
+  JxlColorEncoding color;
+  JxlColorEncodingSetToSRGB(&color, JXL_FALSE);
+
+  const JxlPixelFormat format = {4, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0};
+  JxlEncoderFrameSettings *settings = JxlEncoderFrameSettingsCreate(encoder, NULL);
+  bool ok = JxlEncoderSetBasicInfo(encoder, &info) == JXL_ENC_SUCCESS
+    && JxlEncoderSetColorEncoding(encoder, &color) == JXL_ENC_SUCCESS
+    && JxlEncoderFrameSettingsSetOption(settings,
+        JXL_ENC_FRAME_SETTING_EFFORT, 3) == JXL_ENC_SUCCESS
+    && JxlEncoderAddImageFrame(settings, &format, rgba,
+        (size_t)width * height * 4) == JXL_ENC_SUCCESS;
+  JxlEncoderCloseInput(encoder);
+
+  size_t size = 1 << 20, used = 0;
+  unsigned char *data = ok ? malloc(size) : NULL;
+  JxlEncoderStatus status = JXL_ENC_NEED_MORE_OUTPUT;
+  while (data && status == JXL_ENC_NEED_MORE_OUTPUT) {
+    uint8_t *next = data + used;
+    size_t avail = size - used;
+    status = JxlEncoderProcessOutput(encoder, &next, &avail);
+    used = next - data;
+    if (status == JXL_ENC_NEED_MORE_OUTPUT) {
+      unsigned char *bigger = realloc(data, size * 2);
+      if (!bigger) {
+        break;
+      }
+      data = bigger;
+      size *= 2;
+    }
+  }
+  JxlEncoderDestroy(encoder);
+
+  ok = data && status == JXL_ENC_SUCCESS;
+  if (ok) {
+    FILE *file = fopen(path, "wb");
+    ok = file && fwrite(data, 1, used, file) == used;
+    if (file && fclose(file)) {
+      ok = false;
+    }
+  }
+  free(data);
+  return ok;
+}
+#endif
+
+#ifdef IMV_BACKEND_LIBHEIF
+/* Only possible with one of libheif's HEVC encoder plugins installed */
+static bool write_heic(const char *path, const unsigned char *rgba,
+                       int width, int height)
+{
+  struct heif_context *ctx = heif_context_alloc();
+  struct heif_encoder *encoder = NULL;
+  struct heif_error err = heif_context_get_encoder_for_format(ctx,
+      heif_compression_HEVC, &encoder);
+  if (err.code != heif_error_Ok) {
+    heif_context_free(ctx);
+    return false;
+  }
+  heif_encoder_set_lossy_quality(encoder, 80);
+
+  struct heif_image *image = NULL;
+  err = heif_image_create(width, height, heif_colorspace_RGB,
+      heif_chroma_interleaved_RGBA, &image);
+  if (err.code == heif_error_Ok) {
+    err = heif_image_add_plane(image, heif_channel_interleaved, width, height, 8);
+  }
+  if (err.code == heif_error_Ok) {
+    int stride;
+    uint8_t *plane = heif_image_get_plane(image, heif_channel_interleaved, &stride);
+    for (int y = 0; y < height; ++y) {
+      memcpy(plane + (size_t)y * stride, rgba + (size_t)y * width * 4,
+          (size_t)width * 4);
+    }
+    err = heif_context_encode_image(ctx, image, encoder, NULL, NULL);
+  }
+  if (err.code == heif_error_Ok) {
+    err = heif_context_write_to_file(ctx, path);
+  }
+
+  if (image) {
+    heif_image_release(image);
+  }
+  heif_encoder_release(encoder);
+  heif_context_free(ctx);
+  return err.code == heif_error_Ok;
+}
+#endif
+
+#ifdef IMV_BACKEND_LIBRSVG
+/* A few thousand overlapping shapes, to keep the rasteriser busy */
+static bool write_svg(const char *path, const unsigned char *rgba,
+                      int width, int height)
+{
+  (void)rgba;
+
+  FILE *file = fopen(path, "w");
+  if (!file) {
+    return false;
+  }
+
+  fprintf(file, "<svg xmlns=\"http://www.w3.org/2000/svg\" "
+      "width=\"%d\" height=\"%d\">\n", width, height);
+  uint32_t seed = 88172645u;
+  for (int i = 0; i < 4000; ++i) {
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    fprintf(file, "<circle cx=\"%u\" cy=\"%u\" r=\"%u\" "
+        "fill=\"#%06x\" fill-opacity=\"0.5\"/>\n",
+        seed % width, (seed >> 8) % height, 8 + (seed >> 16) % 128,
+        seed & 0xffffff);
+  }
+  fputs("</svg>\n", file);
+  return !fclose(file);
+}
+#endif
+
+/* One file of the corpus */
+struct sample {
+  char path[64];
+  const char *format;
+  int width;
+  int height;
+  /* an image decoded from it, for the canvas to draw */
+  struct imv_image *image;
+};
+
+static size_t write_corpus(const char *dir, int width, int height,
+                           struct sample *samples)
+{
+  unsigned char *rgba = malloc((size_t)width * height * 4);
+  if (!rgba) {
+    return 0;
+  }
+  make_pixels(rgba, width, height, 0);
+
+  struct {
+    const char *format;
+    bool (*write)(const char *path, const unsigned char *rgba,
+                  int width, int height);
+  } writers[] = {
+#ifdef IMV_BACKEND_LIBPNG
+    {"png", &write_png},
+#endif
+#ifdef IMV_BACKEND_LIBJPEG
+    {"jpg", &write_jpeg},
+#endif
+#ifdef IMV_BACKEND_LIBTIFF
+    {"tiff", &write_tiff},
+#endif
+#ifdef IMV_BACKEND_LIBJXL
+    {"jxl", &write_jxl},
+#endif
+#ifdef IMV_BACKEND_LIBHEIF
+    {"heic", &write_heic},
+#endif
+#ifdef IMV_BACKEND_LIBNSGIF
+    {"gif", &write_gif},
+#endif
+#ifdef IMV_BACKEND_LIBRSVG
+    {"svg", &write_svg},
+#endif
+    {NULL, NULL},
+  };
+
+  size_t count = 0;
+  for (size_t i = 0; writers[i].format; ++i) {
+    struct sample *sample = &samples[count];
+    snprintf(sample->path, sizeof sample->path, "%s/bench.%s",
+        dir, writers[i].format);
+    const double start = now();
+    if (!writers[i].write(sample->path, rgba, width, height)) {
+      printf("couldn't write a %s file, skipping it\n", writers[i].format);
+      unlink(sample->path);
+      continue;
+    }
+    printf("wrote %s in %.0f ms\n", sample->path, (now() - start) * 1000.0);
+    sample->format = writers[i].format;
+    sample->width = width;
+    sample->height = height;
+    ++count;
+  }
+  free(rgba);
+  return count;
+}
+
+/* What a source's callback collects */
+struct decoded {
+  struct imv_image *image;
+  int frames;
+  bool animated;
+};
+
+static void on_message(struct imv_source_message *message)
+{
+  struct decoded *decoded = message->user_data;
+  if (!message->image) {
+    return;
+  }
+  decoded->frames++;
+  decoded->animated = message->frametime;
+  if (decoded->image) {
+    imv_image_free(decoded->image);
+  }
+  decoded->image = message->image;
+}
+
+/* Opens and decodes the sample with backend, as imv would before showing
+ * it, along with a few more frames if it's animated. Returns the seconds
+ * taken, or a negative number if the backend couldn't. */
+static double time_decode(const struct imv_backend *backend,
+                          struct sample *sample, int *frames)
+{
+  const double start = now();
+  struct imv_source *src = NULL;
+  if (backend->open_path(sample->path, &src) != BACKEND_SUCCESS) {
+    return -1.0;
+  }
+
+  struct decoded decoded = {0};
+  imv_source_set_callback(src, &on_message, &decoded);
+  imv_source_load_first_frame(src);
+  for (int i = 0; decoded.animated && i < NEXT_FRAMES; ++i) {
+    imv_source_load_next_frame(src);
+  }
+  const double taken = now() - start;
+  imv_source_free(src);
+
+  *frames = decoded.frames;
+  if (!decoded.image) {
+    return -1.0;
+  }
+  if (!sample->image) {
+    sample->image = decoded.image;
+  } else {
+    imv_image_free(decoded.image);
+  }
+  return taken;
+}
+
+static void bench_decode(struct sample *samples, size_t count, int repeats)
+{
+  for (size_t i = 0; i < count; ++i) {
+    struct sample *sample = &samples[i];
+    unsigned char head[BACKEND_SNIFF_LEN] = {0};
+    FILE *file = fopen(sample->path, "rb");
+    const size_t head_len = file ? fread(head, 1, sizeof head, file) : 0;
+    if (file) {
+      fclose(file);
+    }
+
+    for (const struct imv_backend **backend = backends; *backend; ++backend) {
+      if (imv_backend_match(*backend, sample->path, head, head_len)
+          == BACKEND_NO_MATCH) {
+        continue;
+      }
+      imv_backend_init(*backend);
+
+      struct timing timing = {0};
+      int frames = 0;
+      for (int r = 0; r < repeats; ++r) {
+        const double taken = time_decode(*backend, sample, &frames);
+        if (taken < 0.0) {
+          break;
+        }
+        add_timing(&timing, taken);
+      }
+      if (!timing.count) {
+        continue;
+      }
+
+      char what[64];
+      snprintf(what, sizeof what, "%s %s x%d", (*backend)->name,
+          sample->format, frames);
+      print_timing("decode", what, &timing,
+          (double)sample->width * sample->height * frames / 1000000.0);
+    }
+  }
+}
+
+static void bench_convert(int width, int height, int repeats)
+{
+  const size_t count = (size_t)width * height;
+  unsigned char *src = malloc(count * 4);
+  unsigned char *dst = malloc(count * 4);
+  if (!src || !dst) {
+    free(src);
+    free(dst);
+    return;
+  }
+  make_pixels(src, width, height, 0);
+
+  const double megapixels = count / 1000000.0;
+  struct timing rgb = {0}, swap = {0}, premultiply = {0};
+  for (int r = 0; r < repeats; ++r) {
+    double start = now();
+    imv_pixel_rgb_to_rgba(dst, src, count);
+    add_timing(&rgb, now() - start);
+
+    start = now();
+    imv_pixel_swap_red_blue(dst, src, count);
+    add_timing(&swap, now() - start);
+
+    start = now();
+    imv_pixel_premultiply(dst, src, count);
+    add_timing(&premultiply, now() - start);
+  }
+  print_timing("convert", "rgb to rgba", &rgb, megapixels);
+  print_timing("convert", "swap red and blue", &swap, megapixels);
+  print_timing("convert", "premultiply", &premultiply, megapixels);
+
+  free(src);
+  free(dst);
+}
+
+struct imv_bitmap *imv_image_get_bitmap(const struct imv_image *image);
+
+/* Draws each decoded image to fit a window, as the software renderer would
+ * each frame, and then at 1:1 scale, which needs no filtering */
+static void bench_render(struct sample *samples, size_t count, int repeats)
+{
+  const int stride = WINDOW_WIDTH * 4;
+  unsigned char *pixels = malloc((size_t)stride * WINDOW_HEIGHT);
+  struct imv_canvas *canvas = imv_canvas_create(WINDOW_WIDTH, WINDOW_HEIGHT, true);
+  if (!pixels || !canvas) {
+    free(pixels);
+    return;
+  }
+  imv_canvas_set_target(canvas, pixels, WINDOW_WIDTH, WINDOW_HEIGHT, stride);
+
+  const double megapixels = (double)WINDOW_WIDTH * WINDOW_HEIGHT / 1000000.0;
+  for (size_t i = 0; i < count; ++i) {
+    /* Vectors are rasterised in the background, so can't be timed here */
+    struct imv_image *image = samples[i].image;
+    if (!image || !imv_image_get_bitmap(image)) {
+      continue;
+    }
+
+    const int width = imv_image_width(image);
+    const int height = imv_image_height(image);
+    const double fit = fmin((double)WINDOW_WIDTH / width,
+                            (double)WINDOW_HEIGHT / height);
+    const double scales[] = {fit, 1.0};
+    const char *names[] = {"fit", "1:1"};
+    for (int s = 0; s < 2; ++s) {
+      const int x = (WINDOW_WIDTH - width * scales[s]) / 2;
+      const int y = (WINDOW_HEIGHT - height * scales[s]) / 2;
+
+      /* the first draw converts the image, which later ones reuse */
+      struct timing first = {0}, timing = {0};
+      double start = now();
+      imv_canvas_draw_image(canvas, image, x, y, scales[s], 0.0, false,
+          false, UPSCALING_LINEAR);
+      add_timing(&first, now() - start);
+      for (int r = 0; r < repeats * 10; ++r) {
+        start = now();
+        imv_canvas_draw_image(canvas, image, x, y, scales[s], 0.0, false,
+            false, UPSCALING_LINEAR);
+        add_timing(&timing, now() - start);
+      }
+
+      char what[64];
+      snprintf(what, sizeof what, "%s %s first", samples[i].format, names[s]);
+      print_timing("render", what, &first, megapixels);
+      snprintf(what, sizeof what, "%s %s", samples[i].format, names[s]);
+      print_timing("render", what, &timing, megapixels);
+    }
+  }
+
+  imv_canvas_free(canvas);
+  free(pixels);
+}
+
+int main(int argc, char **argv)
+{
+  int width = 6000, height = 4000, repeats = 3;
+  if (argc >= 3) {
+    width = atoi(argv[1]);
+    height = atoi(argv[2]);
+  }
+  if (argc >= 4) {
+    repeats = atoi(argv[3]);
+  }
+  if (width <= 0 || height <= 0 || repeats <= 0) {
+    fprintf(stderr, "usage: %s [width height [repeats]]\n", argv[0]);
+    return 1;
+  }
+
+  char dir[] = "/tmp/imv-benchmark-XXXXXX";
+  if (!mkdtemp(dir)) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  struct sample samples[8];
+  memset(samples, 0, sizeof samples);
+  const size_t count = write_corpus(dir, width, height, samples);
+
+  /* Files are mapped, and sources decode with the help of the workers, as
+   * they are in imv */
+  imv_mapped_file_init();
+  struct imv_worker_pool *workers = imv_worker_pool_create(0);
+  imv_source_set_worker_pool(workers);
+
+  bench_decode(samples, count, repeats);
+  bench_convert(width, height, repeats);
+  bench_render(samples, count, repeats);
+
+  imv_source_set_worker_pool(NULL);
+  imv_worker_pool_free(workers);
+
+  for (size_t i = 0; i < count; ++i) {
+    if (samples[i].image) {
+      imv_image_free(samples[i].image);
+    }
+    unlink(samples[i].path);
+  }
+  rmdir(dir);
+
+  struct rusage usage;
+  if (!getrusage(RUSAGE_SELF, &usage)) {
+    printf("peak RSS %.1f MiB\n", usage.ru_maxrss / 1024.0);
+  }
+  return 0;
+}
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,93 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <string.h>
+#include "bitmap.h"
+#include "bitmap_pool.h"
+
+static void test_bitmap_pool_recycle(void **state)
+{
+  (void)state;
+
+  struct imv_bitmap_pool *pool = imv_bitmap_pool_create();
+  struct imv_bitmap *first = imv_bitmap_pool_get(pool, 8, 4, IMV_ABGR);
+  assert_non_null(first);
+  assert_int_equal(first->stride, 8 * 4);
+  unsigned char *data = first->data;
+  imv_bitmap_free(first);
+  assert_int_equal(imv_bitmap_pool_idle(pool), 1);
+
+  /* the same size again gets the same buffer back */
+  struct imv_bitmap *second = imv_bitmap_pool_get(pool, 8, 4, IMV_ABGR);
+  assert_true(second->data == data);
+  assert_int_equal(imv_bitmap_pool_idle(pool), 0);
+
+  /* as does one of another shape taking as many bytes */
+  imv_bitmap_free(second);
+  struct imv_bitmap *third = imv_bitmap_pool_get(pool, 4, 4, IMV_ABGR16);
+  assert_true(third->data == data);
+  assert_int_equal(third->stride, 4 * 8);
+  imv_bitmap_free(third);
+
+  imv_bitmap_pool_free(pool);
+}
+
+static void test_bitmap_pool_resize(void **state)
+{
+  (void)state;
+
+  struct imv_bitmap_pool *pool = imv_bitmap_pool_create();
+  struct imv_bitmap *small[2] = {
+    imv_bitmap_pool_get(pool, 8, 8, IMV_ABGR),
+    imv_bitmap_pool_get(pool, 8, 8, IMV_ABGR),
+  };
+  imv_bitmap_free(small[0]);
+  assert_int_equal(imv_bitmap_pool_idle(pool), 1);
+
+  /* a new size drops the buffers kept for the old one */
+  struct imv_bitmap *big = imv_bitmap_pool_get(pool, 16, 16, IMV_ABGR);
+  assert_non_null(big);
+  assert_int_equal(imv_bitmap_pool_idle(pool), 0);
+
+  /* and once buffers of the new size are kept, the old size isn't */
+  imv_bitmap_free(big);
+  assert_int_equal(imv_bitmap_pool_idle(pool), 1);
+  imv_bitmap_free(small[1]);
+  assert_int_equal(imv_bitmap_pool_idle(pool), 1);
+
+  imv_bitmap_pool_free(pool);
+}
+
+static void test_bitmap_pool_outlives_owner(void **state)
+{
+  (void)state;
+
+  struct imv_bitmap_pool *pool = imv_bitmap_pool_create();
+  struct imv_bitmap *kept = imv_bitmap_pool_get(pool, 8, 8, IMV_ABGR);
+  struct imv_bitmap *idle = imv_bitmap_pool_get(pool, 8, 8, IMV_ABGR);
+  memset(kept->data, 0x5a, (size_t)kept->stride * kept->height);
+  imv_bitmap_free(idle);
+
+  /* bitmaps still out when the owner lets go stay valid, and the pool goes
+   * with the last of them */
+  imv_bitmap_pool_free(pool);
+  assert_int_equal(kept->data[0], 0x5a);
+  assert_int_equal(kept->data[8 * 8 * 4 - 1], 0x5a);
+  memset(kept->data, 0, (size_t)kept->stride * kept->height);
+  imv_bitmap_free(kept);
+}
+
+int main(void)
+{
+  const struct CMUnitTest tests[] = {
+    cmocka_unit_test(test_bitmap_pool_recycle),
+    cmocka_unit_test(test_bitmap_pool_resize),
+    cmocka_unit_test(test_bitmap_pool_outlives_owner),
+  };
+
+  return cmocka_run_group_tests(tests, NULL, NULL);
+}
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,78 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdlib.h>
+#include <string.h>
+#include "color.h"
+
+#ifdef IMV_HAVE_LCMS2
+#include <lcms2.h>
+
+static void test_color_identity(void **state)
+{
+  (void)state;
+
+  cmsHPROFILE srgb = cmsCreate_sRGBProfile();
+  cmsUInt32Number len = 0;
+  cmsSaveProfileToMem(srgb, NULL, &len);
+  void *profile = malloc(len);
+  cmsSaveProfileToMem(srgb, profile, &len);
+  cmsCloseProfile(srgb);
+
+  /* Built on the spot without workers, and from sRGB to sRGB, every point
+   * of the table is where it started */
+  struct imv_color *color = imv_color_create(NULL, NULL, NULL);
+  const struct imv_color_lut *lut = imv_color_get_lut(color, profile, len);
+  assert_non_null(lut);
+  assert_ptr_equal(imv_color_get_lut(color, profile, len), lut);
+
+  const int size = imv_color_lut_size(lut);
+  const unsigned char *data = imv_color_lut_data(lut);
+  for (int b = 0; b < size; ++b) {
+    for (int g = 0; g < size; ++g) {
+      for (int r = 0; r < size; ++r) {
+        const unsigned char *texel = data + ((size_t)g * size * size + b * size + r) * 4;
+        assert_true(abs(texel[0] - r * 255 / (size - 1)) <= 1);
+        assert_true(abs(texel[1] - g * 255 / (size - 1)) <= 1);
+        assert_true(abs(texel[2] - b * 255 / (size - 1)) <= 1);
+        assert_int_equal(texel[3], 255);
+      }
+    }
+  }
+
+  imv_color_free(color);
+  free(profile);
+}
+#endif
+
+static void test_color_bad_profile(void **state)
+{
+  (void)state;
+
+  /* A broken profile gets no table, however often it's asked for */
+  static const char garbage[] = "not an ICC profile";
+  struct imv_color *color = imv_color_create(NULL, NULL, NULL);
+  assert_null(imv_color_get_lut(color, garbage, sizeof garbage));
+  assert_null(imv_color_get_lut(color, garbage, sizeof garbage));
+
+  /* An unreadable display profile leaves things as they were */
+  assert_false(imv_color_set_display_profile(color, "/nonexistent/display.icc"));
+  assert_true(imv_color_set_display_profile(color, NULL));
+  imv_color_free(color);
+}
+
+int main(void)
+{
+  const struct CMUnitTest tests[] = {
+#ifdef IMV_HAVE_LCMS2
+    cmocka_unit_test(test_color_identity),
+#endif
+    cmocka_unit_test(test_color_bad_profile),
+  };
+
+  return cmocka_run_group_tests(tests, NULL, NULL);
+}
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,182 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "event_queue.h"
+
+#define THREADS 4
+#define EVENTS_PER_THREAD 10000
+
+struct producer {
+  struct imv_event_queue *queue;
+  uintptr_t id;
+};
+
+static void *produce(void *data)
+{
+  struct producer *producer = data;
+  for (uintptr_t i = 0; i < EVENTS_PER_THREAD; ++i) {
+    struct imv_event e = {
+      .type = IMV_EVENT_CUSTOM,
+      .data = {
+        .custom = (void *)(producer->id * EVENTS_PER_THREAD + i)
+      }
+    };
+    imv_event_queue_push(producer->queue, &e);
+  }
+  return NULL;
+}
+
+struct received {
+  uintptr_t next[THREADS];
+  size_t count;
+  bool in_order;
+};
+
+static void receive(void *data, const struct imv_event *e)
+{
+  struct received *received = data;
+  const uintptr_t value = (uintptr_t)e->data.custom;
+  const uintptr_t id = value / EVENTS_PER_THREAD;
+  if (value % EVENTS_PER_THREAD != received->next[id]) {
+    received->in_order = false;
+  }
+  received->next[id]++;
+  received->count++;
+}
+
+static bool is_readable(int fd, int timeout)
+{
+  struct pollfd fds[] = {{.fd = fd, .events = POLLIN}};
+  return poll(fds, 1, timeout) == 1;
+}
+
+static void test_event_queue(void **state)
+{
+  (void)state;
+
+  struct imv_event_queue *queue = imv_event_queue_create();
+  assert_non_null(queue);
+  const int fd = imv_event_queue_fd(queue);
+  assert_false(is_readable(fd, 0));
+
+  pthread_t threads[THREADS];
+  struct producer producers[THREADS];
+  for (int i = 0; i < THREADS; ++i) {
+    producers[i].queue = queue;
+    producers[i].id = i;
+    assert_int_equal(pthread_create(&threads[i], NULL, produce, &producers[i]), 0);
+  }
+
+  /* every event arrives, and each thread's in the order it pushed them */
+  struct received received = {.in_order = true};
+  while (received.count < THREADS * EVENTS_PER_THREAD) {
+    assert_true(is_readable(fd, 1000));
+    imv_event_queue_dispatch(queue, &receive, &received, NULL);
+  }
+  assert_true(received.in_order);
+
+  for (int i = 0; i < THREADS; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+
+  /* nothing left, so nothing to wake up for */
+  imv_event_queue_dispatch(queue, &receive, &received, NULL);
+  assert_int_equal(received.count, THREADS * EVENTS_PER_THREAD);
+  assert_false(is_readable(fd, 0));
+
+  imv_event_queue_free(queue);
+}
+
+struct motion {
+  int count;
+  struct imv_event events[4];
+};
+
+static void record(void *data, const struct imv_event *e)
+{
+  struct motion *motion = data;
+  if (motion->count < 4) {
+    motion->events[motion->count] = *e;
+  }
+  motion->count++;
+}
+
+static void test_event_queue_coalesce(void **state)
+{
+  (void)state;
+
+  struct imv_event_queue *queue = imv_event_queue_create();
+  assert_non_null(queue);
+
+  /* runs of motion merge, but not across other events */
+  for (int i = 1; i <= 3; ++i) {
+    struct imv_event e = {
+      .type = IMV_EVENT_MOUSE_MOTION,
+      .data = {.mouse_motion = {.x = i, .y = 2 * i, .dx = 1, .dy = 2}},
+    };
+    imv_event_queue_push(queue, &e);
+  }
+  struct imv_event button = {
+    .type = IMV_EVENT_MOUSE_BUTTON,
+    .data = {.mouse_button = {.button = 1, .pressed = true}},
+  };
+  imv_event_queue_push(queue, &button);
+  for (int i = 1; i <= 2; ++i) {
+    struct imv_event e = {
+      .type = IMV_EVENT_TOUCH_ZOOM_CHANGE,
+      .data = {.touch_zoom = {.center_x = 10, .center_y = 20, .zoom = i}},
+    };
+    imv_event_queue_push(queue, &e);
+  }
+  struct imv_event motion = {
+    .type = IMV_EVENT_MOUSE_MOTION,
+    .data = {.mouse_motion = {.x = 7, .y = 8, .dx = -1, .dy = -1}},
+  };
+  imv_event_queue_push(queue, &motion);
+
+  struct motion received = {0};
+  imv_event_queue_dispatch(queue, &record, &received, NULL);
+  assert_int_equal(received.count, 4);
+
+  assert_int_equal(received.events[0].type, IMV_EVENT_MOUSE_MOTION);
+  assert_true(received.events[0].data.mouse_motion.x == 3);
+  assert_true(received.events[0].data.mouse_motion.y == 6);
+  assert_true(received.events[0].data.mouse_motion.dx == 3);
+  assert_true(received.events[0].data.mouse_motion.dy == 6);
+
+  assert_int_equal(received.events[1].type, IMV_EVENT_MOUSE_BUTTON);
+
+  /* gestures keep the latest, as they're measured from their start */
+  assert_int_equal(received.events[2].type, IMV_EVENT_TOUCH_ZOOM_CHANGE);
+  assert_true(received.events[2].data.touch_zoom.zoom == 2);
+
+  assert_int_equal(received.events[3].type, IMV_EVENT_MOUSE_MOTION);
+  assert_true(received.events[3].data.mouse_motion.dx == -1);
+
+  /* nothing merges into events already dispatched */
+  imv_event_queue_push(queue, &motion);
+  received.count = 0;
+  imv_event_queue_dispatch(queue, &record, &received, NULL);
+  assert_int_equal(received.count, 1);
+  assert_true(received.events[0].data.mouse_motion.dx == -1);
+
+  imv_event_queue_free(queue);
+}
+
+int main(void)
+{
+  const struct CMUnitTest tests[] = {
+    cmocka_unit_test(test_event_queue),
+    cmocka_unit_test(test_event_queue_coalesce),
+  };
+
+  return cmocka_run_group_tests(tests, NULL, NULL);
+}
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
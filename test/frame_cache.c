@@ -0,0 +1,123 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bitmap.h"
+#include "frame_cache.h"
+#include "memory_budget.h"
+
+static struct imv_bitmap *make_frame(int width, int height, unsigned char value)
+{
+  struct imv_bitmap *bmp = imv_bitmap_create(width, height, IMV_ABGR);
+  memset(bmp->data, value, (size_t)bmp->stride * height);
+  return bmp;
+}
+
+static void test_frame_cache_playback(void **state)
+{
+  (void)state;
+
+  struct imv_frame_cache *cache = imv_frame_cache_create(2, 1024 * 1024);
+  int frametime = 0;
+  assert_null(imv_frame_cache_get(cache, 0, &frametime));
+
+  struct imv_bitmap *first = make_frame(8, 8, 1);
+  struct imv_bitmap *second = make_frame(8, 8, 2);
+  imv_frame_cache_put(cache, 0, first, 40);
+  imv_frame_cache_put(cache, 1, second, 60);
+  const unsigned long first_id = first->id;
+  imv_bitmap_free(first);
+  imv_bitmap_free(second);
+
+  /* played back with the pixels, timing and id they were put with */
+  struct imv_bitmap *bmp = imv_frame_cache_get(cache, 0, &frametime);
+  assert_non_null(bmp);
+  assert_int_equal(frametime, 40);
+  assert_true(bmp->id == first_id);
+  assert_int_equal(bmp->data[0], 1);
+  imv_bitmap_free(bmp);
+
+  bmp = imv_frame_cache_get(cache, 1, &frametime);
+  assert_int_equal(frametime, 60);
+  assert_int_equal(bmp->data[8 * 8 * 4 - 1], 2);
+
+  /* a frame handed out outlives the cache */
+  imv_frame_cache_free(cache);
+  assert_int_equal(bmp->data[0], 2);
+  imv_bitmap_free(bmp);
+}
+
+static void test_frame_cache_budget(void **state)
+{
+  (void)state;
+
+  /* room for one 8x8 frame, but not two, so neither is kept */
+  struct imv_frame_cache *cache = imv_frame_cache_create(2, 8 * 8 * 4);
+  struct imv_bitmap *frame = make_frame(8, 8, 0);
+  int frametime;
+  imv_frame_cache_put(cache, 0, frame, 10);
+  struct imv_bitmap *kept = imv_frame_cache_get(cache, 0, &frametime);
+  assert_non_null(kept);
+  imv_frame_cache_put(cache, 1, frame, 10);
+  assert_null(imv_frame_cache_get(cache, 1, &frametime));
+  assert_null(imv_frame_cache_get(cache, 0, &frametime));
+
+  /* and once it's given up, it keeps nothing more */
+  imv_frame_cache_put(cache, 1, frame, 10);
+  assert_null(imv_frame_cache_get(cache, 1, &frametime));
+
+  /* the frame let go of while in use is still there for its user */
+  assert_int_equal(kept->data[0], 0);
+  imv_bitmap_free(kept);
+  imv_frame_cache_free(cache);
+
+  /* nor are frames kept once the viewer is out of memory */
+  cache = imv_frame_cache_create(1, 1024 * 1024);
+  imv_frame_cache_put(cache, 0, frame, 10);
+  imv_memory_set_budget(1);
+  assert_null(imv_frame_cache_get(cache, 0, &frametime));
+  imv_memory_set_budget(0);
+  imv_frame_cache_free(cache);
+  imv_bitmap_free(frame);
+}
+
+static void test_frame_cache_accounting(void **state)
+{
+  (void)state;
+
+  struct imv_frame_cache *cache = imv_frame_cache_create(1, 1024 * 1024);
+  struct imv_bitmap *frame = make_frame(8, 8, 0);
+  imv_frame_cache_put(cache, 0, frame, 10);
+  imv_bitmap_free(frame);
+
+  /* a frame handed out is counted once, as the cache's copy */
+  const size_t used = imv_memory_used();
+  int frametime;
+  struct imv_bitmap *first = imv_frame_cache_get(cache, 0, &frametime);
+  struct imv_bitmap *second = imv_frame_cache_get(cache, 0, &frametime);
+  assert_true(imv_memory_used() == used);
+  imv_bitmap_free(first);
+  assert_true(imv_memory_used() == used);
+
+  /* and the last of it goes with the last user once the cache is gone */
+  imv_frame_cache_free(cache);
+  assert_true(imv_memory_used() == used);
+  imv_bitmap_free(second);
+  assert_true(imv_memory_used() == used - 8 * 8 * 4);
+}
+
+int main(void)
+{
+  const struct CMUnitTest tests[] = {
+    cmocka_unit_test(test_frame_cache_playback),
+    cmocka_unit_test(test_frame_cache_budget),
+    cmocka_unit_test(test_frame_cache_accounting),
+  };
+
+  return cmocka_run_group_tests(tests, NULL, NULL);
+}
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,175 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bitmap.h"
+#include "image.h"
+#include "image_cache.h"
+#include "packed_image.h"
+
+struct imv_bitmap *imv_image_get_bitmap(const struct imv_image *image);
+
+static struct imv_image *make_image(int width, int height)
+{
+  struct imv_bitmap *bmp = imv_bitmap_create(width, height, IMV_ABGR);
+  return imv_image_create_from_bitmap(bmp);
+}
+
+static void test_cache_hit_and_miss(void **state)
+{
+  (void)state;
+
+  struct imv_image_cache *cache = imv_image_cache_create(1024 * 1024);
+  const struct timespec mtime = {.tv_sec = 100};
+  const struct timespec newer = {.tv_sec = 100, .tv_nsec = 1};
+
+  struct imv_image *image = make_image(16, 16);
+  imv_image_cache_put(cache, "a.png", &mtime, imv_image_ref(image));
+
+  assert_false(imv_image_cache_get(cache, "b.png", &mtime));
+  assert_true(imv_image_cache_contains(cache, "a.png", &mtime));
+
+  struct imv_image *hit = imv_image_cache_get(cache, "a.png", &mtime);
+  assert_true(hit == image);
+  imv_image_free(hit);
+
+  /* the file changed, so the entry is stale */
+  assert_false(imv_image_cache_get(cache, "a.png", &newer));
+  assert_false(imv_image_cache_contains(cache, "a.png", &mtime));
+
+  /* our own reference should have outlived the cache's */
+  assert_true(imv_image_width(image) == 16);
+  imv_image_free(image);
+
+  imv_image_cache_free(cache);
+}
+
+static void test_cache_eviction(void **state)
+{
+  (void)state;
+
+  /* room for two 16x16 images */
+  struct imv_image_cache *cache = imv_image_cache_create(2 * 16 * 16 * 4);
+  const struct timespec mtime = {.tv_sec = 1};
+
+  imv_image_cache_put(cache, "a", &mtime, make_image(16, 16));
+  imv_image_cache_put(cache, "b", &mtime, make_image(16, 16));
+
+  /* using 'a' makes 'b' the least recently used */
+  imv_image_free(imv_image_cache_get(cache, "a", &mtime));
+
+  imv_image_cache_put(cache, "c", &mtime, make_image(16, 16));
+  assert_true(imv_image_cache_contains(cache, "a", &mtime));
+  assert_false(imv_image_cache_contains(cache, "b", &mtime));
+  assert_true(imv_image_cache_contains(cache, "c", &mtime));
+
+  /* an entry larger than the whole budget is still kept on its own */
+  imv_image_cache_put(cache, "d", &mtime, make_image(64, 64));
+  assert_false(imv_image_cache_contains(cache, "a", &mtime));
+  assert_false(imv_image_cache_contains(cache, "c", &mtime));
+  assert_true(imv_image_cache_contains(cache, "d", &mtime));
+
+  imv_image_cache_set_budget(cache, 0);
+  assert_true(imv_image_cache_contains(cache, "d", &mtime));
+
+  imv_image_cache_clear(cache);
+  assert_false(imv_image_cache_contains(cache, "d", &mtime));
+
+  imv_image_cache_free(cache);
+}
+
+static void test_cache_pages(void **state)
+{
+  (void)state;
+
+  struct imv_image_cache *cache = imv_image_cache_create(1024 * 1024);
+  const struct timespec mtime = {.tv_sec = 1};
+
+  struct imv_image *first = make_image(16, 16);
+  struct imv_image *second = make_image(8, 8);
+  imv_image_cache_put(cache, "a.tiff", &mtime, imv_image_ref(first));
+  imv_image_cache_put_page(cache, "a.tiff", 1, &mtime, imv_image_ref(second));
+
+  /* pages of the one file are kept apart, page 0 being the plain entry */
+  assert_true(imv_image_cache_contains_page(cache, "a.tiff", 0, &mtime));
+  assert_false(imv_image_cache_contains_page(cache, "a.tiff", 2, &mtime));
+
+  struct imv_image *hit = imv_image_cache_get_page(cache, "a.tiff", 1, &mtime);
+  assert_true(hit == second);
+  imv_image_free(hit);
+  hit = imv_image_cache_get(cache, "a.tiff", &mtime);
+  assert_true(hit == first);
+  imv_image_free(hit);
+
+  /* replacing one page leaves the other be */
+  imv_image_cache_put_page(cache, "a.tiff", 1, &mtime, make_image(4, 4));
+  assert_true(imv_image_cache_contains(cache, "a.tiff", &mtime));
+  assert_true(imv_image_cache_size(cache) == (16 * 16 + 4 * 4) * 4);
+
+  imv_image_free(first);
+  imv_image_free(second);
+  imv_image_cache_free(cache);
+}
+
+static void test_cache_packed(void **state)
+{
+  (void)state;
+
+  struct imv_image_cache *cache = imv_image_cache_create(1024 * 1024);
+  const struct timespec mtime = {.tv_sec = 1};
+
+  struct imv_bitmap *bmp = imv_bitmap_create(16, 16, IMV_ABGR);
+  for (int i = 0; i < 16 * 16 * 4; ++i) {
+    bmp->data[i] = i % 4 == 3 ? 255 : i / 4;
+  }
+  struct imv_image *image = imv_image_create_from_scaled_bitmap(bmp, 32, 32);
+  imv_image_set_transfer(image, IMV_TRANSFER_PQ);
+
+  /* opaque pixels pack into less than they took decoded */
+  struct imv_packed_image *packed = imv_packed_image_create(image);
+  assert_non_null(packed);
+  assert_true(imv_packed_image_size(packed) < imv_image_size(image));
+  imv_image_cache_put_packed(cache, "a.png", 0, &mtime, packed);
+  assert_true(imv_image_cache_contains(cache, "a.png", &mtime));
+  assert_true(imv_image_cache_size(cache) < imv_image_size(image));
+
+  /* looking ahead leaves it packed */
+  assert_null(imv_image_cache_get_decoded(cache, "a.png", &mtime));
+
+  /* and what's unpacked is the image that was packed */
+  struct imv_image *hit = imv_image_cache_get(cache, "a.png", &mtime);
+  assert_non_null(hit);
+  assert_true(hit != image);
+  assert_int_equal(imv_image_width(hit), 32);
+  assert_int_equal(imv_image_transfer(hit), IMV_TRANSFER_PQ);
+  struct imv_bitmap *unpacked = imv_image_get_bitmap(hit);
+  assert_true(unpacked->id == bmp->id);
+  assert_memory_equal(unpacked->data, bmp->data, 16 * 16 * 4);
+  imv_image_free(hit);
+
+  /* images still decoded are looked ahead at as usual */
+  imv_image_cache_put(cache, "b.png", &mtime, imv_image_ref(image));
+  hit = imv_image_cache_get_decoded(cache, "b.png", &mtime);
+  assert_true(hit == image);
+  imv_image_free(hit);
+
+  imv_image_free(image);
+  imv_image_cache_free(cache);
+}
+
+int main(void)
+{
+  const struct CMUnitTest tests[] = {
+    cmocka_unit_test(test_cache_hit_and_miss),
+    cmocka_unit_test(test_cache_eviction),
+    cmocka_unit_test(test_cache_pages),
+    cmocka_unit_test(test_cache_packed),
+  };
+
+  return cmocka_run_group_tests(tests, NULL, NULL);
+}
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,292 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "ipc.h"
+
+struct echo {
+  struct imv_ipc *ipc;
+};
+
+/* Replies to each command with the command itself */
+static void echo(const char *command, unsigned int client, void *data)
+{
+  struct echo *echo = data;
+  char reply[8192];
+  snprintf(reply, sizeof reply, "ok %s", command);
+  imv_ipc_reply(echo->ipc, client, reply);
+}
+
+static int connect_to_self(void)
+{
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  assert_true(fd >= 0);
+
+  struct sockaddr_un desc = {
+    .sun_family = AF_UNIX
+  };
+  imv_ipc_path(desc.sun_path, sizeof desc.sun_path, getpid());
+  assert_int_equal(connect(fd, (struct sockaddr *)&desc, sizeof desc), 0);
+  return fd;
+}
+
+static void send_all(int fd, const char *text)
+{
+  size_t len = strlen(text);
+  while (len) {
+    ssize_t sent = write(fd, text, len);
+    assert_true(sent > 0);
+    text += sent;
+    len -= sent;
+  }
+}
+
+/* Reads everything until the other end hangs up */
+static char *read_all(int fd)
+{
+  size_t len = 0, cap = 4096;
+  char *buf = malloc(cap);
+  while (true) {
+    if (len + 1 == cap) {
+      cap *= 2;
+      buf = realloc(buf, cap);
+    }
+    ssize_t got = read(fd, buf + len, cap - len - 1);
+    assert_true(got >= 0);
+    if (got == 0) {
+      break;
+    }
+    len += got;
+  }
+  buf[len] = 0;
+  return buf;
+}
+
+static struct echo *start(void)
+{
+  char dir[] = "/tmp/imv-ipc-XXXXXX";
+  assert_non_null(mkdtemp(dir));
+  setenv("XDG_RUNTIME_DIR", dir, 1);
+
+  struct echo *echo_data = calloc(1, sizeof *echo_data);
+  echo_data->ipc = imv_ipc_create();
+  assert_non_null(echo_data->ipc);
+  imv_ipc_set_command_callback(echo_data->ipc, echo, echo_data);
+  return echo_data;
+}
+
+static void stop(struct echo *echo_data)
+{
+  imv_ipc_free(echo_data->ipc);
+  free(echo_data);
+  rmdir(getenv("XDG_RUNTIME_DIR"));
+}
+
+static void test_ipc_pipelined(void **state)
+{
+  (void)state;
+  struct echo *echo_data = start();
+
+  /* Many commands in one write, blank lines, surrounding whitespace and a
+   * last line with no newline, all replied to in order */
+  int fd = connect_to_self();
+  send_all(fd, "next\ngoto 3\r\n\n  zoom 50  \nget imv_loading");
+  shutdown(fd, SHUT_WR);
+
+  char *replies = read_all(fd);
+  assert_string_equal(replies,
+      "ok next\nok goto 3\nok   zoom 50\nok get imv_loading\n");
+  free(replies);
+  close(fd);
+  stop(echo_data);
+}
+
+static void test_ipc_long_lines(void **state)
+{
+  (void)state;
+  struct echo *echo_data = start();
+
+  /* Lines much longer than any one read, split across writes */
+  char command[6000];
+  memset(command, 'x', sizeof command - 1);
+  command[sizeof command - 1] = 0;
+
+  int fd = connect_to_self();
+  for (int i = 0; i < 3; ++i) {
+    send_all(fd, "open ");
+    send_all(fd, command);
+    send_all(fd, "\n");
+  }
+  shutdown(fd, SHUT_WR);
+
+  char *replies = read_all(fd);
+  char *line = replies;
+  for (int i = 0; i < 3; ++i) {
+    assert_memory_equal(line, "ok open ", 8);
+    assert_memory_equal(line + 8, command, strlen(command));
+    line += 8 + strlen(command);
+    assert_int_equal(*line++, '\n');
+  }
+  assert_int_equal(*line, 0);
+  free(replies);
+  close(fd);
+  stop(echo_data);
+}
+
+static void test_ipc_many_lines(void **state)
+{
+  (void)state;
+  struct echo *echo_data = start();
+
+  /* Far more short commands in a row than the longest a line may be */
+  const size_t count = 3 * 1024 * 1024 / 5;
+  char *commands = malloc(count * 5 + 1);
+  for (size_t i = 0; i < count; ++i) {
+    memcpy(commands + i * 5, "next\n", 5);
+  }
+  commands[count * 5] = 0;
+
+  int fd = connect_to_self();
+  send_all(fd, commands);
+  shutdown(fd, SHUT_WR);
+
+  char *replies = read_all(fd);
+  assert_int_equal(strlen(replies), count * 8);
+  assert_memory_equal(replies + (count - 1) * 8, "ok next\n", 8);
+  free(replies);
+  free(commands);
+  close(fd);
+  stop(echo_data);
+}
+
+static void test_ipc_clients(void **state)
+{
+  (void)state;
+  struct echo *echo_data = start();
+
+  /* Clients connected at once each hear only their own replies */
+  int first = connect_to_self();
+  int second = connect_to_self();
+  send_all(first, "one\n");
+  send_all(second, "two\n");
+  send_all(first, "three\n");
+  shutdown(second, SHUT_WR);
+  shutdown(first, SHUT_WR);
+
+  char *replies = read_all(second);
+  assert_string_equal(replies, "ok two\n");
+  free(replies);
+  replies = read_all(first);
+  assert_string_equal(replies, "ok one\nok three\n");
+  free(replies);
+  close(first);
+  close(second);
+
+  /* and a reply to a client that's gone goes nowhere */
+  imv_ipc_reply(echo_data->ipc, 12345, "ok");
+  stop(echo_data);
+}
+
+/* Answers commands as imv does around a wait: once one is sent, every
+ * command after it from any client is held back until the load it waits on
+ * is over */
+struct waiter {
+  struct imv_ipc *ipc;
+  pthread_mutex_t lock;
+  bool waiting;
+  unsigned int waiting_client;
+  unsigned int held[8];
+  int held_count;
+};
+
+static void wait_callback(const char *command, unsigned int client, void *data)
+{
+  struct waiter *waiter = data;
+  pthread_mutex_lock(&waiter->lock);
+  if (waiter->waiting) {
+    waiter->held[waiter->held_count++] = client;
+  } else if (!strcmp(command, "wait")) {
+    waiter->waiting = true;
+    waiter->waiting_client = client;
+  } else {
+    imv_ipc_reply(waiter->ipc, client, "ok");
+  }
+  pthread_mutex_unlock(&waiter->lock);
+}
+
+static int held_count(struct waiter *waiter)
+{
+  pthread_mutex_lock(&waiter->lock);
+  const int count = waiter->held_count;
+  pthread_mutex_unlock(&waiter->lock);
+  return count;
+}
+
+static void test_ipc_wait_failed(void **state)
+{
+  (void)state;
+  struct echo *echo_data = start();
+  struct waiter waiter = {.ipc = echo_data->ipc};
+  pthread_mutex_init(&waiter.lock, NULL);
+  imv_ipc_set_command_callback(echo_data->ipc, wait_callback, &waiter);
+
+  /* a wait on an image that fails to load, with commands behind it from
+   * both the client waiting and another */
+  int first = connect_to_self();
+  send_all(first, "open missing.png\nwait\nquit\n");
+  shutdown(first, SHUT_WR);
+  const struct timespec delay = {.tv_nsec = 1000 * 1000};
+  while (held_count(&waiter) < 1) {
+    nanosleep(&delay, NULL);
+  }
+  int second = connect_to_self();
+  send_all(second, "next\n");
+  shutdown(second, SHUT_WR);
+  while (held_count(&waiter) < 2) {
+    nanosleep(&delay, NULL);
+  }
+
+  /* the failure ends the wait with an error, and the held commands then go
+   * on to be replied to, each to its own client */
+  imv_ipc_reply(echo_data->ipc, waiter.waiting_client,
+      "error failed to load image");
+  for (int i = 0; i < waiter.held_count; ++i) {
+    imv_ipc_reply(echo_data->ipc, waiter.held[i], "ok");
+  }
+
+  char *replies = read_all(first);
+  assert_string_equal(replies, "ok\nerror failed to load image\nok\n");
+  free(replies);
+  replies = read_all(second);
+  assert_string_equal(replies, "ok\n");
+  free(replies);
+  close(first);
+  close(second);
+  pthread_mutex_destroy(&waiter.lock);
+  stop(echo_data);
+}
+
+int main(void)
+{
+  const struct CMUnitTest tests[] = {
+    cmocka_unit_test(test_ipc_pipelined),
+    cmocka_unit_test(test_ipc_long_lines),
+    cmocka_unit_test(test_ipc_many_lines),
+    cmocka_unit_test(test_ipc_clients),
+    cmocka_unit_test(test_ipc_wait_failed),
+  };
+
+  return cmocka_run_group_tests(tests, NULL, NULL);
+}
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
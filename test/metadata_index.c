@@ -0,0 +1,208 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "metadata_index.h"
+
+static void write_file(const char *dir, const char *name,
+    const unsigned char *data, size_t len)
+{
+  char path[PATH_MAX];
+  snprintf(path, sizeof path, "%s/%s", dir, name);
+  FILE *f = fopen(path, "wb");
+  assert_non_null(f);
+  assert_int_equal(fwrite(data, 1, len, f), len);
+  fclose(f);
+}
+
+/* The signature and IHDR of a 300x200 PNG */
+static const unsigned char png[] = {
+  0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n',
+  0, 0, 0, 13, 'I', 'H', 'D', 'R',
+  0, 0, 0x01, 0x2c, 0, 0, 0, 0xc8,
+  8, 6, 0, 0, 0,
+};
+
+/* A JPEG's segments up to a 640x480 frame header, after EXIF data saying
+ * it was taken at 2021:06:15 12:30:00, little endian */
+static const unsigned char jpeg[] = {
+  0xff, 0xd8,
+  /* APP1, 2 + 6 + 8 + 18 + 18 + 20 bytes */
+  0xff, 0xe1, 0, 72,
+  'E', 'x', 'i', 'f', 0, 0,
+  /* TIFF header, IFD0 at 8 */
+  'I', 'I', 42, 0, 8, 0, 0, 0,
+  /* IFD0: one entry, the EXIF IFD at 26 */
+  1, 0, 0x69, 0x87, 4, 0, 1, 0, 0, 0, 26, 0, 0, 0, 0, 0, 0, 0,
+  /* EXIF IFD: DateTimeOriginal, 20 ASCII bytes at 44 */
+  1, 0, 0x03, 0x90, 2, 0, 20, 0, 0, 0, 44, 0, 0, 0, 0, 0, 0, 0,
+  '2', '0', '2', '1', ':', '0', '6', ':', '1', '5', ' ',
+  '1', '2', ':', '3', '0', ':', '0', '0', 0,
+  /* SOF0 */
+  0xff, 0xc0, 0, 11, 8, 0x01, 0xe0, 0x02, 0x80, 1, 1, 0x11, 0,
+};
+
+static const unsigned char gif[] = {
+  'G', 'I', 'F', '8', '9', 'a', 0x10, 0, 0x20, 0, 0, 0, 0,
+};
+
+static int64_t expected_taken(void)
+{
+  struct tm tm = {
+    .tm_year = 121, .tm_mon = 5, .tm_mday = 15,
+    .tm_hour = 12, .tm_min = 30, .tm_isdst = -1,
+  };
+  return mktime(&tm);
+}
+
+static void test_file_info(void **state)
+{
+  (void)state;
+
+  char dir[] = "/tmp/imv-metadata-XXXXXX";
+  assert_non_null(mkdtemp(dir));
+  write_file(dir, "a.png", png, sizeof png);
+  write_file(dir, "b.jpg", jpeg, sizeof jpeg);
+  write_file(dir, "c.gif", gif, sizeof gif);
+  write_file(dir, "d.txt", (const unsigned char *)"text", 4);
+
+  char path[PATH_MAX];
+  struct imv_file_info info;
+  snprintf(path, sizeof path, "%s/a.png", dir);
+  assert_true(imv_file_info_read(path, &info));
+  assert_int_equal(info.size, sizeof png);
+  assert_int_equal(info.width, 300);
+  assert_int_equal(info.height, 200);
+  assert_int_equal(info.taken, 0);
+
+  snprintf(path, sizeof path, "%s/b.jpg", dir);
+  assert_true(imv_file_info_read(path, &info));
+  assert_int_equal(info.width, 640);
+  assert_int_equal(info.height, 480);
+  assert_int_equal(info.taken, expected_taken());
+
+  snprintf(path, sizeof path, "%s/c.gif", dir);
+  assert_true(imv_file_info_read(path, &info));
+  assert_int_equal(info.width, 16);
+  assert_int_equal(info.height, 32);
+
+  /* anything else has only its status */
+  snprintf(path, sizeof path, "%s/d.txt", dir);
+  assert_true(imv_file_info_read(path, &info));
+  assert_int_equal(info.size, 4);
+  assert_int_equal(info.width, 0);
+
+  snprintf(path, sizeof path, "%s/missing", dir);
+  assert_false(imv_file_info_read(path, &info));
+
+  char command[PATH_MAX + 16];
+  snprintf(command, sizeof command, "rm -rf %s", dir);
+  assert_int_equal(system(command), 0);
+}
+
+static int notified;
+
+static void count_notify(void *data)
+{
+  (void)data;
+  notified++;
+}
+
+static size_t count_files(const char *dir)
+{
+  size_t count = 0;
+  DIR *d = opendir(dir);
+  struct dirent *entry;
+  while ((entry = readdir(d))) {
+    count += entry->d_name[0] != '.';
+  }
+  closedir(d);
+  return count;
+}
+
+static void test_index(void **state)
+{
+  (void)state;
+
+  char dir[] = "/tmp/imv-metadata-XXXXXX";
+  assert_non_null(mkdtemp(dir));
+  char images[PATH_MAX], cache[PATH_MAX];
+  snprintf(images, sizeof images, "%s/images", dir);
+  snprintf(cache, sizeof cache, "%s/cache", dir);
+  assert_int_equal(mkdir(images, 0700), 0);
+  write_file(images, "a.png", png, sizeof png);
+  write_file(images, "b.jpg", jpeg, sizeof jpeg);
+
+  /* without workers, a directory's read the first time it's asked about */
+  char path[PATH_MAX];
+  struct imv_file_info info;
+  struct imv_metadata_index *index =
+    imv_metadata_index_create(cache, NULL, &count_notify, NULL);
+  snprintf(path, sizeof path, "%s/b.jpg", images);
+  assert_true(imv_metadata_index_get(index, path, &info));
+  assert_int_equal(info.width, 640);
+  assert_int_equal(notified, 1);
+  snprintf(path, sizeof path, "%s/a.png", images);
+  assert_true(imv_metadata_index_get(index, path, &info));
+  assert_int_equal(info.height, 200);
+
+  /* a file unknown to a directory already read has it read again, once */
+  write_file(images, "c.gif", gif, sizeof gif);
+  snprintf(path, sizeof path, "%s/c.gif", images);
+  assert_true(imv_metadata_index_get(index, path, &info));
+  assert_int_equal(info.height, 32);
+  snprintf(path, sizeof path, "%s/d.gif", images);
+  assert_false(imv_metadata_index_get(index, path, &info));
+  write_file(images, "d.gif", gif, sizeof gif);
+  assert_false(imv_metadata_index_get(index, path, &info));
+
+  /* until it's refreshed, as when the file's seen to change */
+  imv_metadata_index_refresh(index, path);
+  assert_true(imv_metadata_index_get(index, path, &info));
+  snprintf(path, sizeof path, "%s/a.png", images);
+  write_file(images, "a.png", gif, sizeof gif);
+  imv_metadata_index_refresh(index, path);
+  assert_true(imv_metadata_index_get(index, path, &info));
+  assert_int_equal(info.width, 16);
+  snprintf(path, sizeof path, "%s/c.gif", images);
+  imv_metadata_index_free(index);
+
+  /* which leaves one file in the cache for the directory */
+  assert_int_equal(count_files(cache), 1);
+
+  /* read back next time, along with what's new */
+  notified = 0;
+  index = imv_metadata_index_create(cache, NULL, &count_notify, NULL);
+  assert_true(imv_metadata_index_get(index, path, &info));
+  assert_int_equal(info.width, 16);
+  snprintf(path, sizeof path, "%s/b.jpg", images);
+  assert_true(imv_metadata_index_get(index, path, &info));
+  assert_int_equal(info.taken, expected_taken());
+  assert_true(notified > 0);
+  imv_metadata_index_free(index);
+  assert_int_equal(count_files(cache), 1);
+
+  char command[PATH_MAX + 16];
+  snprintf(command, sizeof command, "rm -rf %s", dir);
+  assert_int_equal(system(command), 0);
+}
+
+int main(void)
+{
+  const struct CMUnitTest tests[] = {
+    cmocka_unit_test(test_file_info),
+    cmocka_unit_test(test_index),
+  };
+
+  return cmocka_run_group_tests(tests, NULL, NULL);
+}
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
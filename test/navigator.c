@@ -6,6 +6,10 @@
 #include <fcntl.h>
 #include <cmocka.h>
 #include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "navigator.h"
 
@@ -111,12 +115,192 @@ static void test_navigator_file_changed(void **state)
   imv_navigator_free(nav);
 }
 
+static void touch(const char *dir, const char *name)
+{
+  char path[PATH_MAX];
+  snprintf(path, sizeof path, "%s/%s", dir, name);
+  int fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+  assert_false(fd == -1);
+  (void)close(fd);
+}
+
+static void test_navigator_scan_order(void **state)
+{
+  (void)state;
+
+  /* realpath here, so the expected paths match what the navigator adds */
+  char tmp[] = "/tmp/imv-navigator-XXXXXX";
+  assert_non_null(mkdtemp(tmp));
+  char dir[PATH_MAX];
+  assert_non_null(realpath(tmp, dir));
+
+  char path[PATH_MAX];
+  snprintf(path, sizeof path, "%s/b", dir);
+  assert_false(mkdir(path, 0700));
+  snprintf(path, sizeof path, "%s/b/d", dir);
+  assert_false(mkdir(path, 0700));
+  touch(dir, "c");
+  touch(dir, "a");
+  touch(dir, "b/2");
+  touch(dir, "b/1");
+  touch(dir, "b/d/3");
+
+  struct imv_navigator *nav = imv_navigator_create();
+  assert_false(imv_navigator_add(nav, dir, 1));
+  /* given after the directory, so must be added after all of it */
+  snprintf(path, sizeof path, "%s/a", dir);
+  assert_false(imv_navigator_add(nav, path, 0));
+  imv_navigator_finish_scan(nav);
+  assert_false(imv_navigator_scanning(nav));
+
+  const char *expected[] = {"a", "b/1", "b/2", "b/d/3", "c", "a"};
+  assert_int_equal(imv_navigator_length(nav), 6);
+  for (size_t i = 0; i < 6; ++i) {
+    snprintf(path, sizeof path, "%s/%s", dir, expected[i]);
+    assert_string_equal(imv_navigator_at(nav, i), path);
+  }
+
+  /* without recursing, subdirectories are left out */
+  imv_navigator_remove_all(nav);
+  assert_false(imv_navigator_add(nav, dir, 0));
+  imv_navigator_finish_scan(nav);
+  assert_int_equal(imv_navigator_length(nav), 2);
+  imv_navigator_free(nav);
+
+  char command[PATH_MAX + 16];
+  snprintf(command, sizeof command, "rm -rf %s", dir);
+  assert_int_equal(system(command), 0);
+}
+
+static void test_navigator_index(void **state)
+{
+  (void)state;
+
+  char tmp[] = "/tmp/imv-navigator-XXXXXX";
+  assert_non_null(mkdtemp(tmp));
+  char dir[PATH_MAX];
+  assert_non_null(realpath(tmp, dir));
+
+  /* enough paths to fill several arena blocks and grow the index */
+  const int count = 3000;
+  char name[256], path[PATH_MAX];
+  struct imv_navigator *nav = imv_navigator_create();
+  for (int i = 0; i < count; ++i) {
+    snprintf(name, sizeof name, "%04d-%0200d", i, 0);
+    touch(dir, name);
+    snprintf(path, sizeof path, "%s/%s", dir, name);
+    assert_false(imv_navigator_add(nav, path, 0));
+  }
+  assert_int_equal(imv_navigator_length(nav), count);
+
+  /* remove every third path */
+  for (int i = 0; i < count; i += 3) {
+    snprintf(path, sizeof path, "%s/%04d-%0200d", dir, i, 0);
+    imv_navigator_remove(nav, path);
+  }
+  assert_int_equal(imv_navigator_length(nav), count - count / 3);
+
+  ssize_t expected = 0;
+  for (int i = 0; i < count; ++i) {
+    snprintf(path, sizeof path, "%s/%04d-%0200d", dir, i, 0);
+    if (i % 3 == 0) {
+      assert_int_equal(imv_navigator_find_path(nav, path), -1);
+    } else {
+      assert_int_equal(imv_navigator_find_path(nav, path), expected);
+      assert_string_equal(imv_navigator_at(nav, expected), path);
+      ++expected;
+    }
+  }
+
+  /* the first of two copies of a path is found, then the second */
+  snprintf(path, sizeof path, "%s/%04d-%0200d", dir, 1, 0);
+  assert_false(imv_navigator_add(nav, path, 0));
+  assert_int_equal(imv_navigator_find_path(nav, path), 0);
+  imv_navigator_remove(nav, path);
+  assert_int_equal(imv_navigator_find_path(nav, path), expected - 1);
+
+  imv_navigator_remove_all(nav);
+  assert_int_equal(imv_navigator_length(nav), 0);
+  assert_int_equal(imv_navigator_find_path(nav, path), -1);
+  assert_false(imv_navigator_add(nav, path, 0));
+  assert_int_equal(imv_navigator_find_path(nav, path), 0);
+  imv_navigator_free(nav);
+
+  char command[PATH_MAX + 16];
+  snprintf(command, sizeof command, "rm -rf %s", dir);
+  assert_int_equal(system(command), 0);
+}
+
+/* Sorts by the path's last character, backwards */
+static int64_t last_char_key(const char *path, void *data)
+{
+  (void)data;
+  return -path[strlen(path) - 1];
+}
+
+/* Keeps odd numbered paths */
+static bool keep_odd(const char *path, void *data)
+{
+  (void)data;
+  return (path[strlen(path) - 1] - '0') % 2;
+}
+
+static void test_navigator_sort_filter(void **state)
+{
+  (void)state;
+  struct imv_navigator *nav = imv_navigator_create();
+  /* not there, so kept as they are, and found by their names */
+  const char *paths[] = {
+    "/nonexistent/" FILENAME1, "/nonexistent/" FILENAME2,
+    "/nonexistent/" FILENAME3, "/nonexistent/" FILENAME4,
+    "/nonexistent/" FILENAME5, "/nonexistent/" FILENAME6,
+  };
+  for (size_t i = 0; i < 6; ++i) {
+    assert_false(imv_navigator_add(nav, paths[i], 0));
+  }
+  imv_navigator_select_abs(nav, 1);
+
+  /* sorted, with the same path still selected */
+  imv_navigator_sort(nav, &last_char_key, NULL);
+  for (size_t i = 0; i < 6; ++i) {
+    assert_string_equal(imv_navigator_at(nav, i), paths[5 - i]);
+  }
+  assert_int_equal(imv_navigator_index(nav), 4);
+  assert_string_equal(imv_navigator_selection(nav), paths[1]);
+
+  /* paths are still found and removed once out of order */
+  assert_int_equal(imv_navigator_find_path(nav, FILENAME5), 1);
+  imv_navigator_remove(nav, paths[4]);
+  assert_int_equal(imv_navigator_find_path(nav, FILENAME4), 1);
+  assert_int_equal(imv_navigator_find_path(nav, FILENAME5), -1);
+
+  /* and put back in the order they were added */
+  imv_navigator_sort(nav, NULL, NULL);
+  assert_string_equal(imv_navigator_at(nav, 0), paths[0]);
+  assert_string_equal(imv_navigator_at(nav, 3), paths[3]);
+  assert_string_equal(imv_navigator_at(nav, 4), paths[5]);
+  assert_string_equal(imv_navigator_selection(nav), paths[1]);
+
+  /* filtering out the current path moves on to the next one kept */
+  imv_navigator_filter(nav, &keep_odd, NULL);
+  assert_int_equal(imv_navigator_length(nav), 2);
+  assert_string_equal(imv_navigator_at(nav, 0), paths[0]);
+  assert_string_equal(imv_navigator_at(nav, 1), paths[2]);
+  assert_string_equal(imv_navigator_selection(nav), paths[2]);
+  assert_int_equal(imv_navigator_find_path(nav, FILENAME4), -1);
+  assert_int_equal(imv_navigator_find_path(nav, FILENAME3), 1);
+  imv_navigator_free(nav);
+}
+
 int main(void)
 {
   (void)test_navigator_add_remove; /* skipped for now */
   const struct CMUnitTest tests[] = {
     /* cmocka_unit_test(test_navigator_add_remove), */
     cmocka_unit_test(test_navigator_file_changed),
+    cmocka_unit_test(test_navigator_scan_order),
+    cmocka_unit_test(test_navigator_index),
+    cmocka_unit_test(test_navigator_sort_filter),
   };
 
   return cmocka_run_group_tests(tests, NULL, NULL);
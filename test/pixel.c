@@ -0,0 +1,201 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pixel.h"
+
+/* Enough pixels to fill several vectors of any width, with some left over */
+#define COUNT 75
+
+static const char *isas[] = {"avx2", "sse2", "neon", "c"};
+
+static void fill(unsigned char *buf, size_t len, unsigned seed)
+{
+  for (size_t i = 0; i < len; ++i) {
+    seed = seed * 1103515245 + 12345;
+    buf[i] = seed >> 16;
+  }
+}
+
+static void test_pixel_rgb_to_rgba(void **state)
+{
+  (void)state;
+
+  unsigned char src[COUNT * 3], dst[COUNT * 4];
+  fill(src, sizeof src, 1);
+
+  for (size_t isa = 0; isa < sizeof isas / sizeof *isas; ++isa) {
+    if (!imv_pixel_use_isa(isas[isa])) {
+      continue;
+    }
+    for (size_t count = 0; count <= COUNT; ++count) {
+      memset(dst, 0, sizeof dst);
+      imv_pixel_rgb_to_rgba(dst, src, count);
+      for (size_t i = 0; i < count; ++i) {
+        assert_memory_equal(dst + i * 4, src + i * 3, 3);
+        assert_int_equal(dst[i * 4 + 3], 0xff);
+      }
+      /* nothing past the end is touched */
+      for (size_t i = count * 4; i < sizeof dst; ++i) {
+        assert_int_equal(dst[i], 0);
+      }
+    }
+  }
+}
+
+static void test_pixel_swap_red_blue(void **state)
+{
+  (void)state;
+
+  unsigned char src[COUNT * 4], dst[COUNT * 4];
+  fill(src, sizeof src, 2);
+
+  for (size_t isa = 0; isa < sizeof isas / sizeof *isas; ++isa) {
+    if (!imv_pixel_use_isa(isas[isa])) {
+      continue;
+    }
+    imv_pixel_swap_red_blue(dst, src, COUNT);
+    for (size_t i = 0; i < COUNT; ++i) {
+      const unsigned char *s = src + i * 4, *d = dst + i * 4;
+      assert_int_equal(d[0], s[2]);
+      assert_int_equal(d[1], s[1]);
+      assert_int_equal(d[2], s[0]);
+      assert_int_equal(d[3], s[3]);
+    }
+
+    /* in place, twice over, changes nothing */
+    imv_pixel_swap_red_blue(dst, dst, COUNT);
+    assert_memory_equal(dst, src, sizeof src);
+  }
+}
+
+static void test_pixel_premultiply(void **state)
+{
+  (void)state;
+
+  unsigned char src[COUNT * 4], dst[COUNT * 4];
+  fill(src, sizeof src, 3);
+  /* make sure of the extremes */
+  src[3] = 0;
+  src[7] = 255;
+
+  for (size_t isa = 0; isa < sizeof isas / sizeof *isas; ++isa) {
+    if (!imv_pixel_use_isa(isas[isa])) {
+      continue;
+    }
+    imv_pixel_premultiply(dst, src, COUNT);
+    for (size_t i = 0; i < COUNT; ++i) {
+      const unsigned char *s = src + i * 4, *d = dst + i * 4;
+      for (int c = 0; c < 3; ++c) {
+        /* rounded to the nearest */
+        assert_int_equal(d[c], (s[c] * s[3] * 2 + 255) / 510);
+      }
+      assert_int_equal(d[3], s[3]);
+    }
+
+    memcpy(dst, src, sizeof src);
+    imv_pixel_premultiply(dst, dst, COUNT);
+    unsigned char expected[COUNT * 4];
+    imv_pixel_premultiply(expected, src, COUNT);
+    assert_memory_equal(dst, expected, sizeof dst);
+  }
+}
+
+static void test_pixel_narrow_16(void **state)
+{
+  (void)state;
+
+  uint16_t src[COUNT * 2];
+  unsigned char dst[COUNT * 2];
+  fill((unsigned char *)src, sizeof src, 4);
+
+  for (size_t isa = 0; isa < sizeof isas / sizeof *isas; ++isa) {
+    if (!imv_pixel_use_isa(isas[isa])) {
+      continue;
+    }
+    imv_pixel_narrow_16(dst, src, COUNT * 2);
+    for (size_t i = 0; i < COUNT * 2; ++i) {
+      assert_int_equal(dst[i], src[i] >> 8);
+    }
+  }
+}
+
+static void test_pixel_narrow_half(void **state)
+{
+  (void)state;
+
+  /* 1, 0.5, 0, -1, infinity, 2, NaN and the smallest subnormal */
+  const uint16_t src[] = {0x3c00, 0x3800, 0x0000, 0xbc00, 0x7c00, 0x4000, 0x7e00, 0x0001};
+  const unsigned char want[] = {255, 128, 0, 0, 255, 255, 0, 0};
+  unsigned char dst[sizeof want];
+  imv_pixel_narrow_half(dst, src, sizeof want);
+  assert_memory_equal(dst, want, sizeof want);
+
+  /* and floats come back as the same halves */
+  const float floats[] = {1.0f, 0.5f, 0.0f, -1.0f, 1e6f, 2.0f, 5.96046448e-8f, 0.1f};
+  const uint16_t halves[] = {0x3c00, 0x3800, 0x0000, 0xbc00, 0x7c00, 0x4000, 0x0001, 0x2e66};
+  uint16_t out[8];
+  imv_pixel_float_to_half(out, floats, 8);
+  assert_memory_equal(out, halves, sizeof halves);
+}
+
+static void test_pixel_rgb16_to_rgba16(void **state)
+{
+  (void)state;
+
+  /* converted in place, as backends do */
+  uint16_t data[COUNT * 4];
+  fill((unsigned char *)data, COUNT * 6, 5);
+  uint16_t copy[COUNT * 3];
+  memcpy(copy, data, sizeof copy);
+
+  imv_pixel_rgb16_to_rgba16(data, data, COUNT);
+  for (size_t i = 0; i < COUNT; ++i) {
+    assert_memory_equal(data + i * 4, copy + i * 3, 6);
+    assert_int_equal(data[i * 4 + 3], 0xffff);
+  }
+}
+
+static void test_pixel_flip_vertical(void **state)
+{
+  (void)state;
+
+  /* wider than the buffer the rows are swapped through */
+  const size_t stride = 5000, row_bytes = 4999;
+  for (int height = 0; height <= 5; ++height) {
+    unsigned char *data = malloc(stride * 5);
+    unsigned char *copy = malloc(stride * 5);
+    fill(data, stride * 5, height);
+    memcpy(copy, data, stride * 5);
+
+    imv_pixel_flip_vertical(data, stride, row_bytes, height);
+    for (int y = 0; y < height; ++y) {
+      assert_memory_equal(data + y * stride, copy + (height - 1 - y) * stride,
+          row_bytes);
+    }
+
+    free(data);
+    free(copy);
+  }
+}
+
+int main(void)
+{
+  const struct CMUnitTest tests[] = {
+    cmocka_unit_test(test_pixel_rgb_to_rgba),
+    cmocka_unit_test(test_pixel_swap_red_blue),
+    cmocka_unit_test(test_pixel_premultiply),
+    cmocka_unit_test(test_pixel_narrow_16),
+    cmocka_unit_test(test_pixel_narrow_half),
+    cmocka_unit_test(test_pixel_rgb16_to_rgba16),
+    cmocka_unit_test(test_pixel_flip_vertical),
+  };
+
+  return cmocka_run_group_tests(tests, NULL, NULL);
+}
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
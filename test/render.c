@@ -0,0 +1,99 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "bitmap.h"
+#include "image.h"
+#include "render.h"
+
+static void test_render_output_path(void **state)
+{
+  (void)state;
+
+  char buf[64];
+  assert_true(imv_render_output_path("out/%s.png", "dir/photo.jpg", buf, sizeof buf));
+  assert_string_equal(buf, "out/photo.png");
+  assert_true(imv_render_output_path("%s-%s", "a.b.c", buf, sizeof buf));
+  assert_string_equal(buf, "a.b-a.b");
+  assert_true(imv_render_output_path("%s.raw", "dir/.hidden", buf, sizeof buf));
+  assert_string_equal(buf, ".hidden.raw");
+  assert_true(imv_render_output_path("100%%/%s", "noext", buf, sizeof buf));
+  assert_string_equal(buf, "100%/noext");
+  assert_true(imv_render_output_path("-", "a.png", buf, sizeof buf));
+  assert_string_equal(buf, "-");
+
+  /* too long */
+  assert_false(imv_render_output_path("out/%s.png", "dir/photo.jpg", buf, 13));
+  assert_true(imv_render_output_path("out/%s.png", "dir/photo.jpg", buf, 14));
+}
+
+/* A width x height opaque IMV_ABGR image of a single colour */
+static struct imv_image *solid_image(int width, int height,
+                                     const unsigned char rgba[4])
+{
+  struct imv_bitmap *bitmap = imv_bitmap_create(width, height, IMV_ABGR);
+  for (int i = 0; i < width * height; ++i) {
+    memcpy(bitmap->data + i * 4, rgba, 4);
+  }
+  return imv_image_create_from_bitmap(bitmap);
+}
+
+static void test_render_image(void **state)
+{
+  (void)state;
+
+  const unsigned char colour[4] = {200, 100, 50, 255};
+  struct imv_image *image = solid_image(100, 50, colour);
+
+  /* scaled to fit 40x40, it's covered by a 40x20 surface */
+  cairo_surface_t *surface = imv_render_image(image, 0, 10, 0.4, 40, 40,
+      UPSCALING_LINEAR);
+  assert_non_null(surface);
+  assert_int_equal(cairo_image_surface_get_width(surface), 40);
+  assert_int_equal(cairo_image_surface_get_height(surface), 20);
+
+  char dir[] = "/tmp/imv-render-XXXXXX";
+  assert_non_null(mkdtemp(dir));
+  char path[64];
+  snprintf(path, sizeof path, "%s/out.raw", dir);
+  assert_true(imv_render_write(surface, path));
+  cairo_surface_destroy(surface);
+
+  unsigned char raw[40 * 20 * 4 + 1];
+  FILE *file = fopen(path, "rb");
+  assert_non_null(file);
+  assert_int_equal(fread(raw, 1, sizeof raw, file), 40 * 20 * 4);
+  fclose(file);
+  unlink(path);
+  rmdir(dir);
+  for (int i = 0; i < 40 * 20; ++i) {
+    assert_memory_equal(raw + i * 4, colour, 4);
+  }
+
+  /* cropped by the window, and not at all when outside it */
+  surface = imv_render_image(image, -30, -10, 1.0, 40, 30, UPSCALING_LINEAR);
+  assert_non_null(surface);
+  assert_int_equal(cairo_image_surface_get_width(surface), 40);
+  assert_int_equal(cairo_image_surface_get_height(surface), 30);
+  cairo_surface_destroy(surface);
+  assert_null(imv_render_image(image, 50, 50, 1.0, 40, 40, UPSCALING_LINEAR));
+
+  imv_image_free(image);
+}
+
+int main(void)
+{
+  const struct CMUnitTest tests[] = {
+    cmocka_unit_test(test_render_output_path),
+    cmocka_unit_test(test_render_image),
+  };
+
+  return cmocka_run_group_tests(tests, NULL, NULL);
+}
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
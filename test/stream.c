@@ -0,0 +1,140 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "stream.h"
+
+/* The structure of a JPEG, with a thumbnail inside its EXIF segment and
+ * both a stuffed 0xFF and a restart marker in its entropy coded data */
+static const unsigned char jpeg[] = {
+  0xFF, 0xD8,
+  0xFF, 0xE1, 0x00, 0x0A, 'E', 'x', 'i', 'f', 0xFF, 0xD8, 0xFF, 0xD9,
+  0xFF, 0xDB, 0x00, 0x04, 0x01, 0x02,
+  0xFF, 0xDA, 0x00, 0x03, 0x01,
+  0x12, 0xFF, 0x00, 0x34, 0xFF, 0xD0, 0x56,
+  0xFF, 0xFF, 0xD9,
+};
+
+/* The structure of a PNG, with a chunk holding what could be taken for
+ * a JPEG's end */
+static const unsigned char png[] = {
+  0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n',
+  0x00, 0x00, 0x00, 0x02, 'I', 'H', 'D', 'R', 0xFF, 0xD9, 1, 2, 3, 4,
+  0x00, 0x00, 0x00, 0x00, 'I', 'E', 'N', 'D', 5, 6, 7, 8,
+};
+
+static const unsigned char sized[] = {
+  0x00, 0x00, 0x00, 0x05, 'G', 'I', 'F', '8', '9',
+};
+
+static void assert_frame(struct imv_stream_frame *frame,
+                         const void *data, size_t size)
+{
+  assert_non_null(frame);
+  assert_int_equal(imv_stream_frame_size(frame), size);
+  assert_memory_equal(imv_stream_frame_data(frame), data, size);
+  imv_stream_frame_unref(frame);
+}
+
+static void test_stream_whole(void **state)
+{
+  (void)state;
+
+  struct imv_stream *stream = imv_stream_create();
+  imv_stream_feed(stream, jpeg, sizeof jpeg);
+  imv_stream_feed(stream, png, sizeof png);
+  imv_stream_feed(stream, sized, sizeof sized);
+  imv_stream_feed(stream, jpeg, sizeof jpeg);
+
+  assert_frame(imv_stream_next(stream), jpeg, sizeof jpeg);
+  assert_frame(imv_stream_next(stream), png, sizeof png);
+  assert_frame(imv_stream_next(stream), sized + 4, sizeof sized - 4);
+  assert_frame(imv_stream_next(stream), jpeg, sizeof jpeg);
+  assert_null(imv_stream_next(stream));
+
+  imv_stream_free(stream);
+}
+
+static void test_stream_bytewise(void **state)
+{
+  (void)state;
+
+  unsigned char data[sizeof jpeg + sizeof png + sizeof sized];
+  memcpy(data, jpeg, sizeof jpeg);
+  memcpy(data + sizeof jpeg, png, sizeof png);
+  memcpy(data + sizeof jpeg + sizeof png, sized, sizeof sized);
+
+  /* Each frame comes out as soon as its last byte goes in, and no sooner */
+  struct imv_stream *stream = imv_stream_create();
+  for (size_t i = 0; i < sizeof data; ++i) {
+    imv_stream_feed(stream, data + i, 1);
+    struct imv_stream_frame *frame = imv_stream_next(stream);
+    if (i == sizeof jpeg - 1) {
+      assert_frame(frame, jpeg, sizeof jpeg);
+    } else if (i == sizeof jpeg + sizeof png - 1) {
+      assert_frame(frame, png, sizeof png);
+    } else if (i == sizeof data - 1) {
+      assert_frame(frame, sized + 4, sizeof sized - 4);
+    } else {
+      assert_null(frame);
+    }
+  }
+
+  imv_stream_free(stream);
+}
+
+static void test_stream_resync(void **state)
+{
+  (void)state;
+
+  /* Garbage too big to be a length, such as a multipart boundary */
+  static const char boundary[] = "--frame\r\nContent-Type: image/jpeg\r\n\r\n";
+
+  struct imv_stream *stream = imv_stream_create();
+  imv_stream_feed(stream, boundary, strlen(boundary));
+  imv_stream_feed(stream, jpeg, 1);
+  assert_null(imv_stream_next(stream));
+  imv_stream_feed(stream, jpeg + 1, sizeof jpeg - 1);
+  imv_stream_feed(stream, boundary, strlen(boundary));
+  imv_stream_feed(stream, png, sizeof png);
+
+  assert_frame(imv_stream_next(stream), jpeg, sizeof jpeg);
+  assert_frame(imv_stream_next(stream), png, sizeof png);
+  assert_null(imv_stream_next(stream));
+
+  imv_stream_free(stream);
+}
+
+static void test_stream_frame_ref(void **state)
+{
+  (void)state;
+
+  struct imv_stream *stream = imv_stream_create();
+  imv_stream_feed(stream, png, sizeof png);
+  struct imv_stream_frame *frame = imv_stream_next(stream);
+  imv_stream_free(stream);
+
+  /* Frames outlive their stream and each holder of a reference */
+  assert_ptr_equal(imv_stream_frame_ref(frame), frame);
+  imv_stream_frame_unref(frame);
+  assert_frame(frame, png, sizeof png);
+  imv_stream_frame_unref(NULL);
+}
+
+int main(void)
+{
+  const struct CMUnitTest tests[] = {
+    cmocka_unit_test(test_stream_whole),
+    cmocka_unit_test(test_stream_bytewise),
+    cmocka_unit_test(test_stream_resync),
+    cmocka_unit_test(test_stream_frame_ref),
+  };
+
+  return cmocka_run_group_tests(tests, NULL, NULL);
+}
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
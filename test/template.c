@@ -0,0 +1,95 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdlib.h>
+#include <string.h>
+#include "template.h"
+
+static const char *lookup(const char *name, void *data)
+{
+  (void)data;
+  if (!strcmp(name, "imv_width")) {
+    return "640";
+  }
+  if (!strcmp(name, "imv_current_file")) {
+    return "a b.png";
+  }
+  return NULL;
+}
+
+static void assert_expands(const char *format, const char *expected)
+{
+  char buf[256];
+  struct imv_template *tmpl = imv_template_create(format);
+  assert_true(tmpl);
+  assert_int_equal(imv_template_expand(tmpl, buf, sizeof buf, &lookup, NULL),
+                   strlen(expected));
+  assert_string_equal(buf, expected);
+  assert_false(imv_template_needs_shell(tmpl));
+  imv_template_free(tmpl);
+}
+
+static void test_expand_variables(void **state)
+{
+  (void)state;
+
+  setenv("IMV_TEST_VAR", "env", 1);
+
+  assert_expands("plain text", "plain text");
+  assert_expands("[$imv_width]", "[640]");
+  assert_expands("${imv_width}px", "640px");
+  assert_expands("$imv_current_file", "a b.png");
+  assert_expands("$IMV_TEST_VAR $imv_unset.", "env .");
+  assert_expands("100% $", "100% $");
+}
+
+static void test_quoting(void **state)
+{
+  (void)state;
+
+  assert_expands("  odd   spacing  ", "odd spacing");
+  assert_expands("\"  kept  \" '$imv_width'", "  kept   $imv_width");
+  assert_expands("\"$imv_width\"", "640");
+  assert_expands("\\$imv_width \\\\", "$imv_width \\");
+  assert_expands("\"\\a\"", "\\a");
+}
+
+static void test_truncation(void **state)
+{
+  (void)state;
+
+  char buf[8];
+  struct imv_template *tmpl = imv_template_create("width: $imv_width");
+  assert_int_equal(imv_template_expand(tmpl, buf, sizeof buf, &lookup, NULL), 10);
+  assert_string_equal(buf, "width: ");
+  imv_template_free(tmpl);
+}
+
+static void test_needs_shell(void **state)
+{
+  (void)state;
+
+  const char *formats[] = {"$(ls)", "`ls`", "${imv_width:-0}", "$1", "~/x"};
+  for (size_t i = 0; i < sizeof formats / sizeof *formats; ++i) {
+    struct imv_template *tmpl = imv_template_create(formats[i]);
+    assert_true(imv_template_needs_shell(tmpl));
+    assert_string_equal(imv_template_format(tmpl), formats[i]);
+    imv_template_free(tmpl);
+  }
+}
+
+int main(void)
+{
+  const struct CMUnitTest tests[] = {
+    cmocka_unit_test(test_expand_variables),
+    cmocka_unit_test(test_quoting),
+    cmocka_unit_test(test_truncation),
+    cmocka_unit_test(test_needs_shell),
+  };
+
+  return cmocka_run_group_tests(tests, NULL, NULL);
+}
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,130 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "bitmap.h"
+#include "thumbnail_cache.h"
+
+static void test_thumbnail_round_trip(void **state)
+{
+  (void)state;
+
+  char dir[] = "/tmp/imv-thumbnails-XXXXXX";
+  assert_non_null(mkdtemp(dir));
+
+  char cache_dir[64], image_path[64];
+  snprintf(cache_dir, sizeof cache_dir, "%s/cache/nested", dir);
+  snprintf(image_path, sizeof image_path, "%s/image.png", dir);
+
+  FILE *f = fopen(image_path, "w");
+  assert_non_null(f);
+  fputs("not really a png", f);
+  fclose(f);
+
+  struct stat st;
+  assert_int_equal(stat(image_path, &st), 0);
+
+  struct imv_thumbnail_cache *cache = imv_thumbnail_cache_create(cache_dir);
+  assert_non_null(cache);
+  assert_null(imv_thumbnail_cache_get(cache, image_path, &st));
+
+  struct imv_bitmap *thumb = imv_bitmap_create(3, 2, IMV_ABGR);
+  for (int i = 0; i < 3 * 2 * 4; ++i) {
+    thumb->data[i] = i;
+  }
+  assert_true(imv_thumbnail_cache_put(cache, image_path, &st, thumb));
+
+  struct imv_bitmap *hit = imv_thumbnail_cache_get(cache, image_path, &st);
+  assert_non_null(hit);
+  assert_int_equal(hit->width, 3);
+  assert_int_equal(hit->height, 2);
+  assert_memory_equal(hit->data, thumb->data, 3 * 2 * 4);
+  imv_bitmap_free(hit);
+
+  /* the file changed, so the thumbnail is stale */
+  struct stat changed = st;
+  changed.st_size++;
+  assert_null(imv_thumbnail_cache_get(cache, image_path, &changed));
+  changed = st;
+  changed.st_mtim.tv_nsec++;
+  assert_null(imv_thumbnail_cache_get(cache, image_path, &changed));
+
+  imv_bitmap_free(thumb);
+  imv_thumbnail_cache_free(cache);
+
+  char command[128];
+  snprintf(command, sizeof command, "rm -rf %s", dir);
+  assert_int_equal(system(command), 0);
+}
+
+static void test_thumbnail_scale(void **state)
+{
+  (void)state;
+
+  /* 4x2 ARGB, left half black, right half red */
+  struct imv_bitmap *bmp = imv_bitmap_create(4, 2, IMV_ARGB);
+  uint32_t *pixels = (uint32_t *)bmp->data;
+  for (int y = 0; y < 2; ++y) {
+    for (int x = 0; x < 4; ++x) {
+      pixels[y * 4 + x] = x < 2 ? 0xff000000 : 0xffff0000;
+    }
+  }
+
+  struct imv_bitmap *thumb = imv_thumbnail_scale(bmp, 2);
+  assert_int_equal(thumb->width, 2);
+  assert_int_equal(thumb->height, 1);
+  assert_int_equal(thumb->format, IMV_ABGR);
+
+  /* each output pixel averages a 2x2 block, with red moved for ABGR */
+  uint32_t out[2];
+  memcpy(out, thumb->data, sizeof out);
+  assert_int_equal(out[0], 0xff000000);
+  assert_int_equal(out[1], 0xff0000ff);
+  imv_bitmap_free(thumb);
+
+  /* small enough already, so only converted */
+  thumb = imv_thumbnail_scale(bmp, 8);
+  assert_int_equal(thumb->width, 4);
+  assert_int_equal(thumb->height, 2);
+  imv_bitmap_free(thumb);
+
+  imv_bitmap_free(bmp);
+
+  /* deeper pixels are narrowed to 8 bits first, half floats clamped */
+  bmp = imv_bitmap_create(2, 1, IMV_ABGR16);
+  const uint16_t deep[] = {0xffff, 0x8000, 0x0000, 0xffff,
+                           0xffff, 0x8000, 0x0000, 0xffff};
+  memcpy(bmp->data, deep, sizeof deep);
+  thumb = imv_thumbnail_scale(bmp, 1);
+  assert_int_equal(thumb->format, IMV_ABGR);
+  assert_memory_equal(thumb->data, "\xff\x80\x00\xff", 4);
+  imv_bitmap_free(thumb);
+  imv_bitmap_free(bmp);
+
+  bmp = imv_bitmap_create(1, 1, IMV_ABGR_HALF);
+  const uint16_t half[] = {0x4000, 0x3800, 0xbc00, 0x3c00};
+  memcpy(bmp->data, half, sizeof half);
+  thumb = imv_thumbnail_scale(bmp, 1);
+  assert_memory_equal(thumb->data, "\xff\x80\x00\xff", 4);
+  imv_bitmap_free(thumb);
+  imv_bitmap_free(bmp);
+}
+
+int main(void)
+{
+  const struct CMUnitTest tests[] = {
+    cmocka_unit_test(test_thumbnail_round_trip),
+    cmocka_unit_test(test_thumbnail_scale),
+  };
+
+  return cmocka_run_group_tests(tests, NULL, NULL);
+}
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
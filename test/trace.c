@@ -0,0 +1,77 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "trace.h"
+
+static char *read_file(const char *path)
+{
+  FILE *file = fopen(path, "r");
+  assert_non_null(file);
+  static char buf[4096];
+  const size_t len = fread(buf, 1, sizeof buf - 1, file);
+  buf[len] = '\0';
+  fclose(file);
+  return buf;
+}
+
+static void test_trace_disabled(void **state)
+{
+  (void)state;
+
+  assert_false(imv_trace_enabled());
+  /* nothing to write to, so nothing happens */
+  imv_trace_span("decode", NULL, 1.0, 2.0);
+  imv_trace_close();
+}
+
+static void test_trace_spans(void **state)
+{
+  (void)state;
+
+  char path[] = "/tmp/imv-trace-XXXXXX";
+  const int fd = mkstemp(path);
+  assert_true(fd >= 0);
+  close(fd);
+
+  assert_true(imv_trace_open(path));
+  assert_true(imv_trace_enabled());
+  const double now = imv_trace_now();
+  assert_true(now > 0.0);
+  imv_trace_span("decode", NULL, 1.0, 1.5);
+  imv_trace_span("open", "dir/\"quoted\"\\.png", 2.0, 2.25);
+  imv_trace_close();
+  assert_false(imv_trace_enabled());
+
+  const char *text = read_file(path);
+  char expected[256];
+  snprintf(expected, sizeof expected,
+      "{\"name\":\"decode\",\"ph\":\"X\",\"pid\":%d,\"tid\":1,"
+      "\"ts\":1000000.000,\"dur\":500000.000}", (int)getpid());
+  assert_non_null(strstr(text, expected));
+  assert_non_null(strstr(text,
+      "\"ts\":2000000.000,\"dur\":250000.000,"
+      "\"args\":{\"detail\":\"dir/\\\"quoted\\\"\\\\.png\"}}"));
+  /* a complete JSON array */
+  assert_int_equal(text[0], '[');
+  assert_string_equal(text + strlen(text) - 4, "}\n]\n");
+
+  unlink(path);
+}
+
+int main(void)
+{
+  const struct CMUnitTest tests[] = {
+    cmocka_unit_test(test_trace_disabled),
+    cmocka_unit_test(test_trace_spans),
+  };
+
+  return cmocka_run_group_tests(tests, NULL, NULL);
+}
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
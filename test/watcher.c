@@ -0,0 +1,108 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "watcher.h"
+
+struct seen {
+  enum imv_watch_event event;
+  char path[PATH_MAX];
+  int count;
+};
+
+static void record(enum imv_watch_event event, const char *path, void *data)
+{
+  struct seen *seen = data;
+  seen->event = event;
+  snprintf(seen->path, sizeof seen->path, "%s", path);
+  seen->count++;
+}
+
+/* Waits for the watcher to have something, then dispatches it */
+static void dispatch(struct imv_watcher *watcher, struct seen *seen)
+{
+  struct pollfd fds[] = {{.fd = imv_watcher_fd(watcher), .events = POLLIN}};
+  assert_int_equal(poll(fds, 1, 1000), 1);
+  memset(seen, 0, sizeof *seen);
+  imv_watcher_dispatch(watcher, &record, seen);
+}
+
+static void write_file(const char *path)
+{
+  FILE *f = fopen(path, "w");
+  assert_non_null(f);
+  fputs("image", f);
+  fclose(f);
+}
+
+static void test_watch_file(void **state)
+{
+  (void)state;
+
+  struct imv_watcher *watcher = imv_watcher_create();
+  if (!watcher) {
+    skip();
+  }
+
+  char dir[] = "/tmp/imv-watcher-XXXXXX";
+  assert_non_null(mkdtemp(dir));
+  char file[64], other[64], tmp[64];
+  snprintf(file, sizeof file, "%s/image.png", dir);
+  snprintf(other, sizeof other, "%s/other.png", dir);
+  snprintf(tmp, sizeof tmp, "%s/image.png.tmp", dir);
+  write_file(file);
+
+  imv_watcher_watch_file(watcher, file);
+
+  struct seen seen;
+  write_file(file);
+  dispatch(watcher, &seen);
+  assert_string_equal(seen.path, file);
+
+  /* changes to other files in the directory aren't of interest */
+  write_file(other);
+  write_file(file);
+  dispatch(watcher, &seen);
+  assert_string_equal(seen.path, file);
+  assert_int_equal(seen.event, IMV_WATCH_CHANGED);
+
+  /* replacing the file by renaming another over it is followed */
+  write_file(tmp);
+  assert_int_equal(rename(tmp, file), 0);
+  dispatch(watcher, &seen);
+  assert_string_equal(seen.path, file);
+
+  if (imv_watcher_watch_dir(watcher, dir)) {
+    unlink(other);
+    dispatch(watcher, &seen);
+    assert_int_equal(seen.count, 1);
+    assert_int_equal(seen.event, IMV_WATCH_REMOVED);
+    assert_string_equal(seen.path, other);
+  }
+
+  imv_watcher_free(watcher);
+
+  char command[128];
+  snprintf(command, sizeof command, "rm -rf %s", dir);
+  assert_int_equal(system(command), 0);
+}
+
+int main(void)
+{
+  const struct CMUnitTest tests[] = {
+    cmocka_unit_test(test_watch_file),
+  };
+
+  return cmocka_run_group_tests(tests, NULL, NULL);
+}
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
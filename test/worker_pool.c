@@ -0,0 +1,294 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <time.h>
+#include "worker_pool.h"
+
+/* Records the order jobs ran or were cancelled in */
+struct record {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  int order[64];
+  int count;
+  /* jobs of one owner running at once, and the most there ever were */
+  int running;
+  int most_running;
+  /* set once a blocking job has started, and to let it finish */
+  bool started;
+  bool release;
+};
+
+struct job {
+  struct record *record;
+  int value;
+};
+
+static void record(struct record *record, int value)
+{
+  pthread_mutex_lock(&record->lock);
+  record->order[record->count++] = value;
+  pthread_mutex_unlock(&record->lock);
+}
+
+static void run_job(void *data)
+{
+  struct job *job = data;
+  record(job->record, job->value);
+}
+
+/* Records a cancelled job as the negative of its value */
+static void cancel_job(void *data)
+{
+  struct job *job = data;
+  record(job->record, -job->value);
+}
+
+/* Runs long enough for others of its owner to start alongside it, were they
+ * allowed to */
+static void slow_job(void *data)
+{
+  struct job *job = data;
+  struct record *record = job->record;
+
+  pthread_mutex_lock(&record->lock);
+  if (++record->running > record->most_running) {
+    record->most_running = record->running;
+  }
+  pthread_mutex_unlock(&record->lock);
+
+  const struct timespec delay = {.tv_nsec = 1000 * 1000};
+  nanosleep(&delay, NULL);
+
+  pthread_mutex_lock(&record->lock);
+  record->running--;
+  record->order[record->count++] = job->value;
+  pthread_mutex_unlock(&record->lock);
+}
+
+/* Holds up its worker until released */
+static void blocking_job(void *data)
+{
+  struct job *job = data;
+  struct record *record = job->record;
+
+  pthread_mutex_lock(&record->lock);
+  record->started = true;
+  pthread_cond_broadcast(&record->changed);
+  while (!record->release) {
+    pthread_cond_wait(&record->changed, &record->lock);
+  }
+  record->order[record->count++] = job->value;
+  pthread_mutex_unlock(&record->lock);
+}
+
+static void wait_started(struct record *record)
+{
+  pthread_mutex_lock(&record->lock);
+  while (!record->started) {
+    pthread_cond_wait(&record->changed, &record->lock);
+  }
+  pthread_mutex_unlock(&record->lock);
+}
+
+static void release(struct record *record)
+{
+  pthread_mutex_lock(&record->lock);
+  record->release = true;
+  pthread_cond_broadcast(&record->changed);
+  pthread_mutex_unlock(&record->lock);
+}
+
+static void wait_count(struct record *record, int count)
+{
+  while (true) {
+    pthread_mutex_lock(&record->lock);
+    const bool done = record->count >= count;
+    pthread_mutex_unlock(&record->lock);
+    if (done) {
+      return;
+    }
+    const struct timespec delay = {.tv_nsec = 1000 * 1000};
+    nanosleep(&delay, NULL);
+  }
+}
+
+static struct record *record_create(void)
+{
+  struct record *record = calloc(1, sizeof *record);
+  pthread_mutex_init(&record->lock, NULL);
+  pthread_cond_init(&record->changed, NULL);
+  return record;
+}
+
+static void record_free(struct record *record)
+{
+  pthread_cond_destroy(&record->changed);
+  pthread_mutex_destroy(&record->lock);
+  free(record);
+}
+
+static void test_worker_pool_owner_order(void **state)
+{
+  (void)state;
+
+  struct record *record = record_create();
+  struct job jobs[32];
+  struct imv_worker_pool *pool = imv_worker_pool_create(4);
+  assert_int_equal(imv_worker_pool_size(pool), 4);
+
+  /* however many workers are free, one owner's jobs run one at a time, in
+   * the order they were queued */
+  for (int i = 0; i < 32; ++i) {
+    jobs[i].record = record;
+    jobs[i].value = i;
+    imv_worker_pool_submit(pool, record, IMV_JOB_NORMAL, slow_job, NULL, &jobs[i]);
+  }
+  imv_worker_pool_free(pool);
+
+  assert_int_equal(record->count, 32);
+  assert_int_equal(record->most_running, 1);
+  for (int i = 0; i < 32; ++i) {
+    assert_int_equal(record->order[i], i);
+  }
+  record_free(record);
+}
+
+static void test_worker_pool_priority(void **state)
+{
+  (void)state;
+
+  struct record *record = record_create();
+  struct job blocker = {record, 0};
+  struct job jobs[4] = {{record, 1}, {record, 2}, {record, 3}, {record, 4}};
+  struct imv_worker_pool *pool = imv_worker_pool_create(1);
+
+  /* with the only worker busy, queue background work before normal work */
+  imv_worker_pool_submit(pool, NULL, IMV_JOB_NORMAL, blocking_job, NULL, &blocker);
+  wait_started(record);
+  imv_worker_pool_submit(pool, NULL, IMV_JOB_BACKGROUND, run_job, NULL, &jobs[0]);
+  imv_worker_pool_submit(pool, NULL, IMV_JOB_NORMAL, run_job, NULL, &jobs[1]);
+  imv_worker_pool_submit(pool, NULL, IMV_JOB_BACKGROUND, run_job, NULL, &jobs[2]);
+  imv_worker_pool_submit(pool, NULL, IMV_JOB_NORMAL, run_job, NULL, &jobs[3]);
+  release(record);
+  imv_worker_pool_free(pool);
+
+  /* the normal jobs jump the background ones, each kept in order */
+  const int expected[] = {0, 2, 4, 1, 3};
+  assert_int_equal(record->count, 5);
+  assert_memory_equal(record->order, expected, sizeof expected);
+  record_free(record);
+}
+
+static void test_worker_pool_cancel(void **state)
+{
+  (void)state;
+
+  struct record *record = record_create();
+  struct job blocker = {record, 1};
+  struct job jobs[3] = {{record, 2}, {record, 3}, {record, 4}};
+  const int owner = 0, other = 0;
+  struct imv_worker_pool *pool = imv_worker_pool_create(1);
+
+  imv_worker_pool_submit(pool, &owner, IMV_JOB_NORMAL, blocking_job,
+      cancel_job, &blocker);
+  wait_started(record);
+  imv_worker_pool_submit(pool, &owner, IMV_JOB_NORMAL, run_job, cancel_job, &jobs[0]);
+  imv_worker_pool_submit(pool, &owner, IMV_JOB_NORMAL, run_job, NULL, &jobs[1]);
+  imv_worker_pool_submit(pool, &other, IMV_JOB_NORMAL, run_job, cancel_job, &jobs[2]);
+
+  /* only the owner's queued, cancellable job is cancelled, from here */
+  imv_worker_pool_cancel(pool, &owner);
+  assert_int_equal(record->count, 1);
+  assert_int_equal(record->order[0], -2);
+
+  /* while the one running and the rest are left to run */
+  release(record);
+  wait_count(record, 4);
+  imv_worker_pool_free(pool);
+  const int expected[] = {-2, 1, 3, 4};
+  assert_int_equal(record->count, 4);
+  assert_memory_equal(record->order, expected, sizeof expected);
+  record_free(record);
+}
+
+static void test_worker_pool_set_priority(void **state)
+{
+  (void)state;
+
+  struct record *record = record_create();
+  struct job blocker = {record, 1};
+  struct job jobs[3] = {{record, 2}, {record, 3}, {record, 4}};
+  struct imv_worker_pool *pool = imv_worker_pool_create(1);
+
+  /* background jobs for several images, one of which is then waited on, and
+   * the others dropped, as when moving onto an image being prefetched */
+  imv_worker_pool_submit(pool, NULL, IMV_JOB_NORMAL, blocking_job, NULL, &blocker);
+  wait_started(record);
+  for (int i = 0; i < 3; ++i) {
+    imv_worker_pool_submit(pool, &jobs[i], IMV_JOB_BACKGROUND, run_job,
+        cancel_job, &jobs[i]);
+  }
+  imv_worker_pool_set_priority(pool, &jobs[2], IMV_JOB_NORMAL);
+  imv_worker_pool_cancel(pool, &jobs[0]);
+
+  /* the awaited job runs next, and is still there to run at all */
+  release(record);
+  wait_count(record, 4);
+  imv_worker_pool_free(pool);
+  const int expected[] = {-2, 1, 4, 3};
+  assert_int_equal(record->count, 4);
+  assert_memory_equal(record->order, expected, sizeof expected);
+  record_free(record);
+}
+
+/* Cancelled in place of a job, then lets the blocking job finish */
+static void cancel_and_release(void *data)
+{
+  struct job *job = data;
+  cancel_job(job);
+  release(job->record);
+}
+
+static void test_worker_pool_free(void **state)
+{
+  (void)state;
+
+  struct record *record = record_create();
+  struct job blocker = {record, 1};
+  struct job jobs[2] = {{record, 2}, {record, 3}};
+  struct imv_worker_pool *pool = imv_worker_pool_create(1);
+
+  imv_worker_pool_submit(pool, NULL, IMV_JOB_NORMAL, blocking_job, NULL, &blocker);
+  wait_started(record);
+  imv_worker_pool_submit(pool, NULL, IMV_JOB_NORMAL, run_job,
+      cancel_and_release, &jobs[0]);
+  imv_worker_pool_submit(pool, NULL, IMV_JOB_NORMAL, run_job, NULL, &jobs[1]);
+
+  /* the queued job that can be is cancelled, the one running is waited on,
+   * and the one that can't be cancelled still runs */
+  imv_worker_pool_free(pool);
+  const int expected[] = {-2, 1, 3};
+  assert_int_equal(record->count, 3);
+  assert_memory_equal(record->order, expected, sizeof expected);
+  record_free(record);
+}
+
+int main(void)
+{
+  const struct CMUnitTest tests[] = {
+    cmocka_unit_test(test_worker_pool_owner_order),
+    cmocka_unit_test(test_worker_pool_priority),
+    cmocka_unit_test(test_worker_pool_cancel),
+    cmocka_unit_test(test_worker_pool_set_priority),
+    cmocka_unit_test(test_worker_pool_free),
+  };
+
+  return cmocka_run_group_tests(tests, NULL, NULL);
+}
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */